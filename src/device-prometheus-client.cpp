@@ -195,7 +195,7 @@ void device_prometheus_client_count_pings(double value)
     client.ping_count_total->Increment(value);
 }
 
-void device_prometheus_client_count_ping(const char* app_env)
+void device_prometheus_client_count_ping(const char* app_env, double value)
 {
     std::string stream(app_env);
     std::unordered_map<std::string,stream_counter_t*>::const_iterator got = client.ping_count_by_stream_total_map.find(stream);
@@ -206,7 +206,7 @@ void device_prometheus_client_count_ping(const char* app_env)
         client.ping_count_by_stream_total_map[stream] = counter;
     } else
         counter = got->second;
-    counter->counter->Increment(1);
+    counter->counter->Increment(value);
     counter->last_seen = zclock_time();
 }
 
@@ -231,7 +231,7 @@ void device_prometheus_client_count_broken_metas(double value)
     client.broken_meta_count_total->Increment(value);
 }
 
-void device_prometheus_client_count_broken_meta(const char* app_env)
+void device_prometheus_client_count_broken_meta(const char* app_env, double value)
 {
     std::string stream(app_env);
     std::unordered_map<std::string,stream_counter_t*>::const_iterator got = client.broken_meta_count_by_stream_total_map.find(stream);
@@ -242,7 +242,7 @@ void device_prometheus_client_count_broken_meta(const char* app_env)
         client.broken_meta_count_by_stream_total_map[stream] = counter;
     } else
         counter = got->second;
-    counter->counter->Increment(1);
+    counter->counter->Increment(value);
     counter->last_seen = zclock_time();
 }
 
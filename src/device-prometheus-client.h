@@ -16,9 +16,9 @@ extern void device_prometheus_client_count_msgs_compressed(double value);
 extern void device_prometheus_client_count_bytes_compressed(double value);
 extern void device_prometheus_client_count_invalid_messages(double value);
 extern void device_prometheus_client_count_pings(double value);
-extern void device_prometheus_client_count_ping(const char* app_env);
+extern void device_prometheus_client_count_ping(const char* app_env, double value);
 extern void device_prometheus_client_count_broken_metas(double value);
-extern void device_prometheus_client_count_broken_meta(const char* app_env);
+extern void device_prometheus_client_count_broken_meta(const char* app_env, double value);
 extern void device_prometheus_client_delete_old_ping_counters(int64_t max_age);
 extern void device_prometheus_client_delete_old_broken_meta_counters(int64_t max_age);
 extern void device_prometheus_client_record_rusage();
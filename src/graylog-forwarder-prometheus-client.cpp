@@ -2,13 +2,14 @@
 #include <prometheus/exposer.h>
 #include <prometheus/registry.h>
 #include "graylog-forwarder-prometheus-client.h"
+#include "prometheus-sharded-counter.h"
 #include <sys/resource.h>
 
+// never freed, as threads cache pointers to them
 typedef struct {
-    prometheus::Counter *forwarded_msgs_total;
-    prometheus::Counter *forwarded_bytes_total;
-    prometheus::Counter *gelf_source_bytes_total;
-    int64_t last_seen;
+    logjam::ShardedCounter *forwarded_msgs_total;
+    logjam::ShardedCounter *forwarded_bytes_total;
+    logjam::ShardedCounter *gelf_source_bytes_total;
 } stream_counters_t;
 
 static std::mutex mutex;
@@ -16,6 +17,7 @@ static std::mutex mutex;
 static struct prometheus_client_t {
     prometheus::Exposer *exposer;
     std::shared_ptr<prometheus::Registry> registry;
+    std::shared_ptr<logjam::ShardedCounterRegistry> sharded_registry;
     prometheus::Family<prometheus::Counter> *received_msgs_total_family;
     prometheus::Counter *received_msgs_total;
     prometheus::Family<prometheus::Counter> *received_bytes_total_family;
@@ -44,6 +46,8 @@ void graylog_forwarder_prometheus_client_init(const char* address, int num_parse
     client.exposer = new prometheus::Exposer{address};
     // create a metrics registry
     client.registry = std::make_shared<prometheus::Registry>();
+    // per stream counters are incremented for every message by all parsers
+    client.sharded_registry = std::make_shared<logjam::ShardedCounterRegistry>(client.registry);
 
     client.received_msgs_total_family = &prometheus::BuildCounter()
         .Name("logjam:graylog_forwarder:msgs_received_total")
@@ -115,7 +119,7 @@ void graylog_forwarder_prometheus_client_init(const char* address, int num_parse
         .Register(*client.registry);
 
     // ask the exposer to scrape the registry on incoming scrapes
-    client.exposer->RegisterCollectable(client.registry);
+    client.exposer->RegisterCollectable(client.sharded_registry);
 }
 
 void graylog_forwarder_prometheus_client_shutdown()
@@ -149,23 +153,37 @@ void graylog_forwarder_prometheus_client_count_gelf_bytes(double value)
     client.gelf_source_bytes_total->Increment(value);
 }
 
-stream_counters_t * get_counter(const char* app_env)
+// each thread caches the counters it has used, so that the mutex is only taken for new streams
+static thread_local std::unordered_map<std::string, stream_counters_t*> thread_counters_map;
+
+static
+stream_counters_t * get_shared_counter(const std::string& stream)
 {
     std::lock_guard<std::mutex> lock(mutex);
-    std::string stream(app_env);
     std::unordered_map<std::string,stream_counters_t*>::const_iterator got = client.counters_by_stream_total_map.find(stream);
     stream_counters_t *counter;
     if (got == client.counters_by_stream_total_map.end()) {
         counter = new(stream_counters_t);
-        counter->forwarded_msgs_total = &client.forwarded_msgs_by_stream_total_family->Add({{"stream", app_env}});
-        counter->forwarded_bytes_total = &client.forwarded_bytes_by_stream_total_family->Add({{"stream", app_env}});
-        counter->gelf_source_bytes_total = &client.gelf_source_bytes_by_stream_total_family->Add({{"stream", app_env}});
+        counter->forwarded_msgs_total = &client.sharded_registry->Add(*client.forwarded_msgs_by_stream_total_family, {{"stream", stream}});
+        counter->forwarded_bytes_total = &client.sharded_registry->Add(*client.forwarded_bytes_by_stream_total_family, {{"stream", stream}});
+        counter->gelf_source_bytes_total = &client.sharded_registry->Add(*client.gelf_source_bytes_by_stream_total_family, {{"stream", stream}});
         client.counters_by_stream_total_map[stream] = counter;
     } else
         counter = got->second;
     return counter;
 }
 
+stream_counters_t * get_counter(const char* app_env)
+{
+    std::string stream(app_env);
+    std::unordered_map<std::string,stream_counters_t*>::const_iterator got = thread_counters_map.find(stream);
+    if (got != thread_counters_map.end())
+        return got->second;
+    stream_counters_t *counter = get_shared_counter(stream);
+    thread_counters_map[stream] = counter;
+    return counter;
+}
+
 void graylog_forwarder_prometheus_client_count_msg_for_stream(const char* app_env)
 {
     get_counter(app_env)->forwarded_msgs_total->Increment(1);
@@ -183,21 +201,7 @@ void graylog_forwarder_prometheus_client_count_gelf_source_bytes_for_stream(cons
 
 void graylog_forwarder_prometheus_client_delete_old_stream_counters(int64_t max_age)
 {
-    std::lock_guard<std::mutex> lock(mutex);
-    int64_t threshold = zclock_time() - max_age;
-    std::unordered_map<std::string,stream_counters_t*>::iterator it = client.counters_by_stream_total_map.begin();
-    while (it != client.counters_by_stream_total_map.end()) {
-        if (it->second->last_seen < threshold) {
-            stream_counters_t *counter = it->second;
-            client.forwarded_msgs_total_family->Remove(counter->forwarded_msgs_total);
-            client.forwarded_bytes_total_family->Remove(counter->forwarded_bytes_total);
-            client.gelf_source_bytes_total_family->Remove(counter->gelf_source_bytes_total);
-            delete counter;
-            it = client.counters_by_stream_total_map.erase(it);
-        } else {
-            it++;
-        }
-    }
+    client.sharded_registry->RemoveIdle(max_age);
 }
 
 static
@@ -57,21 +57,22 @@ void merge_quants(zhash_t *target, zhash_t *source)
 static
 void merge_histograms(zhash_t *target, zhash_t *source)
 {
-    size_t *source_histogram = NULL;
+    histogram_t *source_histogram = NULL;
 
     while ( (source_histogram = zhash_first(source)) ) {
         const char* key = zhash_cursor(source);
         assert(key);
-        size_t *dest = zhash_lookup(target, key);
+        histogram_t *dest = zhash_lookup(target, key);
         if (dest) {
             for (int i=0; i < HISTOGRAM_SIZE; i++) {
-                size_t c = source_histogram[i];
+                size_t c = source_histogram->buckets[i];
                 if (c)
-                    dest[i] += c;
+                    dest->buckets[i] += c;
             }
+            ddsketch_merge(&dest->sketch, &source_histogram->sketch);
         } else {
             zhash_insert(target, key, source_histogram);
-            zhash_freefn(target, key, free);
+            zhash_freefn(target, key, histogram_destroy);
             zhash_freefn(source, key, NULL);
         }
         zhash_delete(source, key);
@@ -97,7 +98,7 @@ void merge_modules(zhash_t* target, zhash_t *source)
 }
 
 static
-void merge_increments(zhash_t* target, zhash_t *source)
+void merge_increments(zhash_t* target, zhash_t *source, size_t max_dynamic_keys)
 {
     increments_t *source_increments = NULL;
 
@@ -107,6 +108,7 @@ void merge_increments(zhash_t* target, zhash_t *source)
         increments_t *dest_increments = zhash_lookup(target, namespace);
         if (dest_increments) {
             increments_add(dest_increments, source_increments);
+            increments_compact_dynamic_keys(dest_increments, max_dynamic_keys);
         } else {
             zhash_insert(target, namespace, source_increments);
             zhash_freefn(target, namespace, increments_destroy);
@@ -140,6 +142,24 @@ void merge_agents(zhash_t* target, zhash_t *source)
     }
 }
 
+// moves all data of source into target, leaving source empty
+void merge_processor(processor_state_t *dest_processor, processor_state_t *source_processor)
+{
+    // printf("[D] combining %s\n", dest_processor->db_name);
+    assert( streq(dest_processor->db_name, source_processor->db_name) );
+    dest_processor->request_count += source_processor->request_count;
+    if (source_processor->oldest_created_ms > 0 &&
+        (dest_processor->oldest_created_ms == 0 || source_processor->oldest_created_ms < dest_processor->oldest_created_ms))
+        dest_processor->oldest_created_ms = source_processor->oldest_created_ms;
+    merge_modules(dest_processor->modules, source_processor->modules);
+    int max_dynamic_keys = dest_processor->stream_info->max_dynamic_keys;
+    merge_increments(dest_processor->totals, source_processor->totals, max_dynamic_keys);
+    merge_increments(dest_processor->minutes, source_processor->minutes, max_dynamic_keys);
+    merge_quants(dest_processor->quants, source_processor->quants);
+    merge_histograms(dest_processor->histograms, source_processor->histograms);
+    merge_agents(dest_processor->agents, source_processor->agents);
+}
+
 static
 void merge_processors(zhash_t *target, zhash_t *source)
 {
@@ -151,15 +171,7 @@ void merge_processors(zhash_t *target, zhash_t *source)
         processor_state_t *dest_processor = zhash_lookup(target, db_name);
 
         if (dest_processor) {
-            // printf("[D] combining %s\n", dest_processor->db_name);
-            assert( streq(dest_processor->db_name, source_processor->db_name) );
-            dest_processor->request_count += source_processor->request_count;
-            merge_modules(dest_processor->modules, source_processor->modules);
-            merge_increments(dest_processor->totals, source_processor->totals);
-            merge_increments(dest_processor->minutes, source_processor->minutes);
-            merge_quants(dest_processor->quants, source_processor->quants);
-            merge_histograms(dest_processor->histograms, source_processor->histograms);
-            merge_agents(dest_processor->agents, source_processor->agents);
+            merge_processor(dest_processor, source_processor);
         } else {
             zhash_insert(target, db_name, source_processor);
             zhash_freefn(target, db_name, processor_destroy);
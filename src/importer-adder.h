@@ -2,12 +2,14 @@
 #define __LOGJAM_IMPORTER_ADDER_H_INCLUDED__
 
 #include "importer-common.h"
+#include "importer-processor.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 extern void adder(zsock_t *pipe, void *args);
+extern void merge_processor(processor_state_t *target, processor_state_t *source);
 
 #ifdef __cplusplus
 }
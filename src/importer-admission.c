@@ -0,0 +1,64 @@
+#include "importer-admission.h"
+
+int queued_parses = 0;
+int admission_level = ADMISSION_NORMAL;
+int admission_max_queued_parses = DEFAULT_ADMISSION_MAX_QUEUED_PARSES;
+int admission_max_queued_inserts = DEFAULT_ADMISSION_MAX_QUEUED_INSERTS;
+int admission_max_queued_updates = DEFAULT_ADMISSION_MAX_QUEUED_UPDATES;
+
+// load (as a fraction of the configured maximum queue depths) at which we enter a level
+static double level_thresholds[NUM_ADMISSION_LEVELS] = {0, 0.5, 0.75, 1.0};
+
+// load needs to fall this much below the threshold of the current level before we step down
+#define ADMISSION_HYSTERESIS 0.1
+
+static const char* level_names[NUM_ADMISSION_LEVELS] = {"normal", "sample_frontend", "store_errors_only", "shed"};
+
+const char* admission_level_str(admission_level_t level)
+{
+    if (level >= 0 && level < NUM_ADMISSION_LEVELS)
+        return level_names[level];
+    return "unknown";
+}
+
+static
+double queue_load(int queued, int max_queued)
+{
+    if (max_queued <= 0 || queued <= 0)
+        return 0;
+    return (double) queued / max_queued;
+}
+
+// called by the controller on every tick. escalates immediately, but relaxes only one
+// level per tick and only after load has fallen clearly below the current threshold.
+admission_level_t admission_control_update(int parses, int inserts, int updates)
+{
+    double load = queue_load(parses, admission_max_queued_parses);
+    double l;
+    if ((l = queue_load(inserts, admission_max_queued_inserts)) > load)
+        load = l;
+    if ((l = queue_load(updates, admission_max_queued_updates)) > load)
+        load = l;
+
+    admission_level_t target = ADMISSION_NORMAL;
+    for (int i = NUM_ADMISSION_LEVELS - 1; i > 0; i--) {
+        if (load >= level_thresholds[i]) {
+            target = i;
+            break;
+        }
+    }
+
+    admission_level_t current = admission_current_level();
+    admission_level_t next = current;
+    if (target > current)
+        next = target;
+    else if (target < current && load < level_thresholds[current] - ADMISSION_HYSTERESIS)
+        next = current - 1;
+
+    if (next != current) {
+        fprintf(stderr, "[W] admission: %s -> %s (load: %.2f, queued parses/inserts/updates: %d/%d/%d)\n",
+                admission_level_str(current), admission_level_str(next), load, parses, inserts, updates);
+        __atomic_store_n(&admission_level, next, __ATOMIC_RELAXED);
+    }
+    return next;
+}
@@ -0,0 +1,48 @@
+#ifndef __LOGJAM_IMPORTER_ADMISSION_H_INCLUDED__
+#define __LOGJAM_IMPORTER_ADMISSION_H_INCLUDED__
+
+#include "importer-common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// degradation levels, ordered by severity. each level implies the previous ones.
+typedef enum {
+    ADMISSION_NORMAL             = 0,  // accept everything
+    ADMISSION_SAMPLE_FRONTEND    = 1,  // only accept a sample of frontend.page and frontend.ajax msgs
+    ADMISSION_STORE_ERRORS_ONLY  = 2,  // don't store requests which are not errors
+    ADMISSION_SHED               = 3,  // drop everything but backend requests before parsing
+} admission_level_t;
+
+#define NUM_ADMISSION_LEVELS 4
+
+// keep one in N frontend messages when sampling
+#define ADMISSION_FRONTEND_SAMPLING_RATE 10
+
+// queue depths at which we consider the pipeline fully loaded
+#define DEFAULT_ADMISSION_MAX_QUEUED_PARSES  50000
+#define DEFAULT_ADMISSION_MAX_QUEUED_INSERTS 20000
+#define DEFAULT_ADMISSION_MAX_QUEUED_UPDATES 10000
+
+extern int queued_parses;
+extern int admission_level;
+extern int admission_max_queued_parses;
+extern int admission_max_queued_inserts;
+extern int admission_max_queued_updates;
+
+extern admission_level_t admission_control_update(int parses, int inserts, int updates);
+extern const char* admission_level_str(admission_level_t level);
+
+static inline admission_level_t admission_current_level()
+{
+    int level;
+    __atomic_load(&admission_level, &level, __ATOMIC_RELAXED);
+    return level;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,584 @@
+#include "importer-checkpoint.h"
+#include "importer-processor.h"
+#include "importer-increments.h"
+#include "importer-resources.h"
+#include "importer-adder.h"
+#include "logjam-streaminfo.h"
+#include "importer-prometheus-client.h"
+
+// The checkpoint holds processor state which has been collected by the controller, but
+// not yet forwarded to the updaters. It is rewritten every checkpoint_interval ticks and on
+// shutdown and replayed into the updaters on startup. The file is only valid for the same
+// host architecture and resource configuration, both of which are checked when reading.
+//
+// During normal operation the controller only serializes processors into memory, the
+// checkpoint writer actor writes and renames the file. Each invalidation bumps a generation
+// number, and checkpoints serialized before it are discarded instead of renamed into place.
+
+const char *checkpoint_directory = NULL;
+int checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+
+static char checkpoint_path[1024];
+static char checkpoint_tmp_path[1024];
+static char checkpoint_writer_tmp_path[1024];
+
+// protects renaming and removing the checkpoint file
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t checkpoint_generation = 0;
+// set while the writer actor has a checkpoint which it hasn't written yet
+static bool checkpoint_pending = false;
+
+#define CHECKPOINT_MAGIC 0x4b434a4c   // "LJCK"
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_MAX_STRING_LEN (64 * 1024 * 1024)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t resource_fingerprint;    // hash over all resource names, in offset order
+    uint32_t num_resources;
+    uint32_t histogram_size;
+    uint32_t agent_stats_size;
+    uint32_t reserved;
+    uint64_t num_processors;
+} checkpoint_header_t;
+
+typedef struct {
+    FILE *file;
+    bool ok;
+} checkpoint_io_t;
+
+typedef struct {
+    char *data;
+    size_t size;
+    uint64_t generation;
+    uint64_t num_processors;
+} checkpoint_buffer_t;
+
+typedef void (checkpoint_put_fn)(checkpoint_io_t *io, void *item);
+typedef void* (checkpoint_get_fn)(checkpoint_io_t *io, const char *key);
+
+void checkpoint_init(const char *directory)
+{
+    checkpoint_directory = directory;
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "%s/processors.checkpoint", directory);
+    snprintf(checkpoint_tmp_path, sizeof(checkpoint_tmp_path), "%s/processors.checkpoint.tmp", directory);
+    snprintf(checkpoint_writer_tmp_path, sizeof(checkpoint_writer_tmp_path), "%s/processors.checkpoint.writer.tmp", directory);
+}
+
+static
+uint64_t resource_fingerprint()
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i <= last_resource_offset; i++) {
+        for (const char *p = int_to_resource[i]; *p; p++)
+            hash = (hash ^ (uint8_t)*p) * 1099511628211ULL;
+        hash = (hash ^ ',') * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static
+void checkpoint_header_init(checkpoint_header_t *header, uint64_t num_processors)
+{
+    memset(header, 0, sizeof(*header));
+    header->magic = CHECKPOINT_MAGIC;
+    header->version = CHECKPOINT_VERSION;
+    header->resource_fingerprint = resource_fingerprint();
+    header->num_resources = last_resource_offset + 1;
+    header->histogram_size = HISTOGRAM_SIZE;
+    header->agent_stats_size = sizeof(user_agent_stats_t);
+    header->num_processors = num_processors;
+}
+
+static
+void put(checkpoint_io_t *io, const void *data, size_t n)
+{
+    if (io->ok && n > 0 && fwrite(data, 1, n, io->file) != n)
+        io->ok = false;
+}
+
+static
+void put_u64(checkpoint_io_t *io, uint64_t value)
+{
+    put(io, &value, sizeof(value));
+}
+
+static
+void put_str(checkpoint_io_t *io, const char *s)
+{
+    uint32_t n = strlen(s);
+    put(io, &n, sizeof(n));
+    put(io, s, n);
+}
+
+static
+void get(checkpoint_io_t *io, void *data, size_t n)
+{
+    if (io->ok && n > 0 && fread(data, 1, n, io->file) != n)
+        io->ok = false;
+    if (!io->ok)
+        memset(data, 0, n);
+}
+
+static
+uint64_t get_u64(checkpoint_io_t *io)
+{
+    uint64_t value;
+    get(io, &value, sizeof(value));
+    return value;
+}
+
+static
+char* get_str(checkpoint_io_t *io)
+{
+    uint32_t n;
+    get(io, &n, sizeof(n));
+    if (!io->ok || n > CHECKPOINT_MAX_STRING_LEN) {
+        io->ok = false;
+        return NULL;
+    }
+    char *s = malloc(n + 1);
+    get(io, s, n);
+    s[n] = '\0';
+    if (!io->ok) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+static
+void put_hash(checkpoint_io_t *io, zhash_t *hash, checkpoint_put_fn *fn)
+{
+    put_u64(io, zhash_size(hash));
+    void *item = zhash_first(hash);
+    while (item) {
+        put_str(io, zhash_cursor(hash));
+        if (fn)
+            fn(io, item);
+        item = zhash_next(hash);
+    }
+}
+
+static
+void get_hash(checkpoint_io_t *io, zhash_t *hash, checkpoint_get_fn *fn, zhash_free_fn *free_fn)
+{
+    uint64_t n = get_u64(io);
+    for (uint64_t i = 0; i < n && io->ok; i++) {
+        char *key = get_str(io);
+        if (key == NULL)
+            break;
+        void *item = fn(io, key);
+        if (item) {
+            if (zhash_insert(hash, key, item) == 0)
+                zhash_freefn(hash, key, free_fn);
+            else
+                free_fn(item);
+        }
+        free(key);
+    }
+}
+
+static
+void put_increments(checkpoint_io_t *io, void *item)
+{
+    increments_t *increments = item;
+    put_u64(io, increments->backend_request_count);
+    put_u64(io, increments->page_request_count);
+    put_u64(io, increments->ajax_request_count);
+    put(io, increments->metrics, sizeof(metric_pair_t) * (last_resource_offset + 1));
+    put_str(io, json_object_to_json_string_ext(increments->others, JSON_C_TO_STRING_PLAIN));
+}
+
+static
+void* get_increments(checkpoint_io_t *io, const char *key)
+{
+    increments_t *increments = increments_new();
+    increments->backend_request_count = get_u64(io);
+    increments->page_request_count = get_u64(io);
+    increments->ajax_request_count = get_u64(io);
+    get(io, increments->metrics, sizeof(metric_pair_t) * (last_resource_offset + 1));
+    char *others = get_str(io);
+    if (others) {
+        json_object *obj = json_tokener_parse(others);
+        if (obj && json_object_is_type(obj, json_type_object)) {
+            json_object_put(increments->others);
+            increments->others = obj;
+            increments_count_dynamic_keys(increments);
+        } else {
+            json_object_put(obj);
+            io->ok = false;
+        }
+        free(others);
+    }
+    if (!io->ok) {
+        increments_destroy(increments);
+        return NULL;
+    }
+    return increments;
+}
+
+static
+void put_quants(checkpoint_io_t *io, void *item)
+{
+    put(io, item, sizeof(size_t) * (last_resource_offset + 1));
+}
+
+static
+void* get_quants(checkpoint_io_t *io, const char *key)
+{
+    size_t *quants = zmalloc(sizeof(size_t) * (last_resource_offset + 1));
+    get(io, quants, sizeof(size_t) * (last_resource_offset + 1));
+    return quants;
+}
+
+static
+void put_histogram(checkpoint_io_t *io, void *item)
+{
+    histogram_t *histogram = item;
+    put(io, histogram->buckets, sizeof(size_t) * HISTOGRAM_SIZE);
+    ddsketch_t *sketch = &histogram->sketch;
+    put(io, &sketch->offset, sizeof(sketch->offset));
+    put(io, &sketch->num_buckets, sizeof(sketch->num_buckets));
+    put(io, sketch->counts, sizeof(uint32_t) * sketch->num_buckets);
+}
+
+static
+void* get_histogram(checkpoint_io_t *io, const char *key)
+{
+    histogram_t *histogram = histogram_new();
+    get(io, histogram->buckets, sizeof(size_t) * HISTOGRAM_SIZE);
+    int32_t offset = 0;
+    uint32_t num_buckets = 0;
+    get(io, &offset, sizeof(offset));
+    get(io, &num_buckets, sizeof(num_buckets));
+    if (!io->ok || num_buckets > DDSKETCH_MAX_BUCKETS) {
+        io->ok = false;
+        histogram_destroy(histogram);
+        return NULL;
+    }
+    uint32_t counts[DDSKETCH_MAX_BUCKETS];
+    get(io, counts, sizeof(uint32_t) * num_buckets);
+    for (uint32_t j = 0; j < num_buckets; j++) {
+        if (counts[j])
+            ddsketch_add_bucket(&histogram->sketch, offset + j, counts[j]);
+    }
+    return histogram;
+}
+
+static
+void put_agent(checkpoint_io_t *io, void *item)
+{
+    put(io, item, sizeof(user_agent_stats_t));
+}
+
+static
+void* get_agent(checkpoint_io_t *io, const char *key)
+{
+    user_agent_stats_t *agent_stats = zmalloc(sizeof(user_agent_stats_t));
+    get(io, agent_stats, sizeof(user_agent_stats_t));
+    return agent_stats;
+}
+
+// modules are stored as keys only, the value is a copy of the key
+static
+void* get_module(checkpoint_io_t *io, const char *key)
+{
+    return strdup(key);
+}
+
+static
+void put_processor(checkpoint_io_t *io, processor_state_t *p)
+{
+    put_str(io, p->stream_info->key);
+    put_str(io, p->db_name);
+    put_u64(io, p->request_count);
+    put(io, &p->oldest_created_ms, sizeof(p->oldest_created_ms));
+    put_hash(io, p->modules, NULL);
+    put_hash(io, p->totals, put_increments);
+    put_hash(io, p->minutes, put_increments);
+    put_hash(io, p->quants, put_quants);
+    put_hash(io, p->histograms, put_histogram);
+    put_hash(io, p->agents, put_agent);
+}
+
+// the stream_info of the returned processor is NULL if the stream is no longer configured
+static
+processor_state_t* get_processor(checkpoint_io_t *io)
+{
+    char *stream = get_str(io);
+    char *db_name = get_str(io);
+    if (!io->ok) {
+        free(stream);
+        free(db_name);
+        return NULL;
+    }
+    processor_state_t *p = processor_new(get_stream_info(stream, NULL), db_name);
+    free(stream);
+    free(db_name);
+    p->request_count = get_u64(io);
+    get(io, &p->oldest_created_ms, sizeof(p->oldest_created_ms));
+    get_hash(io, p->modules, get_module, free);
+    get_hash(io, p->totals, get_increments, increments_destroy);
+    get_hash(io, p->minutes, get_increments, increments_destroy);
+    get_hash(io, p->quants, get_quants, free);
+    get_hash(io, p->histograms, get_histogram, histogram_destroy);
+    get_hash(io, p->agents, get_agent, free);
+    return p;
+}
+
+static
+uint64_t checkpoint_serialize(FILE *file, zlist_t *processor_hashes, bool *ok)
+{
+    checkpoint_io_t io = {.file = file, .ok = true};
+
+    uint64_t num_processors = 0;
+    for (zhash_t *h = zlist_first(processor_hashes); h; h = zlist_next(processor_hashes))
+        num_processors += zhash_size(h);
+
+    checkpoint_header_t header;
+    checkpoint_header_init(&header, num_processors);
+    put(&io, &header, sizeof(header));
+
+    for (zhash_t *h = zlist_first(processor_hashes); h; h = zlist_next(processor_hashes)) {
+        for (processor_state_t *p = zhash_first(h); p; p = zhash_next(h))
+            put_processor(&io, p);
+    }
+    put(&io, &header.magic, sizeof(header.magic));
+
+    if (fclose(file) != 0)
+        io.ok = false;
+    *ok = io.ok;
+    return num_processors;
+}
+
+// returns false if the checkpoint has been invalidated after it was serialized
+static
+bool checkpoint_rename(const char *tmp_path, uint64_t generation, bool *ok)
+{
+    pthread_mutex_lock(&checkpoint_mutex);
+    bool current = generation == checkpoint_generation;
+    if (current && *ok && rename(tmp_path, checkpoint_path) != 0)
+        *ok = false;
+    pthread_mutex_unlock(&checkpoint_mutex);
+    if (!current || !*ok)
+        unlink(tmp_path);
+    return current;
+}
+
+bool checkpoint_write(zlist_t *processor_hashes)
+{
+    if (checkpoint_directory == NULL)
+        return false;
+
+    int64_t start_time_us = zclock_usecs();
+    FILE *file = fopen(checkpoint_tmp_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "[E] checkpoint: could not open %s: %s\n", checkpoint_tmp_path, strerror(errno));
+        return false;
+    }
+    bool ok;
+    uint64_t num_processors = checkpoint_serialize(file, processor_hashes, &ok);
+
+    // supersedes all checkpoints still queued for the writer
+    pthread_mutex_lock(&checkpoint_mutex);
+    uint64_t generation = ++checkpoint_generation;
+    pthread_mutex_unlock(&checkpoint_mutex);
+
+    checkpoint_rename(checkpoint_tmp_path, generation, &ok);
+    if (!ok) {
+        fprintf(stderr, "[E] checkpoint: could not write %s: %s\n", checkpoint_path, strerror(errno));
+        return false;
+    }
+    if (debug)
+        printf("[D] checkpoint: wrote %" PRIu64 " databases (%d ms)\n",
+               num_processors, (int)((zclock_usecs() - start_time_us) / 1000));
+    return true;
+}
+
+bool checkpoint_send(zactor_t *writer, zlist_t *processor_hashes)
+{
+    if (checkpoint_directory == NULL || writer == NULL)
+        return false;
+
+    bool pending;
+    __atomic_load(&checkpoint_pending, &pending, __ATOMIC_ACQUIRE);
+    if (pending) {
+        fprintf(stderr, "[W] checkpoint: skipping checkpoint, as the last one hasn't been written yet\n");
+        return false;
+    }
+
+    int64_t start_time_us = zclock_usecs();
+    checkpoint_buffer_t *buffer = zmalloc(sizeof(*buffer));
+    FILE *file = open_memstream(&buffer->data, &buffer->size);
+    assert(file);
+    bool ok;
+    buffer->num_processors = checkpoint_serialize(file, processor_hashes, &ok);
+    assert(ok);
+    // only the controller changes the generation
+    buffer->generation = checkpoint_generation;
+    importer_prometheus_client_observe_checkpoint_serialize((zclock_usecs() - start_time_us) / 1e6);
+
+    pending = true;
+    __atomic_store(&checkpoint_pending, &pending, __ATOMIC_RELEASE);
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, "write");
+    zmsg_addptr(msg, buffer);
+    int rc = zmsg_send(&msg, writer);
+    assert(rc == 0);
+    return true;
+}
+
+void checkpoint_invalidate()
+{
+    if (checkpoint_directory == NULL)
+        return;
+    pthread_mutex_lock(&checkpoint_mutex);
+    checkpoint_generation++;
+    if (unlink(checkpoint_path) != 0 && errno != ENOENT)
+        fprintf(stderr, "[E] checkpoint: could not remove %s: %s\n", checkpoint_path, strerror(errno));
+    pthread_mutex_unlock(&checkpoint_mutex);
+}
+
+static
+void checkpoint_buffer_write(checkpoint_buffer_t *buffer)
+{
+    int64_t start_time_us = zclock_usecs();
+    bool ok = true;
+    FILE *file = fopen(checkpoint_writer_tmp_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "[E] checkpoint: could not open %s: %s\n", checkpoint_writer_tmp_path, strerror(errno));
+        return;
+    }
+    if (fwrite(buffer->data, 1, buffer->size, file) != buffer->size)
+        ok = false;
+    if (fclose(file) != 0)
+        ok = false;
+    bool current = checkpoint_rename(checkpoint_writer_tmp_path, buffer->generation, &ok);
+    if (!ok) {
+        fprintf(stderr, "[E] checkpoint: could not write %s: %s\n", checkpoint_path, strerror(errno));
+        return;
+    }
+    double seconds = (zclock_usecs() - start_time_us) / 1e6;
+    importer_prometheus_client_observe_checkpoint_write(seconds);
+    if (debug)
+        printf("[D] checkpoint: %s %" PRIu64 " databases (%d ms)\n",
+               current ? "wrote" : "discarded invalidated", buffer->num_processors, (int)(seconds * 1000));
+}
+
+static
+int writer_command(zloop_t *loop, zsock_t *socket, void *arg)
+{
+    int rc = 0;
+    zmsg_t *msg = zmsg_recv(socket);
+    if (msg) {
+        char *cmd = zmsg_popstr(msg);
+        if (streq(cmd, "$TERM")) {
+            rc = -1;
+        } else if (streq(cmd, "write")) {
+            checkpoint_buffer_t *buffer = zmsg_popptr(msg);
+            checkpoint_buffer_write(buffer);
+            free(buffer->data);
+            free(buffer);
+            bool pending = false;
+            __atomic_store(&checkpoint_pending, &pending, __ATOMIC_RELEASE);
+        } else {
+            fprintf(stderr, "[E] checkpoint: received unknown actor command: %s\n", cmd);
+        }
+        free(cmd);
+        zmsg_destroy(&msg);
+    }
+    return rc;
+}
+
+void checkpoint_writer_actor_fn(zsock_t *pipe, void *args)
+{
+    set_thread_name("checkpoint[0]");
+
+    int rc;
+    zsock_signal(pipe, 0);
+
+    zloop_t *loop = zloop_new();
+    assert(loop);
+    zloop_set_verbose(loop, 0);
+    // we rely on the controller shutting us down
+    zloop_ignore_interrupts(loop);
+
+    rc = zloop_reader(loop, pipe, writer_command, NULL);
+    assert(rc == 0);
+
+    if (!quiet)
+        printf("[I] checkpoint: writer starting\n");
+
+    bool should_continue_to_run = getenv("CPUPROFILE") != NULL;
+    do {
+        rc = zloop_start(loop);
+        should_continue_to_run &= errno == EINTR;
+        log_zmq_error(rc, __FILE__, __LINE__);
+    } while (should_continue_to_run);
+
+    zloop_destroy(&loop);
+    assert(loop == NULL);
+
+    if (!quiet)
+        printf("[I] checkpoint: writer terminated\n");
+}
+
+zhash_t* checkpoint_read()
+{
+    if (checkpoint_directory == NULL)
+        return NULL;
+
+    FILE *file = fopen(checkpoint_path, "r");
+    if (file == NULL) {
+        if (errno != ENOENT)
+            fprintf(stderr, "[E] checkpoint: could not open %s: %s\n", checkpoint_path, strerror(errno));
+        return NULL;
+    }
+    checkpoint_io_t io = {.file = file, .ok = true};
+
+    checkpoint_header_t header, expected;
+    get(&io, &header, sizeof(header));
+    checkpoint_header_init(&expected, header.num_processors);
+    if (!io.ok || memcmp(&header, &expected, sizeof(header)) != 0) {
+        fprintf(stderr, "[W] checkpoint: ignoring %s: incompatible format or resource configuration\n", checkpoint_path);
+        fclose(file);
+        return NULL;
+    }
+
+    zhash_t *processors = zhash_new();
+    size_t restored = 0, skipped = 0, requests = 0;
+    for (uint64_t i = 0; i < header.num_processors && io.ok; i++) {
+        processor_state_t *p = get_processor(&io);
+        if (p == NULL)
+            break;
+        if (!io.ok || p->stream_info == NULL) {
+            skipped += io.ok;
+            processor_destroy(p);
+            continue;
+        }
+        restored++;
+        requests += p->request_count;
+        processor_state_t *existing = zhash_lookup(processors, p->db_name);
+        if (existing) {
+            merge_processor(existing, p);
+            processor_destroy(p);
+        } else {
+            zhash_insert(processors, p->db_name, p);
+            zhash_freefn(processors, p->db_name, processor_destroy);
+        }
+    }
+    uint32_t trailer = 0;
+    get(&io, &trailer, sizeof(trailer));
+    fclose(file);
+
+    if (!io.ok || trailer != CHECKPOINT_MAGIC) {
+        fprintf(stderr, "[E] checkpoint: ignoring truncated or corrupt checkpoint %s\n", checkpoint_path);
+        zhash_destroy(&processors);
+        return NULL;
+    }
+    printf("[I] checkpoint: restored %zu databases (%zu requests), skipped %zu for unknown streams\n",
+           restored, requests, skipped);
+    return processors;
+}
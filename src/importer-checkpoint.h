@@ -0,0 +1,40 @@
+#ifndef __LOGJAM_IMPORTER_CHECKPOINT_H_INCLUDED__
+#define __LOGJAM_IMPORTER_CHECKPOINT_H_INCLUDED__
+
+#include "importer-common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// write a checkpoint every N ticks, unless updates get forwarded on that tick, which
+// invalidates the checkpoint instead. at most N ticks of stats are lost on a crash.
+#define DEFAULT_CHECKPOINT_INTERVAL 2
+
+// directory holding the checkpoint and the last known stream config. NULL disables both.
+extern const char *checkpoint_directory;
+extern int checkpoint_interval;
+
+extern void checkpoint_init(const char *directory);
+
+// serialize all processors contained in the list of (db_name -> processor) hashes and
+// write them synchronously. supersedes checkpoints not yet written by the writer actor.
+extern bool checkpoint_write(zlist_t *processor_hashes);
+
+// serialize the processors into memory and leave writing the file to the given writer
+// actor. skips the checkpoint if the writer is still busy with the previous one.
+extern bool checkpoint_send(zactor_t *writer, zlist_t *processor_hashes);
+
+// remove the checkpoint before forwarding its contents, discarding queued checkpoints
+extern void checkpoint_invalidate();
+
+extern void checkpoint_writer_actor_fn(zsock_t *pipe, void *args);
+
+// returns a (db_name -> processor) hash or NULL, if there is no usable checkpoint
+extern zhash_t* checkpoint_read();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
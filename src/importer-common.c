@@ -1,5 +1,9 @@
 #include "importer-common.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 bool dryrun = false;
 bool verbose = false;
 bool debug = false;
@@ -8,6 +12,19 @@ bool initialize_dbs = false;
 
 int queued_updates = 0;
 int queued_inserts = 0;
+int latency_sampling_rate = -1;
+
+// set from the command line and the config file
+int snd_hwm = -1;
+int rcv_hwm = -1;
+int pull_port = -1;
+int router_port = -1;
+int sub_port = -1;
+int replay_port = -1;
+int replay_router_msgs = -1;
+char* live_stream_connection_spec = NULL;
+char* unknown_streams_collector_connection_spec = NULL;
+zlist_t *hosts = NULL;
 
 // utf8 conversion
 static char UTF8_DOT[4] = {0xE2, 0x80, 0xA4, '\0' };
@@ -15,76 +32,85 @@ static char UTF8_CURRENCY[3] = {0xC2, 0xA4, '\0'};
 static char *URI_ESCAPED_DOT = "%2E";
 static char *URI_ESCAPED_DOLLAR = "%24";
 
+// aligned loads never cross a page boundary, so reading past the terminating null char is safe.
+// address sanitizer doesn't know that and would report the bytes read after the string.
+#if defined(__SSE2__)
+__attribute__ ((no_sanitize_address))
+#endif
+size_t dots_and_dollars_span(const char *s)
+{
+#if defined(__SSE2__)
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i zero = _mm_setzero_si128();
+    size_t offset = (uintptr_t)s & 15;
+    const char *p = s - offset;
+    for (;;) {
+        __m128i chunk = _mm_load_si128((const __m128i*)p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, dot), _mm_cmpeq_epi8(chunk, dollar)),
+                                    _mm_cmpeq_epi8(chunk, zero));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits) >> offset;
+        if (mask)
+            return (p - s) + offset + __builtin_ctz(mask);
+        p += 16;
+        offset = 0;
+    }
+#else
+    const char *p = s;
+    while (*p && *p != '.' && *p != '$')
+        p++;
+    return p - s;
+#endif
+}
+
 int replace_dots_and_dollars(char *s)
 {
     if (s == NULL) return 0;
     int count = 0;
-    char c;
-    while ((c = *s) != '\0') {
-        if (c == '.' || c == '$') {
-            *s = '_';
-            count++;
-        }
-        s++;
+    for (;;) {
+        s += dots_and_dollars_span(s);
+        if (*s == '\0')
+            break;
+        *s++ = '_';
+        count++;
     }
     return count;
 }
 
-int copy_replace_dots_and_dollars(char* buffer, const char *s)
+// copies runs without dots and dollars in bulk and replaces dots and dollars with the given strings
+static
+int copy_replace(char* buffer, const char *s, const char *dot_replacement, size_t dot_len, const char *dollar_replacement, size_t dollar_len)
 {
-    int len = 0;
+    char *start = buffer;
     if (s != NULL) {
-        char c;
-        while ((c = *s) != '\0') {
-            if (c == '.') {
-                char *p = UTF8_DOT;
-                *buffer++ = *p++;
-                *buffer++ = *p++;
-                *buffer++ = *p;
-                len += 3;
-            } else if (c == '$') {
-                char *p = UTF8_CURRENCY;
-                *buffer++ = *p++;
-                *buffer++ = *p;
-                len += 2;
+        for (;;) {
+            size_t n = dots_and_dollars_span(s);
+            memcpy(buffer, s, n);
+            buffer += n;
+            s += n;
+            if (*s == '\0')
+                break;
+            if (*s++ == '.') {
+                memcpy(buffer, dot_replacement, dot_len);
+                buffer += dot_len;
             } else {
-                *buffer++ = c;
-                len++;
+                memcpy(buffer, dollar_replacement, dollar_len);
+                buffer += dollar_len;
             }
-            s++;
         }
     }
     *buffer = '\0';
-    return len;
+    return buffer - start;
+}
+
+int copy_replace_dots_and_dollars(char* buffer, const char *s)
+{
+    return copy_replace(buffer, s, UTF8_DOT, 3, UTF8_CURRENCY, 2);
 }
 
 int uri_replace_dots_and_dollars(char* buffer, const char *s)
 {
-    int len = 0;
-    if (s != NULL) {
-        char c;
-        while ((c = *s) != '\0') {
-            if (c == '.') {
-                char *p = URI_ESCAPED_DOT;
-                *buffer++ = *p++;
-                *buffer++ = *p++;
-                *buffer++ = *p;
-                len += 3;
-            } else if (c == '$') {
-                char *p = URI_ESCAPED_DOLLAR;
-                *buffer++ = *p++;
-                *buffer++ = *p++;
-                *buffer++ = *p;
-                len += 3;
-            } else {
-                *buffer++ = c;
-                len++;
-            }
-            s++;
-        }
-    }
-    *buffer = '\0';
-    return len;
+    return copy_replace(buffer, s, URI_ESCAPED_DOT, 3, URI_ESCAPED_DOLLAR, 3);
 }
 
 static char *win1252_to_utf8[128] = {
@@ -218,32 +244,71 @@ static char *win1252_to_utf8[128] = {
     /* 0xFF */	  "\u00FF"   ,   // Latin Small Letter Y With Diaeresis
 };
 
+// the utf8 sequences of win1252_to_utf8, padded to four bytes, so that they can be copied
+// without looking at their length first
+static char win1252_codes[128][4];
+static uint8_t win1252_lengths[128];
+static pthread_once_t win1252_codes_once = PTHREAD_ONCE_INIT;
+
+static
+void win1252_codes_init()
+{
+    for (int i = 0; i < 128; i++) {
+        size_t len = strlen(win1252_to_utf8[i]);
+        assert(len < 4);
+        memcpy(win1252_codes[i], win1252_to_utf8[i], len);
+        win1252_lengths[i] = len;
+    }
+}
+
+// utf8 must have room for 6*n+1 bytes. returns the length of the converted string.
 int convert_to_win1252(const char *str, size_t n, char *utf8)
 {
+    pthread_once(&win1252_codes_once, win1252_codes_init);
+    const uint8_t *s = (const uint8_t*)str;
+    size_t i = 0;
     int j = 0;
-    for (int i=0; i < n; i++) {
-        uint8_t c = str[i];
-        if ((c & 0x80) == 0) { // ascii 7bit
-            // handle null characters
-            if (c)
-                utf8[j++] = c;
-            else {
-                utf8[j++] = '\\';
-                utf8[j++] = 'u';
-                utf8[j++] = '0';
-                utf8[j++] = '0';
-                utf8[j++] = '0';
-                utf8[j++] = '0';
-           }
-        } else { // high bit set
-            char *t = win1252_to_utf8[c & 0x7F];
-            while ( (c = *t++) ) {
-                utf8[j++] = c;
-            }
+    while (i < n) {
+        // copy runs of ascii characters in bulk
+        size_t run = ascii_prefix_length(str + i, n - i);
+        memcpy(utf8 + j, str + i, run);
+        i += run;
+        j += run;
+        if (i == n)
+            break;
+#if defined(__SSE2__)
+        // latin-1 letters and symbols (0xA0-0xFF) become C2 or C3 followed by the byte
+        // with bit 6 cleared, so we convert runs of them 16 bytes at a time
+        while (i + 16 <= n) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(str + i));
+            __m128i biased = _mm_xor_si128(chunk, _mm_set1_epi8((char)0x80));
+            if (_mm_movemask_epi8(_mm_cmpgt_epi8(biased, _mm_set1_epi8(0x1F))) != 0xFFFF)
+                break;
+            __m128i upper = _mm_cmpgt_epi8(biased, _mm_set1_epi8(0x3F));
+            __m128i lead = _mm_sub_epi8(_mm_set1_epi8((char)0xC2), upper);
+            __m128i trail = _mm_and_si128(chunk, _mm_set1_epi8((char)0xBF));
+            _mm_storeu_si128((__m128i*)(utf8 + j), _mm_unpacklo_epi8(lead, trail));
+            _mm_storeu_si128((__m128i*)(utf8 + j + 16), _mm_unpackhi_epi8(lead, trail));
+            i += 16;
+            j += 32;
+        }
+#endif
+        // everything else, up to the next ascii character or 16 bytes
+        for (size_t end = i + 16; i < n && i < end; i++) {
+            uint8_t c = s[i];
+            if (c == 0) {
+                // handle null characters
+                memcpy(utf8 + j, "\\u0000", 6);
+                j += 6;
+            } else if (c & 0x80) {
+                memcpy(utf8 + j, win1252_codes[c & 0x7F], 4);
+                j += win1252_lengths[c & 0x7F];
+            } else
+                break;
         }
     }
     utf8[j] = '\0';
-    return j-1;
+    return j;
 }
 
 
@@ -294,3 +359,147 @@ bool config_update_date_info()
 
     return changed;
 }
+
+// byte at a time versions of the dots and dollars functions, for testing
+static size_t test_span(const char *s)
+{
+    const char *p = s;
+    while (*p && *p != '.' && *p != '$')
+        p++;
+    return p - s;
+}
+
+static void test_copy_replace(char *buffer, const char *s, const char *dot, const char *dollar)
+{
+    for (; *s; s++) {
+        const char *r = *s == '.' ? dot : *s == '$' ? dollar : NULL;
+        if (r) {
+            strcpy(buffer, r);
+            buffer += strlen(r);
+        } else
+            *buffer++ = *s;
+    }
+    *buffer = '\0';
+}
+
+static void test_dots_and_dollars_string(const char *s)
+{
+    char expected[256], actual[256];
+    assert(dots_and_dollars_span(s) == test_span(s));
+
+    test_copy_replace(expected, s, UTF8_DOT, UTF8_CURRENCY);
+    int n = copy_replace_dots_and_dollars(actual, s);
+    assert(streq(expected, actual));
+    assert(n == (int)strlen(expected));
+
+    test_copy_replace(expected, s, URI_ESCAPED_DOT, URI_ESCAPED_DOLLAR);
+    n = uri_replace_dots_and_dollars(actual, s);
+    assert(streq(expected, actual));
+    assert(n == (int)strlen(expected));
+
+    strcpy(actual, s);
+    test_copy_replace(expected, s, "_", "_");
+    replace_dots_and_dollars(actual);
+    assert(streq(expected, actual));
+}
+
+// strings of up to 40 chars at every alignment, with a dot or dollar at each position,
+// which covers special chars in the first, last and following chunk and keys longer than 16
+static void test_dots_and_dollars_positions (int verbose)
+{
+    char buffer[128] __attribute__ ((aligned (16)));
+    for (size_t align = 0; align < 16; align++) {
+        char *s = buffer + align;
+        for (size_t len = 0; len <= 40; len++) {
+            memset(s, 'a', len);
+            s[len] = '\0';
+            test_dots_and_dollars_string(s);
+            for (size_t pos = 0; pos < len; pos++) {
+                s[pos] = '.';
+                test_dots_and_dollars_string(s);
+                s[pos] = '$';
+                test_dots_and_dollars_string(s);
+                // a second special char in the following chunk
+                if (pos + 16 < len) {
+                    s[pos + 16] = '.';
+                    test_dots_and_dollars_string(s);
+                    s[pos + 16] = 'a';
+                }
+                s[pos] = 'a';
+            }
+        }
+    }
+}
+
+static void test_dots_and_dollars_examples (int verbose)
+{
+    char buffer[256];
+    assert(dots_and_dollars_span("") == 0);
+    assert(dots_and_dollars_span(".") == 0);
+    assert(dots_and_dollars_span("abcdefghijklmnopqrstuvwxyz$") == 26);
+
+    copy_replace_dots_and_dollars(buffer, "a.b$c");
+    assert(streq(buffer, "a\xE2\x80\xA4" "b\xC2\xA4" "c"));
+    uri_replace_dots_and_dollars(buffer, "ActiveRecord::Base.connection.$cmd");
+    assert(streq(buffer, "ActiveRecord::Base%2Econnection%2E%24cmd"));
+    assert(copy_replace_dots_and_dollars(buffer, NULL) == 0 && buffer[0] == '\0');
+
+    strcpy(buffer, "...$$$abc");
+    assert(replace_dots_and_dollars(buffer) == 6);
+    assert(streq(buffer, "______abc"));
+    assert(replace_dots_and_dollars(NULL) == 0);
+}
+
+// byte at a time version of convert_to_win1252
+static int test_convert_to_win1252(const char *str, size_t n, char *utf8)
+{
+    int j = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint8_t c = str[i];
+        const char *t = c == 0 ? "\\u0000" : (c & 0x80) ? win1252_to_utf8[c & 0x7F] : NULL;
+        if (t) {
+            strcpy(utf8 + j, t);
+            j += strlen(t);
+        } else
+            utf8[j++] = c;
+    }
+    utf8[j] = '\0';
+    return j;
+}
+
+// random mixes of ascii, latin-1, other win1252 and null bytes, with long runs of each kind
+static void test_win1252_conversion (int verbose)
+{
+    static const uint8_t ranges[4][2] = {{0x01, 0x7F}, {0xA0, 0xFF}, {0x80, 0x9F}, {0x00, 0x00}};
+    char str[128], expected[6*128+1], actual[6*128+1];
+    srandom(42);
+    for (int round = 0; round < 20000; round++) {
+        size_t n = random() % sizeof(str);
+        int kind = random() % 4;
+        for (size_t i = 0; i < n; i++) {
+            // switch kinds rarely, favoring ascii and latin-1
+            if (random() % 8 == 0)
+                kind = random() % 8 < 6 ? random() % 2 : 2 + random() % 2;
+            const uint8_t *r = ranges[kind];
+            str[i] = r[0] + random() % (r[1] - r[0] + 1);
+        }
+        int m = test_convert_to_win1252(str, n, expected);
+        assert(convert_to_win1252(str, n, actual) == m);
+        assert(memcmp(expected, actual, m + 1) == 0);
+    }
+    assert(convert_to_win1252("M\xFCller \x80 5", 10, actual) == 13);
+    assert(streq(actual, "M\xC3\xBCller \xE2\x82\xAC 5"));
+}
+
+void importer_common_test (int verbose)
+{
+    printf (" * importer-common: ");
+    if (verbose)
+        printf("\n");
+
+    test_dots_and_dollars_examples (verbose);
+    test_dots_and_dollars_positions (verbose);
+    test_win1252_conversion (verbose);
+
+    printf ("OK\n");
+}
@@ -14,11 +14,18 @@ extern "C" {
 #define MAX_ADDERS 16
 #define MAX_WRITERS 20
 #define MAX_UPDATERS 20
+#define MAX_INDEXERS 8
 
 extern unsigned long num_subscribers;
 extern unsigned long num_parsers;
 extern unsigned long num_writers;
 extern unsigned long num_updaters;
+extern unsigned long num_indexers;
+
+// upper bounds for elastic thread pools, see importer-elastic.h
+extern unsigned long max_parsers;
+extern unsigned long max_writers;
+extern unsigned long max_updaters;
 
 extern int queued_updates;
 extern int queued_inserts;
@@ -29,6 +36,9 @@ extern int queued_inserts;
 #define DEFAULT_SND_HWM_STR "100000"
 #define HWM_UNLIMITED 0
 
+// record latency for one in N messages, 0 disables latency tracing
+#define DEFAULT_LATENCY_SAMPLING_RATE 100
+
 #define DEFAULT_ROUTER_PORT 9604
 #define DEFAULT_PULL_PORT 9605
 #define DEFAULT_SUB_PORT 9606
@@ -54,7 +64,6 @@ extern int replay_router_msgs;
 extern int rcv_hwm;
 extern int snd_hwm;
 extern zlist_t* hosts;
-extern FILE* frontend_timings;
 
 #define INVALID_DATE -1
 
@@ -75,11 +84,15 @@ extern char iso_date_today[ISO_DATE_STR_LEN];
 extern char iso_date_tomorrow[ISO_DATE_STR_LEN];
 extern time_t time_last_tick;
 
+// length of the prefix of s without dots and dollars
+extern size_t dots_and_dollars_span(const char *s);
 extern int replace_dots_and_dollars(char *s);
 extern int copy_replace_dots_and_dollars(char* buffer, const char *s);
 extern int uri_replace_dots_and_dollars(char* buffer, const char *s);
 extern int convert_to_win1252(const char *str, size_t n, char *utf8);
 
+extern void importer_common_test (int verbose);
+
 extern void config_file_init(const char* file_name);
 extern bool config_file_has_changed();
 extern bool config_update_date_info();
@@ -108,6 +121,28 @@ extern int set_thread_name(const char* name);
 // maximum size of histograms stored in mongo
 #define HISTOGRAM_SIZE 22
 
+// fixed log scale buckets, plus a quantile sketch of the same values
+typedef struct {
+    size_t buckets[HISTOGRAM_SIZE];
+    ddsketch_t sketch;
+} histogram_t;
+
+// record stage latencies for every n-th message (by device sequence number), 0 disables
+extern int latency_sampling_rate;
+
+static inline bool latency_sampled(msg_meta_t *meta)
+{
+    return latency_sampling_rate > 0 && meta->created_ms > 0
+        && meta->sequence_number % latency_sampling_rate == 0;
+}
+
+// stage timestamps attached to sampled requests on their way to the request writers
+typedef struct {
+    int64_t created_ms;         // set by the logjam device
+    int64_t parsed_ms;          // request body has been parsed
+    int64_t processed_ms;       // request has been added to the processor
+} latency_trace_t;
+
 #ifdef __cplusplus
 }
 #endif
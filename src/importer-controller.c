@@ -10,7 +10,12 @@
 #include "importer-subscriber.h"
 #include "importer-watchdog.h"
 #include "unknown-streams-collector.h"
+#include "importer-timingslog.h"
 #include "importer-prometheus-client.h"
+#include "importer-admission.h"
+#include "importer-mongoutils.h"
+#include "importer-checkpoint.h"
+#include "importer-elastic.h"
 
 /*
  * connections: n_s = num_subscribers, n_w = num_writers, n_p = num_parsers, n_u= num_updaters, n_a = num_adders "[<>^v]" = connect, "o" = bind
@@ -40,12 +45,18 @@
 // The data from the parsers is collected using the pipes, but maybe we should have an
 // independent socket for this. The controller send ticks to the watchdog, which aborts
 // the whole process if it doesn't receive ticks for ten consecutive seconds.
+// Parsers, writers and updaters are added and removed at the end of a tick, when the
+// configured maximum thread counts allow it (see importer-elastic.h).
 
 unsigned long num_subscribers = 1;
 unsigned long num_parsers = 8;
 unsigned long num_writers = 10;
 unsigned long num_updaters = 10;
 unsigned long num_adders = 4;
+unsigned long num_indexers = 2;
+unsigned long max_parsers = 0;
+unsigned long max_writers = 0;
+unsigned long max_updaters = 0;
 
 typedef struct {
     zconfig_t *config;
@@ -61,12 +72,17 @@ typedef struct {
     zactor_t *updaters[MAX_UPDATERS];
     zactor_t *live_stream_publisher;
     zactor_t *unknown_streams_collector;
+    zactor_t *timings_log;
+    zactor_t *checkpoint_writer;
     zsock_t *updates_socket;
     size_t updates_blocked;
     zsock_t *adder_socket;
     zsock_t *live_stream_socket;
     size_t ticks;
     zlist_t *collected_processors;
+    active_streams_t active_streams;
+    size_t drained_msgs_count;          // from parsers removed since the last tick
+    frontend_stats_t drained_fe_stats;
 } controller_state_t;
 
 
@@ -88,22 +104,13 @@ void extract_parser_state(controller_state_t *state, zmsg_t* msg, zhash_t **proc
 static
 void publish_totals(stream_info_t *stream_info, zhash_t *totals, zsock_t *live_stream_socket)
 {
-    size_t n = stream_info->app_len + 1 + stream_info->env_len;
-    zhash_t *known_modules = stream_info->known_modules;
-    void *value = zhash_first(known_modules);
-    while (value) {
-        const char *module = zhash_cursor(known_modules);
-        const char *namespace = module;
-        // skip :: at the beginning of module
-        while (*module == ':') module++;
-        size_t m = strlen(module);
-        char key[n + m + 3];
-        sprintf(key, "%s-%s,%s", stream_info->app, stream_info->env, module);
-        // TODO: change this crap in the live stream publisher
-        // tolower is unsafe and not really necessary
-        for (char *p = key; *p; ++p) *p = tolower(*p);
-
-        // printf("[D] publishing totals for module: %s, key: %s\n", module, key);
+    size_t n = stream_info->known_modules_count;
+    known_module_t *modules = stream_info->known_modules_list;
+    for (size_t i = 0; i < n; i++) {
+        const char *namespace = modules[i].module;
+        const char *key = modules[i].live_stream_key;
+
+        // printf("[D] publishing totals for module: %s, key: %s\n", namespace, key);
         json_object *json = json_object_new_object();
         increments_t *incs = totals ? zhash_lookup(totals, namespace) : NULL;
         if (incs) {
@@ -120,41 +127,33 @@ void publish_totals(stream_info_t *stream_info, zhash_t *totals, zsock_t *live_s
         const char* json_str = json_object_to_json_string_ext(json, JSON_C_TO_STRING_PLAIN);
         live_stream_publish(live_stream_socket, key, json_str);
         json_object_put(json);
-
-        value = zhash_next(known_modules);
     }
 }
 
 static
 void publish_totals_for_every_known_stream(controller_state_t *state, zhash_t *processors)
 {
-    zhash_t *published_streams= zhash_new();
+    uint64_t tick = state->ticks;
 
     // publish updates for all streams where we received some data
     processor_state_t* processor = zhash_first(processors);
     while (processor) {
         stream_info_t *stream_info = processor->stream_info;
         update_known_modules(stream_info, processor->modules);
-        zhash_insert(published_streams, stream_info->key, (void*)1);
+        stream_info->published_tick = tick;
         publish_totals(stream_info, processor->totals, state->live_stream_socket);
         processor = zhash_next(processors);
     }
 
     // publish updates for all streams where we didn't receive anything
-    zlist_t *streams = get_active_stream_names();
-    const char *stream = zlist_first(streams);
-    while (stream) {
-        stream_info_t *stream_info = get_stream_info(stream, NULL);
-        if (stream_info) {
-            if (!zhash_lookup(published_streams, stream)) {
-                publish_totals(stream_info, NULL, state->live_stream_socket);
-            }
-            release_stream_info(stream_info);
-        }
-        stream = zlist_next(streams);
+    refresh_active_streams(&state->active_streams);
+    size_t n = state->active_streams.size;
+    stream_info_t **streams = state->active_streams.streams;
+    for (size_t i = 0; i < n; i++) {
+        stream_info_t *stream_info = streams[i];
+        if (stream_info->published_tick != tick)
+            publish_totals(stream_info, NULL, state->live_stream_socket);
     }
-    zlist_destroy(&streams);
-    zhash_destroy(&published_streams);
 }
 
 static
@@ -196,6 +195,41 @@ void merge_processors(controller_state_t *state, zlist_t *additions)
 
 }
 
+// hands each database's processor over to the updater owning the database
+static
+void schedule_updates(controller_state_t *state, zhash_t *processor)
+{
+    size_t coalesced = 0;
+    zlist_t *db_names = zhash_keys(processor);
+    const char* db_name = zlist_first(db_names);
+    while (db_name != NULL) {
+        processor_state_t *proc = zhash_lookup(processor, db_name);
+        zhash_freefn(processor, db_name, NULL);
+        zhash_delete(processor, db_name);
+        switch (stats_updater_schedule(proc)) {
+        case UPDATE_QUEUED:
+            __atomic_add_fetch(&queued_updates, 1, __ATOMIC_SEQ_CST);
+            break;
+        case UPDATE_MERGED:
+            coalesced++;
+            break;
+        case UPDATE_REJECTED:
+            break;
+        }
+        db_name = zlist_next(db_names);
+    }
+    zlist_destroy(&db_names);
+
+    importer_prometheus_client_count_updates_coalesced(coalesced);
+    if (coalesced)
+        printf("[I] controller: coalesced updates for %zu databases still waiting for an updater\n", coalesced);
+
+    // wake up all updaters, so that idle ones can steal from backlogged ones
+    for (int i=0; i<num_updaters; i++) {
+        zstr_send(state->updaters[i], "work");
+    }
+}
+
 static
 void forward_updates(controller_state_t *state, zhash_t *processor)
 {
@@ -214,6 +248,7 @@ void forward_updates(controller_state_t *state, zhash_t *processor)
         reference_stream_info(proc->stream_info);
         zmsg_addptr(stats_msg, proc->totals);
         proc->totals = NULL;
+        zmsg_addmem(stats_msg, &proc->oldest_created_ms, sizeof(int64_t));
         if (!output_socket_ready(state->updates_socket, 0)) {
             if (!state->updates_blocked++)
                 fprintf(stderr, "[W] controller: updates push socket not ready. blocking!\n");
@@ -231,6 +266,7 @@ void forward_updates(controller_state_t *state, zhash_t *processor)
         reference_stream_info(proc->stream_info);
         zmsg_addptr(stats_msg, proc->minutes);
         proc->minutes = NULL;
+        zmsg_addmem(stats_msg, &proc->oldest_created_ms, sizeof(int64_t));
         if (!output_socket_ready(state->updates_socket, 0)) {
             if (!state->updates_blocked++)
                 fprintf(stderr, "[W] controller: updates push socket not ready. blocking!\n");
@@ -248,6 +284,7 @@ void forward_updates(controller_state_t *state, zhash_t *processor)
         reference_stream_info(proc->stream_info);
         zmsg_addptr(stats_msg, proc->quants);
         proc->quants = NULL;
+        zmsg_addmem(stats_msg, &proc->oldest_created_ms, sizeof(int64_t));
         if (!output_socket_ready(state->updates_socket, 0)) {
             if (!state->updates_blocked++)
                 fprintf(stderr, "[W] controller: updates push socket not ready. blocking!\n");
@@ -265,6 +302,7 @@ void forward_updates(controller_state_t *state, zhash_t *processor)
         reference_stream_info(proc->stream_info);
         zmsg_addptr(stats_msg, proc->histograms);
         proc->histograms = NULL;
+        zmsg_addmem(stats_msg, &proc->oldest_created_ms, sizeof(int64_t));
         if (!output_socket_ready(state->updates_socket, 0)) {
             if (!state->updates_blocked++)
                 fprintf(stderr, "[W] controller: updates push socket not ready. blocking!\n");
@@ -282,6 +320,7 @@ void forward_updates(controller_state_t *state, zhash_t *processor)
         reference_stream_info(proc->stream_info);
         zmsg_addptr(stats_msg, proc->agents);
         proc->agents = NULL;
+        zmsg_addmem(stats_msg, &proc->oldest_created_ms, sizeof(int64_t));
         if (!output_socket_ready(state->updates_socket, 0)) {
             if (!state->updates_blocked++)
                 fprintf(stderr, "[W] controller: updates push socket not ready. blocking!\n");
@@ -296,6 +335,165 @@ void forward_updates(controller_state_t *state, zhash_t *processor)
     zlist_destroy(&db_names);
 }
 
+static
+double pool_cpu_seconds(elastic_pool_id_t id)
+{
+    double total = 0;
+    size_t n = *elastic_pools[id].size;
+    for (size_t i = 0; i < n; i++) {
+        switch (id) {
+        case ELASTIC_PARSERS:
+            total += importer_prometheus_client_cpu_seconds_parser(i);
+            break;
+        case ELASTIC_WRITERS:
+            total += importer_prometheus_client_cpu_seconds_writer(i);
+            break;
+        case ELASTIC_UPDATERS:
+            total += importer_prometheus_client_cpu_seconds_updater(i);
+            break;
+        }
+    }
+    return total;
+}
+
+static
+void add_parser(controller_state_t *state)
+{
+    size_t i = num_parsers;
+    state->parsers[i] = parser_new(state->config, i);
+    num_parsers = i + 1;
+}
+
+// subscribers are held while the parser empties its socket (see parser_drain). its
+// processors and message counts get merged with those of the other parsers on the next tick.
+static
+void remove_parser(controller_state_t *state)
+{
+    size_t i = num_parsers - 1;
+    for (size_t j=0; j<num_subscribers; j++) {
+        zstr_send(state->subscribers[j], "hold");
+        zsock_wait(state->subscribers[j]);
+    }
+    zstr_send(state->parsers[i], "drain");
+    zmsg_t *response = zmsg_recv(state->parsers[i]);
+    for (size_t j=0; j<num_subscribers; j++) {
+        zstr_send(state->subscribers[j], "resume");
+    }
+    num_parsers = i;
+
+    if (response) {
+        zhash_t *processors;
+        size_t parsed_msgs_count;
+        frontend_stats_t fe_stats;
+        extract_parser_state(state, response, &processors, &parsed_msgs_count, &fe_stats);
+        zlist_append(state->collected_processors, processors);
+        state->drained_msgs_count += parsed_msgs_count;
+        state->drained_fe_stats.received += fe_stats.received;
+        state->drained_fe_stats.dropped += fe_stats.dropped;
+        for (int j=0; j<FE_MSG_NUM_REASONS; j++)
+            state->drained_fe_stats.drop_reasons[j] += fe_stats.drop_reasons[j];
+        zmsg_destroy(&response);
+    }
+    parser_destroy(&state->parsers[i]);
+}
+
+static
+void add_writer(controller_state_t *state)
+{
+    size_t i = num_writers;
+    state->writers[i] = request_writer_new(state->config, i);
+    char index[16];
+    snprintf(index, sizeof(index), "%zu", i);
+    for (size_t j=0; j<num_parsers; j++) {
+        zstr_sendx(state->parsers[j], "connect-writer", index, NULL);
+        zsock_wait(state->parsers[j]);
+    }
+    num_writers = i + 1;
+}
+
+// once all parsers have disconnected, the writer only needs to store what's left in its queue
+static
+void remove_writer(controller_state_t *state)
+{
+    size_t i = num_writers - 1;
+    num_writers = i;
+    char index[16];
+    snprintf(index, sizeof(index), "%zu", i);
+    for (size_t j=0; j<num_parsers; j++) {
+        zstr_sendx(state->parsers[j], "disconnect-writer", index, NULL);
+        zsock_wait(state->parsers[j]);
+    }
+    zstr_send(state->writers[i], "drain");
+    zsock_wait(state->writers[i]);
+    zactor_destroy(&state->writers[i]);
+}
+
+static
+void add_updater(controller_state_t *state)
+{
+    size_t i = num_updaters;
+    state->updaters[i] = stats_updater_new(state->config, i);
+    __atomic_store_n(&num_updaters, i + 1, __ATOMIC_SEQ_CST);
+    if (updater_db_affinity && stats_updater_rehome(i) > 0)
+        zstr_send(state->updaters[i], "work");
+}
+
+// we don't send updates while the updater drains, and it hands its queue over to the others
+static
+void remove_updater(controller_state_t *state)
+{
+    size_t i = num_updaters - 1;
+    __atomic_store_n(&num_updaters, i, __ATOMIC_SEQ_CST);
+    zstr_send(state->updaters[i], "drain");
+    zsock_wait(state->updaters[i]);
+    zactor_destroy(&state->updaters[i]);
+    if (updater_db_affinity) {
+        for (int j=0; j<num_updaters; j++) {
+            zstr_send(state->updaters[j], "work");
+        }
+    }
+}
+
+// adds or removes at most one thread per pool and tick
+static
+void resize_elastic_pools(controller_state_t *state, int parses, int inserts, int updates)
+{
+    int queued[NUM_ELASTIC_POOLS] = {parses, inserts, updates};
+    for (int id = 0; id < NUM_ELASTIC_POOLS; id++) {
+        elastic_pool_t *pool = &elastic_pools[id];
+        int change = elastic_pool_update(id, queued[id], pool_cpu_seconds(id), zclock_mono());
+        if (change == 0 || zsys_interrupted)
+            continue;
+        unsigned long old_size = *pool->size;
+        switch (id) {
+        case ELASTIC_PARSERS:
+            if (change > 0)
+                add_parser(state);
+            else
+                remove_parser(state);
+            break;
+        case ELASTIC_WRITERS:
+            if (change > 0)
+                add_writer(state);
+            else
+                remove_writer(state);
+            break;
+        case ELASTIC_UPDATERS:
+            if (change > 0)
+                add_updater(state);
+            else
+                remove_updater(state);
+            break;
+        }
+        printf("[I] controller: %s %s: %lu -> %lu (queued: %d, cpu: %.0f%%)\n",
+               change > 0 ? "growing" : "shrinking", pool->name, old_size, *pool->size, queued[id], pool->cpu_usage * 100);
+        elastic_pool_resized(id, pool_cpu_seconds(id), zclock_mono());
+    }
+    for (int id = 0; id < NUM_ELASTIC_POOLS; id++) {
+        importer_prometheus_client_gauge_threads(id, *elastic_pools[id].size);
+    }
+}
+
 static
 int collect_stats_and_forward(zloop_t *loop, int timer_id, void *arg)
 {
@@ -306,6 +504,8 @@ int collect_stats_and_forward(zloop_t *loop, int timer_id, void *arg)
     frontend_stats_t fe_stats[num_parsers];
 
     state->ticks++;
+    // requests collected by the parsers during the last tick get stored in the new window
+    advance_insert_window();
 
     // tell tracker, subscribers, live stream publisher and stream updater to tick
     zstr_send(state->stream_config_updater, "tick");
@@ -338,12 +538,13 @@ int collect_stats_and_forward(zloop_t *loop, int timer_id, void *arg)
     }
 
     zlist_t *additions = zlist_new();
-    zlist_append(additions, processors[0]);
 
     // printf("[D] controller: combining processors states\n");
-    size_t parsed_msgs_count = parsed_msgs_counts[0];
-    frontend_stats_t front_stats = fe_stats[0];
-    for (int i=1; i<num_parsers; i++) {
+    size_t parsed_msgs_count = state->drained_msgs_count;
+    frontend_stats_t front_stats = state->drained_fe_stats;
+    memset(&state->drained_fe_stats, 0, sizeof(frontend_stats_t));
+    state->drained_msgs_count = 0;
+    for (int i=0; i<num_parsers; i++) {
         parsed_msgs_count += parsed_msgs_counts[i];
         front_stats.received += fe_stats[i].received;
         front_stats.dropped += fe_stats[i].dropped;
@@ -381,8 +582,15 @@ int collect_stats_and_forward(zloop_t *loop, int timer_id, void *arg)
     if (state->ticks % DATABASE_UPDATE_INTERVAL == 0) {
         // printf("[D] controller: forwarding updates\n");
         zhash_t *processors = zlist_pop(state->collected_processors);
-        forward_updates(state, processors);
+        // invalidate the checkpoint first: after a crash, losing updates is better than adding them twice
+        checkpoint_invalidate();
+        if (updater_db_affinity)
+            schedule_updates(state, processors);
+        else
+            forward_updates(state, processors);
         zhash_destroy(&processors);
+    } else if (state->ticks % checkpoint_interval == 0) {
+        checkpoint_send(state->checkpoint_writer, state->collected_processors);
     }
 
     // tell request writers to tick
@@ -391,20 +599,26 @@ int collect_stats_and_forward(zloop_t *loop, int timer_id, void *arg)
         zstr_send(state->writers[i], "tick");
     }
 
+    // page guards are shared by all parsers
+    if (max_pages_per_stream && state->ticks % PAGE_GUARD_REBALANCE_TICKS == 0)
+        page_guards_rebalance();
+
     bool terminate = (state->ticks % CONFIG_FILE_CHECK_INTERVAL == 0) && config_file_has_changed();
     int64_t end_time_ms = zclock_mono();
     int runtime = end_time_ms - start_time_ms;
+    importer_prometheus_client_observe_controller_tick(runtime / 1000.0);
     int next_tick = runtime > 999 ? 1 : 1000 - runtime;
     double received_percent = parsed_msgs_count == 0 ? 0 : ((double) front_stats.received / parsed_msgs_count) * 100;
     double dropped_percent  = front_stats.received == 0 ? 0 : ((double) front_stats.dropped / front_stats.received) * 100;
-    int updates, inserts;
+    int updates, inserts, parses;
     __atomic_load(&queued_updates, &updates, __ATOMIC_SEQ_CST);
     __atomic_load(&queued_inserts, &inserts, __ATOMIC_SEQ_CST);
-    printf("[I] controller: %5zu messages (%3d ms); frontend: %3zu [%4.1f%%] (dropped: %2zu [%4.1f%%]); queued updates/inserts: %4d/%4d\n",
+    __atomic_load(&queued_parses, &parses, __ATOMIC_SEQ_CST);
+    printf("[I] controller: %5zu messages (%3d ms); frontend: %3zu [%4.1f%%] (dropped: %2zu [%4.1f%%]); queued parses/updates/inserts: %4d/%4d/%4d\n",
            parsed_msgs_count, runtime,
            front_stats.received, received_percent,
            front_stats.dropped, dropped_percent,
-           updates, inserts) ;
+           parses, updates, inserts) ;
 
     if (updates < 0) {
         printf("[E] controller: queued updates are negative: %d\n", updates);
@@ -414,8 +628,22 @@ int collect_stats_and_forward(zloop_t *loop, int timer_id, void *arg)
         printf("[E] controller: queued inserts are negative: %d\n", inserts);
         inserts = 0;
     }
+    if (parses < 0)
+        parses = 0;
     importer_prometheus_client_gauge_queued_updates(updates);
     importer_prometheus_client_gauge_queued_inserts(inserts);
+    importer_prometheus_client_gauge_queued_parses(parses);
+
+    admission_level_t level = admission_control_update(parses, inserts, updates);
+    importer_prometheus_client_gauge_admission_level(level);
+
+    if (!terminate)
+        resize_elastic_pools(state, parses, inserts, updates);
+
+    mongo_client_pools_record_metrics();
+    // ping mongodb to reestablish connections if they got lost
+    if (!dryrun && state->ticks % PING_INTERVAL == 0)
+        mongo_client_pools_ping();
 
     importer_prometheus_client_count_updates_blocked(state->updates_blocked);
 
@@ -468,6 +696,12 @@ bool controller_create_actors(controller_state_t *state, uint64_t indexer_opts)
     state->live_stream_publisher = zactor_new(live_stream_actor_fn, state->config);
     // start the unknown streams collector
     state->unknown_streams_collector = zactor_new(unknown_streams_collector_actor_fn, NULL);
+    // start the frontend timings log writer
+    if (timings_log_enabled)
+        state->timings_log = zactor_new(timings_log_actor_fn, NULL);
+    // start the checkpoint writer
+    if (checkpoint_directory)
+        state->checkpoint_writer = zactor_new(checkpoint_writer_actor_fn, NULL);
 
     // create subscribers
     for (size_t i=0; i<num_subscribers; i++) {
@@ -547,6 +781,12 @@ void controller_destroy_actors(controller_state_t *state)
         }
     }
 
+    // after the parsers, so that it writes their last timings
+    if (state->timings_log) {
+        if (verbose) printf("[D] controller: destroying timings log\n");
+        zactor_destroy(&state->timings_log);
+    }
+
     for (size_t i=0; i<num_writers; i++) {
         if (state->writers[i]) {
             if (verbose) printf("[D] controller: destroying writer[%zu]\n", i);
@@ -604,6 +844,7 @@ void controller_destroy_actors(controller_state_t *state)
     }
 
     // shut down mongo client
+    destroy_mongo_client_pools();
     if (!dryrun)
         mongoc_cleanup();
 }
@@ -663,6 +904,7 @@ int run_controller_loop(zconfig_t* config, size_t io_threads, const char *logjam
     if (verbose)
         printf("[D] io-threads: %lu\n", io_threads);
     zsys_set_io_threads(io_threads);
+    thread_placement_pin_zmq_io_threads();
 
     zsys_set_rcvhwm(DEFAULT_RCV_HWM);
     zsys_set_sndhwm(DEFAULT_SND_HWM);
@@ -686,6 +928,12 @@ int run_controller_loop(zconfig_t* config, size_t io_threads, const char *logjam
         rc = 1;
         goto cleanup;
     }
+
+    // updates collected before the last shutdown will be sent with the next database update
+    zhash_t *restored_processors = checkpoint_read();
+    if (restored_processors)
+        zlist_append(state.collected_processors, restored_processors);
+
     // set up event loop
     zloop_t *loop = zloop_new();
     assert(loop);
@@ -715,11 +963,16 @@ int run_controller_loop(zconfig_t* config, size_t io_threads, const char *logjam
 
     zhash_t *p = NULL;
  cleanup:
+    // save updates which have not been forwarded yet, after pending checkpoints have been written
+    zactor_destroy(&state.checkpoint_writer);
+    if (start_up_complete)
+        checkpoint_write(state.collected_processors);
     // free collected processors
     while ( (p = zlist_pop(state.collected_processors) )) {
         zhash_destroy(&p);
     }
     zlist_destroy(&state.collected_processors);
+    release_active_streams(&state.active_streams);
     // create apocalypse timer
     if (start_shutdown_timer() == -1)
         printf("[W] controller: could not start shutdown timer\n");
@@ -0,0 +1,66 @@
+#include "importer-elastic.h"
+
+elastic_pool_t elastic_pools[NUM_ELASTIC_POOLS] = {
+    {.name = "parsers",  .size = &num_parsers,  .queue_depth = DEFAULT_ELASTIC_QUEUE_DEPTH_PARSERS},
+    {.name = "writers",  .size = &num_writers,  .queue_depth = DEFAULT_ELASTIC_QUEUE_DEPTH_WRITERS},
+    {.name = "updaters", .size = &num_updaters, .queue_depth = DEFAULT_ELASTIC_QUEUE_DEPTH_UPDATERS},
+};
+
+void elastic_pools_init()
+{
+    unsigned long max_sizes[NUM_ELASTIC_POOLS] = {max_parsers, max_writers, max_updaters};
+    for (int i = 0; i < NUM_ELASTIC_POOLS; i++) {
+        elastic_pool_t *pool = &elastic_pools[i];
+        pool->min_size = *pool->size;
+        pool->max_size = max_sizes[i] > pool->min_size ? max_sizes[i] : pool->min_size;
+    }
+}
+
+bool elastic_pool_enabled(elastic_pool_id_t id)
+{
+    return elastic_pools[id].max_size > elastic_pools[id].min_size;
+}
+
+static
+void sample_cpu_usage(elastic_pool_t *pool, double cpu_seconds, int64_t now_ms)
+{
+    double elapsed = (now_ms - pool->sampled_at_ms) / 1000.0;
+    if (pool->sampled_at_ms > 0 && elapsed > 0 && *pool->size > 0)
+        pool->cpu_usage = (cpu_seconds - pool->cpu_seconds) / elapsed / *pool->size;
+    pool->cpu_seconds = cpu_seconds;
+    pool->sampled_at_ms = now_ms;
+}
+
+// grows quickly when queues build up or threads are saturated, but shrinks only after
+// load has stayed low enough for the remaining threads for a couple of minutes
+int elastic_pool_update(elastic_pool_id_t id, int queued, double cpu_seconds, int64_t now_ms)
+{
+    elastic_pool_t *pool = &elastic_pools[id];
+    sample_cpu_usage(pool, cpu_seconds, now_ms);
+    if (!elastic_pool_enabled(id))
+        return 0;
+
+    unsigned long size = *pool->size;
+    bool busy = queued > pool->queue_depth * (long)size || pool->cpu_usage > ELASTIC_BUSY_CPU;
+    bool idle = size > 1
+        && queued <= pool->queue_depth * (long)(size - 1) / 4
+        && pool->cpu_usage * size / (size - 1) < ELASTIC_IDLE_CPU;
+
+    pool->busy_ticks = busy ? pool->busy_ticks + 1 : 0;
+    pool->idle_ticks = idle ? pool->idle_ticks + 1 : 0;
+
+    if (pool->busy_ticks >= ELASTIC_GROW_TICKS && size < pool->max_size)
+        return 1;
+    if (pool->idle_ticks >= ELASTIC_SHRINK_TICKS && size > pool->min_size)
+        return -1;
+    return 0;
+}
+
+void elastic_pool_resized(elastic_pool_id_t id, double cpu_seconds, int64_t now_ms)
+{
+    elastic_pool_t *pool = &elastic_pools[id];
+    pool->busy_ticks = 0;
+    pool->idle_ticks = 0;
+    pool->cpu_seconds = cpu_seconds;
+    pool->sampled_at_ms = now_ms;
+}
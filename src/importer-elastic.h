@@ -0,0 +1,63 @@
+#ifndef __LOGJAM_IMPORTER_ELASTIC_H_INCLUDED__
+#define __LOGJAM_IMPORTER_ELASTIC_H_INCLUDED__
+
+#include "importer-common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// thread pools which the controller grows and shrinks between the configured number of
+// threads and the configured maximum, depending on queue depth and cpu usage.
+typedef enum {
+    ELASTIC_PARSERS  = 0,
+    ELASTIC_WRITERS  = 1,
+    ELASTIC_UPDATERS = 2,
+} elastic_pool_id_t;
+
+#define NUM_ELASTIC_POOLS 3
+
+// queued items per thread above which a pool counts as busy
+#define DEFAULT_ELASTIC_QUEUE_DEPTH_PARSERS  2000
+#define DEFAULT_ELASTIC_QUEUE_DEPTH_WRITERS   500
+#define DEFAULT_ELASTIC_QUEUE_DEPTH_UPDATERS   50
+
+// average cpu usage per thread above which a pool counts as busy
+#define ELASTIC_BUSY_CPU 0.8
+// a thread is removed only if the remaining ones would stay below this
+#define ELASTIC_IDLE_CPU 0.5
+// consecutive busy/idle ticks before we add/remove a thread
+#define ELASTIC_GROW_TICKS 3
+#define ELASTIC_SHRINK_TICKS 120
+
+typedef struct {
+    const char *name;
+    unsigned long *size;        // current number of threads
+    unsigned long min_size;     // configured number of threads
+    unsigned long max_size;     // pool is elastic if larger than min_size
+    int queue_depth;            // queued items per thread we consider a backlog
+    int busy_ticks;
+    int idle_ticks;
+    double cpu_seconds;         // cpu time of all threads at the last sample
+    int64_t sampled_at_ms;
+    double cpu_usage;           // average cpu usage per thread since the last sample
+} elastic_pool_t;
+
+extern elastic_pool_t elastic_pools[NUM_ELASTIC_POOLS];
+
+// call after thread counts have been configured
+extern void elastic_pools_init();
+extern bool elastic_pool_enabled(elastic_pool_id_t id);
+
+// called by the controller on every tick. returns 1 if a thread should be added, -1 if one
+// should be removed and 0 otherwise.
+extern int elastic_pool_update(elastic_pool_id_t id, int queued, double cpu_seconds, int64_t now_ms);
+
+// resets load tracking after threads have been added or removed
+extern void elastic_pool_resized(elastic_pool_id_t id, double cpu_seconds, int64_t now_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
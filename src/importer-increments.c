@@ -53,6 +53,7 @@ increments_t* increments_clone(increments_t* increments)
     new_increments->page_request_count = increments->page_request_count;
     new_increments->ajax_request_count = increments->ajax_request_count;
     memcpy(new_increments->metrics, increments->metrics, METRICS_ARRAY_SIZE);
+    memcpy(new_increments->dynamic_keys, increments->dynamic_keys, sizeof(increments->dynamic_keys));
     json_object_object_foreach(increments->others, key, value) {
         json_object_get(value);
         json_object_object_add(new_increments->others, key, value);
@@ -77,6 +78,19 @@ void increments_fill_metrics(increments_t *increments, json_object *request)
     }
 }
 
+// used when we haven't built a json object for the request. unknown resources are ignored,
+// like the fields of a request which aren't resources.
+void increments_fill_metric(increments_t *increments, const char *resource, double v)
+{
+    size_t i = (size_t)zhash_lookup(resource_to_int, resource);
+    if (i == 0 && strcmp(resource, int_to_resource[0]))
+        return;
+    metric_pair_t *p = &increments->metrics[i];
+    p->val = v;
+    p->val_squared = v*v;
+    p->val_max = v;
+}
+
 void increments_add_metrics_to_json(increments_t *increments, json_object *jobj)
 {
     const int n = last_resource_offset;
@@ -91,6 +105,29 @@ void increments_add_metrics_to_json(increments_t *increments, json_object *jobj)
 
 #define NEW_INT1 (json_object_new_int(1))
 
+static const char* dynamic_prefixes[NUM_DYNAMIC_DIMENSIONS] = {"callers.", "senders.", "exceptions.", "soft_exceptions.", "js_exceptions."};
+static const size_t dynamic_prefix_lengths[NUM_DYNAMIC_DIMENSIONS] = {8, 8, 11, 16, 14};
+static const char* overflow_keys[NUM_DYNAMIC_DIMENSIONS] = {"callers.Other@other", "senders.Other@other", "exceptions.Other", "soft_exceptions.Other", "js_exceptions.Other"};
+
+// returns -1 for keys which don't belong to a dynamic dimension and for overflow keys
+static
+int dynamic_dimension(const char *key)
+{
+    for (int d = 0; d < NUM_DYNAMIC_DIMENSIONS; d++) {
+        if (strncmp(key, dynamic_prefixes[d], dynamic_prefix_lengths[d]) == 0)
+            return streq(key, overflow_keys[d]) ? -1 : d;
+    }
+    return -1;
+}
+
+static
+void increments_add_dynamic_key(increments_t *increments, dynamic_dimension_t d, const char *key)
+{
+    if (!json_object_object_get_ex(increments->others, key, NULL))
+        increments->dynamic_keys[d]++;
+    json_object_object_add(increments->others, key, NEW_INT1);
+}
+
 
 void increments_fill_apdex(increments_t *increments, double total_time)
 {
@@ -194,7 +231,7 @@ void increments_fill_exceptions(increments_t *increments, json_object *exception
             json_object* new_ex = json_object_new_string(ex_str_dup+11);
             json_object_array_put_idx(exceptions, i, new_ex);
         }
-        json_object_object_add(increments->others, ex_str_dup, NEW_INT1);
+        increments_add_dynamic_key(increments, DYNAMIC_EXCEPTIONS, ex_str_dup);
     }
 }
 
@@ -219,7 +256,7 @@ void increments_fill_soft_exceptions(increments_t *increments, json_object *soft
       json_object* new_ex = json_object_new_string(ex_str_dup+16);
       json_object_array_put_idx(soft_exceptions, i, new_ex);
     }
-    json_object_object_add(increments->others, ex_str_dup, NEW_INT1);
+    increments_add_dynamic_key(increments, DYNAMIC_SOFT_EXCEPTIONS, ex_str_dup);
   }
 }
 
@@ -231,7 +268,7 @@ void increments_fill_js_exception(increments_t *increments, const char *js_excep
     strcpy(xbuffer, "js_exceptions.");
     uri_replace_dots_and_dollars(xbuffer+l, js_exception);
     // printf("[D] JS EXCEPTION: %s\n", xbuffer);
-    json_object_object_add(increments->others, xbuffer, NEW_INT1);
+    increments_add_dynamic_key(increments, DYNAMIC_JS_EXCEPTIONS, xbuffer);
 }
 
 void increments_fill_caller_info(increments_t *increments, json_object *request)
@@ -255,7 +292,7 @@ void increments_fill_caller_info(increments_t *increments, json_object *request)
                 caller_name[real_app_len + 8] = '@';
                 copy_replace_dots_and_dollars(caller_name + 8 + real_app_len + 1, caller_action);
                 // printf("[D] CALLER: %s\n", caller_name);
-                json_object_object_add(increments->others, caller_name, NEW_INT1);
+                increments_add_dynamic_key(increments, DYNAMIC_CALLERS, caller_name);
             }
         }
     }
@@ -282,7 +319,7 @@ void increments_fill_sender_info(increments_t *increments, json_object *request)
                 sender_name[real_app_len + 8] = '@';
                 copy_replace_dots_and_dollars(sender_name + 8 + real_app_len + 1, sender_action);
                 // printf("[D] SENDER: %s\n", sender_name);
-                json_object_object_add(increments->others, sender_name, NEW_INT1);
+                increments_add_dynamic_key(increments, DYNAMIC_SENDERS, sender_name);
             }
         }
     }
@@ -333,6 +370,284 @@ void increments_add(increments_t *stored_increments, increments_t* increments)
         }
         if (new_obj) {
             json_object_object_add(stored_increments->others, key, new_obj);
+            int d;
+            if (!perform_addition && (d = dynamic_dimension(key)) >= 0)
+                stored_increments->dynamic_keys[d]++;
         }
     }
 }
+
+typedef struct {
+    const char *key;
+    json_object *obj;
+    double value;
+} dynamic_entry_t;
+
+static
+int dynamic_entry_cmp(const void *a, const void *b)
+{
+    const dynamic_entry_t *x = a, *y = b;
+    if (x->value != y->value)
+        return x->value > y->value ? -1 : 1;
+    return strcmp(x->key, y->key);
+}
+
+// returns the keys of the given dimension, largest values first
+static
+dynamic_entry_t* increments_sorted_dimension(increments_t *increments, dynamic_dimension_t d, size_t *n)
+{
+    size_t max = increments->dynamic_keys[d];
+    dynamic_entry_t *entries = zmalloc((max + 1) * sizeof(dynamic_entry_t));
+    size_t i = 0;
+    json_object_object_foreach(increments->others, key, value) {
+        if (i < max && dynamic_dimension(key) == (int)d)
+            entries[i++] = (dynamic_entry_t){key, value, json_object_get_double(value)};
+    }
+    qsort(entries, i, sizeof(dynamic_entry_t), dynamic_entry_cmp);
+    *n = i;
+    return entries;
+}
+
+static
+void increments_add_overflow(increments_t *increments, dynamic_dimension_t d, int overflow)
+{
+    json_object *stored_obj;
+    if (json_object_object_get_ex(increments->others, overflow_keys[d], &stored_obj))
+        overflow += json_object_get_int(stored_obj);
+    json_object_object_add(increments->others, overflow_keys[d], json_object_new_int(overflow));
+}
+
+// keeps the max_keys largest keys of the given dimension and adds the values of all
+// other keys to the overflow key
+static
+void increments_trim_dimension(increments_t *increments, dynamic_dimension_t d, size_t max_keys)
+{
+    size_t n;
+    dynamic_entry_t *entries = increments_sorted_dimension(increments, d, &n);
+    int overflow = 0;
+    for (size_t i = max_keys; i < n; i++) {
+        overflow += json_object_get_int(entries[i].obj);
+        json_object_object_del(increments->others, entries[i].key);
+    }
+    free(entries);
+    if (n <= max_keys)
+        return;
+    increments_add_overflow(increments, d, overflow);
+    increments->dynamic_keys[d] = max_keys;
+}
+
+struct dynamic_key_set {
+    char *db_name;
+    int ref_count;                              // protected by dynamic_key_sets_mutex
+    int64_t last_used;                          // protected by dynamic_key_sets_mutex
+    pthread_mutex_t mutex;
+    zhash_t *keys[NUM_DYNAMIC_DIMENSIONS];
+};
+
+// db_name -> dynamic_key_set_t*
+static zhash_t *dynamic_key_sets = NULL;
+static pthread_mutex_t dynamic_key_sets_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+void dynamic_key_set_destroy(void *item)
+{
+    dynamic_key_set_t *set = item;
+    for (int d = 0; d < NUM_DYNAMIC_DIMENSIONS; d++)
+        zhash_destroy(&set->keys[d]);
+    pthread_mutex_destroy(&set->mutex);
+    free(set->db_name);
+    free(set);
+}
+
+// caller must hold dynamic_key_sets_mutex. databases are per day, so their sets are
+// only needed until late updates for the previous day have been written.
+static
+void dynamic_key_sets_expire(int64_t now)
+{
+    zlist_t *expired = zlist_new();
+    dynamic_key_set_t *set = zhash_first(dynamic_key_sets);
+    while (set) {
+        if (set->ref_count == 0 && now - set->last_used > DYNAMIC_KEY_SET_MAX_AGE)
+            zlist_append(expired, set->db_name);
+        set = zhash_next(dynamic_key_sets);
+    }
+    const char *db_name;
+    while ( (db_name = zlist_pop(expired)) )
+        zhash_delete(dynamic_key_sets, db_name);
+    zlist_destroy(&expired);
+}
+
+dynamic_key_set_t* dynamic_key_set_acquire(const char *db_name)
+{
+    int64_t now = zclock_time();
+    pthread_mutex_lock(&dynamic_key_sets_mutex);
+    if (dynamic_key_sets == NULL)
+        dynamic_key_sets = zhash_new();
+    dynamic_key_set_t *set = zhash_lookup(dynamic_key_sets, db_name);
+    if (set == NULL) {
+        dynamic_key_sets_expire(now);
+        set = zmalloc(sizeof(*set));
+        set->db_name = strdup(db_name);
+        pthread_mutex_init(&set->mutex, NULL);
+        for (int d = 0; d < NUM_DYNAMIC_DIMENSIONS; d++)
+            set->keys[d] = zhash_new();
+        zhash_insert(dynamic_key_sets, db_name, set);
+        zhash_freefn(dynamic_key_sets, db_name, dynamic_key_set_destroy);
+    }
+    set->ref_count++;
+    set->last_used = now;
+    pthread_mutex_unlock(&dynamic_key_sets_mutex);
+    return set;
+}
+
+void dynamic_key_set_release(dynamic_key_set_t *set)
+{
+    pthread_mutex_lock(&dynamic_key_sets_mutex);
+    set->ref_count--;
+    pthread_mutex_unlock(&dynamic_key_sets_mutex);
+}
+
+// keeps the keys which have been stored before. new keys are admitted, largest values
+// first, until the database has max_keys keys for the dimension. all others go to the
+// overflow key.
+static
+void increments_fold_dimension(increments_t *increments, dynamic_dimension_t d, size_t max_keys, zhash_t *stored)
+{
+    size_t n;
+    dynamic_entry_t *entries = increments_sorted_dimension(increments, d, &n);
+    int overflow = 0;
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        const char *key = entries[i].key;
+        if (zhash_lookup(stored, key) || (zhash_size(stored) < max_keys && zhash_insert(stored, key, (void*)1) == 0)) {
+            kept++;
+        } else {
+            overflow += json_object_get_int(entries[i].obj);
+            json_object_object_del(increments->others, key);
+        }
+    }
+    free(entries);
+    if (kept < n)
+        increments_add_overflow(increments, d, overflow);
+    increments->dynamic_keys[d] = kept;
+}
+
+// needed after replacing others
+void increments_count_dynamic_keys(increments_t *increments)
+{
+    memset(increments->dynamic_keys, 0, sizeof(increments->dynamic_keys));
+    json_object_object_foreach(increments->others, key, value) {
+        int d = dynamic_dimension(key);
+        if (d >= 0)
+            increments->dynamic_keys[d]++;
+    }
+}
+
+// called on aggregates after adding increments. we let dimensions grow to twice their
+// limit before trimming, so that we don't have to sort on every new key.
+void increments_compact_dynamic_keys(increments_t *increments, size_t max_keys)
+{
+    if (max_keys == 0)
+        return;
+    for (int d = 0; d < NUM_DYNAMIC_DIMENSIONS; d++) {
+        if (increments->dynamic_keys[d] > 2 * max_keys)
+            increments_trim_dimension(increments, d, max_keys);
+    }
+}
+
+void increments_trim_dynamic_keys(increments_t *increments, size_t max_keys, dynamic_key_set_t *stored)
+{
+    if (max_keys == 0)
+        return;
+    pthread_mutex_lock(&stored->mutex);
+    for (int d = 0; d < NUM_DYNAMIC_DIMENSIONS; d++) {
+        if (increments->dynamic_keys[d] > 0)
+            increments_fold_dimension(increments, d, max_keys, stored->keys[d]);
+    }
+    pthread_mutex_unlock(&stored->mutex);
+}
+
+static
+increments_t* test_increments_with_callers(int first, int last)
+{
+    increments_t *increments = increments_new();
+    for (int i = first; i <= last; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "callers.app%d@call", i);
+        json_object_object_add(increments->others, key, json_object_new_int(i));
+    }
+    increments_count_dynamic_keys(increments);
+    return increments;
+}
+
+static
+int test_others_int(increments_t *increments, const char *key)
+{
+    json_object *obj;
+    return json_object_object_get_ex(increments->others, key, &obj) ? json_object_get_int(obj) : -1;
+}
+
+static void test_compact_dynamic_keys (int verbose)
+{
+    // nothing happens below twice the limit
+    increments_t *increments = test_increments_with_callers(1, 10);
+    increments_compact_dynamic_keys(increments, 5);
+    assert(increments->dynamic_keys[DYNAMIC_CALLERS] == 10);
+    increments_destroy(increments);
+
+    // above, the largest keys are kept and the others summed up
+    increments = test_increments_with_callers(1, 11);
+    json_object_object_add(increments->others, "callers.Other@other", json_object_new_int(100));
+    increments_compact_dynamic_keys(increments, 5);
+    assert(increments->dynamic_keys[DYNAMIC_CALLERS] == 5);
+    assert(test_others_int(increments, "callers.app11@call") == 11);
+    assert(test_others_int(increments, "callers.app7@call") == 7);
+    assert(test_others_int(increments, "callers.app6@call") == -1);
+    assert(test_others_int(increments, "callers.Other@other") == 100 + 1+2+3+4+5+6);
+    increments_destroy(increments);
+}
+
+static void test_trim_dynamic_keys (int verbose)
+{
+    dynamic_key_set_t *stored = dynamic_key_set_acquire("logjam-test-increments-2026-10-19");
+
+    // the largest keys get stored first
+    increments_t *increments = test_increments_with_callers(1, 4);
+    increments_trim_dynamic_keys(increments, 3, stored);
+    assert(increments->dynamic_keys[DYNAMIC_CALLERS] == 3);
+    assert(test_others_int(increments, "callers.app1@call") == -1);
+    assert(test_others_int(increments, "callers.Other@other") == 1);
+    increments_destroy(increments);
+
+    // stored keys stay, new ones go to the overflow key, however large they are
+    increments = test_increments_with_callers(3, 9);
+    increments_trim_dynamic_keys(increments, 3, stored);
+    assert(increments->dynamic_keys[DYNAMIC_CALLERS] == 2);
+    assert(test_others_int(increments, "callers.app3@call") == 3);
+    assert(test_others_int(increments, "callers.app4@call") == 4);
+    assert(test_others_int(increments, "callers.app9@call") == -1);
+    assert(test_others_int(increments, "callers.Other@other") == 5+6+7+8+9);
+    increments_destroy(increments);
+
+    // other databases have their own keys
+    dynamic_key_set_t *other = dynamic_key_set_acquire("logjam-test-increments-2026-10-20");
+    increments = test_increments_with_callers(9, 9);
+    increments_trim_dynamic_keys(increments, 3, other);
+    assert(test_others_int(increments, "callers.app9@call") == 9);
+    increments_destroy(increments);
+
+    dynamic_key_set_release(other);
+    dynamic_key_set_release(stored);
+}
+
+void increments_test (int verbose)
+{
+    printf (" * importer-increments: ");
+    if (verbose)
+        printf("\n");
+
+    test_compact_dynamic_keys (verbose);
+    test_trim_dynamic_keys (verbose);
+
+    printf ("OK\n");
+}
@@ -9,6 +9,26 @@ extern "C" {
 
 // TODO: support integer values (for call metrics)
 
+// dimensions of increments->others with an unbounded number of keys. aggregates keep the
+// top keys of each dimension and sum up the remaining ones under an overflow key.
+typedef enum {
+    DYNAMIC_CALLERS         = 0,
+    DYNAMIC_SENDERS         = 1,
+    DYNAMIC_EXCEPTIONS      = 2,
+    DYNAMIC_SOFT_EXCEPTIONS = 3,
+    DYNAMIC_JS_EXCEPTIONS   = 4,
+} dynamic_dimension_t;
+
+#define NUM_DYNAMIC_DIMENSIONS 5
+
+// dynamic keys which have been written to the documents of a database. stored documents
+// only get new keys until a dimension holds the limit, later keys go to the overflow key.
+// sets are kept in memory, so a restart can add up to the limit once more.
+typedef struct dynamic_key_set dynamic_key_set_t;
+
+// unused sets get dropped after a day and a bit (ms)
+#define DYNAMIC_KEY_SET_MAX_AGE ((int64_t)25 * 3600 * 1000)
+
 typedef struct {
     double val;
     double val_squared;
@@ -21,6 +41,7 @@ typedef struct {
     size_t ajax_request_count;
     metric_pair_t *metrics;
     json_object *others;
+    uint32_t dynamic_keys[NUM_DYNAMIC_DIMENSIONS];  // number of keys per dynamic dimension in others
 } increments_t;
 
 typedef struct {
@@ -41,6 +62,7 @@ extern void increments_destroy(void *increments);
 extern increments_t* increments_clone(increments_t* increments);
 extern void increments_add(increments_t *stored_increments, increments_t* increments);
 extern void increments_fill_metrics(increments_t *increments, json_object *request);
+extern void increments_fill_metric(increments_t *increments, const char *resource, double v);
 extern void increments_add_metrics_to_json(increments_t *increments, json_object *jobj);
 extern void increments_fill_apdex(increments_t *increments, double total_time);
 extern void increments_fill_frontend_apdex(increments_t *increments, double total_time);
@@ -53,10 +75,17 @@ extern void increments_fill_soft_exceptions(increments_t *increments, json_objec
 extern void increments_fill_js_exception(increments_t *increments, const char *js_exception);
 extern void increments_fill_caller_info(increments_t *increments, json_object *request);
 extern void increments_fill_sender_info(increments_t *increments, json_object *request);
+extern void increments_count_dynamic_keys(increments_t *increments);
+extern void increments_compact_dynamic_keys(increments_t *increments, size_t max_keys);
+extern void increments_trim_dynamic_keys(increments_t *increments, size_t max_keys, dynamic_key_set_t *stored);
+extern dynamic_key_set_t* dynamic_key_set_acquire(const char *db_name);
+extern void dynamic_key_set_release(dynamic_key_set_t *set);
 
 extern void dump_metrics(metric_pair_t *metrics);
 extern void dump_increments(const char *action, increments_t *increments);
 
+extern void increments_test (int verbose);
+
 #ifdef __cplusplus
 }
 #endif
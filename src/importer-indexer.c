@@ -4,13 +4,13 @@
 
 
 /*
- * connections: n_w = num_writers, n_p = num_parsers, "o" = bind, "[<>v^]" = connect
+ * connections: n_w = num_writers, n_p = num_parsers, n_i = num_indexers, "o" = bind, "[<>v^]" = connect
  *
  *                            controller
  *                                |
  *                               PIPE
- *               PUSH    PULL     |
- *  parser(n_p)  >----------o  indexer
+ *               PUSH    PULL     |              QUEUE
+ *  parser(n_p)  >----------o  indexer  ----------------> indexer workers(n_i)
  *
  */
 
@@ -20,8 +20,10 @@
 // The indexer therefore creates databases along with all their indexes one day in advance.
 // On startup, databases and indexes for the current day are created synchronously. The completion
 // of this is signalled to the controller by sending a started message to the controller.
-// Databases and indexes for dates in the future are always created via a fresh background
-// thread, spawned from the indexer.
+// All other work (indexes for today in fast start mode, indexes for tomorrow and refreshing
+// storage sizes) is put on a work queue, which is processed by a small pool of worker threads.
+// Jobs for today always run first, then jobs for tomorrow (paced, to reduce load on the
+// database servers), then storage size refreshes.
 
 typedef struct {
     size_t id;
@@ -30,15 +32,39 @@ typedef struct {
     zsock_t *pull_socket;
     zhash_t *databases;
     uint64_t opts;
+    struct indexer_queue *queue;
 } indexer_state_t;
 
+// job kinds, in priority order
+typedef enum {
+    INDEX_TODAY = 0,        // create indexes for a database of today
+    INDEX_TOMORROW = 1,     // create indexes for a database of tomorrow
+    REFRESH_STORAGE = 2,    // refresh storage sizes of all active streams
+} indexer_job_kind_t;
+
+#define NUM_INDEXER_JOB_KINDS 3
+
 typedef struct {
-    size_t id;
+    indexer_job_kind_t kind;
+    char *stream;
     char iso_date[ISO_DATE_STR_LEN];
-    bool ensure_known;
-} bg_indexer_args_t;
+} indexer_job_t;
+
+typedef struct indexer_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    zlist_t *jobs[NUM_INDEXER_JOB_KINDS];  // one fifo per priority
+    bool storage_refresh_queued;           // at most one storage refresh can be pending
+    bool terminating;
+    int64_t next_tomorrow_job_ms;          // paces index creation for tomorrow
+    size_t num_workers;
+    pthread_t workers[MAX_INDEXERS];
+} indexer_queue_t;
 
-enum future_t {tomorrow = 1, today = 0};
+typedef struct {
+    size_t id;
+    indexer_queue_t *queue;
+} indexer_worker_args_t;
 
 // sleep 5 seconds in between each step when iterating over all
 // databases to create tomorrow's indexes
@@ -150,6 +176,11 @@ bool add_jse_collection_indexes(indexer_state_t *state, mongoc_database_t *db)
     ok &= create_index(state, db, "js_exceptions", keys, NON_UNIQUE);
     bson_destroy(keys);
 
+    keys = bson_new();
+    bson_append_int32(keys, "fingerprint", 11, 1);
+    ok &= create_index(state, db, "js_exceptions", keys, NON_UNIQUE);
+    bson_destroy(keys);
+
     return ok;
 }
 
@@ -190,25 +221,47 @@ bool add_metrics_collection_indexes(indexer_state_t *state, mongoc_database_t *d
 }
 
 static
-int64_t extract_storage_size(bson_t *doc)
+void indexer_set_storage_size(indexer_state_t *state, const char *db_name, stream_info_t *stream_info, int64_t storage_size)
 {
-    bson_iter_t iter;
-    if (bson_iter_init_find (&iter, doc, "storageSize")) {
-        bson_type_t bit = bson_iter_type (&iter);
-        switch (bit) {
-        case BSON_TYPE_DOUBLE:
-            return bson_iter_double(&iter);
-        case BSON_TYPE_INT64:
-            return bson_iter_int64(&iter);
-        case BSON_TYPE_INT32:
-            return bson_iter_int32(&iter);
-        default:
-            fprintf(stderr, "unexpected bson type when reading databse stats: %d\n", bit);
-        }
+    stream_info->storage_size = storage_size;
+    if (stream_info->storage_size > HARD_LIMIT_STORAGE_SIZE)
+        fprintf(stderr, "[E] indexer[%zu]: hard limiting %s at %"PRId64"\n", state->id, db_name, stream_info->storage_size);
+    else if (stream_info->storage_size > SOFT_LIMIT_STORAGE_SIZE)
+        fprintf(stderr, "[W] indexer[%zu]: soft limiting %s at %"PRId64"\n", state->id, db_name, stream_info->storage_size);
+    else if (verbose)
+        fprintf(stdout, "[I] indexer[%zu]: not limiting %s at %"PRId64"\n", state->id, db_name, stream_info->storage_size);
+}
+
+static
+int64_t extract_size(bson_iter_t *iter)
+{
+    bson_type_t bit = bson_iter_type(iter);
+    switch (bit) {
+    case BSON_TYPE_DOUBLE:
+        return bson_iter_double(iter);
+    case BSON_TYPE_INT64:
+        return bson_iter_int64(iter);
+    case BSON_TYPE_INT32:
+        return bson_iter_int32(iter);
+    default:
+        fprintf(stderr, "unexpected bson type when reading databse stats: %d\n", bit);
     }
     return 0;
 }
 
+// storage plus index size, which is what listDatabases reports as sizeOnDisk
+static
+int64_t extract_storage_size(bson_t *doc)
+{
+    int64_t size = 0;
+    bson_iter_t iter;
+    if (bson_iter_init_find(&iter, doc, "storageSize"))
+        size += extract_size(&iter);
+    if (bson_iter_init_find(&iter, doc, "indexSize"))
+        size += extract_size(&iter);
+    return size;
+}
+
 static
 void indexer_check_disk_usage(indexer_state_t *state, const char *db_name, stream_info_t *stream_info)
 {
@@ -232,13 +285,7 @@ void indexer_check_disk_usage(indexer_state_t *state, const char *db_name, strea
         // char* bjs = bson_as_json(reply, &n);
         // printf("[D] database stats for (%s): %s\n", db_name, bjs);
         // bson_free(bjs);
-        stream_info->storage_size = extract_storage_size(&reply);
-        if (stream_info->storage_size > HARD_LIMIT_STORAGE_SIZE)
-            fprintf(stderr, "[E] indexer[%zu]: hard limiting %s at %"PRId64"\n", state->id, db_name, stream_info->storage_size);
-        else if (stream_info->storage_size > SOFT_LIMIT_STORAGE_SIZE)
-            fprintf(stderr, "[W] indexer[%zu]: soft limiting %s at %"PRId64"\n", state->id, db_name, stream_info->storage_size);
-        else if (verbose)
-            fprintf(stdout, "[I] indexer[%zu]: not limiting %s at %"PRId64"\n", state->id, db_name, stream_info->storage_size);
+        indexer_set_storage_size(state, db_name, stream_info, extract_storage_size(&reply));
     }
 
     bson_destroy(cmd);
@@ -246,24 +293,86 @@ void indexer_check_disk_usage(indexer_state_t *state, const char *db_name, strea
     mongoc_database_destroy(database);
 }
 
+// Retrieves the sizes of all logjam databases for the given date with a single
+// listDatabases command, as a hash from database name to sizeOnDisk (int64_t*).
+// Returns NULL if the command fails, for example due to missing privileges.
+static
+zhash_t* indexer_list_database_sizes(indexer_state_t *state, mongoc_client_t *client, const char *iso_date)
+{
+    char pattern[ISO_DATE_STR_LEN + 16];
+    snprintf(pattern, sizeof(pattern), "^logjam-.*-%s$", iso_date);
+    bson_t *cmd = BCON_NEW("listDatabases", BCON_INT32(1),
+                           "filter", "{", "name", "{", "$regex", BCON_UTF8(pattern), "}", "}");
+    bson_t reply;
+    bson_error_t error;
+    zhash_t *sizes = NULL;
+
+    bool ok = mongoc_client_command_simple(client, "admin", cmd, NULL, &reply, &error);
+    if (!ok) {
+        fprintf(stderr, "[W] indexer[%zu]: could not list databases: (%d) %s\n", state->id, error.code, error.message);
+        goto cleanup;
+    }
+
+    bson_iter_t iter, dbs;
+    if (!bson_iter_init_find(&iter, &reply, "databases") || !bson_iter_recurse(&iter, &dbs)) {
+        fprintf(stderr, "[W] indexer[%zu]: listDatabases reply has no databases\n", state->id);
+        goto cleanup;
+    }
+
+    sizes = zhash_new();
+    while (bson_iter_next(&dbs)) {
+        bson_iter_t db, name, size;
+        if (!bson_iter_recurse(&dbs, &db))
+            continue;
+        name = db;
+        size = db;
+        if (!bson_iter_find(&name, "name") || bson_iter_type(&name) != BSON_TYPE_UTF8)
+            continue;
+        int64_t *size_on_disk = zmalloc(sizeof(int64_t));
+        if (bson_iter_find(&size, "sizeOnDisk"))
+            *size_on_disk = extract_size(&size);
+        const char *db_name = bson_iter_utf8(&name, NULL);
+        zhash_update(sizes, db_name, size_on_disk);
+        zhash_freefn(sizes, db_name, free);
+    }
+
+ cleanup:
+    bson_destroy(&reply);
+    bson_destroy(cmd);
+    return sizes;
+}
+
 static
 void indexer_refresh_storage_sizes(indexer_state_t *self)
 {
     if (dryrun) return;
 
-    zlist_t *streams = get_active_stream_names();
-    char *stream = zlist_first(streams);
-    while (stream && !zsys_interrupted) {
-        stream_info_t *info = get_stream_info(stream, NULL);
-        if (info) {
-            char db_name[1000];
-            sprintf(db_name, "logjam-%s-%s-%s", info->app, info->env, iso_date_today);
+    char iso_date[ISO_DATE_STR_LEN];
+    char iso_date_next[ISO_DATE_STR_LEN];
+    get_iso_date_info(iso_date, iso_date_next);
+
+    // one round trip per database server. dbStats is only used if listing fails.
+    zhash_t *sizes[num_databases];
+    for (int i = 0; i < num_databases; i++)
+        sizes[i] = indexer_list_database_sizes(self, self->mongo_clients[i], iso_date);
+
+    active_streams_t streams = {0};
+    refresh_active_streams(&streams);
+    for (size_t i = 0; i < streams.size && !zsys_interrupted; i++) {
+        stream_info_t *info = streams.streams[i];
+        char db_name[1000];
+        sprintf(db_name, "logjam-%s-%s-%s", info->app, info->env, iso_date);
+        if (sizes[info->db]) {
+            // databases missing from the list haven't been written to yet
+            int64_t *size = zhash_lookup(sizes[info->db], db_name);
+            indexer_set_storage_size(self, db_name, info, size ? *size : 0);
+        } else
             indexer_check_disk_usage(self, db_name, info);
-            release_stream_info(info);
-        }
-        stream = zlist_next(streams);
     }
-    zlist_destroy(&streams);
+    release_active_streams(&streams);
+
+    for (int i = 0; i < num_databases; i++)
+        zhash_destroy(&sizes[i]);
 }
 
 static
@@ -318,27 +427,19 @@ bool indexer_create_indexes(indexer_state_t *state, const char *db_name, stream_
 }
 
 static
-void indexer_create_all_indexes(indexer_state_t *self, const char *iso_date, int delay)
+void indexer_create_all_indexes(indexer_state_t *self, const char *iso_date)
 {
     if (dryrun) return;
 
-    zlist_t *streams = get_active_stream_names();
-    char *stream = zlist_first(streams);
-    while (stream && !zsys_interrupted) {
-        stream_info_t *info = get_stream_info(stream, NULL);
-        if (info) {
-            char db_name[1000];
-            sprintf(db_name, "logjam-%s-%s-%s", info->app, info->env, iso_date);
-            indexer_create_indexes(self, db_name, info);
-            indexer_check_disk_usage(self, db_name, info);
-            release_stream_info(info);
-            if (delay) {
-                zclock_sleep(1000 * delay);
-            }
-        }
-        stream = zlist_next(streams);
+    active_streams_t streams = {0};
+    refresh_active_streams(&streams);
+    for (size_t i = 0; i < streams.size && !zsys_interrupted; i++) {
+        stream_info_t *info = streams.streams[i];
+        char db_name[1000];
+        sprintf(db_name, "logjam-%s-%s-%s", info->app, info->env, iso_date);
+        indexer_create_indexes(self, db_name, info);
     }
-    zlist_destroy(&streams);
+    release_active_streams(&streams);
 }
 
 static
@@ -381,84 +482,227 @@ void ensure_databases_are_known(indexer_state_t *state, const char* iso_date)
 {
     if (dryrun) return;
 
-    zlist_t *streams = get_active_stream_names();
-    char *stream = zlist_first(streams);
-
     zlist_t *db_names[num_databases];
     for (int i = 0; i<num_databases; i++) {
         db_names[i] = zlist_new();
         zlist_autofree(db_names[i]);
     }
 
-    while (stream && !zsys_interrupted) {
-        stream_info_t *info = get_stream_info(stream, NULL);
-        if (info) {
-            char db_name[1000];
-            sprintf(db_name, "logjam-%s-%s-%s", info->app, info->env, iso_date);
-            zlist_append(db_names[info->db], db_name);
-            release_stream_info(info);
-        }
-        stream = zlist_next(streams);
+    active_streams_t streams = {0};
+    refresh_active_streams(&streams);
+    for (size_t i = 0; i < streams.size && !zsys_interrupted; i++) {
+        stream_info_t *info = streams.streams[i];
+        char db_name[1000];
+        sprintf(db_name, "logjam-%s-%s-%s", info->app, info->env, iso_date);
+        zlist_append(db_names[info->db], db_name);
     }
+    release_active_streams(&streams);
 
     for (int i = 0; i<num_databases; i++) {
         if (!zsys_interrupted)
             ensure_known_databases(state->mongo_clients[i], db_names[i]);
         zlist_destroy(&db_names[i]);
     }
+}
+
+static
+void indexer_job_destroy(indexer_job_t **job_p)
+{
+    indexer_job_t *job = *job_p;
+    free(job->stream);
+    free(job);
+    *job_p = NULL;
+}
+
+static
+void indexer_queue_push(indexer_queue_t *queue, indexer_job_kind_t kind, const char *stream, const char *iso_date)
+{
+    indexer_job_t *job = zmalloc(sizeof(*job));
+    assert(job);
+    job->kind = kind;
+    if (stream)
+        job->stream = strdup(stream);
+    if (iso_date)
+        strcpy(job->iso_date, iso_date);
+    pthread_mutex_lock(&queue->mutex);
+    if (kind == REFRESH_STORAGE && queue->storage_refresh_queued) {
+        indexer_job_destroy(&job);
+    } else {
+        if (kind == REFRESH_STORAGE)
+            queue->storage_refresh_queued = true;
+        zlist_append(queue->jobs[kind], job);
+        pthread_cond_signal(&queue->cond);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static
+void indexer_queue_push_all_streams(indexer_queue_t *queue, indexer_job_kind_t kind, const char *iso_date)
+{
+    active_streams_t streams = {0};
+    refresh_active_streams(&streams);
+    for (size_t i = 0; i < streams.size; i++)
+        indexer_queue_push(queue, kind, streams.streams[i]->key, iso_date);
+    release_active_streams(&streams);
+}
+
+// after a date change, pending jobs for tomorrow might refer to today
+static
+void indexer_queue_promote_jobs_for_date(indexer_queue_t *queue, const char *iso_date)
+{
+    size_t promoted = 0;
+    pthread_mutex_lock(&queue->mutex);
+    zlist_t *pending = queue->jobs[INDEX_TOMORROW];
+    zlist_t *remaining = zlist_new();
+    indexer_job_t *job;
+    while ( (job = zlist_pop(pending)) ) {
+        if (streq(job->iso_date, iso_date)) {
+            job->kind = INDEX_TODAY;
+            zlist_append(queue->jobs[INDEX_TODAY], job);
+            promoted++;
+        } else
+            zlist_append(remaining, job);
+    }
+    zlist_destroy(&queue->jobs[INDEX_TOMORROW]);
+    queue->jobs[INDEX_TOMORROW] = remaining;
+    if (promoted)
+        pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    if (promoted)
+        printf("[I] indexer: promoted %zu pending jobs for %s\n", promoted, iso_date);
+}
+
+// blocks until a job is available or the queue is terminated
+static
+indexer_job_t* indexer_queue_pop(indexer_queue_t *queue)
+{
+    indexer_job_t *job = NULL;
+    pthread_mutex_lock(&queue->mutex);
+    while (!job && !queue->terminating && !zsys_interrupted) {
+        int64_t now = zclock_mono();
+        if (zlist_size(queue->jobs[INDEX_TODAY]) > 0) {
+            job = zlist_pop(queue->jobs[INDEX_TODAY]);
+        } else if (zlist_size(queue->jobs[INDEX_TOMORROW]) > 0 && now >= queue->next_tomorrow_job_ms) {
+            job = zlist_pop(queue->jobs[INDEX_TOMORROW]);
+            queue->next_tomorrow_job_ms = now + 1000 * INDEXER_DELAY;
+        } else if (zlist_size(queue->jobs[REFRESH_STORAGE]) > 0) {
+            job = zlist_pop(queue->jobs[REFRESH_STORAGE]);
+            queue->storage_refresh_queued = false;
+        } else {
+            // wake up once a second to check for termination and paced jobs
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&queue->cond, &queue->mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return job;
+}
 
-    zlist_destroy(&streams);
+static
+void indexer_run_job(indexer_state_t *state, indexer_job_t *job)
+{
+    if (job->kind == REFRESH_STORAGE) {
+        indexer_refresh_storage_sizes(state);
+        return;
+    }
+    stream_info_t *info = get_stream_info(job->stream, NULL);
+    if (info) {
+        char db_name[1000];
+        sprintf(db_name, "logjam-%s-%s-%s", info->app, info->env, job->iso_date);
+        indexer_create_indexes(state, db_name, info);
+        release_stream_info(info);
+    }
 }
 
 static
-void* bg_create_indexes_for_date(void* args)
+void* indexer_worker(void* args)
 {
-    bg_indexer_args_t *indexer_args = args;
-    if (dryrun) goto exit;
+    indexer_worker_args_t *worker_args = args;
+    indexer_queue_t *queue = worker_args->queue;
 
     indexer_state_t state;
     memset(&state, 0, sizeof(state));
-    state.id = indexer_args->id;;
+    state.id = worker_args->id;
+    free(worker_args);
 
     char thread_name[16];
     memset(thread_name, 0, 16);
     snprintf(thread_name, 16, "indexer[%zu]", state.id);
     set_thread_name(thread_name);
 
-    for (int i=0; i<num_databases; i++) {
-        state.mongo_clients[i] = mongoc_client_new(databases[i]);
-        assert(state.mongo_clients[i]);
+    if (!dryrun) {
+        for (int i=0; i<num_databases; i++) {
+            state.mongo_clients[i] = mongoc_client_new(databases[i]);
+            assert(state.mongo_clients[i]);
+        }
     }
-    state.databases = zhash_new();
-
-    if (indexer_args->ensure_known)
-        ensure_databases_are_known(&state, indexer_args->iso_date);
 
-    indexer_create_all_indexes(&state, indexer_args->iso_date, INDEXER_DELAY);
-
-    zhash_destroy(&state.databases);
-    for (int i=0; i<num_databases; i++) {
-        mongoc_client_destroy(state.mongo_clients[i]);
+    indexer_job_t *job;
+    while ( (job = indexer_queue_pop(queue)) ) {
+        if (!dryrun)
+            indexer_run_job(&state, job);
+        indexer_job_destroy(&job);
     }
 
- exit:
-    free(indexer_args);
+    if (!dryrun) {
+        for (int i=0; i<num_databases; i++) {
+            mongoc_client_destroy(state.mongo_clients[i]);
+        }
+    }
     return NULL;
 }
 
 static
-void spawn_bg_indexer_for_date(size_t id, const char* iso_date, enum future_t future)
+indexer_queue_t* indexer_queue_new(size_t num_workers)
 {
-    bg_indexer_args_t *indexer_args = zmalloc(sizeof(bg_indexer_args_t));
-    assert(indexer_args != NULL);
-    indexer_args->id = id;
-    indexer_args->ensure_known = future == today;
-    strcpy(indexer_args->iso_date, iso_date);
-    pthread_t thread;
-    int rc = pthread_create (&thread, NULL, bg_create_indexes_for_date, indexer_args);
+    indexer_queue_t *queue = zmalloc(sizeof(*queue));
+    assert(queue);
+    int rc = pthread_mutex_init(&queue->mutex, NULL);
     assert(rc == 0);
-    rc = pthread_detach (thread);
+    rc = pthread_cond_init(&queue->cond, NULL);
     assert(rc == 0);
+    for (int i = 0; i < NUM_INDEXER_JOB_KINDS; i++)
+        queue->jobs[i] = zlist_new();
+
+    if (num_workers < 1)
+        num_workers = 1;
+    if (num_workers > MAX_INDEXERS)
+        num_workers = MAX_INDEXERS;
+    queue->num_workers = num_workers;
+    for (size_t i = 0; i < num_workers; i++) {
+        indexer_worker_args_t *args = zmalloc(sizeof(*args));
+        assert(args);
+        args->id = i + 1;
+        args->queue = queue;
+        rc = pthread_create(&queue->workers[i], NULL, indexer_worker, args);
+        assert(rc == 0);
+    }
+    return queue;
+}
+
+static
+void indexer_queue_destroy(indexer_queue_t **queue_p)
+{
+    indexer_queue_t *queue = *queue_p;
+    pthread_mutex_lock(&queue->mutex);
+    queue->terminating = true;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+    for (size_t i = 0; i < queue->num_workers; i++)
+        pthread_join(queue->workers[i], NULL);
+
+    for (int i = 0; i < NUM_INDEXER_JOB_KINDS; i++) {
+        indexer_job_t *job;
+        while ( (job = zlist_pop(queue->jobs[i])) )
+            indexer_job_destroy(&job);
+        zlist_destroy(&queue->jobs[i]);
+    }
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue);
+    *queue_p = NULL;
 }
 
 static
@@ -512,6 +756,7 @@ indexer_state_t* indexer_state_new(zsock_t *pipe, size_t id, int opts)
     }
     state->databases = zhash_new();
     state->opts = opts;
+    state->queue = indexer_queue_new(num_indexers);
     return state;
 }
 
@@ -519,6 +764,7 @@ static
 void indexer_state_destroy(indexer_state_t **state_p)
 {
     indexer_state_t *state = *state_p;
+    indexer_queue_destroy(&state->queue);
     zsock_destroy(&state->pull_socket);
     zhash_destroy(&state->databases);
     if (!dryrun) {
@@ -542,7 +788,6 @@ void indexer(zsock_t *pipe, void *args)
         printf("[I] indexer[%zu]: starting\n", id);
 
     size_t ticks = 0;
-    size_t bg_indexer_runs = 0;
     indexer_state_t *state = indexer_state_new(pipe, id, (uint64_t)args);
 
     // setup indexes on global databases
@@ -552,7 +797,7 @@ void indexer(zsock_t *pipe, void *args)
     config_update_date_info();
     ensure_databases_are_known(state, iso_date_today);
     if (!(state->opts & INDEXER_DB_FAST_START))
-        indexer_create_all_indexes(state, iso_date_today, 0);
+        indexer_create_all_indexes(state, iso_date_today);
 
     // signal readyiness after index creation
     zsock_signal(pipe, 0);
@@ -560,9 +805,10 @@ void indexer(zsock_t *pipe, void *args)
     // setup indexes for tomorrow (asynchronously)
     if (!(state->opts & INDEXER_DB_ON_DEMAND)) {
         if (state->opts & INDEXER_DB_FAST_START)
-            spawn_bg_indexer_for_date(++bg_indexer_runs, iso_date_today, today);
-        spawn_bg_indexer_for_date(++bg_indexer_runs, iso_date_tomorrow, tomorrow);
+            indexer_queue_push_all_streams(state->queue, INDEX_TODAY, iso_date_today);
+        indexer_queue_push_all_streams(state->queue, INDEX_TOMORROW, iso_date_tomorrow);
     }
+    indexer_queue_push(state->queue, REFRESH_STORAGE, NULL, NULL);
 
     zpoller_t *poller = zpoller_new(state->controller_socket, state->pull_socket, NULL);
     assert(poller);
@@ -581,15 +827,16 @@ void indexer(zsock_t *pipe, void *args)
                     printf("[D] indexer[%zu]: tick\n", id);
 
                 // if date has changed, make sure databases of today are added to the
-                // known datbases table and spawn a background thread to create databases
-                // for the next day, unless we're running in lazy mode
+                // known datbases table and queue index creation for databases of the
+                // next day, unless we're running in lazy mode
                 if (config_update_date_info()) {
                     printf("[I] indexer[%zu]: date change detected\n", id);
+                    indexer_queue_promote_jobs_for_date(state->queue, iso_date_today);
                     printf("[I] indexer[%zu]: making sure today's databases are known\n", id);
                     ensure_databases_are_known(state, iso_date_today);
                     if (!(state->opts & INDEXER_DB_ON_DEMAND)) {
-                        printf("[I] indexer[%zu]: creating indexes for tomorrow\n", id);
-                        spawn_bg_indexer_for_date(++bg_indexer_runs, iso_date_tomorrow, tomorrow);
+                        printf("[I] indexer[%zu]: queueing index creation for tomorrow\n", id);
+                        indexer_queue_push_all_streams(state->queue, INDEX_TOMORROW, iso_date_tomorrow);
                     }
                 }
                 if (ticks++ % PING_INTERVAL == 0) {
@@ -599,8 +846,8 @@ void indexer(zsock_t *pipe, void *args)
                     }
                 }
                 if (ticks % DATABASE_INFO_REFRESH_INTERVAL == 0) {
-                    // retrieve current database storage sizew
-                    indexer_refresh_storage_sizes(state);
+                    // retrieve current database storage sizes
+                    indexer_queue_push(state->queue, REFRESH_STORAGE, NULL, NULL);
                 }
                 if (ticks % COLLECTION_REFRESH_INTERVAL == COLLECTION_REFRESH_INTERVAL - id - 1) {
                     // free known databases list
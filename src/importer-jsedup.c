@@ -0,0 +1,195 @@
+#include "importer-jsedup.h"
+
+size_t max_js_exception_exemplars = DEFAULT_MAX_JS_EXCEPTION_EXEMPLARS;
+
+static inline
+uint64_t fnv1a_update(uint64_t h, const char *s)
+{
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 1099511628211ULL;
+    }
+    // separate fields, so that "ab" + "c" differs from "a" + "bc"
+    h ^= 0xff;
+    h *= 1099511628211ULL;
+    return h;
+}
+
+// line and column numbers and query strings change with every deploy of the same code,
+// so we drop them: "app.js?v=3:12:5" becomes "app.js::"
+static
+uint64_t fnv1a_update_stack(uint64_t h, const char *s)
+{
+    while (*s) {
+        if (*s == '?') {
+            while (*s && *s != ':' && *s != ')' && !isspace((unsigned char) *s))
+                s++;
+            continue;
+        }
+        h ^= (unsigned char) *s;
+        h *= 1099511628211ULL;
+        if (*s++ == ':')
+            while (isdigit((unsigned char) *s))
+                s++;
+    }
+    return h;
+}
+
+uint64_t js_exception_fingerprint(const char *description, const char *page, json_object *request)
+{
+    uint64_t h = 14695981039346656037ULL;
+    h = fnv1a_update(h, description);
+    h = fnv1a_update(h, page);
+    json_object *stack_obj;
+    if (json_object_object_get_ex(request, "stack", &stack_obj)
+        || json_object_object_get_ex(request, "backtrace", &stack_obj)) {
+        if (json_object_is_type(stack_obj, json_type_array)) {
+            size_t n = json_object_array_length(stack_obj);
+            for (size_t i = 0; i < n; i++) {
+                const char *frame = json_object_get_string(json_object_array_get_idx(stack_obj, i));
+                if (frame)
+                    h = fnv1a_update_stack(h, frame);
+            }
+        } else {
+            const char *stack = json_object_get_string(stack_obj);
+            if (stack)
+                h = fnv1a_update_stack(h, stack);
+        }
+    }
+    return h;
+}
+
+static
+void js_exception_group_destroy(void *group)
+{
+    js_exception_group_t *g = group;
+    release_stream_info(g->stream_info);
+    free(g->db_name);
+    free(g->module);
+    free(g->page);
+    free(g->description);
+    json_object_put(g->exemplars);
+    free(g);
+}
+
+void js_exception_groups_add(zhash_t *groups, stream_info_t *stream_info, const char *db_name, const char *module,
+                             const char *page, const char *description, json_object *request)
+{
+    uint64_t fingerprint = js_exception_fingerprint(description, page, request);
+    char key[1024];
+    snprintf(key, sizeof(key), "%s-%016" PRIx64, stream_info->key, fingerprint);
+    int64_t now = zclock_time();
+
+    js_exception_group_t *group = zhash_lookup(groups, key);
+    if (group == NULL) {
+        group = zmalloc(sizeof(js_exception_group_t));
+        reference_stream_info(stream_info);
+        group->stream_info = stream_info;
+        group->db_name = strdup(db_name);
+        group->module = strdup(module);
+        group->page = strdup(page);
+        group->description = strdup(description);
+        snprintf(group->fingerprint, sizeof(group->fingerprint), "%016" PRIx64, fingerprint);
+        group->first_seen = now;
+        group->exemplars = json_object_new_array();
+        int rc = zhash_insert(groups, key, group);
+        assert(rc == 0);
+        zhash_freefn(groups, key, js_exception_group_destroy);
+    }
+    group->count++;
+    group->last_seen = now;
+    if (json_object_array_length(group->exemplars) < max_js_exception_exemplars)
+        json_object_array_add(group->exemplars, json_object_get(request));
+}
+
+// the writer owns the group object after a successful send
+static
+void js_exception_group_send(js_exception_group_t *self, zsock_t *socket)
+{
+    json_object *obj = json_object_new_object();
+    json_object_object_add(obj, "fingerprint", json_object_new_string(self->fingerprint));
+    json_object_object_add(obj, "description", json_object_new_string(self->description));
+    json_object_object_add(obj, "page", json_object_new_string(self->page));
+    json_object_object_add(obj, "count", json_object_new_int64(self->count));
+    json_object_object_add(obj, "first_seen", json_object_new_int64(self->first_seen));
+    json_object_object_add(obj, "last_seen", json_object_new_int64(self->last_seen));
+    json_object_object_add(obj, "exemplars", json_object_get(self->exemplars));
+
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, self->db_name);
+    zmsg_addstr(msg, "j");
+    zmsg_addstr(msg, self->module);
+    zmsg_addptr(msg, obj);
+    zmsg_addptr(msg, self->stream_info);
+    reference_stream_info(self->stream_info);
+    if (zmsg_send_with_retry(&msg, socket)) {
+        json_object_put(obj);
+        release_stream_info(self->stream_info);
+        return;
+    }
+    __atomic_add_fetch(&queued_inserts, 1, __ATOMIC_SEQ_CST);
+}
+
+// called at the end of every tick
+void js_exception_groups_flush(zhash_t *groups, zsock_t *socket)
+{
+    js_exception_group_t *group = zhash_first(groups);
+    while (group) {
+        js_exception_group_send(group, socket);
+        group = zhash_next(groups);
+    }
+    while ((group = zhash_first(groups)))
+        zhash_delete(groups, zhash_cursor(groups));
+}
+
+static uint64_t test_fingerprint(const char *description, const char *page, const char *request_json)
+{
+    json_object *request = json_tokener_parse(request_json);
+    assert(request);
+    uint64_t h = js_exception_fingerprint(description, page, request);
+    json_object_put(request);
+    return h;
+}
+
+static void test_fingerprint_normalization (int verbose)
+{
+    // line and column numbers and query strings are ignored
+    uint64_t h = test_fingerprint("TypeError", "Home#index", "{\"stack\":\"at f (app.js?v=3:12:5)\\nat g (lib.js:1:20)\"}");
+    assert(h == test_fingerprint("TypeError", "Home#index", "{\"stack\":\"at f (app.js?v=4:13:7)\\nat g (lib.js:2:2)\"}"));
+    assert(h == test_fingerprint("TypeError", "Home#index", "{\"stack\":\"at f (app.js:99:1)\\nat g (lib.js:3:3)\"}"));
+    // but not file or function names
+    assert(h != test_fingerprint("TypeError", "Home#index", "{\"stack\":\"at f (app2.js:12:5)\\nat g (lib.js:1:20)\"}"));
+    assert(h != test_fingerprint("TypeError", "Home#index", "{\"stack\":\"at h (app.js:12:5)\\nat g (lib.js:1:20)\"}"));
+
+    // stacks given as arrays of frames, and under the backtrace key
+    h = test_fingerprint("TypeError", "Home#index", "{\"stack\":[\"app.js?v=1:1:1\",\"lib.js:2:2\"]}");
+    assert(h == test_fingerprint("TypeError", "Home#index", "{\"backtrace\":[\"app.js?v=2:3:4\",\"lib.js:5:6\"]}"));
+    assert(h != test_fingerprint("TypeError", "Home#index", "{\"stack\":[\"lib.js:2:2\",\"app.js:1:1\"]}"));
+
+    // non ascii characters are hashed like any other byte
+    h = test_fingerprint("TypeError", "Home#index", "{\"stack\":\"at \xc3\xa4 (m\xc3\xbcll.js?\xc3\xa9=1:1:1)\"}");
+    assert(h == test_fingerprint("TypeError", "Home#index", "{\"stack\":\"at \xc3\xa4 (m\xc3\xbcll.js:2:2)\"}"));
+    assert(h != test_fingerprint("TypeError", "Home#index", "{\"stack\":\"at \xc3\xb6 (m\xc3\xbcll.js:2:2)\"}"));
+}
+
+static void test_fingerprint_fields (int verbose)
+{
+    // fields are separated, so moving characters between them changes the fingerprint
+    assert(test_fingerprint("ab", "c", "{}") != test_fingerprint("a", "bc", "{}"));
+    assert(test_fingerprint("TypeError", "Home#index", "{}") != test_fingerprint("TypeError", "Home#show", "{}"));
+    assert(test_fingerprint("TypeError", "Home#index", "{}") != test_fingerprint("RangeError", "Home#index", "{}"));
+    // a missing stack is the same as an empty one
+    assert(test_fingerprint("TypeError", "Home#index", "{}") == test_fingerprint("TypeError", "Home#index", "{\"stack\":\"\"}"));
+}
+
+void jsedup_test (int verbose)
+{
+    printf (" * importer-jsedup: ");
+    if (verbose)
+        printf("\n");
+
+    test_fingerprint_normalization (verbose);
+    test_fingerprint_fields (verbose);
+
+    printf ("OK\n");
+}
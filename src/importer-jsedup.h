@@ -0,0 +1,45 @@
+#ifndef __LOGJAM_IMPORTER_JSEDUP_H_INCLUDED__
+#define __LOGJAM_IMPORTER_JSEDUP_H_INCLUDED__
+
+#include "importer-common.h"
+#include "logjam-streaminfo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// javascript exceptions are grouped by a fingerprint of description, page and normalized
+// stack during a tick. when the tick ends, the parser sends one message per group, which
+// the writer turns into an upsert of the group document and inserts of a few exemplars.
+// writers store at most max_js_exception_exemplars exemplars per fingerprint and day.
+#define DEFAULT_MAX_JS_EXCEPTION_EXEMPLARS 3
+
+extern size_t max_js_exception_exemplars;
+
+typedef struct {
+    stream_info_t *stream_info;
+    char *db_name;
+    char *module;
+    char *page;
+    char *description;
+    char fingerprint[17];       // hex encoded
+    uint64_t count;
+    int64_t first_seen;         // milliseconds since epoch
+    int64_t last_seen;
+    json_object *exemplars;     // the first max_js_exception_exemplars exceptions of the tick
+} js_exception_group_t;
+
+extern uint64_t js_exception_fingerprint(const char *description, const char *page, json_object *request);
+
+// groups indexed by "<stream>-<fingerprint>"
+extern void js_exception_groups_add(zhash_t *groups, stream_info_t *stream_info, const char *db_name, const char *module,
+                                    const char *page, const char *description, json_object *request);
+extern void js_exception_groups_flush(zhash_t *groups, zsock_t *socket);
+
+extern void jsedup_test (int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
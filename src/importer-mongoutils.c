@@ -1,11 +1,17 @@
 #include "importer-mongoutils.h"
+#include "importer-prometheus-client.h"
 
 int num_databases = 0;
 const char *databases[MAX_DATABASES];
 
+int mongo_pool_size = 0;
+int mongo_pipelined_writes = DEFAULT_MONGO_PIPELINED_WRITES;
+static mongoc_client_pool_t *mongo_pools[MAX_DATABASES];
+static int operations_in_flight[MAX_DATABASES];
+
 mongoc_write_concern_t *wc_no_wait = NULL;
 mongoc_write_concern_t *wc_wait = NULL;
-static bson_t *bulk_opts = NULL;
+bson_t *bulk_opts = NULL;
 
 static
 void my_mongo_log_handler(mongoc_log_level_t log_level, const char *log_domain, const char *message, void *user_data)
@@ -88,6 +94,96 @@ void initialize_mongo_db_globals(zconfig_t* config)
         printf("[I] database[%d]: %s\n", num_databases, DEFAULT_MONGO_URI);
         num_databases++;
     }
+
+    const char *pool_size = zconfig_resolve(config, "backend/max_concurrent_operations", NULL);
+    if (pool_size)
+        mongo_pool_size = atoi(pool_size);
+    // writers and updaters hold at most one client at a time, so by default none of them
+    // ever waits for the pool. pools create clients on demand, so connections grow with
+    // the threads actually writing to a database, not with threads * databases. the extra
+    // client lets the controller ping while all workers are busy.
+    if (mongo_pool_size <= 0)
+        mongo_pool_size = max_writers + max_updaters + 1;
+    printf("[I] database connections: at most %d concurrent operations per database\n", mongo_pool_size);
+
+    const char *pipelined_writes = zconfig_resolve(config, "backend/pipelined_writes", NULL);
+    if (pipelined_writes) {
+        char *end;
+        long n = strtol(pipelined_writes, &end, 10);
+        if (*end || n <= 0) {
+            fprintf(stderr, "[E] invalid value for backend/pipelined_writes: %s\n", pipelined_writes);
+            exit(1);
+        }
+        mongo_pipelined_writes = n;
+    }
+    printf("[I] database connections: at most %d request inserts in flight per writer and database\n", mongo_pipelined_writes);
+
+    for (int i=0; i<num_databases; i++) {
+        mongoc_uri_t *uri = mongoc_uri_new(databases[i]);
+        assert(uri);
+        mongo_pools[i] = mongoc_client_pool_new(uri);
+        assert(mongo_pools[i]);
+        mongoc_client_pool_max_size(mongo_pools[i], mongo_pool_size);
+        mongoc_uri_destroy(uri);
+    }
+}
+
+void destroy_mongo_client_pools()
+{
+    for (int i=0; i<num_databases; i++) {
+        if (mongo_pools[i])
+            mongoc_client_pool_destroy(mongo_pools[i]);
+        mongo_pools[i] = NULL;
+    }
+}
+
+// blocks until a client for the given database is available
+mongoc_client_t* mongo_lease_acquire(mongo_lease_t *lease, int db)
+{
+    int64_t start_us = zclock_usecs();
+    lease->db = db;
+    lease->client = mongoc_client_pool_pop(mongo_pools[db]);
+    assert(lease->client);
+    lease->acquired_us = zclock_usecs();
+    __atomic_add_fetch(&operations_in_flight[db], 1, __ATOMIC_RELAXED);
+    importer_prometheus_client_observe_mongo_pool_wait(db, (lease->acquired_us - start_us) / 1000000.0);
+    return lease->client;
+}
+
+void mongo_lease_release(mongo_lease_t *lease)
+{
+    int64_t end_us = zclock_usecs();
+    __atomic_sub_fetch(&operations_in_flight[lease->db], 1, __ATOMIC_RELAXED);
+    importer_prometheus_client_observe_mongo_operation(lease->db, (end_us - lease->acquired_us) / 1000000.0);
+    mongoc_client_pool_push(mongo_pools[lease->db], lease->client);
+    lease->client = NULL;
+}
+
+// called by the controller instead of letting every writer and updater ping the servers.
+// never blocks: if no client is free, the pool is in use and we skip the ping.
+void mongo_client_pools_ping()
+{
+#if USE_PINGS == 1
+    for (int i=0; i<num_databases; i++) {
+        mongoc_client_t *client = mongoc_client_pool_try_pop(mongo_pools[i]);
+        if (client == NULL) {
+            if (debug)
+                printf("[D] controller: skipped ping of database[%d]: no free client\n", i);
+            continue;
+        }
+        mongo_client_ping(client);
+        mongoc_client_pool_push(mongo_pools[i], client);
+    }
+#endif
+}
+
+void mongo_client_pools_record_metrics()
+{
+    for (int i=0; i<num_databases; i++) {
+        int in_flight;
+        __atomic_load(&operations_in_flight[i], &in_flight, __ATOMIC_RELAXED);
+        importer_prometheus_client_gauge_mongo_operations_in_flight(i, in_flight);
+    }
 }
 
 bool add_database_to_databases_collection(mongoc_client_t *client, const char* db_name)
@@ -13,7 +13,31 @@ extern const char *databases[MAX_DATABASES];
 extern mongoc_write_concern_t *wc_no_wait;
 extern mongoc_write_concern_t *wc_wait;
 
+// max concurrent operations per database. 0 means one per writer and updater thread, plus
+// one for the controller.
+extern int mongo_pool_size;
+
+// request writers send this many inserts per database in one unordered bulk operation
+// before waiting for a reply. 1 means one round trip per request.
+#define DEFAULT_MONGO_PIPELINED_WRITES 64
+extern int mongo_pipelined_writes;
+
+// unordered bulk operations using wc_no_wait
+extern bson_t *bulk_opts;
+
+// a client checked out from the pool of a database
+typedef struct {
+    int db;
+    mongoc_client_t *client;
+    int64_t acquired_us;
+} mongo_lease_t;
+
 extern void initialize_mongo_db_globals(zconfig_t* config);
+extern void destroy_mongo_client_pools();
+extern mongoc_client_t* mongo_lease_acquire(mongo_lease_t *lease, int db);
+extern void mongo_lease_release(mongo_lease_t *lease);
+extern void mongo_client_pools_ping();
+extern void mongo_client_pools_record_metrics();
 extern bool ensure_known_database(mongoc_client_t *client, const char* db_name);
 extern bool ensure_known_databases(mongoc_client_t *client, zlist_t *db_names);
 extern int mongo_client_ping(mongoc_client_t *client);
@@ -0,0 +1,202 @@
+#include "importer-pageguard.h"
+
+size_t max_pages_per_stream = DEFAULT_MAX_PAGES_PER_STREAM;
+
+static zhash_t *page_guards = NULL;
+static pthread_mutex_t page_guards_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+page_guard_t* page_guard_new(size_t max_pages)
+{
+    assert(max_pages > 0);
+    page_guard_t *self = zmalloc(sizeof(*self));
+    self->max_pages = max_pages;
+    int rc = pthread_mutex_init(&self->mutex, NULL);
+    assert(rc == 0);
+    self->admitted = zhash_new();
+    self->folded = space_saving_new(max_pages);
+    return self;
+}
+
+void page_guard_destroy(page_guard_t **guard_p)
+{
+    page_guard_t *self = *guard_p;
+    if (self == NULL)
+        return;
+    zhash_destroy(&self->admitted);
+    space_saving_destroy(&self->folded);
+    pthread_mutex_destroy(&self->mutex);
+    free(self);
+    *guard_p = NULL;
+}
+
+static
+void page_guard_admit(zhash_t *admitted, const char *page, uint64_t hits)
+{
+    uint64_t *count = zmalloc(sizeof(uint64_t));
+    *count = hits;
+    int rc = zhash_insert(admitted, page, count);
+    assert(rc == 0);
+    zhash_freefn(admitted, page, free);
+}
+
+// module names carry a "::" prefix. the folded page maps back to the same module.
+static
+const char* folded_page(const char *module, char *buffer, size_t size)
+{
+    const char *name = module + 2;
+    if (*name)
+        snprintf(buffer, size, "%s::" FOLDED_PAGE_ACTION, name);
+    else
+        snprintf(buffer, size, FOLDED_PAGE_ACTION);
+    return buffer;
+}
+
+// returns the page under which a request should be aggregated: either page itself or
+// the folded page of its module, written into buffer
+const char* page_guard_check(page_guard_t *self, const char *page, const char *module, char *buffer, size_t size)
+{
+    const char *stats_page = page;
+    pthread_mutex_lock(&self->mutex);
+    self->window_hits++;
+    uint64_t *hits = zhash_lookup(self->admitted, page);
+    if (hits)
+        (*hits)++;
+    else if (zhash_size(self->admitted) < self->max_pages)
+        page_guard_admit(self->admitted, page, 1);
+    else {
+        space_saving_add(self->folded, page, 1);
+        stats_page = folded_page(module, buffer, size);
+    }
+    pthread_mutex_unlock(&self->mutex);
+    return stats_page;
+}
+
+typedef struct {
+    const char *page;
+    uint64_t hits;
+    bool admitted;
+} page_candidate_t;
+
+static
+int page_candidate_cmp(const void *a, const void *b)
+{
+    const page_candidate_t *x = a, *y = b;
+    if (x->hits != y->hits)
+        return x->hits > y->hits ? -1 : 1;
+    // on ties, keep what we have
+    if (x->admitted != y->admitted)
+        return x->admitted ? -1 : 1;
+    return strcmp(x->page, y->page);
+}
+
+// admits the most requested pages among admitted and folded ones. folded pages compete with
+// their guaranteed hits (count - error), which keeps the admitted set stable. all counts are
+// halved afterwards, so the guard adapts to changing traffic.
+void page_guard_rebalance(page_guard_t *self)
+{
+    size_t num_admitted = zhash_size(self->admitted);
+    size_t n = num_admitted + self->folded->size;
+    page_candidate_t *candidates = zmalloc((n + 1) * sizeof(page_candidate_t));
+
+    size_t i = 0;
+    uint64_t *hits = zhash_first(self->admitted);
+    while (hits) {
+        candidates[i++] = (page_candidate_t){zhash_cursor(self->admitted), *hits, true};
+        hits = zhash_next(self->admitted);
+    }
+    for (size_t j = 0; j < self->folded->size; j++) {
+        space_saving_entry_t *e = &self->folded->heap[j];
+        candidates[i++] = (page_candidate_t){e->key, e->count - e->error, false};
+    }
+    qsort(candidates, n, sizeof(page_candidate_t), page_candidate_cmp);
+
+    zhash_t *admitted = zhash_new();
+    for (i = 0; i < n && i < self->max_pages; i++)
+        page_guard_admit(admitted, candidates[i].page, candidates[i].hits / 2);
+
+    // promoted pages leave the sketch before demoted ones enter it, as entering can evict
+    // entries whose keys we still reference
+    size_t promoted = 0, demoted = 0;
+    for (i = 0; i < n && i < self->max_pages; i++) {
+        if (!candidates[i].admitted) {
+            space_saving_remove(self->folded, candidates[i].page);
+            promoted++;
+        }
+    }
+    for (i = self->max_pages; i < n; i++) {
+        if (candidates[i].admitted) {
+            space_saving_add(self->folded, candidates[i].page, candidates[i].hits);
+            demoted++;
+        }
+    }
+    space_saving_decay(self->folded);
+
+    if (verbose && (promoted || demoted))
+        printf("[I] page guard: promoted %zu and demoted %zu pages\n", promoted, demoted);
+
+    zhash_destroy(&self->admitted);
+    self->admitted = admitted;
+    self->window_hits = 0;
+    free(candidates);
+}
+
+static
+void page_guard_free(void *guard)
+{
+    page_guard_destroy((page_guard_t**)&guard);
+}
+
+page_guard_t* page_guards_acquire(const char *stream)
+{
+    pthread_mutex_lock(&page_guards_mutex);
+    if (page_guards == NULL)
+        page_guards = zhash_new();
+    page_guard_t *guard = zhash_lookup(page_guards, stream);
+    if (guard == NULL) {
+        guard = page_guard_new(max_pages_per_stream);
+        int rc = zhash_insert(page_guards, stream, guard);
+        assert(rc == 0);
+        zhash_freefn(page_guards, stream, page_guard_free);
+    }
+    guard->references++;
+    pthread_mutex_unlock(&page_guards_mutex);
+    return guard;
+}
+
+void page_guards_release(page_guard_t *guard)
+{
+    pthread_mutex_lock(&page_guards_mutex);
+    guard->references--;
+    pthread_mutex_unlock(&page_guards_mutex);
+}
+
+// guards of streams which didn't receive requests since the last rebalance are discarded,
+// unless a processor still holds them
+void page_guards_rebalance()
+{
+    pthread_mutex_lock(&page_guards_mutex);
+    if (page_guards == NULL) {
+        pthread_mutex_unlock(&page_guards_mutex);
+        return;
+    }
+    zlist_t *idle = zlist_new();
+    zlist_autofree(idle);
+    page_guard_t *guard = zhash_first(page_guards);
+    while (guard) {
+        pthread_mutex_lock(&guard->mutex);
+        if (guard->window_hits == 0) {
+            if (guard->references == 0)
+                zlist_append(idle, (void*)zhash_cursor(page_guards));
+        } else
+            page_guard_rebalance(guard);
+        pthread_mutex_unlock(&guard->mutex);
+        guard = zhash_next(page_guards);
+    }
+    char *stream;
+    while ((stream = zlist_pop(idle))) {
+        zhash_delete(page_guards, stream);
+        free(stream);
+    }
+    zlist_destroy(&idle);
+    pthread_mutex_unlock(&page_guards_mutex);
+}
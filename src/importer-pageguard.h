@@ -0,0 +1,45 @@
+#ifndef __LOGJAM_IMPORTER_PAGEGUARD_H_INCLUDED__
+#define __LOGJAM_IMPORTER_PAGEGUARD_H_INCLUDED__
+
+#include "importer-common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bounds the number of distinct pages we aggregate per stream. pages are tracked
+// exactly while there is room, the long tail is folded into a "Other#other" page per module.
+// a space-saving sketch estimates the hits of folded pages, so that pages which become
+// popular later replace the least requested ones when the guard gets rebalanced.
+// all parsers share the guard of a stream, so the limit holds for the merged stats.
+#define DEFAULT_MAX_PAGES_PER_STREAM 2000
+#define PAGE_GUARD_REBALANCE_TICKS 60
+#define FOLDED_PAGE_ACTION "Other#other"
+
+// 0 disables the guard
+extern size_t max_pages_per_stream;
+
+typedef struct {
+    size_t max_pages;
+    pthread_mutex_t mutex;      // parsers check pages concurrently
+    int references;             // processors holding this guard
+    zhash_t *admitted;          // page -> hits since last rebalance (uint64_t*)
+    space_saving_t *folded;     // estimated hits of folded pages
+    uint64_t window_hits;       // requests seen since last rebalance
+} page_guard_t;
+
+extern page_guard_t* page_guard_new(size_t max_pages);
+extern void page_guard_destroy(page_guard_t **guard_p);
+extern const char* page_guard_check(page_guard_t *self, const char *page, const char *module, char *buffer, size_t size);
+extern void page_guard_rebalance(page_guard_t *self);
+
+// guards indexed by stream name. processors release their guard when they are destroyed.
+extern page_guard_t* page_guards_acquire(const char *stream);
+extern void page_guards_release(page_guard_t *guard);
+extern void page_guards_rebalance();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
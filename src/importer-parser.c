@@ -3,6 +3,10 @@
 #include "importer-processor.h"
 #include "importer-parser.h"
 #include "importer-prometheus-client.h"
+#include "importer-admission.h"
+#include "importer-pageguard.h"
+#include "importer-reservoir.h"
+#include "importer-jsedup.h"
 
 /*
  * connections: n_w = num_writers, n_p = num_parsers, "[<>^v]" = connect, "o" = bind
@@ -59,6 +63,15 @@ zsock_t* parser_pull_socket_new()
     return socket;
 }
 
+static
+void parser_disconnect_from_subscribers(zsock_t *socket)
+{
+    for (int j = 0; j < num_subscribers; j++) {
+        int rc = zsock_disconnect(socket, "inproc://subscriber-%d", j);
+        log_zmq_error(rc, __FILE__, __LINE__);
+    }
+}
+
 static
 zsock_t* parser_push_socket_new()
 {
@@ -92,29 +105,73 @@ zsock_t* parser_unknown_stream_collector_socket_new()
     return socket;
 }
 
+static inline
+int two_digits(const char *s)
+{
+    if (s[0] < '0' || s[0] > '9' || s[1] < '0' || s[1] > '9')
+        return -1;
+    return 10 * (s[0] - '0') + (s[1] - '0');
+}
+
+// parses "YYYY-MM-DD[T ]HH:MM:SS", without consulting the time zone database.
+// returns the number of seconds since midnight or -1 if the timestamp is malformed.
+static
+int parse_timestamp(const char *s, struct tm *date)
+{
+    int century = two_digits(s), year = two_digits(s+2), month = two_digits(s+5), day = two_digits(s+8);
+    int hours = two_digits(s+11), minutes = two_digits(s+14), seconds = two_digits(s+17);
+    if (century < 0 || year < 0 || s[4] != '-' || month < 1 || month > 12 || s[7] != '-' || day < 1 || day > 31)
+        return -1;
+    if ((s[10] != 'T' && s[10] != ' ') || hours < 0 || hours > 23 || s[13] != ':' || minutes < 0 || minutes > 59
+        || s[16] != ':' || seconds < 0 || seconds > 61)
+        return -1;
+    date->tm_year = 100 * century + year - 1900;
+    date->tm_mon = month - 1;
+    date->tm_mday = day;
+    return 3600 * hours + 60 * minutes + seconds;
+}
+
+// mktime takes a global lock, so we call it only once for each date we see
+static
+time_t day_start_for_date(parser_state_t *state, const char *date, struct tm *tm)
+{
+    for (int i = 0; i < DATE_CACHE_SIZE; i++) {
+        date_cache_entry_t *entry = &state->date_cache[i];
+        if (!memcmp(entry->date, date, ISO_DATE_STR_LEN - 1))
+            return entry->day_start;
+    }
+    struct tm midnight;
+    // fill in correct TZ info
+    localtime_r(&time_last_tick, &midnight);
+    midnight.tm_year = tm->tm_year;
+    midnight.tm_mon = tm->tm_mon;
+    midnight.tm_mday = tm->tm_mday;
+    midnight.tm_hour = midnight.tm_min = midnight.tm_sec = 0;
+    midnight.tm_isdst = -1;
+    time_t day_start = mktime(&midnight);
+
+    date_cache_entry_t *entry = &state->date_cache[state->date_cache_next++ % DATE_CACHE_SIZE];
+    memcpy(entry->date, date, ISO_DATE_STR_LEN - 1);
+    entry->date[ISO_DATE_STR_LEN - 1] = '\0';
+    entry->day_start = day_start;
+    return day_start;
+}
+
 static
-time_t valid_database_date(const char *date)
+time_t valid_database_date(parser_state_t *state, const char *date)
 {
-    if (strlen(date) < 19) {
+    if (strnlen(date, 19) < 19) {
         fprintf(stderr, "[E] detected crippled date string: %s\n", date);
         return INVALID_DATE;
     }
     struct tm time;
-    memset(&time, 0, sizeof(time));
-    // fill in correct TZ and DST info
-    localtime_r(&time_last_tick, &time);
-    const char* format = date[10] == 'T' ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S";
-    if (!strptime(date, format, &time)) {
+    int seconds = parse_timestamp(date, &time);
+    if (seconds < 0) {
         fprintf(stderr, "[E] could not parse date: %s\n", date);
         return INVALID_DATE;
     }
-    time_t res = mktime(&time);
-
-    // char b[100];
-    // ctime_r(&time_last_tick, b);
-    // puts(b);
-    // ctime_r(&res, b);
-    // puts(b);
+    // ignores DST changes during the day, which is irrelevant for the drift check
+    time_t res = day_start_for_date(state, date, &time) + seconds;
 
     int drift = abs((int) difftime(res, time_last_tick) );
     if (drift > INVALID_MSG_AGE_THRESHOLD) {
@@ -125,12 +182,66 @@ time_t valid_database_date(const char *date)
         return res;
 }
 
+static inline
+uint32_t processor_cache_hash(const char *stream, size_t stream_len, const char *date)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < stream_len; i++)
+        h = (h ^ (uint8_t)stream[i]) * 16777619u;
+    for (size_t i = 0; i < ISO_DATE_STR_LEN - 1; i++)
+        h = (h ^ (uint8_t)date[i]) * 16777619u;
+    return h & (PROCESSOR_CACHE_SIZE - 1);
+}
+
+// db names have the form logjam-<stream>-<date>
+static inline
+bool processor_matches(processor_state_t *p, const char *stream, size_t stream_len, const char *date)
+{
+    const char *db_name = p->db_name + 7;
+    return strnlen(db_name, stream_len + ISO_DATE_STR_LEN + 1) == stream_len + ISO_DATE_STR_LEN
+        && !memcmp(db_name, stream, stream_len)
+        && db_name[stream_len] == '-'
+        && !memcmp(db_name + stream_len + 1, date, ISO_DATE_STR_LEN - 1);
+}
+
 static
-processor_state_t* processor_create(zmsg_t** msg, zframe_t* stream_frame, parser_state_t* parser_state, json_object *request, bool *known_stream)
+void log_invalid_date(const char *stream_name, size_t stream_name_len, const char *date_str, json_object *request, const char *action)
+{
+    json_object* action_object;
+    if (request
+        && (json_object_object_get_ex(request, "action", &action_object)
+            || json_object_object_get_ex(request, "logjam_action", &action_object)
+            || json_object_object_get_ex(request, "page", &action_object)))
+        action = json_object_get_string(action_object);
+    fprintf(stderr, "[E] dropped request for %.*s with invalid started_at date: %s. action: %s\n", (int)stream_name_len, stream_name, date_str, action);
+}
+
+// request is NULL for messages we haven't parsed into json. action is only used for logging then.
+static
+processor_state_t* processor_create_for_date(zmsg_t** msg, zframe_t* stream_frame, parser_state_t* parser_state, const char *date_str,
+                                             json_object *request, const char *action, bool *known_stream)
 {
-    // extract stream name onto the stack and add null char
     const char *stream_chars = (char*)zframe_data(stream_frame);
     size_t stream_name_len = zframe_size(stream_frame);
+
+    // fast path: we have seen this stream and date before during the current tick
+    uint32_t cache_slot = 0;
+    if (date_str) {
+        if (strnlen(date_str, 19) == 19) {
+            cache_slot = processor_cache_hash(stream_chars, stream_name_len, date_str);
+            processor_state_t *p = parser_state->processor_cache[cache_slot];
+            if (p && processor_matches(p, stream_chars, stream_name_len, date_str)) {
+                *known_stream = true;
+                if (INVALID_DATE != valid_database_date(parser_state, date_str))
+                    return p;
+                log_invalid_date(stream_chars, stream_name_len, date_str, request, action);
+                return NULL;
+            }
+        }
+    }
+
+    // extract stream name onto the stack and add null char
     char stream_name[stream_name_len+1];
     memcpy(stream_name, stream_chars, stream_name_len);
     stream_name[stream_name_len] = '\0';
@@ -153,22 +264,13 @@ processor_state_t* processor_create(zmsg_t** msg, zframe_t* stream_frame, parser
     db_name[stream_name_len+7+1] = '\0';
     // printf("[D] db_name: %s\n", db_name);
 
-    json_object* started_at_value;
-    if (!json_object_object_get_ex(request, "started_at", &started_at_value)) {
+    if (date_str == NULL) {
         fprintf(stderr, "[E] dropped request without started_at date\n");
         release_stream_info(stream_info);
         return NULL;
     }
-    const char *date_str = json_object_get_string(started_at_value);
-    if (INVALID_DATE == valid_database_date(date_str)) {
-        db_name[stream_name_len+7] = '\0';
-        json_object* action_object;
-        const char* action = NULL;
-        if (json_object_object_get_ex(request, "action", &action_object)
-            || json_object_object_get_ex(request, "logjam_action", &action_object)
-            || json_object_object_get_ex(request, "page", &action_object))
-            action = json_object_get_string(action_object);
-        fprintf(stderr, "[E] dropped request for %*s with invalid started_at date: %s. action: %s\n", (int)stream_name_len, stream_name, date_str, action);
+    if (INVALID_DATE == valid_database_date(parser_state, date_str)) {
+        log_invalid_date(stream_name, stream_name_len, date_str, request, action);
         release_stream_info(stream_info);
         return NULL;
     }
@@ -188,9 +290,117 @@ processor_state_t* processor_create(zmsg_t** msg, zframe_t* stream_frame, parser
         // send msg to indexer to create db indexes and record the database as known
         indexer_ensure_indexes(stream_info, db_name, parser_state->indexer_socket);
     }
+    parser_state->processor_cache[cache_slot] = p;
     return p;
 }
 
+static
+processor_state_t* processor_create(zmsg_t** msg, zframe_t* stream_frame, parser_state_t* parser_state, json_object *request, bool *known_stream)
+{
+    const char *date_str = NULL;
+    json_object* started_at_value;
+    if (json_object_object_get_ex(request, "started_at", &started_at_value))
+        date_str = json_object_get_string(started_at_value);
+    return processor_create_for_date(msg, stream_frame, parser_state, date_str, request, NULL, known_stream);
+}
+
+static
+void parser_count_frontend_msg(parser_state_t *state, enum fe_msg_drop_reason reason)
+{
+    if (reason)
+        state->fe_stats.dropped++;
+    state->fe_stats.drop_reasons[reason]++;
+}
+
+// asks the tracker about all waiting frontend messages at once. must be called before
+// processors are handed over to the controller.
+static
+void parser_flush_frontend_batch(parser_state_t *state)
+{
+    size_t n = state->fe_batch_size;
+    if (n == 0)
+        return;
+    const char *uuids[n];
+    zmsg_t *msgs[n];
+    const char *types[n];
+    int tracked[n];
+    for (size_t i = 0; i < n; i++) {
+        frontend_msg_t *fe = &state->fe_batch[i];
+        uuids[i] = fe->request_id;
+        msgs[i] = fe->msg;
+        types[i] = fe->ajax ? "ajax" : "frontend";
+    }
+    tracker_delete_uuids(state->tracker, n, uuids, msgs, types, tracked);
+    for (size_t i = 0; i < n; i++) {
+        frontend_msg_t *fe = &state->fe_batch[i];
+        enum fe_msg_drop_reason reason = processor_add_frontend_msg(fe->processor, state, fe, tracked[i]);
+        parser_count_frontend_msg(state, reason);
+        zmsg_destroy(&fe->msg);
+    }
+    state->fe_batch_size = 0;
+}
+
+// frontend messages are small and flat, so we extract the few fields we need without
+// parsing the json. returns false if the message needs to go through the json path.
+static
+bool parse_frontend_msg(zmsg_t **msgptr, zframe_t *stream_frame, parser_state_t *state, const char *body, size_t body_len, bool ajax, msg_meta_t *meta)
+{
+    frontend_msg_t *fe = &state->fe_batch[state->fe_batch_size];
+    char request_id[sizeof(fe->request_id)], logjam_action[sizeof(fe->action)];
+    json_string_field_t fields[] = {
+        {"started_at", fe->started_at, sizeof(fe->started_at)},
+        {"logjam_request_id", fe->request_id, sizeof(fe->request_id)},
+        {"request_id", request_id, sizeof(request_id)},
+        {"action", fe->action, sizeof(fe->action)},
+        {"logjam_action", logjam_action, sizeof(logjam_action)},
+        {"user_agent", fe->user_agent, sizeof(fe->user_agent)},
+        {"rts", fe->rts, sizeof(fe->rts)},
+    };
+    if (!json_scan_string_fields(body, body_len, fields, sizeof(fields)/sizeof(fields[0])))
+        return false;
+    // the json path reports these
+    if (!fields[0].found || !fields[6].found || !(fields[1].found || fields[2].found))
+        return false;
+    if (!fields[1].found)
+        strcpy(fe->request_id, request_id);
+    if (!fields[3].found)
+        strcpy(fe->action, fields[4].found ? logjam_action : "");
+    if (!fields[5].found)
+        fe->user_agent[0] = '\0';
+    fe->ajax = ajax;
+
+    bool known_stream;
+    processor_state_t *processor = processor_create_for_date(msgptr, stream_frame, state, fe->started_at, NULL, fe->action, &known_stream);
+    if (processor == NULL) {
+        if (known_stream)
+            fprintf(stderr, "[E] could not create processor for %s request: %s\n", ajax ? "ajax" : "frontend", fe->request_id);
+        return true;
+    }
+    processor->request_count++;
+    if (meta->created_ms > 0 && (processor->oldest_created_ms == 0 || meta->created_ms < processor->oldest_created_ms))
+        processor->oldest_created_ms = meta->created_ms;
+    fe->created_ms = 0;
+    if (latency_sampled(meta)) {
+        fe->created_ms = meta->created_ms;
+        importer_prometheus_client_observe_latency(processor->stream_info, LATENCY_STAGE_PARSER, meta->created_ms, zclock_time());
+    }
+
+    state->fe_stats.received++;
+    enum fe_msg_drop_reason reason = processor_check_frontend_msg(processor, fe);
+    if (reason) {
+        parser_count_frontend_msg(state, reason);
+        return true;
+    }
+
+    // the tracker needs the original message in case the backend request arrives later
+    fe->processor = processor;
+    fe->msg = *msgptr;
+    *msgptr = NULL;
+    if (++state->fe_batch_size == FRONTEND_BATCH_SIZE)
+        parser_flush_frontend_batch(state);
+    return true;
+}
+
 static
 void parse_msg_and_forward_interesting_requests(zmsg_t **msgptr, parser_state_t *parser_state)
 {
@@ -239,11 +449,19 @@ void parse_msg_and_forward_interesting_requests(zmsg_t **msgptr, parser_state_t
         body_len = zframe_size(body_frame);
     }
 
+    char *topic_str = (char*) zframe_data(topic_frame);
+    int topic_len = zframe_size(topic_frame);
+    if (topic_len >= 13 && !strncmp("frontend.", topic_str, 9)) {
+        bool ajax = !strncmp("ajax", topic_str + 9, 4);
+        if ((ajax || !strncmp("page", topic_str + 9, 4))
+            && parse_frontend_msg(msgptr, stream_frame, parser_state, body, body_len, ajax, &meta))
+            return;
+    }
+
     json_object *request = parse_json_data(body, body_len, parser_state->tokener);
     if (request != NULL) {
         // dump_json_object_limiting_log_lines(stdout, "[D] REQUEST", request, 10);
-        char *topic_str = (char*) zframe_data(topic_frame);
-        int n = zframe_size(topic_frame);
+        int n = topic_len;
         bool known_stream;
         processor_state_t *processor = processor_create(msgptr, stream_frame, parser_state, request, &known_stream);
         if (processor == NULL) {
@@ -253,6 +471,15 @@ void parse_msg_and_forward_interesting_requests(zmsg_t **msgptr, parser_state_t
             return;
         }
         processor->request_count++;
+        if (meta.created_ms > 0 && (processor->oldest_created_ms == 0 || meta.created_ms < processor->oldest_created_ms))
+            processor->oldest_created_ms = meta.created_ms;
+
+        parser_state->trace_active = latency_sampled(&meta);
+        if (parser_state->trace_active) {
+            int64_t now = zclock_time();
+            parser_state->latency_trace = (latency_trace_t){.created_ms = meta.created_ms, .parsed_ms = now};
+            importer_prometheus_client_observe_latency(processor->stream_info, LATENCY_STAGE_PARSER, meta.created_ms, now);
+        }
 
         if (n >= 4 && !strncmp("logs", topic_str, 4))
             processor_add_request(processor, parser_state, request);
@@ -263,15 +490,11 @@ void parse_msg_and_forward_interesting_requests(zmsg_t **msgptr, parser_state_t
         else if (n >= 13 && !strncmp("frontend.page", topic_str, 13)) {
             parser_state->fe_stats.received++;
             enum fe_msg_drop_reason reason = processor_add_frontend_data(processor, parser_state, request, msg);
-            if (reason)
-                parser_state->fe_stats.dropped++;
-            parser_state->fe_stats.drop_reasons[reason]++;
+            parser_count_frontend_msg(parser_state, reason);
         } else if (n >= 13 && !strncmp("frontend.ajax", topic_str, 13)) {
             parser_state->fe_stats.received++;
             enum fe_msg_drop_reason reason = processor_add_ajax_data(processor, parser_state, request, msg);
-            if (reason)
-                parser_state->fe_stats.dropped++;
-            parser_state->fe_stats.drop_reasons[reason]++;
+            parser_count_frontend_msg(parser_state, reason);
         } else if (n >= 18 && !strncmp("frontend.webvitals", topic_str, 18)) {
             // ignore message for now
         } else if (n >= 6 && !strncmp("mobile", topic_str, 6)) {
@@ -280,6 +503,10 @@ void parse_msg_and_forward_interesting_requests(zmsg_t **msgptr, parser_state_t
             fprintf(stderr, "[W] unknown topic key\n");
             my_zmsg_fprint(msg, "[E] MSG", stderr);
         }
+        if (parser_state->trace_active) {
+            importer_prometheus_client_observe_latency(processor->stream_info, LATENCY_STAGE_PROCESSOR, meta.created_ms, zclock_time());
+            parser_state->trace_active = false;
+        }
         json_object_put(request);
     } else {
         fprintf(stderr, "[E] parse error\n");
@@ -310,6 +537,10 @@ parser_state_t* parser_state_new(zconfig_t* config, size_t id)
     assert(state->tokener);
     state->processors = processor_hash_new();
     state->stream_info_cache = zhash_new();
+    state->reservoirs = zhash_new();
+    state->insert_pacer = insert_pacer_new();
+    state->js_exception_groups = zhash_new();
+    state->fe_batch = zmalloc(FRONTEND_BATCH_SIZE * sizeof(frontend_msg_t));
     state->tracker = tracker_new();
     state->decompression_buffer = zchunk_new(NULL, INITIAL_DECOMPRESSION_BUFFER_SIZE);
     return state;
@@ -326,12 +557,68 @@ void parser_state_destroy(parser_state_t **state_p)
     zsock_destroy(&state->unknown_streams_collector_socket);
     zhash_destroy(&state->processors);
     zhash_destroy(&state->stream_info_cache);
+    zhash_destroy(&state->reservoirs);
+    insert_pacer_destroy(&state->insert_pacer);
+    zhash_destroy(&state->js_exception_groups);
+    for (size_t i = 0; i < state->fe_batch_size; i++)
+        zmsg_destroy(&state->fe_batch[i].msg);
+    free(state->fe_batch);
     tracker_destroy(&state->tracker);
     zchunk_destroy(&state->decompression_buffer);
     free(state);
     *state_p = NULL;
 }
 
+// hands our processors and counters over to the controller and starts a new interval
+static
+void parser_send_tick_answer(parser_state_t *state)
+{
+    parser_flush_frontend_batch(state);
+    importer_prometheus_client_count_msgs_parsed(state->parsed_msgs_count);
+    reservoirs_flush(state->reservoirs, state->insert_pacer, state->push_socket);
+    js_exception_groups_flush(state->js_exception_groups, state->push_socket);
+    processor_state_t *processor = zhash_first(state->processors);
+    while (processor) {
+        if (processor->pages_folded)
+            importer_prometheus_client_count_pages_folded_for_stream(processor->stream_info, processor->pages_folded);
+        processor = zhash_next(state->processors);
+    }
+    importer_prometheus_client_record_rusage_parser(state->id);
+    zmsg_t *answer = zmsg_new();
+    zmsg_addptr(answer, state->processors);
+    zmsg_addmem(answer, &state->parsed_msgs_count, sizeof(state->parsed_msgs_count));
+    zmsg_addmem(answer, &state->fe_stats, sizeof(state->fe_stats));
+    zmsg_send_with_retry(&answer, state->pipe);
+    state->parsed_msgs_count = 0;
+    memset(&state->fe_stats, 0, sizeof(state->fe_stats));
+    state->processors = processor_hash_new();
+    memset(state->processor_cache, 0, sizeof(state->processor_cache));
+}
+
+static
+void parser_process_msg(parser_state_t *state, zmsg_t *msg)
+{
+    __atomic_sub_fetch(&queued_parses, 1, __ATOMIC_RELAXED);
+    state->parsed_msgs_count++;
+    parse_msg_and_forward_interesting_requests(&msg, state);
+    zmsg_destroy(&msg);
+}
+
+// the controller holds all subscribers while we drain, so nothing arrives after we have
+// emptied the socket. disconnecting first would discard messages still in the pipes.
+static
+void parser_drain(parser_state_t *state)
+{
+    zmsg_t *msg;
+    while ((msg = zmsg_recv_nowait(state->pull_socket)))
+        parser_process_msg(state, msg);
+    parser_disconnect_from_subscribers(state->pull_socket);
+    if (!quiet)
+        printf("[I] parser [%zu]: drained\n", state->id);
+    parser_send_tick_answer(state);
+    insert_pacer_send_all(state->insert_pacer, state->push_socket);
+}
+
 static
 void parser(zsock_t *pipe, void *args)
 {
@@ -351,48 +638,58 @@ void parser(zsock_t *pipe, void *args)
     zpoller_t *poller = zpoller_new(state->pipe, state->pull_socket, NULL);
     assert(poller);
 
+    int timeout = -1;
     while (!zsys_interrupted) {
-        // wait at most one second
-        void *socket = zpoller_wait(poller, 1000);
+        // wait at most one second, or until the next paced insert is due
+        void *socket = zpoller_wait(poller, timeout < 0 ? 1000 : timeout);
         zmsg_t *msg = NULL;
         if (socket == state->pipe) {
             msg = zmsg_recv(state->pipe);
             if (!msg) continue;
             char *cmd = zmsg_popstr(msg);
-            zmsg_destroy(&msg);
             if (streq(cmd, "tick")) {
                 if (state->parsed_msgs_count && verbose)
                     printf("[I] parser [%zu]: tick (%zu messages, %zu frontend)\n", id, state->parsed_msgs_count, state->fe_stats.received);
-                importer_prometheus_client_count_msgs_parsed(state->parsed_msgs_count);
-                importer_prometheus_client_record_rusage_parser(state->id);
-                zmsg_t *answer = zmsg_new();
-                zmsg_addptr(answer, state->processors);
-                zmsg_addmem(answer, &state->parsed_msgs_count, sizeof(state->parsed_msgs_count));
-                zmsg_addmem(answer, &state->fe_stats, sizeof(state->fe_stats));
-                zmsg_send_with_retry(&answer, state->pipe);
-                state->parsed_msgs_count = 0;
-                memset(&state->fe_stats, 0, sizeof(state->fe_stats));
-                state->processors = processor_hash_new();
+                parser_send_tick_answer(state);
                 if (++ticks % 60 == 0) {
                     zhash_destroy(&state->stream_info_cache);
                     state->stream_info_cache = zhash_new();
                 }
                 free(cmd);
+            } else if (streq(cmd, "drain")) {
+                parser_drain(state);
+                free(cmd);
+            } else if (streq(cmd, "connect-writer") || streq(cmd, "disconnect-writer")) {
+                // sent by the controller when the writer pool is resized. sender side disconnects
+                // are safe: the writer still receives everything we have sent before.
+                char *writer = zmsg_popstr(msg);
+                int rc;
+                if (streq(cmd, "connect-writer"))
+                    rc = zsock_connect(state->push_socket, "inproc://request-writer-%s", writer);
+                else
+                    rc = zsock_disconnect(state->push_socket, "inproc://request-writer-%s", writer);
+                log_zmq_error(rc, __FILE__, __LINE__);
+                zsock_signal(state->pipe, 0);
+                free(writer);
+                free(cmd);
             } else if (streq(cmd, "$TERM")) {
                 // printf("[D] parser [%zu]: received $TERM command\n", id);
                 free(cmd);
+                zmsg_destroy(&msg);
                 break;
             } else {
                 printf("[E] parser [%zu]: received unknown command: %s\n", id, cmd);
                 free(cmd);
                 assert(false);
             }
+            zmsg_destroy(&msg);
         } else if (socket == state->pull_socket) {
             msg = zmsg_recv(state->pull_socket);
             if (msg != NULL) {
-                state->parsed_msgs_count++;
-                parse_msg_and_forward_interesting_requests(&msg, state);
-                zmsg_destroy(&msg);
+                parser_process_msg(state, msg);
+                // don't keep frontend messages waiting when there is nothing else to do
+                if (state->fe_batch_size && !(zsock_events(state->pull_socket) & ZMQ_POLLIN))
+                    parser_flush_frontend_batch(state);
             } else {
                 // msg == NULL, probably interrupted by signal handler
                 break;
@@ -405,6 +702,7 @@ void parser(zsock_t *pipe, void *args)
             // probably interrupted by signal handler
             // if so, loop will terminate on condition !zsys_interrupted
         }
+        timeout = insert_pacer_send_due(state->insert_pacer, state->push_socket);
     }
 
     if (!quiet)
@@ -3,6 +3,7 @@
 
 #include "importer-common.h"
 #include "importer-tracker.h"
+#include "importer-reservoir.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,6 +36,34 @@ typedef struct {
     size_t fe_drop_reasons[FE_MSG_NUM_REASONS];  // how many we dropped for a specific reason
 } user_agent_stats_t;
 
+#define NUM_FRONTEND_TIMINGS 16
+// frontend messages waiting for the tracker to confirm their backend requests
+#define FRONTEND_BATCH_SIZE 64
+
+// fields of frontend.page and frontend.ajax messages, extracted without building json objects
+typedef struct {
+    void *processor;                          // processor of the current tick
+    zmsg_t *msg;                              // original message, replayed by the tracker if the backend request is late
+    bool ajax;
+    int64_t created_ms;                       // creation time of messages sampled for latency tracing, 0 otherwise
+    char started_at[32];
+    char request_id[65];
+    char action[1024];
+    char user_agent[512];
+    char rts[256];
+    int64_t timings[NUM_FRONTEND_TIMINGS];
+} frontend_msg_t;
+
+// recently used processors, indexed by a hash of stream name and date (must be a power of 2)
+#define PROCESSOR_CACHE_SIZE 256
+// recently seen dates
+#define DATE_CACHE_SIZE 4
+
+typedef struct {
+    char date[ISO_DATE_STR_LEN];  // YYYY-MM-DD
+    time_t day_start;             // local midnight of date
+} date_cache_entry_t;
+
 typedef struct {
     size_t id;
     char me[16];
@@ -47,10 +76,20 @@ typedef struct {
     zsock_t *indexer_socket;
     json_tokener* tokener;
     zhash_t *processors;
+    void *processor_cache[PROCESSOR_CACHE_SIZE];  // processors of the current tick, cleared when processors get collected
+    date_cache_entry_t date_cache[DATE_CACHE_SIZE];
+    size_t date_cache_next;                       // slot to be replaced on next date cache miss
     zhash_t *stream_info_cache;
+    zhash_t *reservoirs;                      // requests we might store, indexed by stream name
+    insert_pacer_t *insert_pacer;             // requests chosen from the reservoirs at the last tick
+    zhash_t *js_exception_groups;             // javascript exceptions of the current tick, by fingerprint
     uuid_tracker_t *tracker;
     zchunk_t *decompression_buffer;
     zsock_t *unknown_streams_collector_socket;
+    bool trace_active;                        // current message has been sampled for latency tracing
+    latency_trace_t latency_trace;            // timestamps of the sampled message
+    frontend_msg_t *fe_batch;                 // FRONTEND_BATCH_SIZE slots
+    size_t fe_batch_size;
 } parser_state_t;
 
 extern zactor_t* parser_new(zconfig_t *config, size_t id);
@@ -6,6 +6,11 @@
 #include "logjam-streaminfo.h"
 #include "importer-resources.h"
 #include "importer-prometheus-client.h"
+#include "importer-admission.h"
+#include "importer-pageguard.h"
+#include "importer-reservoir.h"
+#include "importer-jsedup.h"
+#include "importer-timingslog.h"
 
 #define DB_PREFIX "logjam-"
 #define DB_PREFIX_LEN 7
@@ -16,12 +21,15 @@ processor_state_t* processor_new(stream_info_t *stream_info, char *db_name)
     p->stream_info = stream_info;
     p->db_name = strdup(db_name);
     p->request_count = 0;
+    p->oldest_created_ms = 0;
     p->modules = zhash_new();
     p->totals = zhash_new();
     p->minutes = zhash_new();
     p->quants = zhash_new();
     p->agents = zhash_new();
     p->histograms = zhash_new();
+    p->page_guard = NULL;
+    p->pages_folded = 0;
     return p;
 }
 
@@ -29,7 +37,8 @@ void processor_destroy(void* processor)
 {
     processor_state_t* p = processor;
     // printf("[D] destroying processor: %s. requests: %zu\n", p->db_name, p->request_count);
-    release_stream_info(p->stream_info);
+    if (p->stream_info)
+        release_stream_info(p->stream_info);
     free(p->db_name);
     zhash_destroy(&p->modules);
     zhash_destroy(&p->totals);
@@ -37,6 +46,8 @@ void processor_destroy(void* processor)
     zhash_destroy(&p->quants);
     zhash_destroy(&p->agents);
     zhash_destroy(&p->histograms);
+    if (p->page_guard)
+        page_guards_release(p->page_guard);
     free(p);
 }
 
@@ -149,6 +160,21 @@ const char* processor_setup_module(processor_state_t *self, const char *page)
     return module;
 }
 
+// returns the page name under which we aggregate stats. the page guard of a stream outlives
+// processors, as it needs to see the traffic of more than one tick.
+static
+const char* processor_stats_page(processor_state_t *self, parser_state_t *pstate, const char *page, const char *module, char *buffer, size_t size)
+{
+    if (max_pages_per_stream == 0)
+        return page;
+    if (self->page_guard == NULL)
+        self->page_guard = page_guards_acquire(self->stream_info->key);
+    const char *stats_page = page_guard_check(self->page_guard, page, module, buffer, size);
+    if (stats_page != page)
+        self->pages_folded++;
+    return stats_page;
+}
+
 static
 int processor_setup_response_code(processor_state_t *self, json_object *request)
 {
@@ -305,10 +331,10 @@ int processor_setup_minute(processor_state_t *self, json_object *request)
     int minute = 0;
     json_object *started_at_obj = NULL;
     if (json_object_object_get_ex(request, "started_at", &started_at_obj)) {
-        const char *started_at = json_object_get_string(started_at_obj);
-        char hours[3] = {started_at[11], started_at[12], '\0'};
-        char minutes[3] = {started_at[14], started_at[15], '\0'};
-        minute = 60 * atoi(hours) + atoi(minutes);
+        const char *s = json_object_get_string(started_at_obj);
+        int hours = 10 * (s[11] - '0') + (s[12] - '0');
+        int minutes = 10 * (s[14] - '0') + (s[15] - '0');
+        minute = 60 * hours + minutes;
     }
     json_object *minute_obj = json_object_new_int(minute);
     json_object_object_add(request, "minute", minute_obj);
@@ -399,6 +425,7 @@ void processor_add_totals(processor_state_t *self, const char* namespace, increm
     increments_t *stored_increments = zhash_lookup(self->totals, namespace);
     if (stored_increments) {
         increments_add(stored_increments, increments);
+        increments_compact_dynamic_keys(stored_increments, self->stream_info->max_dynamic_keys);
     } else {
         increments_t *duped_increments = increments_clone(increments);
         int rc = zhash_insert(self->totals, namespace, duped_increments);
@@ -480,6 +507,7 @@ void processor_add_minutes(processor_state_t *self, const char* namespace, size_
     increments_t *stored_increments = zhash_lookup(self->minutes, key);
     if (stored_increments) {
         increments_add(stored_increments, increments);
+        increments_compact_dynamic_keys(stored_increments, self->stream_info->max_dynamic_keys);
     } else {
         increments_t *duped_increments = increments_clone(increments);
         int rc = zhash_insert(self->minutes, key, duped_increments);
@@ -606,14 +634,41 @@ void dump_histogram(const char* key, size_t *h)
 
 void dump_histograms(zhash_t* histograms)
 {
-    size_t *h = zhash_first(histograms);
+    histogram_t *h = zhash_first(histograms);
     while (h) {
         const char* key = zhash_cursor(histograms);
-        dump_histogram(key, h);
+        dump_histogram(key, h->buckets);
         h = zhash_next(histograms);
     }
 }
 
+histogram_t* histogram_new()
+{
+    histogram_t *histogram = zmalloc(sizeof(histogram_t));
+    ddsketch_init(&histogram->sketch);
+    return histogram;
+}
+
+void histogram_destroy(void *histogram)
+{
+    // void* because of zhash_destroy
+    histogram_t *h = histogram;
+    ddsketch_reset(&h->sketch);
+    free(h);
+}
+
+
+static
+histogram_t* processor_histogram(processor_state_t *self, const char *key)
+{
+    histogram_t *histogram = zhash_lookup(self->histograms, key);
+    if (histogram == NULL) {
+        histogram = histogram_new();
+        zhash_insert(self->histograms, key, histogram);
+        zhash_freefn(self->histograms, key, histogram_destroy);
+    }
+    return histogram;
+}
 
 static
 void processor_add_histogram(processor_state_t *self, const char* namespace, int minute, const char* resource, int time_index, increments_t *increments, json_object *request)
@@ -625,24 +680,37 @@ void processor_add_histogram(processor_state_t *self, const char* namespace, int
     double time = increments->metrics[time_index].val;
     if (time == 0) {
         fprintf(stderr, "[E] HISTOGRAM: expected %s to be greater zero\n", resource);
-        dump_json_object(stderr, "[E] REQUEST", request);
+        if (request)
+            dump_json_object(stderr, "[E] REQUEST", request);
         dump_increments(namespace, increments);
         return;
     }
 
-    size_t *histogram = zhash_lookup(self->histograms, key);
-    if (histogram == NULL) {
-        histogram = zmalloc(HISTOGRAM_SIZE * sizeof(size_t));
-        zhash_insert(self->histograms, key, histogram);
-        zhash_freefn(self->histograms, key, free);
-    }
+    histogram_t *histogram = processor_histogram(self, key);
     size_t i = find_bucket_index(time);
     assert(i < HISTOGRAM_SIZE);
-    histogram[i]++;
+    histogram->buckets[i]++;
+    ddsketch_add(&histogram->sketch, time);
     // dump_histogram(key, histogram);
     // dump_histograms(self->histograms);
 }
 
+// quantile sketches of the time resources first..last other than the one which gets a full
+// histogram. their heatmap buckets stay empty, so they only add sketch keys to the heatmaps.
+static
+void processor_add_time_sketches(processor_state_t *self, const char* namespace, int minute, size_t first, size_t last, size_t histogram_index, increments_t *increments)
+{
+    for (size_t i = first; i <= last; i++) {
+        double time = increments->metrics[i].val;
+        if (i == histogram_index || time <= 0)
+            continue;
+        char key[2000];
+        snprintf(key, 2000, "%d-%s-%s", minute, int_to_resource[i], namespace);
+        histogram_t *histogram = processor_histogram(self, key);
+        ddsketch_add(&histogram->sketch, time);
+    }
+}
+
 static
 bool slow_request(stream_info_t *stream_info, double total_time, const char* module)
 {
@@ -758,11 +826,18 @@ int ignore_request(request_data_t *request_data, json_object *request, stream_in
     return 0;
 }
 
+// requests we still store when admission control restricts inserts
+static
+bool error_request(request_data_t *request_data)
+{
+    return request_data->severity >= LOG_SEVERITY_ERROR
+        || request_data->response_code >= 500
+        || request_data->exceptions != NULL;
+}
+
 static
 throttling_reason_t throttle_request(stream_info_t *stream)
 {
-    if (throttle_request_for_stream(stream))
-        return THROTTLE_MAX_INSERTS_PER_SECOND;
     if (stream->storage_size > HARD_LIMIT_STORAGE_SIZE)
         return THROTTLE_HARD_LIMIT_STORAGE_SIZE;
     if (stream->storage_size > SOFT_LIMIT_STORAGE_SIZE && random() > TEN_PERCENT_OF_MAX_RANDOM)
@@ -810,6 +885,9 @@ void processor_add_request(processor_state_t *self, parser_state_t *pstate, json
     request_data.heap_growth = processor_setup_heap_growth(self, request);
     adjust_caller_info(request_data.path, request_data.module, request, self->stream_info);
 
+    char folded_page[1024];
+    const char *page = processor_stats_page(self, pstate, request_data.page, request_data.module, folded_page, sizeof(folded_page));
+
     increments_t* increments = increments_new();
     increments->backend_request_count = 1;
     increments_fill_metrics(increments, request);
@@ -821,20 +899,24 @@ void processor_add_request(processor_state_t *self, parser_state_t *pstate, json
     increments_fill_exceptions(increments, request_data.exceptions);
     increments_fill_soft_exceptions(increments, request_data.soft_exceptions);
 
-    processor_add_totals(self, request_data.page, increments);
+    processor_add_totals(self, page, increments);
     processor_add_totals(self, request_data.module, increments);
     processor_add_totals(self, "all_pages", increments);
 
-    processor_add_minutes(self, request_data.page, request_data.minute, increments);
+    processor_add_minutes(self, page, request_data.minute, increments);
     processor_add_minutes(self, request_data.module, request_data.minute, increments);
     processor_add_minutes(self, "all_pages", request_data.minute, increments);
 
-    processor_add_quants(self, request_data.page, increments);
+    processor_add_quants(self, page, increments);
 
-    processor_add_histogram(self, request_data.page, request_data.minute, "total_time", total_time_index, increments, request);
+    processor_add_histogram(self, page, request_data.minute, "total_time", total_time_index, increments, request);
     processor_add_histogram(self, request_data.module, request_data.minute, "total_time", total_time_index, increments, request);
     processor_add_histogram(self, "all_pages", request_data.minute, "total_time", total_time_index, increments, request);
 
+    processor_add_time_sketches(self, page, request_data.minute, 0, last_time_resource_offset, total_time_index, increments);
+    processor_add_time_sketches(self, request_data.module, request_data.minute, 0, last_time_resource_offset, total_time_index, increments);
+    processor_add_time_sketches(self, "all_pages", request_data.minute, 0, last_time_resource_offset, total_time_index, increments);
+
     increments_destroy(increments);
 
     processor_add_agent(self, request);
@@ -865,30 +947,24 @@ void processor_add_request(processor_state_t *self, parser_state_t *pstate, json
         return;
     }
     // printf("[D] sampling: %s, reason: %x\n", request_data.page, sampling_reason);
+    if (admission_current_level() >= ADMISSION_STORE_ERRORS_ONLY && !error_request(&request_data)) {
+        importer_prometheus_client_count_admission_decision_for_stream(self->stream_info, ADMISSION_INSERT_SKIPPED);
+        return;
+    }
     throttling_reason_t throttling_reason = throttle_request(self->stream_info);
     if (throttling_reason) {
         importer_prometheus_client_count_throttled_inserts_for_stream(self->stream_info, 1);
         // printf("[D] throttled: %s, reason: %s\n", request_data.page, throttling_reason_str(throttling_reason));
         return;
     }
-    json_object_get(request);
-    zmsg_t *msg = zmsg_new();
-    zmsg_addstr(msg, self->db_name);
-    zmsg_addstr(msg, "r");
-    zmsg_addstr(msg, request_data.module);
-    zmsg_addptr(msg, request);
-    zmsg_addptr(msg, self->stream_info);
-    reference_stream_info(self->stream_info);
-    zmsg_addmem(msg, &sampling_reason, sizeof(sampling_reason_t));
-    if (!output_socket_ready(pstate->push_socket, 0)) {
-        fprintf(stderr, "[W] parser [%zu]: push socket not ready\n", pstate->id);
-    }
-    if (zmsg_send_with_retry(&msg, pstate->push_socket))
-        release_stream_info(self->stream_info);
-    else {
-        __atomic_add_fetch(&queued_inserts, 1, __ATOMIC_SEQ_CST);
-        importer_prometheus_client_count_inserts_for_stream(self->stream_info, 1);
+    // the insert budget of the stream is applied when the tick ends
+    latency_trace_t *trace = NULL;
+    if (pstate->trace_active) {
+        pstate->latency_trace.processed_ms = zclock_time();
+        trace = &pstate->latency_trace;
     }
+    request_reservoir_t *reservoir = reservoirs_lookup(pstate->reservoirs, self->stream_info);
+    reservoir_offer(reservoir, self->db_name, page, request_data.module, request, sampling_reason, trace);
 }
 
 static
@@ -953,8 +1029,10 @@ void processor_add_js_exception(processor_state_t *self, parser_state_t *pstate,
     processor_add_minutes(self, "all_pages", minute, increments);
 
     if (strstr(page, "#unknown_method") == NULL) {
-        processor_add_totals(self, page, increments);
-        processor_add_minutes(self, page, minute, increments);
+        char folded_page[1024];
+        const char *stats_page = processor_stats_page(self, pstate, page, module, folded_page, sizeof(folded_page));
+        processor_add_totals(self, stats_page, increments);
+        processor_add_minutes(self, stats_page, minute, increments);
     }
 
     if (strcmp(module, "Unknown") != 0) {
@@ -963,19 +1041,12 @@ void processor_add_js_exception(processor_state_t *self, parser_state_t *pstate,
     }
 
     increments_destroy(increments);
+
+    // identical exceptions are stored once per tick
+    js_exception_groups_add(pstate->js_exception_groups, self->stream_info, self->db_name, module, page, js_exception, request);
+
     free(page);
     free(js_exception);
-
-    json_object_get(request);
-    zmsg_t *msg = zmsg_new();
-    zmsg_addstr(msg, self->db_name);
-    zmsg_addstr(msg, "j");
-    zmsg_addstr(msg, module);
-    zmsg_addptr(msg, request);
-    zmsg_addptr(msg, self->stream_info);
-    reference_stream_info(self->stream_info);
-    zmsg_send_with_retry(&msg, pstate->push_socket);
-    __atomic_add_fetch(&queued_inserts, 1, __ATOMIC_SEQ_CST);
 }
 
 void processor_add_event(processor_state_t *self, parser_state_t *pstate, json_object *request)
@@ -1040,20 +1111,10 @@ void make_relative(int64_t *a, int n, int64_t base)
 }
 
 static
-int extract_frontend_timings(json_object *request, int64_t *timings, int num_timings, const char *type, const char **rts)
+int parse_frontend_timings(const char *rts, int64_t *timings, int num_timings)
 {
-    json_object *rts_object = NULL;
-    if (json_object_object_get_ex(request, "rts", &rts_object)) {
-        *rts = json_object_get_string(rts_object);
-        // fprintf(stdout, "[D] RTS: %s\n", rts);
-    } else {
-        *rts = NULL;
-        if (verbose)
-            fprintf(stderr, "[W] processor: dropped %s request without timing information\n", type);
-        return 0;
-    }
     int n = 0;
-    const char *p = *rts;
+    const char *p = rts;
     char c;
     int64_t *times = timings;
     int64_t value = 0;
@@ -1065,7 +1126,7 @@ int extract_frontend_timings(json_object *request, int64_t *timings, int num_tim
             n++;
             if (n == num_timings && c!=0) {
                 if (verbose)
-                    fprintf(stderr, "[W] processor: too many frontend timing values: %s\n", *rts);
+                    fprintf(stderr, "[W] processor: too many frontend timing values: %s\n", rts);
                 return 0;
             } else if (!c)
                 break;
@@ -1092,7 +1153,23 @@ int extract_frontend_timings(json_object *request, int64_t *timings, int num_tim
     }
 }
 
-#define NUM_TIMINGS 16
+static
+int extract_frontend_timings(json_object *request, int64_t *timings, int num_timings, const char *type, const char **rts)
+{
+    json_object *rts_object = NULL;
+    if (json_object_object_get_ex(request, "rts", &rts_object)) {
+        *rts = json_object_get_string(rts_object);
+        // fprintf(stdout, "[D] RTS: %s\n", rts);
+    } else {
+        *rts = NULL;
+        if (verbose)
+            fprintf(stderr, "[W] processor: dropped %s request without timing information\n", type);
+        return 0;
+    }
+    return parse_frontend_timings(*rts, timings, num_timings);
+}
+
+#define NUM_TIMINGS NUM_FRONTEND_TIMINGS
 #define navigationStart 0
 // #define unloadEventStart -1
 // #define unloadEventEnd -1
@@ -1129,8 +1206,10 @@ int processor_set_frontend_apdex_attribute(const char *attr)
     return 0;
 }
 
+#define NUM_FRONTEND_METRICS 8
+
 static
-enum fe_msg_drop_reason convert_frontend_timings_to_json(json_object *request, int64_t *timings, int64_t *mtimes, const char* user_agent, const char* rts)
+enum fe_msg_drop_reason compute_frontend_timings(int64_t *timings, int64_t *mtimes, const char* user_agent, const char* rts)
 {
     int64_t base = timings[navigationStart];
     if (base == 0) {
@@ -1156,14 +1235,13 @@ enum fe_msg_drop_reason convert_frontend_timings_to_json(json_object *request, i
         timings[domInteractive]
     };
 
-    if (frontend_timings) {
-        fprintf(frontend_timings,
-                "%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",\"%s\",%s\n",
-                utimes[0], utimes[1], utimes[2], utimes[3], utimes[4], utimes[5], utimes[6], user_agent, rts);
+    if (timings_log_enabled) {
+        timings_log_printf("%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",\"%s\",%s\n",
+                           utimes[0], utimes[1], utimes[2], utimes[3], utimes[4], utimes[5], utimes[6], user_agent, rts);
     }
 
     if (utimes[0] < 0 || utimes[6] <= 0 || !sorted_ascending(utimes, 5)) {
-        // if (!frontend_timings) {
+        // if (!timings_log_enabled) {
         //     fprintf(stderr,
         //             "[W] processor: dropped frontend request due to invalid timings: "
         //             "%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",%" PRIi64 ",\"%s\"\n",
@@ -1172,23 +1250,33 @@ enum fe_msg_drop_reason convert_frontend_timings_to_json(json_object *request, i
         return FE_MSG_INVALID;
     }
 
-    int64_t navigation_time = mtimes[0] = timings[fetchStart];
-    int64_t connect_time    = mtimes[1] = timings[requestStart] - timings[fetchStart];
-    int64_t request_time    = mtimes[2] = timings[responseStart] - timings[requestStart];
-    int64_t response_time   = mtimes[3] = timings[responseEnd] - timings[responseStart];
-    int64_t processing_time = mtimes[4] = timings[domComplete] - timings[responseEnd];
-    int64_t load_time       = mtimes[5] = timings[loadEventEnd] - timings[domComplete];
-    int64_t page_time       = mtimes[6] = timings[loadEventEnd];
-    int64_t dom_interactive = mtimes[7] = timings[domInteractive];
-
-    json_object_object_add(request, "navigation_time", json_object_new_int64(navigation_time));
-    json_object_object_add(request, "connect_time", json_object_new_int64(connect_time));
-    json_object_object_add(request, "request_time", json_object_new_int64(request_time));
-    json_object_object_add(request, "response_time", json_object_new_int64(response_time));
-    json_object_object_add(request, "processing_time", json_object_new_int64(processing_time));
-    json_object_object_add(request, "load_time", json_object_new_int64(load_time));
-    json_object_object_add(request, "page_time", json_object_new_int64(page_time));
-    json_object_object_add(request, "dom_interactive", json_object_new_int64(dom_interactive));
+    mtimes[0] = timings[fetchStart];
+    mtimes[1] = timings[requestStart] - timings[fetchStart];
+    mtimes[2] = timings[responseStart] - timings[requestStart];
+    mtimes[3] = timings[responseEnd] - timings[responseStart];
+    mtimes[4] = timings[domComplete] - timings[responseEnd];
+    mtimes[5] = timings[loadEventEnd] - timings[domComplete];
+    mtimes[6] = timings[loadEventEnd];
+    mtimes[7] = timings[domInteractive];
+
+    return FE_MSG_ACCEPTED;
+}
+
+// names of the metrics computed by compute_frontend_timings
+static const char* frontend_timing_names[NUM_FRONTEND_METRICS] = {
+    "navigation_time", "connect_time", "request_time", "response_time",
+    "processing_time", "load_time", "page_time", "dom_interactive"
+};
+
+static
+enum fe_msg_drop_reason convert_frontend_timings_to_json(json_object *request, int64_t *timings, int64_t *mtimes, const char* user_agent, const char* rts)
+{
+    enum fe_msg_drop_reason reason = compute_frontend_timings(timings, mtimes, user_agent, rts);
+    if (reason)
+        return reason;
+
+    for (int i = 0; i < NUM_FRONTEND_METRICS; i++)
+        json_object_object_add(request, frontend_timing_names[i], json_object_new_int64(mtimes[i]));
 
     // dump_json_object(stdout, "[D]", request);
 
@@ -1242,6 +1330,34 @@ void print_fe_drop_reason(const char* type, enum fe_msg_drop_reason reason)
         fprintf(stderr, "[W] processor: dropped %s request (%s)\n", type, str_fe_reason(reason));
 }
 
+// adds page or ajax timings under the page, its module and all_pages
+static
+void processor_add_frontend_increments(processor_state_t *self, parser_state_t *pstate, const char *page, const char *module, int minute,
+                                       const char *resource, size_t time_index, increments_t *increments, json_object *request)
+{
+    char folded_page[1024];
+    const char *stats_page = processor_stats_page(self, pstate, page, module, folded_page, sizeof(folded_page));
+
+    processor_add_totals(self, stats_page, increments);
+    processor_add_totals(self, module, increments);
+    processor_add_totals(self, "all_pages", increments);
+
+    processor_add_minutes(self, stats_page, minute, increments);
+    processor_add_minutes(self, module, minute, increments);
+    processor_add_minutes(self, "all_pages", minute, increments);
+
+    processor_add_quants(self, stats_page, increments);
+
+    processor_add_histogram(self, stats_page, minute, resource, time_index, increments, request);
+    processor_add_histogram(self, module, minute, resource, time_index, increments, request);
+    processor_add_histogram(self, "all_pages", minute, resource, time_index, increments, request);
+
+    size_t first = last_heap_resource_offset + 1;
+    processor_add_time_sketches(self, stats_page, minute, first, last_frontend_resource_offset, time_index, increments);
+    processor_add_time_sketches(self, module, minute, first, last_frontend_resource_offset, time_index, increments);
+    processor_add_time_sketches(self, "all_pages", minute, first, last_frontend_resource_offset, time_index, increments);
+}
+
 enum fe_msg_drop_reason processor_add_frontend_data(processor_state_t *self, parser_state_t *pstate, json_object *request, zmsg_t* msg)
 {
     // dump_json_object(stderr, "[D]", request);
@@ -1268,7 +1384,7 @@ enum fe_msg_drop_reason processor_add_frontend_data(processor_state_t *self, par
         return reason;
     }
 
-    int64_t mtimes[8];
+    int64_t mtimes[NUM_FRONTEND_METRICS];
     reason = convert_frontend_timings_to_json(request, timings, mtimes, agent, rts);
     if (reason) {
         print_fe_drop_reason("frontend", reason);
@@ -1297,19 +1413,8 @@ enum fe_msg_drop_reason processor_add_frontend_data(processor_state_t *self, par
     increments_fill_frontend_apdex(increments, request_data.total_time);
     increments_fill_page_apdex(increments, timings[fe_apdex_attr_index]);
 
-    processor_add_totals(self, request_data.page, increments);
-    processor_add_totals(self, request_data.module, increments);
-    processor_add_totals(self, "all_pages", increments);
-
-    processor_add_minutes(self, request_data.page, request_data.minute, increments);
-    processor_add_minutes(self, request_data.module, request_data.minute, increments);
-    processor_add_minutes(self, "all_pages", request_data.minute, increments);
-
-    processor_add_quants(self, request_data.page, increments);
-
-    processor_add_histogram(self, request_data.page, request_data.minute, "page_time", page_time_index, increments, request);
-    processor_add_histogram(self, request_data.module, request_data.minute, "page_time", page_time_index, increments, request);
-    processor_add_histogram(self, "all_pages", request_data.minute, "page_time", page_time_index, increments, request);
+    processor_add_frontend_increments(self, pstate, request_data.page, request_data.module, request_data.minute,
+                                      "page_time", page_time_index, increments, request);
 
     // dump_increments("add_frontend_data", increments);
 
@@ -1378,19 +1483,8 @@ enum fe_msg_drop_reason processor_add_ajax_data(processor_state_t *self, parser_
     increments_fill_frontend_apdex(increments, request_data.total_time);
     increments_fill_ajax_apdex(increments, request_data.total_time);
 
-    processor_add_totals(self, request_data.page, increments);
-    processor_add_totals(self, request_data.module, increments);
-    processor_add_totals(self, "all_pages", increments);
-
-    processor_add_minutes(self, request_data.page, request_data.minute, increments);
-    processor_add_minutes(self, request_data.module, request_data.minute, increments);
-    processor_add_minutes(self, "all_pages", request_data.minute, increments);
-
-    processor_add_quants(self, request_data.page, increments);
-
-    processor_add_histogram(self, request_data.page, request_data.minute, "ajax_time", ajax_time_index, increments, request);
-    processor_add_histogram(self, request_data.module, request_data.minute, "ajax_time", ajax_time_index, increments, request);
-    processor_add_histogram(self, "all_pages", request_data.minute, "ajax_time", ajax_time_index, increments, request);
+    processor_add_frontend_increments(self, pstate, request_data.page, request_data.module, request_data.minute,
+                                      "ajax_time", ajax_time_index, increments, request);
 
     // dump_increments("add_ajax_data", increments);
 
@@ -1402,3 +1496,103 @@ enum fe_msg_drop_reason processor_add_ajax_data(processor_state_t *self, parser_
     return reason;
 }
 
+// fast path for frontend messages: fields have been extracted by the parser and timings are
+// kept in integer arrays, so we never build a json object. returns FE_MSG_CORRUPTED for
+// messages which shouldn't be sent to the tracker.
+enum fe_msg_drop_reason processor_check_frontend_msg(processor_state_t *self, frontend_msg_t *fe)
+{
+    const char *type = fe->ajax ? "ajax" : "frontend";
+    if (parse_frontend_timings(fe->rts, fe->timings, fe->ajax ? 2 : NUM_FRONTEND_TIMINGS))
+        return FE_MSG_ACCEPTED;
+    print_fe_drop_reason(type, FE_MSG_CORRUPTED);
+    processor_add_user_agent(self, fe->user_agent[0] ? fe->user_agent : NULL, FE_MSG_CORRUPTED);
+    return FE_MSG_CORRUPTED;
+}
+
+// same page name as processor_setup_page
+static
+const char* frontend_msg_page(frontend_msg_t *fe, char *buffer, size_t size)
+{
+    const char *action = fe->action;
+    size_t n = strlen(action);
+    if (n == 0)
+        return "Unknown#unknown_method";
+    if (!strchr(action, '#'))
+        snprintf(buffer, size, "%s#unknown_method", action);
+    else if (action[n-1] == '#')
+        snprintf(buffer, size, "%sunknown_method", action);
+    else
+        return action;
+    return buffer;
+}
+
+enum fe_msg_drop_reason processor_add_frontend_msg(processor_state_t *self, parser_state_t *pstate, frontend_msg_t *fe, bool tracked)
+{
+    const char *type = fe->ajax ? "ajax" : "frontend";
+    const char *agent = fe->user_agent[0] ? fe->user_agent : NULL;
+    enum fe_msg_drop_reason reason;
+
+    if (!tracked) {
+        reason = fe->ajax ? FE_MSG_ILLEGAL : FE_MSG_INVALID;
+        print_fe_drop_reason(type, reason);
+        processor_add_user_agent(self, agent, reason);
+        return reason;
+    }
+
+    int64_t mtimes[NUM_FRONTEND_METRICS];
+    double total_time;
+    if (fe->ajax) {
+        int64_t ajax_time = fe->timings[1] - fe->timings[0];
+        reason = ajax_time < 0 ? FE_MSG_INVALID : FE_MSG_ACCEPTED;
+        total_time = ajax_time;
+    } else {
+        reason = compute_frontend_timings(fe->timings, mtimes, agent, fe->rts);
+        total_time = mtimes[6];
+    }
+    if (reason) {
+        print_fe_drop_reason(type, reason);
+        processor_add_user_agent(self, agent, reason);
+        return reason;
+    }
+    if (total_time == 0)
+        total_time = 1.0;
+
+    // TODO: revisit when switching to percentiles
+    if (total_time > FE_MSG_OUTLIER_THRESHOLD_MS) {
+        reason = FE_MSG_OUTLIER;
+        print_fe_drop_reason(type, reason);
+        processor_add_user_agent(self, agent, reason);
+        return reason;
+    }
+
+    char page_buffer[1100];
+    const char *page = frontend_msg_page(fe, page_buffer, sizeof(page_buffer));
+    const char *module = processor_setup_module(self, page);
+    const char *s = fe->started_at;
+    int minute = 60 * (10 * (s[11] - '0') + (s[12] - '0')) + 10 * (s[14] - '0') + (s[15] - '0');
+
+    increments_t* increments = increments_new();
+    increments_fill_metric(increments, "frontend_time", total_time);
+    increments_fill_frontend_apdex(increments, total_time);
+    if (fe->ajax) {
+        increments->ajax_request_count = 1;
+        increments_fill_metric(increments, "ajax_time", total_time);
+        increments_fill_ajax_apdex(increments, total_time);
+        processor_add_frontend_increments(self, pstate, page, module, minute, "ajax_time", ajax_time_index, increments, NULL);
+    } else {
+        increments->page_request_count = 1;
+        for (int i = 0; i < NUM_FRONTEND_METRICS; i++)
+            increments_fill_metric(increments, frontend_timing_names[i], mtimes[i]);
+        increments_fill_metric(increments, "page_time", total_time);
+        increments_fill_page_apdex(increments, fe->timings[fe_apdex_attr_index]);
+        processor_add_frontend_increments(self, pstate, page, module, minute, "page_time", page_time_index, increments, NULL);
+    }
+    increments_destroy(increments);
+
+    if (fe->created_ms > 0)
+        importer_prometheus_client_observe_latency(self->stream_info, LATENCY_STAGE_PROCESSOR, fe->created_ms, zclock_time());
+
+    reason = FE_MSG_ACCEPTED;
+    processor_add_user_agent(self, agent, reason);
+    return reason;
+}
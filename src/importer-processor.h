@@ -2,6 +2,7 @@
 #define __LOGJAM_IMPORTER_PROCESSOR_H_INCLUDED__
 
 #include "importer-parser.h"
+#include "importer-pageguard.h"
 #include "logjam-streaminfo.h"
 
 #ifdef __cplusplus
@@ -12,12 +13,15 @@ typedef struct {
     stream_info_t *stream_info;
     char *db_name;
     size_t request_count;
+    int64_t oldest_created_ms;  // creation time of the oldest message contributing to this processor
     zhash_t *modules;
     zhash_t *totals;
     zhash_t *minutes;
     zhash_t *quants;
     zhash_t *histograms;
     zhash_t *agents;
+    page_guard_t *page_guard;   // page guard of the stream, shared by all parsers
+    size_t pages_folded;        // requests aggregated under a folded page
 } processor_state_t;
 
 extern processor_state_t* processor_new(stream_info_t *stream_info, char *db_name);
@@ -27,7 +31,11 @@ extern void processor_add_js_exception(processor_state_t *self, parser_state_t *
 extern void processor_add_event(processor_state_t *self, parser_state_t *pstate, json_object *request);
 extern enum fe_msg_drop_reason processor_add_frontend_data(processor_state_t *self, parser_state_t *pstate, json_object *request, zmsg_t *msg);
 extern enum fe_msg_drop_reason processor_add_ajax_data(processor_state_t *self, parser_state_t *pstate, json_object *request, zmsg_t *msg);
+extern enum fe_msg_drop_reason processor_check_frontend_msg(processor_state_t *self, frontend_msg_t *fe);
+extern enum fe_msg_drop_reason processor_add_frontend_msg(processor_state_t *self, parser_state_t *pstate, frontend_msg_t *fe, bool tracked);
 extern int processor_set_frontend_apdex_attribute(const char *attr);
+extern histogram_t* histogram_new();
+extern void histogram_destroy(void *histogram);
 extern void dump_histogram(const char* key, size_t *h);
 extern void dump_histograms(zhash_t* histograms);
 
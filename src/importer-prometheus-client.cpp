@@ -1,13 +1,16 @@
 #include <prometheus/counter.h>
+#include <prometheus/histogram.h>
 #include <prometheus/exposer.h>
 #include <prometheus/registry.h>
 #include "importer-prometheus-client.h"
+#include "prometheus-sharded-counter.h"
 #include <sys/resource.h>
 #include <stdlib.h>
 
 static struct prometheus_client_t {
     prometheus::Exposer *exposer;
     std::shared_ptr<prometheus::Registry> registry;
+    std::shared_ptr<logjam::ShardedCounterRegistry> sharded_registry;
     prometheus::Family<prometheus::Counter> *updates_total_family;
     prometheus::Counter *updates_total;
     prometheus::Family<prometheus::Counter> *updates_seconds_family;
@@ -15,7 +18,7 @@ static struct prometheus_client_t {
     prometheus::Family<prometheus::Counter> *inserts_total_family;
     prometheus::Family<prometheus::Counter> *inserts_throttled_total_family;
     prometheus::Counter *inserts_total;
-    prometheus::Counter *inserts_throttled_total;
+    logjam::ShardedCounter *inserts_throttled_total;
     prometheus::Family<prometheus::Counter> *inserts_by_stream_total_family;
     prometheus::Family<prometheus::Counter> *inserts_throttled_by_stream_total_family;
     prometheus::Family<prometheus::Counter> *inserts_seconds_family;
@@ -36,8 +39,18 @@ static struct prometheus_client_t {
     prometheus::Gauge *queued_updates;
     prometheus::Family<prometheus::Gauge> *queued_inserts_family;
     prometheus::Gauge *queued_inserts;
+    prometheus::Family<prometheus::Gauge> *queued_parses_family;
+    prometheus::Gauge *queued_parses;
+    prometheus::Family<prometheus::Gauge> *admission_level_family;
+    prometheus::Gauge *admission_level;
+    prometheus::Family<prometheus::Counter> *admission_decisions_total_family;
+    prometheus::Family<prometheus::Counter> *pages_folded_total_family;
     prometheus::Counter *blocked_updates_total;
     prometheus::Family<prometheus::Counter> *blocked_updates_total_family;
+    prometheus::Counter *coalesced_updates_total;
+    prometheus::Family<prometheus::Counter> *coalesced_updates_total_family;
+    prometheus::Counter *rejected_updates_total;
+    prometheus::Family<prometheus::Counter> *rejected_updates_total_family;
     prometheus::Counter *failed_inserts_total;
     prometheus::Family<prometheus::Counter> *failed_inserts_total_family;
     std::vector<prometheus::Counter*> cpu_seconds_total_subscribers;
@@ -45,18 +58,48 @@ static struct prometheus_client_t {
     std::vector<prometheus::Counter*> cpu_seconds_total_writers;
     std::vector<prometheus::Counter*> cpu_seconds_total_updaters;
     prometheus::Family<prometheus::Counter> *cpu_seconds_total_family;
+    prometheus::Family<prometheus::Gauge> *threads_family;
+    std::vector<prometheus::Gauge*> threads;
     prometheus::Family<prometheus::Gauge> *sequence_number_family;
+    prometheus::Family<prometheus::Histogram> *latency_seconds_family;
     std::unordered_map<uint32_t, prometheus::Gauge*> sequence_numbers;
+    prometheus::Family<prometheus::Histogram> *mongo_pool_wait_seconds_family;
+    prometheus::Family<prometheus::Histogram> *mongo_operation_seconds_family;
+    prometheus::Family<prometheus::Gauge> *mongo_operations_in_flight_family;
+    std::vector<prometheus::Histogram*> mongo_pool_wait_seconds;
+    std::vector<prometheus::Histogram*> mongo_operation_seconds;
+    std::vector<prometheus::Gauge*> mongo_operations_in_flight;
+    prometheus::Family<prometheus::Histogram> *controller_tick_seconds_family;
+    prometheus::Histogram *controller_tick_seconds;
+    prometheus::Family<prometheus::Histogram> *checkpoint_seconds_family;
+    prometheus::Histogram *checkpoint_serialize_seconds;
+    prometheus::Histogram *checkpoint_write_seconds;
 } client;
 
 static std::mutex mutex;
 
+static const char* latency_stage_names[NUM_LATENCY_STAGES] = {"subscriber", "parser", "processor", "writer", "updater"};
+
+static const char* admission_decision_names[NUM_ADMISSION_DECISIONS] = {"frontend_sampled_out", "insert_skipped", "dropped"};
+
+// roughly exponential, from 1ms to 10 minutes
+static const prometheus::Histogram::BucketBoundaries latency_buckets = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300, 600
+};
+
+// from 100us to 30 seconds
+static const prometheus::Histogram::BucketBoundaries mongo_buckets = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30
+};
+
 void importer_prometheus_client_init(const char* address, importer_prometheus_client_params_t params)
 {
     // create a http server running on the given address
     client.exposer = new prometheus::Exposer{address};
     // create a metrics registry
     client.registry = std::make_shared<prometheus::Registry>();
+    // counters incremented per message from several threads
+    client.sharded_registry = std::make_shared<logjam::ShardedCounterRegistry>(client.registry);
 
     // declare metrics families, counters and gauges
     client.updates_total_family = &prometheus::BuildCounter()
@@ -85,7 +128,7 @@ void importer_prometheus_client_init(const char* address, importer_prometheus_cl
         .Help("How many inserts has this importer rejected")
         .Register(*client.registry);
 
-    client.inserts_throttled_total = &client.inserts_throttled_total_family->Add({});
+    client.inserts_throttled_total = &client.sharded_registry->Add(*client.inserts_throttled_total_family, {});
 
     client.inserts_by_stream_total_family = &prometheus::BuildCounter()
         .Name("logjam:importer:inserts_by_stream_total")
@@ -160,6 +203,30 @@ void importer_prometheus_client_init(const char* address, importer_prometheus_cl
 
     client.queued_inserts = &client.queued_inserts_family->Add({});
 
+    client.queued_parses_family = &prometheus::BuildGauge()
+        .Name("logjam:importer:parses_queued")
+        .Help("How many messages are currently waiting to be processed by the importer parsers")
+        .Register(*client.registry);
+
+    client.queued_parses = &client.queued_parses_family->Add({});
+
+    client.admission_level_family = &prometheus::BuildGauge()
+        .Name("logjam:importer:admission_level")
+        .Help("Current degradation level of importer admission control (0 means accept everything)")
+        .Register(*client.registry);
+
+    client.admission_level = &client.admission_level_family->Add({});
+
+    client.admission_decisions_total_family = &prometheus::BuildCounter()
+        .Name("logjam:importer:admission_decisions_total")
+        .Help("How many messages admission control has sampled out, not stored or dropped for the given stream")
+        .Register(*client.registry);
+
+    client.pages_folded_total_family = &prometheus::BuildCounter()
+        .Name("logjam:importer:pages_folded_total")
+        .Help("How many requests of the given stream were aggregated under a folded page, as the stream has too many distinct pages")
+        .Register(*client.registry);
+
     client.blocked_updates_total_family = &prometheus::BuildCounter()
         .Name("logjam:importer:updates_blocked_total")
         .Help("How many update msgs caused the importer controller to block")
@@ -167,6 +234,20 @@ void importer_prometheus_client_init(const char* address, importer_prometheus_cl
 
     client.blocked_updates_total = &client.blocked_updates_total_family->Add({});
 
+    client.coalesced_updates_total_family = &prometheus::BuildCounter()
+        .Name("logjam:importer:updates_coalesced_total")
+        .Help("How many database updates were merged into updates still waiting for an updater")
+        .Register(*client.registry);
+
+    client.coalesced_updates_total = &client.coalesced_updates_total_family->Add({});
+
+    client.rejected_updates_total_family = &prometheus::BuildCounter()
+        .Name("logjam:importer:updates_rejected_total")
+        .Help("How many database updates were dropped because their updater had shut down")
+        .Register(*client.registry);
+
+    client.rejected_updates_total = &client.rejected_updates_total_family->Add({});
+
     client.failed_inserts_total_family = &prometheus::BuildCounter()
         .Name("logjam:importer:inserts_failed_total")
         .Help("How many update database inserts failed")
@@ -200,13 +281,65 @@ void importer_prometheus_client_init(const char* address, importer_prometheus_cl
         client.cpu_seconds_total_updaters.push_back(&client.cpu_seconds_total_family->Add({{"thread", name}}));
     }
 
+    client.threads_family = &prometheus::BuildGauge()
+        .Name("logjam:importer:threads")
+        .Help("Current number of threads in elastic importer thread pools")
+        .Register(*client.registry);
+
+    for (const char* pool : {"parsers", "writers", "updaters"})
+        client.threads.push_back(&client.threads_family->Add({{"pool", pool}}));
+
     client.sequence_number_family = &prometheus::BuildGauge()
         .Name("logjam:msgbus:sequence")
         .Help("Current sequence number for the given logjam device")
         .Register(*client.registry);
 
+    client.latency_seconds_family = &prometheus::BuildHistogram()
+        .Name("logjam:importer:latency_seconds")
+        .Help("Time between message creation on the logjam device and the given importer stage")
+        .Register(*client.registry);
+
+    client.mongo_pool_wait_seconds_family = &prometheus::BuildHistogram()
+        .Name("logjam:importer:mongo_pool_wait_seconds")
+        .Help("How long writers and updaters waited for a pooled database connection")
+        .Register(*client.registry);
+
+    client.mongo_operation_seconds_family = &prometheus::BuildHistogram()
+        .Name("logjam:importer:mongo_operation_seconds")
+        .Help("How long writers and updaters held a pooled database connection")
+        .Register(*client.registry);
+
+    client.mongo_operations_in_flight_family = &prometheus::BuildGauge()
+        .Name("logjam:importer:mongo_operations_in_flight")
+        .Help("How many pooled database connections are currently in use")
+        .Register(*client.registry);
+
+    // label by index, as database URIs can contain credentials
+    for (uint i=0; i<params.num_databases; i++) {
+        char db[16];
+        sprintf(db, "%u", i);
+        client.mongo_pool_wait_seconds.push_back(&client.mongo_pool_wait_seconds_family->Add({{"database", db}}, mongo_buckets));
+        client.mongo_operation_seconds.push_back(&client.mongo_operation_seconds_family->Add({{"database", db}}, mongo_buckets));
+        client.mongo_operations_in_flight.push_back(&client.mongo_operations_in_flight_family->Add({{"database", db}}));
+    }
+
+    client.controller_tick_seconds_family = &prometheus::BuildHistogram()
+        .Name("logjam:importer:controller_tick_seconds")
+        .Help("How long the controller spent collecting and forwarding stats per tick")
+        .Register(*client.registry);
+
+    client.controller_tick_seconds = &client.controller_tick_seconds_family->Add({}, mongo_buckets);
+
+    client.checkpoint_seconds_family = &prometheus::BuildHistogram()
+        .Name("logjam:importer:checkpoint_seconds")
+        .Help("Time spent serializing checkpoints on the controller and writing them to disk")
+        .Register(*client.registry);
+
+    client.checkpoint_serialize_seconds = &client.checkpoint_seconds_family->Add({{"stage", "serialize"}}, mongo_buckets);
+    client.checkpoint_write_seconds = &client.checkpoint_seconds_family->Add({{"stage", "write"}}, mongo_buckets);
+
     // ask the exposer to scrape the registry on incoming scrapes
-    client.exposer->RegisterCollectable(client.registry);
+    client.exposer->RegisterCollectable(client.sharded_registry);
 }
 
 void importer_prometheus_client_shutdown()
@@ -255,6 +388,16 @@ void importer_prometheus_client_count_updates_blocked(double value)
     client.blocked_updates_total->Increment(value);
 }
 
+void importer_prometheus_client_count_updates_coalesced(double value)
+{
+    client.coalesced_updates_total->Increment(value);
+}
+
+void importer_prometheus_client_count_updates_rejected(double value)
+{
+    client.rejected_updates_total->Increment(value);
+}
+
 void importer_prometheus_client_count_msgs_parsed(double value)
 {
     client.parsed_msgs_total->Increment(value);
@@ -270,6 +413,16 @@ void importer_prometheus_client_gauge_queued_inserts(double value)
     client.queued_inserts->Set(value);
 }
 
+void importer_prometheus_client_gauge_queued_parses(double value)
+{
+    client.queued_parses->Set(value);
+}
+
+void importer_prometheus_client_gauge_admission_level(double value)
+{
+    client.admission_level->Set(value);
+}
+
 void importer_prometheus_client_time_updates(double value)
 {
     client.updates_seconds->Increment(value);
@@ -309,56 +462,143 @@ void importer_prometheus_client_record_rusage_subscriber(uint i)
     client.cpu_seconds_total_subscribers[i]->Increment(value - oldvalue);
 }
 
-void importer_prometheus_client_record_rusage_parser(uint i)
+// elastic pools reuse thread indexes, so we add the cpu time used by the calling thread since
+// its last call instead of setting the counter to the cpu time of the thread
+static thread_local double last_cpu_usage = 0;
+
+static
+void record_thread_cpu_usage(prometheus::Counter *counter)
 {
     double value = get_combined_cpu_usage();
-    double oldvalue = client.cpu_seconds_total_parsers[i]->Value();
-    client.cpu_seconds_total_parsers[i]->Increment(value - oldvalue);
+    counter->Increment(value - last_cpu_usage);
+    last_cpu_usage = value;
+}
+
+void importer_prometheus_client_record_rusage_parser(uint i)
+{
+    record_thread_cpu_usage(client.cpu_seconds_total_parsers[i]);
 }
 
 void importer_prometheus_client_record_rusage_writer(uint i)
 {
-    double value = get_combined_cpu_usage();
-    double oldvalue = client.cpu_seconds_total_writers[i]->Value();
-    client.cpu_seconds_total_writers[i]->Increment(value - oldvalue);
+    record_thread_cpu_usage(client.cpu_seconds_total_writers[i]);
 }
 
 void importer_prometheus_client_record_rusage_updater(uint i)
 {
-    double value = get_combined_cpu_usage();
-    double oldvalue = client.cpu_seconds_total_updaters[i]->Value();
-    client.cpu_seconds_total_updaters[i]->Increment(value - oldvalue);
+    record_thread_cpu_usage(client.cpu_seconds_total_updaters[i]);
 }
 
-// caller must hold lock on stream
+double importer_prometheus_client_cpu_seconds_parser(uint i)
+{
+    return client.cpu_seconds_total_parsers[i]->Value();
+}
+
+double importer_prometheus_client_cpu_seconds_writer(uint i)
+{
+    return client.cpu_seconds_total_writers[i]->Value();
+}
+
+double importer_prometheus_client_cpu_seconds_updater(uint i)
+{
+    return client.cpu_seconds_total_updaters[i]->Value();
+}
+
+void importer_prometheus_client_gauge_threads(uint pool, double value)
+{
+    client.threads[pool]->Set(value);
+}
+
+void importer_prometheus_client_observe_mongo_pool_wait(uint db, double seconds)
+{
+    client.mongo_pool_wait_seconds[db]->Observe(seconds);
+}
+
+void importer_prometheus_client_observe_mongo_operation(uint db, double seconds)
+{
+    client.mongo_operation_seconds[db]->Observe(seconds);
+}
+
+void importer_prometheus_client_observe_controller_tick(double seconds)
+{
+    client.controller_tick_seconds->Observe(seconds);
+}
+
+void importer_prometheus_client_observe_checkpoint_serialize(double seconds)
+{
+    client.checkpoint_serialize_seconds->Observe(seconds);
+}
+
+void importer_prometheus_client_observe_checkpoint_write(double seconds)
+{
+    client.checkpoint_write_seconds->Observe(seconds);
+}
+
+void importer_prometheus_client_gauge_mongo_operations_in_flight(uint db, double value)
+{
+    client.mongo_operations_in_flight[db]->Set(value);
+}
+
+// caller must hold lock on stream. per stream counters are sharded, so that parsers and
+// subscribers don't contend on them, and only get labelled when the exposer collects.
 void importer_prometheus_client_create_stream_counters(stream_info_t *stream)
 {
-    stream->inserts_total = &client.inserts_by_stream_total_family->Add({{"stream", stream->key}});
-    stream->inserts_throttled_total = &client.inserts_throttled_by_stream_total_family->Add({{"stream", stream->key}});
+    stream->inserts_total = &client.sharded_registry->Add(*client.inserts_by_stream_total_family, {{"stream", stream->key}});
+    stream->inserts_throttled_total = &client.sharded_registry->Add(*client.inserts_throttled_by_stream_total_family, {{"stream", stream->key}});
+    for (int i=0; i<NUM_LATENCY_STAGES; i++)
+        stream->latency_histograms[i] = &client.latency_seconds_family->Add({{"stream", stream->key}, {"stage", latency_stage_names[i]}}, latency_buckets);
+    for (int i=0; i<NUM_ADMISSION_DECISIONS; i++)
+        stream->admission_decisions_total[i] = &client.sharded_registry->Add(*client.admission_decisions_total_family, {{"stream", stream->key}, {"decision", admission_decision_names[i]}});
+    stream->pages_folded_total = &client.sharded_registry->Add(*client.pages_folded_total_family, {{"stream", stream->key}});
 }
 
 // caller must hold lock on stream
 void importer_prometheus_client_destroy_stream_counters(stream_info_t *stream)
 {
-    prometheus::Counter* counter = (prometheus::Counter*)stream->inserts_total;
-    client.inserts_by_stream_total_family->Remove(counter);
-    delete counter;
-    counter = (prometheus::Counter*)stream->inserts_throttled_total;
-    client.inserts_throttled_by_stream_total_family->Remove(counter);
-    delete counter;
+    client.sharded_registry->Remove(*(logjam::ShardedCounter*)stream->inserts_total);
+    client.sharded_registry->Remove(*(logjam::ShardedCounter*)stream->inserts_throttled_total);
+    for (int i=0; i<NUM_LATENCY_STAGES; i++)
+        client.latency_seconds_family->Remove((prometheus::Histogram*)stream->latency_histograms[i]);
+    for (int i=0; i<NUM_ADMISSION_DECISIONS; i++)
+        client.sharded_registry->Remove(*(logjam::ShardedCounter*)stream->admission_decisions_total[i]);
+    client.sharded_registry->Remove(*(logjam::ShardedCounter*)stream->pages_folded_total);
 }
 
 // caller must hold lock on stream
 void importer_prometheus_client_count_inserts_for_stream(stream_info_t *stream, double value)
 {
-    ((prometheus::Counter*)stream->inserts_total)->Increment(value);
+    ((logjam::ShardedCounter*)stream->inserts_total)->Increment(value);
 }
 
 // caller must hold lock on stream
 void importer_prometheus_client_count_throttled_inserts_for_stream(stream_info_t *stream, double value)
 {
     client.inserts_throttled_total->Increment(value);
-    ((prometheus::Counter*)stream->inserts_throttled_total)->Increment(value);
+    ((logjam::ShardedCounter*)stream->inserts_throttled_total)->Increment(value);
+}
+
+void importer_prometheus_client_observe_latency(stream_info_t *stream, latency_stage_t stage, int64_t created_ms, int64_t now_ms)
+{
+    prometheus::Histogram* histogram = (prometheus::Histogram*)stream->latency_histograms[stage];
+    if (histogram == NULL || created_ms <= 0)
+        return;
+    // clocks of devices and importer might differ slightly
+    int64_t latency_ms = now_ms > created_ms ? now_ms - created_ms : 0;
+    histogram->Observe(latency_ms / 1000.0);
+}
+
+void importer_prometheus_client_count_admission_decision_for_stream(stream_info_t *stream, admission_decision_t decision)
+{
+    logjam::ShardedCounter* counter = (logjam::ShardedCounter*)stream->admission_decisions_total[decision];
+    if (counter)
+        counter->Increment();
+}
+
+void importer_prometheus_client_count_pages_folded_for_stream(stream_info_t *stream, double value)
+{
+    logjam::ShardedCounter* counter = (logjam::ShardedCounter*)stream->pages_folded_total;
+    if (counter)
+        counter->Increment(value);
 }
 
 void importer_prometheus_client_record_device_sequence_number(uint32_t id, const char* device, uint64_t n)
@@ -13,6 +13,7 @@ typedef struct {
     uint num_parsers;
     uint num_writers;
     uint num_updaters;
+    uint num_databases;
 } importer_prometheus_client_params_t;
 
 extern void importer_prometheus_client_init(const char* address, importer_prometheus_client_params_t params);
@@ -27,20 +28,38 @@ extern void importer_prometheus_client_count_msgs_dropped(double value);
 extern void importer_prometheus_client_count_msgs_blocked(double value);
 extern void importer_prometheus_client_count_msgs_parsed(double value);
 extern void importer_prometheus_client_count_updates_blocked(double value);
+extern void importer_prometheus_client_count_updates_coalesced(double value);
+extern void importer_prometheus_client_count_updates_rejected(double value);
 extern void importer_prometheus_client_count_inserts_failed(double value);
 extern void importer_prometheus_client_gauge_queued_inserts(double value);
 extern void importer_prometheus_client_gauge_queued_updates(double value);
+extern void importer_prometheus_client_gauge_queued_parses(double value);
+extern void importer_prometheus_client_gauge_admission_level(double value);
 extern void importer_prometheus_client_time_inserts(double value);
 extern void importer_prometheus_client_time_updates(double value);
 extern void importer_prometheus_client_record_rusage_subscriber(uint i);
 extern void importer_prometheus_client_record_rusage_parser(uint i);
 extern void importer_prometheus_client_record_rusage_writer(uint i);
 extern void importer_prometheus_client_record_rusage_updater(uint i);
+extern double importer_prometheus_client_cpu_seconds_parser(uint i);
+extern double importer_prometheus_client_cpu_seconds_writer(uint i);
+extern double importer_prometheus_client_cpu_seconds_updater(uint i);
+// pool is one of ELASTIC_PARSERS, ELASTIC_WRITERS, ELASTIC_UPDATERS
+extern void importer_prometheus_client_gauge_threads(uint pool, double value);
+extern void importer_prometheus_client_observe_mongo_pool_wait(uint db, double seconds);
+extern void importer_prometheus_client_observe_mongo_operation(uint db, double seconds);
+extern void importer_prometheus_client_gauge_mongo_operations_in_flight(uint db, double value);
+extern void importer_prometheus_client_observe_controller_tick(double seconds);
+extern void importer_prometheus_client_observe_checkpoint_serialize(double seconds);
+extern void importer_prometheus_client_observe_checkpoint_write(double seconds);
 
 extern void importer_prometheus_client_create_stream_counters(stream_info_t *stream);
 extern void importer_prometheus_client_destroy_stream_counters(stream_info_t *stream);
 extern void importer_prometheus_client_count_inserts_for_stream(stream_info_t *stream, double value);
 extern void importer_prometheus_client_count_throttled_inserts_for_stream(stream_info_t *stream, double value);
+extern void importer_prometheus_client_count_admission_decision_for_stream(stream_info_t *stream, admission_decision_t decision);
+extern void importer_prometheus_client_count_pages_folded_for_stream(stream_info_t *stream, double value);
+extern void importer_prometheus_client_observe_latency(stream_info_t *stream, latency_stage_t stage, int64_t created_ms, int64_t now_ms);
 extern void importer_prometheus_client_record_device_sequence_number(uint32_t id, const char *device, uint64_t n);
 
 #ifdef __cplusplus
@@ -4,6 +4,8 @@
 #include "importer-resources.h"
 #include "importer-mongoutils.h"
 #include "importer-prometheus-client.h"
+#include "importer-jsedup.h"
+#include <lz4.h>
 
 /*
  * connections: n_w = num_writers, n_p = num_parsers, "o" = bind, "[<>v^]" = connect
@@ -18,23 +20,26 @@
 
 // It might be better to insert a load balancer device between parsers and requests writers.
 
+zhash_t *compressed_request_fields = NULL;
+
 typedef struct {
     zconfig_t* config;
     char me[16];
     size_t id;
-    mongoc_client_t* mongo_clients[MAX_DATABASES];
-    zhash_t *request_collections;
-    zhash_t *metrics_collections;
-    zhash_t *jse_collections;
-    zhash_t *events_collections;
+    mongo_lease_t mongo_lease;  // client checked out for the message being processed
     zsock_t *pipe;         // actor command pipe
     zsock_t *pull_socket;
     zsock_t *live_stream_socket;
     int updates_count;     // updates performend since last tick
     int update_time;       // processing time since last tick (micro seconds)
     int updates_failed;    // how many updates failed
+    zhash_t *full_js_exception_groups;  // "<db_name>/<fingerprint>" of groups with enough exemplars
+    zhash_t *pending_requests;  // db_name -> request documents waiting for the next bulk insert
 } request_writer_state_t;
 
+// forget full groups when there are more than this, most of them belong to past days anyway
+#define MAX_FULL_JS_EXCEPTION_GROUPS 100000
+
 
 static
 zsock_t* request_writer_pull_socket_new(int i)
@@ -42,69 +47,32 @@ zsock_t* request_writer_pull_socket_new(int i)
     zsock_t *socket = zsock_new(ZMQ_PULL);
     assert(socket);
     zsock_set_rcvhwm(socket, HWM_UNLIMITED);
-    int rc = zsock_bind(socket, "inproc://request-writer-%d", i);
+    // the endpoint of a writer removed from an elastic pool is released asynchronously
+    int rc;
+    for (int j=0; j<10; j++) {
+        rc = zsock_bind(socket, "inproc://request-writer-%d", i);
+        if (rc == 0) break;
+        zclock_sleep(100); // ms
+    }
+    log_zmq_error(rc, __FILE__, __LINE__);
     assert(rc == 0);
     return socket;
 }
 
+// collections are bound to the pooled client leased for the current message and
+// must be destroyed by the caller before the lease is released
 static
-mongoc_collection_t* request_writer_get_request_collection(request_writer_state_t* self, const char* db_name, stream_info_t *stream_info)
-{
-    if (dryrun) return NULL;
-    mongoc_collection_t *collection = zhash_lookup(self->request_collections, db_name);
-    if (collection == NULL) {
-        // printf("[D] creating requests collection: %s\n", db_name);
-        mongoc_client_t *mongo_client = self->mongo_clients[stream_info->db];
-        collection = mongoc_client_get_collection(mongo_client, db_name, "requests");
-        zhash_insert(self->request_collections, db_name, collection);
-        zhash_freefn(self->request_collections, db_name, (zhash_free_fn*)mongoc_collection_destroy);
-    }
-    return collection;
-}
-
-static
-mongoc_collection_t* request_writer_get_metrics_collection(request_writer_state_t* self, const char* db_name, stream_info_t *stream_info)
-{
-    if (dryrun) return NULL;
-    mongoc_collection_t *collection = zhash_lookup(self->metrics_collections, db_name);
-    if (collection == NULL) {
-        // printf("[D] creating metrics collection: %s\n", db_name);
-        mongoc_client_t *mongo_client = self->mongo_clients[stream_info->db];
-        collection = mongoc_client_get_collection(mongo_client, db_name, "metrics");
-        zhash_insert(self->metrics_collections, db_name, collection);
-        zhash_freefn(self->metrics_collections, db_name, (zhash_free_fn*)mongoc_collection_destroy);
-    }
-    return collection;
-}
-
-static
-mongoc_collection_t* request_writer_get_jse_collection(request_writer_state_t* self, const char* db_name, stream_info_t *stream_info)
+mongoc_collection_t* request_writer_get_collection(request_writer_state_t* self, const char* db_name, const char* name)
 {
     if (dryrun) return NULL;
-    mongoc_collection_t *collection = zhash_lookup(self->jse_collections, db_name);
-    if (collection == NULL) {
-        // printf("[D] creating jse collection: %s\n", db_name);
-        mongoc_client_t *mongo_client = self->mongo_clients[stream_info->db];
-        collection = mongoc_client_get_collection(mongo_client, db_name, "js_exceptions");
-        zhash_insert(self->jse_collections, db_name, collection);
-        zhash_freefn(self->jse_collections, db_name, (zhash_free_fn*)mongoc_collection_destroy);
-    }
-    return collection;
+    return mongoc_client_get_collection(self->mongo_lease.client, db_name, name);
 }
 
 static
-mongoc_collection_t* request_writer_get_events_collection(request_writer_state_t* self, const char* db_name, stream_info_t *stream_info)
+void request_writer_release_collection(mongoc_collection_t *collection)
 {
-    if (dryrun) return NULL;
-    mongoc_collection_t *collection = zhash_lookup(self->events_collections, db_name);
-    if (collection == NULL) {
-        // printf("[D] creating events collection: %s\n", db_name);
-        mongoc_client_t *mongo_client = self->mongo_clients[stream_info->db];
-        collection = mongoc_client_get_collection(mongo_client, db_name, "events");
-        zhash_insert(self->events_collections, db_name, collection);
-        zhash_freefn(self->events_collections, db_name, (zhash_free_fn*)mongoc_collection_destroy);
-    }
-    return collection;
+    if (collection)
+        mongoc_collection_destroy(collection);
 }
 
 // Find first correct UTF8 character position before buf[n], where n is greater than 3.
@@ -148,30 +116,41 @@ int limit_json_string_value_length(const char* str, int n, char** copy)
     return n+15;
 }
 
+// values are at most MAX_STRING_VALUE_SIZE+16 bytes, but converting them can take six times
+// as much, so only short ones are converted on the stack
 static
 int bson_append_win1252(bson_t *b, const char *key, size_t key_len, const char* val, size_t val_len)
 {
-    char utf8[6*val_len+1];
+    char buffer[1024];
+    size_t size = 6*val_len+1;
+    char *utf8 = size <= sizeof(buffer) ? buffer : zmalloc(size);
     int new_len = convert_to_win1252(val, val_len, utf8);
-    return bson_append_utf8(b, key, key_len, utf8, new_len);
+    int rc = bson_append_utf8(b, key, key_len, utf8, new_len);
+    if (utf8 != buffer)
+        free(utf8);
+    return rc;
 }
 
 
 static
 void json_object_to_bson(const char* context, json_object *j, bson_t *b);
 
-//TODO: optimize this!
 static
 void json_key_to_bson_key(const char* context, bson_t *b, json_object *val, const char *key)
 {
-    size_t n = strlen(key);
-    char safe_key[4*n+1];
-    int len = copy_replace_dots_and_dollars(safe_key, key);
-
-    if (!bson_utf8_validate(safe_key, len, false)) {
-        char tmp[6*len+1];
-        len = convert_to_win1252(safe_key, len, tmp);
-        strcpy(safe_key, tmp);
+    // most keys contain neither dots nor dollars and are valid utf8, so we rarely need a copy
+    int len = dots_and_dollars_span(key);
+    const char *safe_key = key;
+    char *replaced_key = NULL, *converted_key = NULL;
+    if (key[len] != '\0') {
+        replaced_key = zmalloc(3*strlen(key)+1);
+        len = copy_replace_dots_and_dollars(replaced_key, key);
+        safe_key = replaced_key;
+    }
+    if (!utf8_validate(safe_key, len)) {
+        converted_key = zmalloc(6*len+1);
+        len = convert_to_win1252(safe_key, len, converted_key);
+        safe_key = converted_key;
     }
     // printf("[D] safe_key: %s\n", safe_key);
 
@@ -212,7 +191,7 @@ void json_key_to_bson_key(const char* context, bson_t *b, json_object *val, cons
         n = limit_json_string_value_length(str, n, &copy);
         if (copy)
             str = copy;
-        if (bson_utf8_validate(str, n, false /* disallow embedded null characters */)) {
+        if (utf8_validate(str, n)) {
             bson_append_utf8(b, safe_key, len, str, n);
         } else {
             fprintf(stderr,
@@ -232,6 +211,10 @@ void json_key_to_bson_key(const char* context, bson_t *b, json_object *val, cons
         fprintf(stderr, "[E] unexpected json type: %s\n", json_type_to_name(type));
         break;
     }
+    if (replaced_key)
+        free(replaced_key);
+    if (converted_key)
+        free(converted_key);
 }
 
 static
@@ -242,6 +225,149 @@ void json_object_to_bson(const char *context, json_object *j, bson_t* b)
   }
 }
 
+// whether a value holds strings which json_key_to_bson_key would truncate or convert
+static
+bool json_needs_cleanup(json_object *val)
+{
+    switch (json_object_get_type(val)) {
+    case json_type_string: {
+        size_t n = json_object_get_string_len(val);
+        return n > MAX_STRING_VALUE_SIZE+16 || !utf8_validate(json_object_get_string(val), n);
+    }
+    case json_type_object: {
+        json_object_object_foreach(val, key, sub) {
+            if (!utf8_validate(key, strlen(key)) || json_needs_cleanup(sub))
+                return true;
+        }
+        return false;
+    }
+    case json_type_array: {
+        int n = json_object_array_length(val);
+        for (int i = 0; i < n; i++) {
+            if (json_needs_cleanup(json_object_array_get_idx(val, i)))
+                return true;
+        }
+        return false;
+    }
+    default:
+        return false;
+    }
+}
+
+static
+json_object* json_new_win1252_string(const char *str, size_t n)
+{
+    char *utf8 = zmalloc(6*n+1);
+    int len = convert_to_win1252(str, n, utf8);
+    json_object *result = json_object_new_string_len(utf8, len);
+    free(utf8);
+    return result;
+}
+
+// returns a copy of val with long strings truncated and invalid utf8 converted, just like
+// the uncompressed fields. parts which need no cleanup are shared with val.
+static
+json_object* json_cleanup_copy(json_object *val)
+{
+    if (!json_needs_cleanup(val))
+        return json_object_get(val);
+
+    switch (json_object_get_type(val)) {
+    case json_type_string: {
+        const char *str = json_object_get_string(val);
+        char *copy = NULL;
+        int n = limit_json_string_value_length(str, json_object_get_string_len(val), &copy);
+        if (copy)
+            str = copy;
+        json_object *result = utf8_validate(str, n) ? json_object_new_string_len(str, n) : json_new_win1252_string(str, n);
+        if (copy)
+            bson_free(copy);
+        return result;
+    }
+    case json_type_object: {
+        json_object *result = json_object_new_object();
+        json_object_object_foreach(val, key, sub) {
+            size_t n = strlen(key);
+            if (utf8_validate(key, n)) {
+                json_object_object_add(result, key, json_cleanup_copy(sub));
+            } else {
+                char *converted_key = zmalloc(6*n+1);
+                convert_to_win1252(key, n, converted_key);
+                json_object_object_add(result, converted_key, json_cleanup_copy(sub));
+                free(converted_key);
+            }
+        }
+        return result;
+    }
+    case json_type_array: {
+        json_object *result = json_object_new_array();
+        int n = json_object_array_length(val);
+        for (int i = 0; i < n; i++)
+            json_object_array_add(result, json_cleanup_copy(json_object_array_get_idx(val, i)));
+        return result;
+    }
+    default:
+        return json_object_get(val);
+    }
+}
+
+// returns the format byte, the uncompressed length and the lz4 compressed JSON text of val.
+// returns NULL for small values and for values which wouldn't fit into a document.
+static
+uint8_t* compress_json(json_object *val, size_t *size)
+{
+    json_object *clean = json_cleanup_copy(val);
+    const char *json = json_object_to_json_string_ext(clean, JSON_C_TO_STRING_PLAIN);
+    size_t n = strlen(json);
+    uint8_t *data = NULL;
+    if (n >= COMPRESSED_FIELD_MIN_SIZE && n <= (size_t)LZ4_MAX_INPUT_SIZE) {
+        int bound = LZ4_compressBound(n);
+        data = malloc(bound + 5);
+        assert(data);
+        int compressed_len = LZ4_compress_default(json, (char*)data + 5, n, bound);
+        if (compressed_len > 0 && compressed_len + 5 <= MAX_COMPRESSED_FIELD_SIZE) {
+            data[0] = COMPRESSED_FIELD_FORMAT_LZ4_JSON;
+            uint32_t encoded_len = htonl(n);
+            memcpy(data + 1, &encoded_len, 4);
+            *size = compressed_len + 5;
+        } else {
+            free(data);
+            data = NULL;
+        }
+    }
+    json_object_put(clean);
+    return data;
+}
+
+// compressed fields are stored as their JSON text, which is much cheaper than building
+// nested bson. small values and values which wouldn't fit into a document are converted
+// as usual.
+static
+bool bson_append_compressed_json(bson_t *b, const char *key, json_object *val)
+{
+    size_t size;
+    uint8_t *data = compress_json(val, &size);
+    if (data == NULL)
+        return false;
+    bool ok = bson_append_binary(b, key, -1, BSON_SUBTYPE_USER, data, size);
+    free(data);
+    return ok;
+}
+
+static
+void request_to_bson(const char *context, json_object *request, bson_t* b)
+{
+    if (compressed_request_fields == NULL) {
+        json_object_to_bson(context, request, b);
+        return;
+    }
+    json_object_object_foreach(request, key, val) {
+        if (zhash_lookup(compressed_request_fields, key) && bson_append_compressed_json(b, key, val))
+            continue;
+        json_key_to_bson_key(context, b, val, key);
+    }
+}
+
 static
 bool json_object_is_zero(json_object* jobj)
 {
@@ -290,12 +416,28 @@ bson_t* convert_metrics_for_indexing(json_object *request)
     return metrics_doc;
 }
 
+// request documents are queued per database and stored with one unordered bulk insert,
+// so that a writer has up to mongo_pipelined_writes inserts in flight per round trip
+typedef struct {
+    bson_t *document;
+    bson_t **metrics;      // inserted into the metrics collection once the request is stored
+    size_t num_metrics;
+} pending_request_t;
+
+typedef struct {
+    int db;
+    size_t size;
+    pending_request_t requests[];
+} pending_requests_t;
+
 static
-void add_metrics_to_metrics_collection(const char* db_name, stream_info_t* stream_info, bson_t* metrics, const char* page, const char* module, int minute, const char* rid, bson_oid_t* oid, request_writer_state_t* state)
+bson_t** metrics_documents_new(bson_t* metrics, const char* page, const char* module, int minute, const char* rid, bson_oid_t* oid, size_t *num_docs)
 {
-    mongoc_collection_t *metrics_collection = request_writer_get_metrics_collection(state, db_name, stream_info);
     size_t n = bson_count_keys(metrics);
-    bson_t *docs[n];
+    *num_docs = n;
+    if (n == 0)
+        return NULL;
+    bson_t **docs = zmalloc(n * sizeof(bson_t*));
     bson_iter_t iter;
     bson_iter_init(&iter, metrics);
     bson_t** p = docs;
@@ -320,28 +462,180 @@ void add_metrics_to_metrics_collection(const char* db_name, stream_info_t* strea
         }
         p++;
     }
+    return docs;
+}
+
+static
+void pending_requests_clear(pending_requests_t *pending)
+{
+    for (size_t i=0; i<pending->size; i++) {
+        pending_request_t *r = &pending->requests[i];
+        bson_destroy(r->document);
+        for (size_t j=0; j<r->num_metrics; j++)
+            bson_destroy(r->metrics[j]);
+        free(r->metrics);
+    }
+    pending->size = 0;
+}
+
+static
+void pending_requests_destroy(void *data)
+{
+    pending_requests_clear(data);
+    free(data);
+}
+
+static
+pending_requests_t* request_writer_pending_requests(request_writer_state_t *state, const char *db_name, int db)
+{
+    pending_requests_t *pending = zhash_lookup(state->pending_requests, db_name);
+    if (pending == NULL) {
+        pending = zmalloc(sizeof(pending_requests_t) + mongo_pipelined_writes * sizeof(pending_request_t));
+        pending->db = db;
+        int rc = zhash_insert(state->pending_requests, db_name, pending);
+        assert(rc == 0);
+        zhash_freefn(state->pending_requests, db_name, pending_requests_destroy);
+    }
+    return pending;
+}
+
+// marks the requests listed in the writeErrors of a bulk reply as failed, positions maps
+// bulk indexes to pending requests. returns the number of write errors.
+static
+size_t mark_failed_inserts(const char *db_name, const bson_t *reply, const size_t *positions, size_t n, bool *failed)
+{
+    size_t num_errors = 0;
+    bson_iter_t it, errors;
+    if (!bson_iter_init_find(&it, reply, "writeErrors") || bson_iter_type(&it) != BSON_TYPE_ARRAY
+        || !bson_iter_recurse(&it, &errors))
+        return 0;
+    while (bson_iter_next(&errors)) {
+        bson_iter_t err;
+        if (bson_iter_type(&errors) != BSON_TYPE_DOCUMENT || !bson_iter_recurse(&errors, &err))
+            continue;
+        if (!bson_iter_find(&err, "index")
+            || (bson_iter_type(&err) != BSON_TYPE_INT32 && bson_iter_type(&err) != BSON_TYPE_INT64))
+            continue;
+        int64_t index = bson_iter_as_int64(&err);
+        if (index < 0 || (size_t)index >= n || failed[positions[index]])
+            continue;
+        failed[positions[index]] = true;
+        num_errors++;
+        if (num_errors == 1 && bson_iter_recurse(&errors, &err) && bson_iter_find(&err, "errmsg")
+            && bson_iter_type(&err) == BSON_TYPE_UTF8)
+            fprintf(stderr, "[E] insert failed for request document on %s: %s\n", db_name, bson_iter_utf8(&err, NULL));
+    }
+    return num_errors;
+}
+
+static
+void request_writer_insert_pending_requests(request_writer_state_t *state, const char *db_name, pending_requests_t *pending)
+{
+    size_t n = pending->size;
+    if (n == 0)
+        return;
+
     if (!dryrun) {
-        bson_t *opts = NULL;
-        bson_t reply;
+        bool *failed = zmalloc(n * sizeof(bool));
+        size_t *positions = zmalloc(n * sizeof(size_t));
+        size_t num_failed = 0;
         bson_error_t error;
-        bool ok = mongoc_collection_insert_many(metrics_collection, (const bson_t**)docs, n, opts, &reply, &error);
-        if (!ok) {
-            size_t m;
-            char* bjs = bson_as_json(metrics, &m);
-            char *reply_str = bson_as_json(&reply, NULL);
-            fprintf(stderr,
-                    "[E] could not insert metrics on %s: (%d) %s\n"
-                    "[E] metrics document size: %zu; value: %s\n"
-                    "[E] reply: %s\n",
-                    db_name, error.code, error.message, n, bjs, reply_str);
-            bson_free(bjs);
-            bson_free(reply_str);
-            state->updates_failed++;
+
+        mongo_lease_acquire(&state->mongo_lease, pending->db);
+
+        mongoc_collection_t *requests_collection = request_writer_get_collection(state, db_name, "requests");
+        mongoc_bulk_operation_t *bulk = mongoc_collection_create_bulk_operation_with_opts(requests_collection, bulk_opts);
+        size_t num_inserts = 0;
+        for (size_t i=0; i<n; i++) {
+            bson_t *document = pending->requests[i].document;
+            if (mongoc_bulk_operation_insert_with_opts(bulk, document, NULL, &error)) {
+                positions[num_inserts++] = i;
+            } else {
+                size_t m;
+                char* bjs = bson_as_json(document, &m);
+                fprintf(stderr,
+                        "[E] insert failed for request document on %s: (%d) %s\n"
+                        "[E] document size: %zu; value: %s\n",
+                        db_name, error.code, error.message, m, bjs);
+                bson_free(bjs);
+                failed[i] = true;
+                num_failed++;
+            }
         }
+        if (num_inserts > 0) {
+            bson_t reply;
+            if (!mongoc_bulk_operation_execute(bulk, &reply, &error)) {
+                size_t num_errors = mark_failed_inserts(db_name, &reply, positions, num_inserts, failed);
+                if (num_errors == 0) {
+                    // no write errors means the bulk as a whole failed
+                    for (size_t k=0; k<num_inserts; k++)
+                        failed[positions[k]] = true;
+                    num_errors = num_inserts;
+                }
+                fprintf(stderr, "[E] %zu of %zu request inserts failed on %s: (%d) %s\n",
+                        num_errors, num_inserts, db_name, error.code, error.message);
+                num_failed += num_errors;
+            }
+            bson_destroy(&reply);
+        }
+        mongoc_bulk_operation_destroy(bulk);
+        request_writer_release_collection(requests_collection);
+        state->updates_failed += num_failed;
+
+        mongoc_collection_t *metrics_collection = NULL;
+        mongoc_bulk_operation_t *metrics_bulk = NULL;
+        for (size_t i=0; i<n; i++) {
+            pending_request_t *r = &pending->requests[i];
+            if (failed[i] || r->num_metrics == 0)
+                continue;
+            if (metrics_bulk == NULL) {
+                metrics_collection = request_writer_get_collection(state, db_name, "metrics");
+                metrics_bulk = mongoc_collection_create_bulk_operation_with_opts(metrics_collection, bulk_opts);
+            }
+            for (size_t j=0; j<r->num_metrics; j++)
+                mongoc_bulk_operation_insert_with_opts(metrics_bulk, r->metrics[j], NULL, NULL);
+        }
+        if (metrics_bulk) {
+            bson_t reply;
+            if (!mongoc_bulk_operation_execute(metrics_bulk, &reply, &error)) {
+                char *reply_str = bson_as_json(&reply, NULL);
+                fprintf(stderr,
+                        "[E] could not insert metrics on %s: (%d) %s\n"
+                        "[E] reply: %s\n",
+                        db_name, error.code, error.message, reply_str);
+                bson_free(reply_str);
+                state->updates_failed++;
+            }
+            bson_destroy(&reply);
+            mongoc_bulk_operation_destroy(metrics_bulk);
+            request_writer_release_collection(metrics_collection);
+        }
+
+        mongo_lease_release(&state->mongo_lease);
+        free(positions);
+        free(failed);
     }
-    for (size_t i=0; i<n; i++) {
-        bson_destroy(docs[i]);
+
+    pending_requests_clear(pending);
+}
+
+// called whenever the pull socket runs dry, so requests are never held back longer
+// than it takes to process the messages which arrived together with them
+static
+void request_writer_flush_requests(request_writer_state_t *state)
+{
+    if (zhash_size(state->pending_requests) == 0)
+        return;
+    int64_t start_time_us = zclock_usecs();
+    pending_requests_t *pending = zhash_first(state->pending_requests);
+    while (pending) {
+        request_writer_insert_pending_requests(state, zhash_cursor(state->pending_requests), pending);
+        pending = zhash_next(state->pending_requests);
     }
+    // database names change daily, so don't keep the batches around
+    zhash_destroy(&state->pending_requests);
+    state->pending_requests = zhash_new();
+    state->update_time += zclock_usecs() - start_time_us;
 }
 
 static
@@ -355,7 +649,6 @@ json_object* store_request(const char* db_name, stream_info_t* stream_info, json
         printf("[D] metrics document. size: %zu; value: %s\n", n, bs);
         bson_free(bs);
     }
-    mongoc_collection_t *requests_collection = request_writer_get_request_collection(state, db_name, stream_info);
     bson_t *document = bson_sized_new(2048);
 
     json_object *request_id_obj;
@@ -386,7 +679,7 @@ json_object* store_request(const char* db_name, stream_info_t* stream_info, json
         size_t n = 1024;
         char context[n];
         snprintf(context, n, "%s:%s", db_name, request_id);
-        json_object_to_bson(context, request, document);
+        request_to_bson(context, request, document);
     }
 
     if (0) {
@@ -396,34 +689,26 @@ json_object* store_request(const char* db_name, stream_info_t* stream_info, json
         bson_free(bs);
     }
 
-    bool update_failed = false;
-    if (!dryrun) {
-        bson_error_t error;
-        if (!mongoc_collection_insert(requests_collection, MONGOC_INSERT_NONE, document, wc_no_wait, &error)) {
-            size_t n;
-            char* bjs = bson_as_json(document, &n);
-            fprintf(stderr,
-                    "[E] insert failed for request document with rid '%s' on %s: (%d) %s\n"
-                    "[E] document size: %zu; value: %s\n",
-                    request_id, db_name, error.code, error.message, n, bjs);
-            bson_free(bjs);
-            update_failed = true;
-            state->updates_failed++;
-        }
-    }
-    bson_destroy(document);
+    pending_requests_t *pending = request_writer_pending_requests(state, db_name, stream_info->db);
+    pending_request_t *r = &pending->requests[pending->size++];
+    r->document = document;
+    r->metrics = NULL;
+    r->num_metrics = 0;
 
     json_object *page_obj;
-    if (!update_failed && json_object_object_get_ex(request, "page", &page_obj)) {
+    if (json_object_object_get_ex(request, "page", &page_obj)) {
         const char* page = json_object_get_string(page_obj);
         json_object *minute_obj;
         if (json_object_object_get_ex(request, "minute", &minute_obj)) {
             int minute = json_object_get_int(minute_obj);
             if (sampling_reason & (SAMPLE_SLOW_REQUEST|SAMPLE_HEAP_GROWTH))
-                add_metrics_to_metrics_collection(db_name, stream_info, metrics, page, module, minute, request_id, oid, state);
+                r->metrics = metrics_documents_new(metrics, page, module, minute, request_id, oid, &r->num_metrics);
         }
     }
 
+    if (pending->size >= (size_t)mongo_pipelined_writes)
+        request_writer_insert_pending_requests(state, db_name, pending);
+
     if (oid)
         free(oid);
     bson_destroy(metrics);
@@ -434,7 +719,7 @@ json_object* store_request(const char* db_name, stream_info_t* stream_info, json
 static
 void store_js_exception(const char* db_name, stream_info_t *stream_info, json_object* request, request_writer_state_t* state)
 {
-    mongoc_collection_t *jse_collection = request_writer_get_jse_collection(state, db_name, stream_info);
+    mongoc_collection_t *jse_collection = request_writer_get_collection(state, db_name, "js_exceptions");
     bson_t *document = bson_sized_new(1024);
     json_object_to_bson("js_exception", request, document);
 
@@ -452,12 +737,125 @@ void store_js_exception(const char* db_name, stream_info_t *stream_info, json_ob
         }
     }
     bson_destroy(document);
+    request_writer_release_collection(jse_collection);
+}
+
+// returns the value of the exemplars counter of the updated group document, or -1 on failure
+static
+int64_t reserve_js_exception_exemplars(mongoc_collection_t *collection, const char *db_name, const char *fingerprint,
+                                       bson_t *selector, bson_t *update, request_writer_state_t* state)
+{
+    bson_t *fields = BCON_NEW("exemplars", BCON_INT32(1));
+    bson_t reply;
+    bson_error_t error;
+    int64_t exemplars = -1;
+    if (mongoc_collection_find_and_modify(collection, selector, NULL, update, fields, false, true, true, &reply, &error)) {
+        bson_iter_t iter, value;
+        if (bson_iter_init_find(&iter, &reply, "value") && bson_iter_type(&iter) == BSON_TYPE_DOCUMENT
+            && bson_iter_recurse(&iter, &value) && bson_iter_find(&value, "exemplars"))
+            exemplars = bson_iter_as_int64(&value);
+    } else {
+        fprintf(stderr, "[E] update failed for exception group %s on %s: (%d) %s\n",
+                fingerprint, db_name, error.code, error.message);
+        state->updates_failed++;
+    }
+    bson_destroy(&reply);
+    bson_destroy(fields);
+    return exemplars;
+}
+
+// one document per fingerprint and day, counting how often the exception occurred. the
+// exemplars counter of the document caps the number of exceptions stored per fingerprint
+// and day at max_js_exception_exemplars, across all parsers and ticks. as this requires an
+// acknowledged write, groups known to be full are only counted.
+static
+void store_js_exception_group(const char* db_name, stream_info_t *stream_info, const char *module, json_object* group, request_writer_state_t* state)
+{
+    json_object *obj;
+    const char *fingerprint = json_object_object_get_ex(group, "fingerprint", &obj) ? json_object_get_string(obj) : "";
+    const char *description = json_object_object_get_ex(group, "description", &obj) ? json_object_get_string(obj) : "";
+    const char *page = json_object_object_get_ex(group, "page", &obj) ? json_object_get_string(obj) : "";
+    int64_t count = json_object_object_get_ex(group, "count", &obj) ? json_object_get_int64(obj) : 0;
+    int64_t first_seen = json_object_object_get_ex(group, "first_seen", &obj) ? json_object_get_int64(obj) : 0;
+    int64_t last_seen = json_object_object_get_ex(group, "last_seen", &obj) ? json_object_get_int64(obj) : 0;
+
+    json_object *exemplars = NULL;
+    size_t offered = 0;
+    if (json_object_object_get_ex(group, "exemplars", &exemplars))
+        offered = json_object_array_length(exemplars);
+
+    char key[1024];
+    snprintf(key, sizeof(key), "%s/%s", db_name, fingerprint);
+    if (offered > 0 && zhash_lookup(state->full_js_exception_groups, key))
+        offered = 0;
+
+    mongoc_collection_t *groups_collection = request_writer_get_collection(state, db_name, "js_exception_groups");
+    bson_t *selector = bson_new();
+    assert(bson_append_utf8(selector, "_id", 3, fingerprint, -1));
+
+    bson_t *document = bson_new();
+    bson_t child;
+    bson_append_document_begin(document, "$inc", 4, &child);
+    assert(bson_append_int64(&child, "count", 5, count));
+    if (offered > 0)
+        assert(bson_append_int64(&child, "exemplars", 9, offered));
+    bson_append_document_end(document, &child);
+    bson_append_document_begin(document, "$min", 4, &child);
+    assert(bson_append_date_time(&child, "first_seen", 10, first_seen));
+    bson_append_document_end(document, &child);
+    bson_append_document_begin(document, "$max", 4, &child);
+    assert(bson_append_date_time(&child, "last_seen", 9, last_seen));
+    bson_append_document_end(document, &child);
+    bson_append_document_begin(document, "$setOnInsert", 12, &child);
+    assert(bson_append_utf8(&child, "description", 11, description, -1));
+    assert(bson_append_utf8(&child, "page", 4, page, -1));
+    assert(bson_append_utf8(&child, "module", 6, module, -1));
+    bson_append_document_end(document, &child);
+
+    size_t granted = 0;
+    if (!dryrun) {
+        bson_error_t error;
+        if (offered > 0) {
+            int64_t reserved = reserve_js_exception_exemplars(groups_collection, db_name, fingerprint, selector, document, state);
+            int64_t before = reserved - offered;
+            if (reserved >= 0 && before < (int64_t)max_js_exception_exemplars) {
+                granted = max_js_exception_exemplars - before;
+                if (granted > offered)
+                    granted = offered;
+            }
+            if (reserved >= (int64_t)max_js_exception_exemplars) {
+                if (zhash_size(state->full_js_exception_groups) >= MAX_FULL_JS_EXCEPTION_GROUPS) {
+                    zhash_destroy(&state->full_js_exception_groups);
+                    state->full_js_exception_groups = zhash_new();
+                }
+                zhash_insert(state->full_js_exception_groups, key, (void*)1);
+            }
+        } else if (!mongoc_collection_update(groups_collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
+            size_t n;
+            char* bjs = bson_as_json(document, &n);
+            fprintf(stderr,
+                    "[E] update failed for exception group %s on %s: (%d) %s\n"
+                    "[E] document size: %zu; value: %s\n",
+                    fingerprint, db_name, error.code, error.message, n, bjs);
+            bson_free(bjs);
+            state->updates_failed++;
+        }
+    }
+    bson_destroy(selector);
+    bson_destroy(document);
+    request_writer_release_collection(groups_collection);
+
+    for (size_t i = 0; i < granted; i++) {
+        json_object *request = json_object_array_get_idx(exemplars, i);
+        json_object_object_add(request, "fingerprint", json_object_new_string(fingerprint));
+        store_js_exception(db_name, stream_info, request, state);
+    }
 }
 
 static
 void store_event(const char* db_name, stream_info_t *stream_info, json_object* request, request_writer_state_t* state)
 {
-    mongoc_collection_t *events_collection = request_writer_get_events_collection(state, db_name, stream_info);
+    mongoc_collection_t *events_collection = request_writer_get_collection(state, db_name, "events");
     bson_t *document = bson_sized_new(1024);
     json_object_to_bson("event", request, document);
 
@@ -508,6 +906,7 @@ void store_event(const char* db_name, stream_info_t *stream_info, json_object* r
         }
     }
     bson_destroy(document);
+    request_writer_release_collection(events_collection);
 }
 
 static
@@ -596,6 +995,7 @@ void handle_request_msg(zmsg_t* msg, request_writer_state_t* state)
     zframe_t *body_frame = zmsg_next(msg);
     zframe_t *stream_frame = zmsg_next(msg);
     zframe_t *sampling_frame = zmsg_next(msg);
+    zframe_t *trace_frame = zmsg_next(msg);
 
     size_t db_name_len = zframe_size(db_frame);
     char db_name[db_name_len+1];
@@ -621,14 +1021,30 @@ void handle_request_msg(zmsg_t* msg, request_writer_state_t* state)
     assert(zframe_size(type_frame) == 1);
     char task_type = *((char*)zframe_data(type_frame));
 
+    // hold the client only while talking to the database, so that a pool can serve
+    // more writers and updaters than it has connections. requests lease it when their
+    // batch gets inserted.
+    if (!dryrun && task_type != 'r')
+        mongo_lease_acquire(&state->mongo_lease, stream_info->db);
+
     switch (task_type) {
     case 'r':
         memcpy(&sampling_reason, zframe_data(sampling_frame), sizeof(sampling_reason_t));
         request_id = store_request(db_name, stream_info, request, module, sampling_reason, state);
         request_writer_publish_error(stream_info, module, request, state, request_id);
+        if (trace_frame && zframe_size(trace_frame) == sizeof(latency_trace_t)) {
+            latency_trace_t trace;
+            memcpy(&trace, zframe_data(trace_frame), sizeof(latency_trace_t));
+            int64_t now = zclock_time();
+            importer_prometheus_client_observe_latency(stream_info, LATENCY_STAGE_WRITER, trace.created_ms, now);
+            if (debug)
+                printf("[D] %s: latency trace %s: parsed +%"PRId64"ms, processed +%"PRId64"ms, stored +%"PRId64"ms\n",
+                       state->me, db_name, trace.parsed_ms - trace.created_ms,
+                       trace.processed_ms - trace.created_ms, now - trace.created_ms);
+        }
         break;
     case 'j':
-        store_js_exception(db_name, stream_info, request, state);
+        store_js_exception_group(db_name, stream_info, module, request, state);
         break;
     case 'e':
         store_event(db_name, stream_info, request, state);
@@ -637,6 +1053,9 @@ void handle_request_msg(zmsg_t* msg, request_writer_state_t* state)
         fprintf(stderr, "[E] unknown task type for request_writer: %c\n", task_type);
     }
 
+    if (!dryrun && task_type != 'r')
+        mongo_lease_release(&state->mongo_lease);
+
     json_object_put(request);
     release_stream_info(stream_info);
 }
@@ -650,14 +1069,8 @@ request_writer_state_t* request_writer_state_new(zconfig_t *config, size_t id)
     snprintf(state->me, 16, "writer[%zu]", id);
     state->pull_socket = request_writer_pull_socket_new(id);
     state->live_stream_socket = live_stream_client_socket_new(config);
-    for (int i=0; i<num_databases; i++) {
-        state->mongo_clients[i] = mongoc_client_new(databases[i]);
-        assert(state->mongo_clients[i]);
-    }
-    state->request_collections = zhash_new();
-    state->metrics_collections = zhash_new();
-    state->jse_collections = zhash_new();
-    state->events_collections = zhash_new();
+    state->full_js_exception_groups = zhash_new();
+    state->pending_requests = zhash_new();
     return state;
 }
 
@@ -668,17 +1081,41 @@ void request_writer_state_destroy(request_writer_state_t **state_p)
     // must not destroy the pipe, as it's owned by the actor
     zsock_destroy(&state->pull_socket);
     zsock_destroy(&state->live_stream_socket);
-    zhash_destroy(&state->request_collections);
-    zhash_destroy(&state->metrics_collections);
-    zhash_destroy(&state->jse_collections);
-    zhash_destroy(&state->events_collections);
-    for (int i=0; i<num_databases; i++) {
-        mongoc_client_destroy(state->mongo_clients[i]);
-    }
+    zhash_destroy(&state->full_js_exception_groups);
+    zhash_destroy(&state->pending_requests);
     free(state);
     *state_p = NULL;
 }
 
+static
+void request_writer_process_msg(request_writer_state_t *state, zmsg_t *msg)
+{
+    int64_t start_time_us = zclock_usecs();
+    handle_request_msg(msg, state);
+    zmsg_destroy(&msg);
+    __atomic_sub_fetch(&queued_inserts, 1, __ATOMIC_SEQ_CST);
+    int64_t end_time_us = zclock_usecs();
+    state->updates_count++;
+    state->update_time += end_time_us - start_time_us;
+}
+
+// all parsers have disconnected from us when the controller sends "drain", so we only
+// need to store what they had sent before
+static
+void request_writer_drain(request_writer_state_t *state)
+{
+    zmsg_t *msg;
+    while ((msg = zmsg_recv_nowait(state->pull_socket)))
+        request_writer_process_msg(state, msg);
+    request_writer_flush_requests(state);
+    importer_prometheus_client_count_inserts(state->updates_count);
+    importer_prometheus_client_time_inserts(((double)state->update_time)/1000000);
+    importer_prometheus_client_count_inserts_failed(state->updates_failed);
+    if (!quiet)
+        printf("[I] writer [%zu]: drained\n", state->id);
+    zsock_signal(state->pipe, 0);
+}
+
 static void request_writer(zsock_t *pipe, void *args)
 {
     request_writer_state_t *state = (request_writer_state_t*)args;
@@ -689,7 +1126,6 @@ static void request_writer(zsock_t *pipe, void *args)
     if (!quiet)
         printf("[I] writer [%zu]: starting\n", id);
 
-    size_t ticks = 0;
     // signal readyiness after sockets have been created
     zsock_signal(pipe, 0);
 
@@ -707,32 +1143,20 @@ static void request_writer(zsock_t *pipe, void *args)
             char *cmd = zmsg_popstr(msg);
             zmsg_destroy(&msg);
             if (streq(cmd, "tick")) {
+                request_writer_flush_requests(state);
                 if (verbose && (state->updates_count || state->update_time))
                     printf("[I] writer [%zu]: tick (%d requests, %d ms)\n", id, state->updates_count, state->update_time/1000);
                 importer_prometheus_client_count_inserts(state->updates_count);
                 importer_prometheus_client_time_inserts(((double)state->update_time)/1000000);
                 importer_prometheus_client_count_inserts_failed(state->updates_failed);
                 importer_prometheus_client_record_rusage_writer(state->id);
-                if (ticks++ % PING_INTERVAL == 0) {
-                    // ping mongodb to reestablish connection if it got lost
-                    for (int i=0; i<num_databases; i++) {
-                        mongo_client_ping(state->mongo_clients[i]);
-                    }
-                }
-                // free collection pointers every hour
-                if (ticks % COLLECTION_REFRESH_INTERVAL == COLLECTION_REFRESH_INTERVAL - id - 1) {
-                    printf("[I] writer [%zu]: freeing request collections\n", id);
-                    zhash_destroy(&state->request_collections);
-                    zhash_destroy(&state->jse_collections);
-                    zhash_destroy(&state->events_collections);
-                    state->request_collections = zhash_new();
-                    state->jse_collections = zhash_new();
-                    state->events_collections = zhash_new();
-                }
                 state->updates_count = 0;
                 state->update_time = 0;
                 state->updates_failed = 0;
                 free(cmd);
+            } else if (streq(cmd, "drain")) {
+                request_writer_drain(state);
+                free(cmd);
             } else if (streq(cmd, "$TERM")) {
                 // printf("[D] writer [%zu]: received $TERM command\n", id);
                 free(cmd);
@@ -743,15 +1167,10 @@ static void request_writer(zsock_t *pipe, void *args)
             }
         } else if (socket == state->pull_socket) {
             msg = zmsg_recv(state->pull_socket);
-            if (msg != NULL) {
-                int64_t start_time_us = zclock_usecs();
-                handle_request_msg(msg, state);
-                zmsg_destroy(&msg);
-                __atomic_sub_fetch(&queued_inserts, 1, __ATOMIC_SEQ_CST);
-                int64_t end_time_us = zclock_usecs();
-                state->updates_count++;
-                state->update_time += end_time_us - start_time_us;
-            }
+            if (msg != NULL)
+                request_writer_process_msg(state, msg);
+            if (!(zsock_events(state->pull_socket) & ZMQ_POLLIN))
+                request_writer_flush_requests(state);
         } else if (socket) {
             // if socket is not null, something is horribly broken
             printf("[E] writer [%zu]: broken poller. committing suicide.\n", id);
@@ -763,6 +1182,8 @@ static void request_writer(zsock_t *pipe, void *args)
         }
     }
 
+    request_writer_flush_requests(state);
+
     if (!quiet)
         printf("[I] writer [%zu]: shutting down\n", id);
 
@@ -777,3 +1198,81 @@ zactor_t* request_writer_new(zconfig_t *config, size_t id)
     request_writer_state_t *state = request_writer_state_new(config, id);
     return zactor_new(request_writer, state);
 }
+
+static
+json_object* test_decompress_json(const uint8_t *data, size_t size)
+{
+    assert(size > 5 && data[0] == COMPRESSED_FIELD_FORMAT_LZ4_JSON);
+    uint32_t n;
+    memcpy(&n, data + 1, 4);
+    n = ntohl(n);
+    char *json = zmalloc(n + 1);
+    int rc = LZ4_decompress_safe((const char*)data + 5, json, size - 5, n);
+    assert(rc == (int)n);
+    json_object *val = json_tokener_parse(json);
+    assert(val);
+    free(json);
+    return val;
+}
+
+static void test_compressed_field_round_trip (int verbose)
+{
+    size_t size;
+    json_object *small = json_object_new_string("small");
+    assert(compress_json(small, &size) == NULL);
+    json_object_put(small);
+
+    char *big = zmalloc(MAX_STRING_VALUE_SIZE + 100);
+    memset(big, 'x', MAX_STRING_VALUE_SIZE + 99);
+    json_object *val = json_object_new_object();
+    json_object_object_add(val, "M\xFCller", json_object_new_string("Gr\xFC\xDF" "e"));
+    json_object_object_add(val, "big", json_object_new_string(big));
+    json_object *lines = json_object_new_array();
+    json_object_array_add(lines, json_object_new_string("valid"));
+    json_object_array_add(lines, json_object_new_string("caf\xE9"));
+    json_object_object_add(val, "lines", lines);
+
+    uint8_t *data = compress_json(val, &size);
+    assert(data);
+    json_object *copy = test_decompress_json(data, size);
+    json_object *obj;
+    assert(json_object_object_get_ex(copy, "M\xC3\xBCller", &obj));
+    assert(streq(json_object_get_string(obj), "Gr\xC3\xBC\xC3\x9F" "e"));
+    assert(json_object_object_get_ex(copy, "big", &obj));
+    assert(json_object_get_string_len(obj) == MAX_STRING_VALUE_SIZE + 15);
+    assert(streq(json_object_get_string(obj) + MAX_STRING_VALUE_SIZE, " ...[TRUNCATED]"));
+    assert(json_object_object_get_ex(copy, "lines", &obj));
+    assert(streq(json_object_get_string(json_object_array_get_idx(obj, 0)), "valid"));
+    assert(streq(json_object_get_string(json_object_array_get_idx(obj, 1)), "caf\xC3\xA9"));
+    json_object_put(copy);
+    free(data);
+
+    // the request itself is left alone
+    assert(json_object_object_get_ex(val, "big", &obj));
+    assert(json_object_get_string_len(obj) == MAX_STRING_VALUE_SIZE + 99);
+    json_object_put(val);
+
+    // clean values are compressed as they are
+    memset(big, 'x', 2000);
+    big[2000] = '\0';
+    val = json_object_new_string(big);
+    data = compress_json(val, &size);
+    assert(data);
+    copy = test_decompress_json(data, size);
+    assert(streq(json_object_get_string(copy), big));
+    json_object_put(copy);
+    json_object_put(val);
+    free(data);
+    free(big);
+}
+
+void requestwriter_test (int verbose)
+{
+    printf (" * importer-requestwriter: ");
+    if (verbose)
+        printf("\n");
+
+    test_compressed_field_round_trip (verbose);
+
+    printf ("OK\n");
+}
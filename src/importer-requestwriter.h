@@ -7,7 +7,18 @@
 extern "C" {
 #endif
 
+// top level request fields stored as a single lz4 compressed binary value instead of a
+// nested document. NULL stores all fields uncompressed.
+extern zhash_t *compressed_request_fields;
+
+// binary values of compressed fields have subtype BSON_SUBTYPE_USER and start with a
+// format byte and the uncompressed length (4 bytes, network byte order)
+#define COMPRESSED_FIELD_FORMAT_LZ4_JSON 1
+#define COMPRESSED_FIELD_MIN_SIZE 1024
+#define MAX_COMPRESSED_FIELD_SIZE (4*1024*1024)
+
 extern zactor_t* request_writer_new(zconfig_t *config, size_t id);
+extern void requestwriter_test (int verbose);
 
 #ifdef __cplusplus
 }
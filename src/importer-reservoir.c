@@ -0,0 +1,418 @@
+#include "importer-reservoir.h"
+#include "importer-prometheus-client.h"
+
+// strata beyond the budget share a single stratum, which bounds the number of held requests.
+// it takes the last slot of the budget.
+#define OVERFLOW_STRATUM ""
+
+static
+void reservoir_item_destroy(reservoir_item_t *item)
+{
+    free(item->db_name);
+    free(item->module);
+    json_object_put(item->request);
+}
+
+static
+void reservoir_stratum_destroy(void *stratum)
+{
+    reservoir_stratum_t *s = stratum;
+    for (size_t i = 0; i < s->size; i++)
+        reservoir_item_destroy(&s->items[i]);
+    free(s->items);
+    free(s);
+}
+
+static
+void reservoir_destroy(void *reservoir)
+{
+    request_reservoir_t *r = reservoir;
+    zhash_destroy(&r->strata);
+    release_stream_info(r->stream_info);
+    free(r);
+}
+
+// all parsers get an equal share of the inserts per second configured for the stream
+static
+size_t reservoir_budget(stream_info_t *stream_info)
+{
+    int64_t cap = __atomic_load_n(&stream_info->requests_inserted->cap, __ATOMIC_SEQ_CST);
+    unsigned long parsers = __atomic_load_n(&num_parsers, __ATOMIC_RELAXED);
+    if (cap <= 0)
+        return 0;
+    if (parsers == 0)
+        parsers = 1;
+    return (cap + parsers - 1) / parsers;
+}
+
+request_reservoir_t* reservoirs_lookup(zhash_t *reservoirs, stream_info_t *stream_info)
+{
+    request_reservoir_t *reservoir = zhash_lookup(reservoirs, stream_info->key);
+    if (reservoir == NULL) {
+        reservoir = zmalloc(sizeof(request_reservoir_t));
+        reference_stream_info(stream_info);
+        reservoir->stream_info = stream_info;
+        reservoir->strata = zhash_new();
+        reservoir->budget = reservoir_budget(stream_info);
+        int rc = zhash_insert(reservoirs, stream_info->key, reservoir);
+        assert(rc == 0);
+        zhash_freefn(reservoirs, stream_info->key, reservoir_destroy);
+    }
+    return reservoir;
+}
+
+static
+reservoir_stratum_t* reservoir_stratum(request_reservoir_t *self, const char *page, sampling_reason_t reason)
+{
+    char key[1024];
+    snprintf(key, sizeof(key), "%x-%s", reason, page);
+    reservoir_stratum_t *stratum = zhash_lookup(self->strata, key);
+    if (stratum)
+        return stratum;
+    if (zhash_size(self->strata) + 1 >= self->budget) {
+        strcpy(key, OVERFLOW_STRATUM);
+        stratum = zhash_lookup(self->strata, key);
+        if (stratum)
+            return stratum;
+    }
+    stratum = zmalloc(sizeof(reservoir_stratum_t));
+    int rc = zhash_insert(self->strata, key, stratum);
+    assert(rc == 0);
+    zhash_freefn(self->strata, key, reservoir_stratum_destroy);
+    return stratum;
+}
+
+// takes a reference on request if it is kept
+void reservoir_offer(request_reservoir_t *self, const char *db_name, const char *page, const char *module,
+                     json_object *request, sampling_reason_t reason, latency_trace_t *trace)
+{
+    self->offered++;
+    if (self->budget == 0)
+        return;
+
+    reservoir_stratum_t *stratum = reservoir_stratum(self, page, reason);
+    stratum->seen++;
+
+    // strata share the budget. strata which filled up while there were fewer of them
+    // keep their size, the surplus is removed when we choose the requests to store.
+    size_t share = self->budget / zhash_size(self->strata);
+    if (share == 0)
+        share = 1;
+
+    reservoir_item_t *item;
+    if (stratum->size < share) {
+        if (stratum->size == stratum->capacity) {
+            stratum->capacity = stratum->capacity ? 2 * stratum->capacity : 4;
+            stratum->items = realloc(stratum->items, stratum->capacity * sizeof(reservoir_item_t));
+            assert(stratum->items);
+        }
+        item = &stratum->items[stratum->size++];
+    } else {
+        // algorithm R: the new request replaces a random one with probability size/seen
+        uint64_t j = random() % stratum->seen;
+        if (j >= stratum->size)
+            return;
+        item = &stratum->items[j];
+        reservoir_item_destroy(item);
+    }
+
+    item->db_name = strdup(db_name);
+    item->module = strdup(module);
+    item->request = json_object_get(request);
+    item->reason = reason;
+    item->traced = trace != NULL;
+    if (trace)
+        item->trace = *trace;
+}
+
+static
+bool reservoir_send(stream_info_t *stream_info, reservoir_item_t *item, zsock_t *socket)
+{
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, item->db_name);
+    zmsg_addstr(msg, "r");
+    zmsg_addstr(msg, item->module);
+    zmsg_addptr(msg, item->request);
+    zmsg_addptr(msg, stream_info);
+    reference_stream_info(stream_info);
+    zmsg_addmem(msg, &item->reason, sizeof(sampling_reason_t));
+    if (item->traced)
+        zmsg_addmem(msg, &item->trace, sizeof(latency_trace_t));
+    if (zmsg_send_with_retry(&msg, socket)) {
+        release_stream_info(stream_info);
+        return false;
+    }
+    // the writer owns the request now
+    item->request = NULL;
+    __atomic_add_fetch(&queued_inserts, 1, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+insert_pacer_t* insert_pacer_new()
+{
+    insert_pacer_t *pacer = zmalloc(sizeof(insert_pacer_t));
+    pacer->inserts = zlist_new();
+    return pacer;
+}
+
+static
+void paced_insert_destroy(paced_insert_t **insert_p)
+{
+    paced_insert_t *insert = *insert_p;
+    reservoir_item_destroy(&insert->item);
+    release_stream_info(insert->stream_info);
+    free(insert);
+    *insert_p = NULL;
+}
+
+void insert_pacer_destroy(insert_pacer_t **pacer_p)
+{
+    insert_pacer_t *pacer = *pacer_p;
+    paced_insert_t *insert;
+    while ((insert = zlist_pop(pacer->inserts)))
+        paced_insert_destroy(&insert);
+    zlist_destroy(&pacer->inserts);
+    free(pacer);
+    *pacer_p = NULL;
+}
+
+// the first insert is due right away, the others follow at equal intervals
+static
+size_t insert_pacer_due(insert_pacer_t *pacer, int64_t now)
+{
+    int64_t elapsed = now - pacer->started;
+    if (elapsed >= RESERVOIR_PACING_INTERVAL)
+        return pacer->chosen;
+    size_t due = pacer->chosen * elapsed / RESERVOIR_PACING_INTERVAL + 1;
+    return due < pacer->chosen ? due : pacer->chosen;
+}
+
+static
+int insert_pacer_timeout(insert_pacer_t *pacer, int64_t now)
+{
+    size_t sent = pacer->chosen - zlist_size(pacer->inserts);
+    if (sent == pacer->chosen)
+        return -1;
+    int64_t next = pacer->started + (sent * RESERVOIR_PACING_INTERVAL + pacer->chosen - 1) / pacer->chosen;
+    return next > now ? next - now : 0;
+}
+
+static
+void insert_pacer_send(insert_pacer_t *pacer, size_t n, zsock_t *socket)
+{
+    paced_insert_t *insert;
+    while (n-- > 0 && (insert = zlist_pop(pacer->inserts))) {
+        if (reservoir_send(insert->stream_info, &insert->item, socket))
+            importer_prometheus_client_count_inserts_for_stream(insert->stream_info, 1);
+        paced_insert_destroy(&insert);
+    }
+}
+
+int insert_pacer_send_due(insert_pacer_t *pacer, zsock_t *socket)
+{
+    if (zlist_size(pacer->inserts) == 0)
+        return -1;
+    int64_t now = zclock_mono();
+    size_t sent = pacer->chosen - zlist_size(pacer->inserts);
+    size_t due = insert_pacer_due(pacer, now);
+    if (due > sent)
+        insert_pacer_send(pacer, due - sent, socket);
+    return insert_pacer_timeout(pacer, now);
+}
+
+void insert_pacer_send_all(insert_pacer_t *pacer, zsock_t *socket)
+{
+    insert_pacer_send(pacer, zlist_size(pacer->inserts), socket);
+}
+
+static
+int stratum_size_cmp(const void *a, const void *b)
+{
+    const reservoir_stratum_t *x = *(reservoir_stratum_t**)a, *y = *(reservoir_stratum_t**)b;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    return 0;
+}
+
+static
+size_t reservoir_held(request_reservoir_t *self)
+{
+    size_t held = 0;
+    reservoir_stratum_t *stratum = zhash_first(self->strata);
+    while (stratum) {
+        held += stratum->size;
+        stratum = zhash_next(self->strata);
+    }
+    return held;
+}
+
+// moves up to granted requests to the pacer. small strata are served first, and the share
+// they don't need is passed on to the larger ones. returns the number of requests chosen.
+static
+size_t reservoir_choose(request_reservoir_t *self, size_t granted, insert_pacer_t *pacer)
+{
+    size_t num_strata = zhash_size(self->strata);
+    reservoir_stratum_t **strata = zmalloc((num_strata + 1) * sizeof(reservoir_stratum_t*));
+    size_t i = 0;
+    reservoir_stratum_t *stratum = zhash_first(self->strata);
+    while (stratum) {
+        strata[i++] = stratum;
+        stratum = zhash_next(self->strata);
+    }
+    qsort(strata, num_strata, sizeof(reservoir_stratum_t*), stratum_size_cmp);
+
+    size_t remaining = granted, chosen = 0;
+    for (i = 0; i < num_strata; i++) {
+        stratum = strata[i];
+        size_t take = remaining / (num_strata - i);
+        if (take > stratum->size)
+            take = stratum->size;
+        remaining -= take;
+        // partial fisher-yates shuffle picks take random items
+        for (size_t t = 0; t < take; t++) {
+            size_t j = t + random() % (stratum->size - t);
+            reservoir_item_t tmp = stratum->items[t];
+            stratum->items[t] = stratum->items[j];
+            stratum->items[j] = tmp;
+            paced_insert_t *insert = zmalloc(sizeof(paced_insert_t));
+            reference_stream_info(self->stream_info);
+            insert->stream_info = self->stream_info;
+            insert->item = stratum->items[t];
+            memset(&stratum->items[t], 0, sizeof(reservoir_item_t));
+            zlist_append(pacer->inserts, insert);
+            chosen++;
+        }
+    }
+    free(strata);
+    return chosen;
+}
+
+// stores as many requests as the stream budget grants us
+static
+void reservoir_flush(request_reservoir_t *self, insert_pacer_t *pacer)
+{
+    size_t held = reservoir_held(self);
+    size_t granted = held ? claim_request_inserts(self->stream_info, held) : 0;
+    size_t chosen = reservoir_choose(self, granted, pacer);
+    pacer->chosen += chosen;
+    if (self->offered > chosen)
+        importer_prometheus_client_count_throttled_inserts_for_stream(self->stream_info, self->offered - chosen);
+}
+
+// called at the end of every tick. reservoirs are recreated when the next request arrives,
+// so we don't hold on to streams which have been removed from the config.
+void reservoirs_flush(zhash_t *reservoirs, insert_pacer_t *pacer, zsock_t *socket)
+{
+    insert_pacer_send_all(pacer, socket);
+    pacer->chosen = 0;
+    pacer->started = zclock_mono();
+
+    request_reservoir_t *reservoir = zhash_first(reservoirs);
+    while (reservoir) {
+        reservoir_flush(reservoir, pacer);
+        reservoir = zhash_next(reservoirs);
+    }
+    while ((reservoir = zhash_first(reservoirs)))
+        zhash_delete(reservoirs, zhash_cursor(reservoirs));
+}
+
+static
+stream_info_t* test_stream_info_new(int64_t cap)
+{
+    stream_info_t *stream_info = zmalloc(sizeof(stream_info_t));
+    stream_info->ref_count = 1;
+    stream_info->key = strdup("test-reservoir");
+    stream_info->requests_inserted = zmalloc(sizeof(requests_inserted_t));
+    stream_info->requests_inserted->cap = cap;
+    return stream_info;
+}
+
+static
+void test_stream_info_destroy(stream_info_t *stream_info)
+{
+    assert(stream_info->ref_count == 1);
+    free(stream_info->requests_inserted);
+    free(stream_info->key);
+    free(stream_info);
+}
+
+static void test_reservoir_strata (int verbose)
+{
+    unsigned long parsers = num_parsers;
+    num_parsers = 1;
+    stream_info_t *stream_info = test_stream_info_new(4);
+    zhash_t *reservoirs = zhash_new();
+    request_reservoir_t *reservoir = reservoirs_lookup(reservoirs, stream_info);
+    assert(reservoir->budget == 4);
+
+    // the overflow stratum counts against the budget
+    for (int i = 0; i < 10; i++) {
+        char page[32];
+        snprintf(page, sizeof(page), "Page#%d", i);
+        json_object *request = json_object_new_object();
+        reservoir_offer(reservoir, "logjam-test-reservoir-2026-10-19", page, "::Page", request, SAMPLE_500, NULL);
+        json_object_put(request);
+    }
+    assert(reservoir->offered == 10);
+    assert(zhash_size(reservoir->strata) == 4);
+    assert(reservoir_held(reservoir) == 4);
+
+    // no more than granted get chosen
+    insert_pacer_t *pacer = insert_pacer_new();
+    assert(reservoir_choose(reservoir, 3, pacer) == 3);
+    assert(zlist_size(pacer->inserts) == 3);
+    insert_pacer_destroy(&pacer);
+
+    zhash_destroy(&reservoirs);
+    test_stream_info_destroy(stream_info);
+    num_parsers = parsers;
+}
+
+static void test_reservoir_claims (int verbose)
+{
+    stream_info_t *stream_info = test_stream_info_new(4);
+    advance_insert_window();
+    assert(claim_request_inserts(stream_info, 3) == 3);
+    assert(claim_request_inserts(stream_info, 3) == 1);
+    assert(claim_request_inserts(stream_info, 1) == 0);
+    // the first claim of a window resets the counter
+    advance_insert_window();
+    assert(claim_request_inserts(stream_info, 5) == 4);
+    test_stream_info_destroy(stream_info);
+}
+
+static void test_insert_pacer (int verbose)
+{
+    insert_pacer_t *pacer = insert_pacer_new();
+    assert(insert_pacer_timeout(pacer, 0) == -1);
+
+    pacer->chosen = 4;
+    pacer->started = 1000;
+    assert(insert_pacer_due(pacer, 1000) == 1);
+    assert(insert_pacer_due(pacer, 1199) == 1);
+    assert(insert_pacer_due(pacer, 1200) == 2);
+    assert(insert_pacer_due(pacer, 1799) == 4);
+    assert(insert_pacer_due(pacer, 5000) == 4);
+
+    // one has been sent, the next one is due after a quarter of the interval
+    for (int i = 0; i < 3; i++)
+        zlist_append(pacer->inserts, pacer);
+    assert(insert_pacer_timeout(pacer, 1000) == RESERVOIR_PACING_INTERVAL / 4);
+    assert(insert_pacer_timeout(pacer, 1300) == 0);
+    while (zlist_pop(pacer->inserts))
+        ;
+    insert_pacer_destroy(&pacer);
+}
+
+void reservoir_test (int verbose)
+{
+    printf (" * importer-reservoir: ");
+    if (verbose)
+        printf("\n");
+
+    test_reservoir_strata (verbose);
+    test_reservoir_claims (verbose);
+    test_insert_pacer (verbose);
+
+    printf ("OK\n");
+}
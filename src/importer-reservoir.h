@@ -0,0 +1,73 @@
+#ifndef __LOGJAM_IMPORTER_RESERVOIR_H_INCLUDED__
+#define __LOGJAM_IMPORTER_RESERVOIR_H_INCLUDED__
+
+#include "importer-common.h"
+#include "logjam-streaminfo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// interesting requests are collected per stream during a tick and the ones we store are
+// chosen when the tick ends. requests are stratified by page and sampling reason. every
+// stratum keeps a uniform sample of its requests, and the insert budget of the stream is
+// split evenly between strata, so a storm of identical errors can't crowd out the rest.
+
+typedef struct {
+    char *db_name;
+    char *module;
+    json_object *request;
+    sampling_reason_t reason;
+    bool traced;
+    latency_trace_t trace;
+} reservoir_item_t;
+
+typedef struct {
+    uint64_t seen;              // requests offered to this stratum during the current tick
+    size_t size;
+    size_t capacity;
+    reservoir_item_t *items;
+} reservoir_stratum_t;
+
+typedef struct {
+    stream_info_t *stream_info;
+    zhash_t *strata;            // "<sampling reason>-<page>" -> reservoir_stratum_t
+    size_t budget;              // max number of requests this parser stores per tick
+    uint64_t offered;
+} request_reservoir_t;
+
+// the requests chosen at the end of a tick are sent to the writers evenly spread over
+// RESERVOIR_PACING_INTERVAL ms, instead of as one burst
+#define RESERVOIR_PACING_INTERVAL 800
+
+typedef struct {
+    stream_info_t *stream_info;
+    reservoir_item_t item;
+} paced_insert_t;
+
+typedef struct {
+    zlist_t *inserts;           // paced_insert_t*, chosen at the last flush and not sent yet
+    size_t chosen;              // number of inserts chosen at the last flush
+    int64_t started;            // zclock_mono() of the last flush
+} insert_pacer_t;
+
+extern request_reservoir_t* reservoirs_lookup(zhash_t *reservoirs, stream_info_t *stream_info);
+extern void reservoir_offer(request_reservoir_t *self, const char *db_name, const char *page, const char *module,
+                            json_object *request, sampling_reason_t reason, latency_trace_t *trace);
+// sends what is left from the last tick, then chooses the requests to store from all reservoirs
+extern void reservoirs_flush(zhash_t *reservoirs, insert_pacer_t *pacer, zsock_t *socket);
+
+extern insert_pacer_t* insert_pacer_new();
+// drops inserts which haven't been sent
+extern void insert_pacer_destroy(insert_pacer_t **pacer_p);
+// sends the inserts which are due. returns the number of ms until the next one is due, -1 if none is left.
+extern int insert_pacer_send_due(insert_pacer_t *pacer, zsock_t *socket);
+extern void insert_pacer_send_all(insert_pacer_t *pacer, zsock_t *socket);
+
+extern void reservoir_test (int verbose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
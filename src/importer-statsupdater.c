@@ -6,6 +6,7 @@
 #include "importer-mongoutils.h"
 #include "importer-parser.h"
 #include "importer-prometheus-client.h"
+#include "importer-adder.h"
 
 /*
  * connections: n_u = NUM_UPDATERS, "o" = bind, "[<>v^]" = connect
@@ -16,8 +17,37 @@
  *                 PUSH    PULL       |
  *  [controller]   o----------<  updater(n_u)
  *
+ * With updater_db_affinity set (the default), the controller bypasses the PUSH socket: it appends each
+ * database's processor to the queue of the updater owning that database and sends a
+ * "work" command through the PIPE. Idle updaters steal whole databases from the tail of
+ * backlogged queues. A database which is still waiting in a queue absorbs the updates of
+ * later intervals, so a backlog grows with the number of databases, not with time.
  */
 
+bool updater_db_affinity = true;
+
+// only steal from queues which have at least this many waiting databases
+#define STEAL_MIN_BACKLOG 2
+
+typedef struct {
+    pthread_mutex_t mutex;
+    zlist_t *tasks;             // processor_state_t*, one per database
+    zhash_t *pending;           // db_name -> processor_state_t* waiting in tasks
+} update_queue_t;
+
+static update_queue_t update_queues[MAX_UPDATERS];
+static pthread_once_t update_queues_once = PTHREAD_ONCE_INIT;
+
+// queue mutexes live as long as the process, as elastic pools reuse updater ids
+static
+void update_queues_init()
+{
+    for (size_t i = 0; i < MAX_UPDATERS; i++) {
+        int rc = pthread_mutex_init(&update_queues[i].mutex, NULL);
+        assert(rc==0);
+    }
+}
+
 // Receives controller commands via PIPE socket and database update tasks vie PULL socket.
 // Currently both messages types are sent by the controller (but this might change).
 // It might be better to insert a load balancer device between controller and updaters.
@@ -25,35 +55,50 @@
 typedef struct {
     size_t id;
     char me[16];
-    mongoc_client_t *mongo_clients[MAX_DATABASES];
-    mongoc_collection_t *global_collection;
-    zhash_t *stats_collections;
     zsock_t *pipe;
     zsock_t *pull_socket;
     int updates_count;     // updates performend since last tick
     int update_time;       // processing time since last tick (micro seconds)
+    int tasks_stolen;      // databases taken from other updaters' queues since last tick
+    bool has_work;         // db affine mode: queues might have tasks for us
 } stats_updater_state_t;
 
-typedef struct {
-    mongoc_collection_t *totals;
-    mongoc_collection_t *minutes;
-    mongoc_collection_t *quants;
-    mongoc_collection_t *histograms;
-    mongoc_collection_t *agents;
-} stats_collections_t;
-
 typedef struct {
     const char *db_name;
-    mongoc_collection_t *collection;
+    const char *collection_name;
+    mongoc_bulk_operation_t *bulk;  // upserts of one collection, sent in one round trip
+    bson_t *upsert_opts;
+    size_t max_dynamic_keys;
+    dynamic_key_set_t *dynamic_keys;
 } collection_update_callback_t;
 
 typedef int (updater_foreach_fn) (const char *key, void *item, void *argument);
 
 static
-bson_t* increments_to_bson(const char* namespace, increments_t* increments)
+void collection_upsert(collection_update_callback_t *cb, const bson_t *selector, const bson_t *document)
+{
+    if (cb->bulk == NULL)
+        return;
+    bson_error_t error;
+    if (!mongoc_bulk_operation_update_one_with_opts(cb->bulk, selector, document, cb->upsert_opts, &error)) {
+        size_t n;
+        char* bjs = bson_as_json(document, &n);
+        fprintf(stderr,
+                "[E] update failed for %s on %s: (%d) %s\n"
+                "[E] document size: %zu; value: %s\n",
+                cb->db_name, cb->collection_name, error.code, error.message, n, bjs);
+        bson_free(bjs);
+    }
+}
+
+static
+bson_t* increments_to_bson(const char* namespace, increments_t* increments, collection_update_callback_t *cb)
 {
     // dump_increments(namespace, increments);
 
+    // aggregates may hold up to twice the number of dynamic keys, and keys we haven't stored yet
+    increments_trim_dynamic_keys(increments, cb->max_dynamic_keys, cb->dynamic_keys);
+
     bson_t *incs = bson_new();
     bson_t *maxs = bson_new();
 
@@ -122,8 +167,6 @@ static
 int minutes_add_increments(const char* namespace, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
     increments_t* increments = data;
 
     int minute = 0;
@@ -143,19 +186,8 @@ int minutes_add_increments(const char* namespace, void* data, void* arg)
     // printf("[D] selector. size: %zu; value:%s\n", n, bs);
     // bson_free(bs);
 
-    bson_t *document = increments_to_bson(namespace, increments);
-    if (!dryrun) {
-        bson_error_t error;
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            size_t n;
-            char* bjs = bson_as_json(document, &n);
-            fprintf(stderr,
-                    "[E] update failed for %s on minutes: (%d) %s\n"
-                    "[E] document size: %zu; value: %s\n",
-                    db_name, error.code, error.message, n, bjs);
-            bson_free(bjs);
-        }
-    }
+    bson_t *document = increments_to_bson(namespace, increments, cb);
+    collection_upsert(cb, selector, document);
     bson_destroy(selector);
     bson_destroy(document);
     return 0;
@@ -165,8 +197,6 @@ static
 int totals_add_increments(const char* namespace, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
     increments_t* increments = data;
     assert(increments);
 
@@ -178,19 +208,8 @@ int totals_add_increments(const char* namespace, void* data, void* arg)
     // printf("[D] selector. size: %zu; value:%s\n", n, bs);
     // bson_free(bs);
 
-    bson_t *document = increments_to_bson(namespace, increments);
-    if (!dryrun) {
-        bson_error_t error;
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            size_t n;
-            char* bjs = bson_as_json(document, &n);
-            fprintf(stderr,
-                    "[E] update failed for %s on totals: (%d) %s\n"
-                    "[E] document size: %zu; value: %s\n",
-                    db_name, error.code, error.message, n, bjs);
-            bson_free(bjs);
-        }
-    }
+    bson_t *document = increments_to_bson(namespace, increments, cb);
+    collection_upsert(cb, selector, document);
 
     bson_destroy(selector);
     bson_destroy(document);
@@ -201,8 +220,6 @@ static
 int quants_add_quants(const char* namespace, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
 
     // extract keys from namespace: kind-quant-page
     char* p = (char*) namespace;
@@ -244,18 +261,7 @@ int quants_add_quants(const char* namespace, void* data, void* arg)
     // printf("[D] document. size: %zu; value:%s\n", n, bs);
     // bson_free(bs);
 
-    if (!dryrun) {
-        bson_error_t error;
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            size_t n;
-            char* bjs = bson_as_json(document, &n);
-            fprintf(stderr,
-                    "[E] update failed for %s on quants: (%d) %s\n"
-                    "[E] document size: %zu; value: %s\n",
-                    db_name, error.code, error.message, n, bjs);
-            bson_free(bjs);
-        }
-    }
+    collection_upsert(cb, selector, document);
     bson_destroy(selector);
     bson_destroy(incs);
     bson_destroy(document);
@@ -266,8 +272,6 @@ static
 int histograms_add_histograms(const char* namespace, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
 
     // extract details from key: minute-resource-page
     char* p = (char*) namespace;
@@ -300,12 +304,21 @@ int histograms_add_histograms(const char* namespace, void* data, void* arg)
     // bson_free(bs1);
 
     bson_t *incs = bson_new();
-    size_t *histogram = data;
+    histogram_t *histogram = data;
     for (int i=0; i < HISTOGRAM_SIZE; i++) {
-        if (histogram[i] > 0) {
+        if (histogram->buckets[i] > 0) {
             char key[256];
             int keylen = snprintf(key, sizeof(key), "%s.%d", resource, i);
-            bson_append_int32(incs, key, keylen, histogram[i]);
+            bson_append_int32(incs, key, keylen, histogram->buckets[i]);
+        }
+    }
+    // sketch buckets are keyed by their index, so $inc merges sketches like the adder does
+    ddsketch_t *sketch = &histogram->sketch;
+    for (uint32_t j=0; j < sketch->num_buckets; j++) {
+        if (sketch->counts[j] > 0) {
+            char key[256];
+            int keylen = snprintf(key, sizeof(key), "%s_sketch.%d", resource, sketch->offset + (int32_t)j);
+            bson_append_int32(incs, key, keylen, sketch->counts[j]);
         }
     }
     bson_t *document = bson_new();
@@ -316,18 +329,7 @@ int histograms_add_histograms(const char* namespace, void* data, void* arg)
     // printf("[D] document. size: %zu; value:%s\n", n2, bs2);
     // bson_free(bs2);
 
-    if (!dryrun) {
-        bson_error_t error;
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            size_t n;
-            char* bjs = bson_as_json(document, &n);
-            fprintf(stderr,
-                    "[E] update failed for %s on histograms: (%d) %s\n"
-                    "[E] document size: %zu; value: %s\n",
-                    db_name, error.code, error.message, n, bjs);
-            bson_free(bjs);
-        }
-    }
+    collection_upsert(cb, selector, document);
     bson_destroy(selector);
     bson_destroy(incs);
     bson_destroy(document);
@@ -339,19 +341,18 @@ static
 int agents_add_agent(const char* agent, void* data, void* arg)
 {
     collection_update_callback_t *cb = arg;
-    mongoc_collection_t *collection = cb->collection;
-    const char *db_name = cb->db_name;
     user_agent_stats_t *stats = data;
 
     const char* agent_ptr;
     size_t agent_len = strlen(agent);
-    char safe_agent[6*agent_len+1];
+    char *safe_agent = NULL;
 
-    if (bson_utf8_validate(agent, agent_len, false)) {
+    if (utf8_validate(agent, agent_len)) {
         agent_ptr = agent;
     } else {
-        agent_ptr = safe_agent;
+        safe_agent = zmalloc(6*agent_len+1);
         agent_len = convert_to_win1252(agent, agent_len, safe_agent);
+        agent_ptr = safe_agent;
     }
     // printf("[D] agent_ptr: %s\n", agent_ptr);
 
@@ -388,69 +389,14 @@ int agents_add_agent(const char* agent, void* data, void* arg)
     // printf("[D] document. size: %zu; value:%s\n", n, bs);
     // bson_free(bs);
 
-    if (!dryrun) {
-        bson_error_t error;
-        if (!mongoc_collection_update(collection, MONGOC_UPDATE_UPSERT, selector, document, wc_no_wait, &error)) {
-            size_t n;
-            char* bjs = bson_as_json(document, &n);
-            fprintf(stderr,
-                    "[E] update failed for %s on agents: (%d) %s\n"
-                    "[E] document size: %zu; value: %s\n",
-                    db_name, error.code, error.message, n, bjs);
-            bson_free(bjs);
-        }
-    }
+    collection_upsert(cb, selector, document);
     bson_destroy(selector);
     bson_destroy(document);
+    if (safe_agent)
+        free(safe_agent);
     return 0;
 }
 
-static
-stats_collections_t *stats_collections_new(mongoc_client_t* client, const char* db_name)
-{
-    stats_collections_t *collections = zmalloc(sizeof(stats_collections_t));
-
-    if (dryrun) return collections;
-
-    collections->totals = mongoc_client_get_collection(client, db_name, "totals");
-    collections->minutes = mongoc_client_get_collection(client, db_name, "minutes");
-    collections->quants = mongoc_client_get_collection(client, db_name, "quants");
-    collections->histograms = mongoc_client_get_collection(client, db_name, "heatmaps");
-    collections->agents = mongoc_client_get_collection(client, db_name, "agents");
-
-    return collections;
-}
-
-static
-void destroy_stats_collections(stats_collections_t* collections)
-{
-    if (collections->totals != NULL)
-        mongoc_collection_destroy(collections->totals);
-    if (collections->minutes != NULL)
-        mongoc_collection_destroy(collections->minutes);
-    if (collections->quants != NULL)
-        mongoc_collection_destroy(collections->quants);
-    if (collections->histograms != NULL)
-        mongoc_collection_destroy(collections->histograms);
-    if (collections->agents != NULL)
-        mongoc_collection_destroy(collections->agents);
-    free(collections);
-}
-
-static
-stats_collections_t *stats_updater_get_collections(stats_updater_state_t *self, const char* db_name, stream_info_t *stream_info)
-{
-    stats_collections_t *collections = zhash_lookup(self->stats_collections, db_name);
-    if (collections == NULL) {
-        mongoc_client_t *mongo_client = self->mongo_clients[stream_info->db];
-        collections = stats_collections_new(mongo_client, db_name);
-        assert(collections);
-        zhash_insert(self->stats_collections, db_name, collections);
-        zhash_freefn(self->stats_collections, db_name, (zhash_free_fn*)destroy_stats_collections);
-    }
-    return collections;
-}
-
 static
 stats_updater_state_t* stats_updater_state_new(zconfig_t *config, size_t id)
 {
@@ -464,11 +410,12 @@ stats_updater_state_t* stats_updater_state_new(zconfig_t *config, size_t id)
     int rc = zsock_connect(state->pull_socket, "inproc://stats-updates");
     assert(rc==0);
 
-    for (int i = 0; i<num_databases; i++) {
-        state->mongo_clients[i] = mongoc_client_new(databases[i]);
-        assert(state->mongo_clients[i]);
-    }
-    state->stats_collections = zhash_new();
+    pthread_once(&update_queues_once, update_queues_init);
+    pthread_mutex_lock(&update_queues[id].mutex);
+    update_queues[id].tasks = zlist_new();
+    update_queues[id].pending = zhash_new();
+    pthread_mutex_unlock(&update_queues[id].mutex);
+
     return state;
 }
 
@@ -477,10 +424,6 @@ void stats_updater_state_destroy(stats_updater_state_t **state_p)
 {
     stats_updater_state_t *state = *state_p;
     zsock_destroy(&state->pull_socket);
-    zhash_destroy(&state->stats_collections);
-    for (int i = 0; i<num_databases; i++) {
-        mongoc_client_destroy(state->mongo_clients[i]);
-    }
     free(state);
     *state_p = NULL;
 }
@@ -496,6 +439,380 @@ void update_collection(zhash_t *updates, updater_foreach_fn *fn, collection_upda
     }
 }
 
+static
+void update_stats_collection(mongoc_client_t *client, stream_info_t *stream_info, const char *db_name, const char *collection_name,
+                             zhash_t *updates, updater_foreach_fn *fn)
+{
+    bson_t upsert_opts;
+    bson_init(&upsert_opts);
+    bson_append_bool(&upsert_opts, "upsert", 6, true);
+
+    collection_update_callback_t cb;
+    cb.db_name = db_name;
+    cb.collection_name = collection_name;
+    cb.upsert_opts = &upsert_opts;
+    cb.max_dynamic_keys = stream_info->max_dynamic_keys;
+    cb.dynamic_keys = dynamic_key_set_acquire(db_name);
+    mongoc_collection_t *collection = client ? mongoc_client_get_collection(client, db_name, collection_name) : NULL;
+    cb.bulk = collection ? mongoc_collection_create_bulk_operation_with_opts(collection, bulk_opts) : NULL;
+    update_collection(updates, fn, &cb);
+
+    if (cb.bulk && zhash_size(updates) > 0) {
+        bson_t reply;
+        bson_error_t error;
+        if (!mongoc_bulk_operation_execute(cb.bulk, &reply, &error)) {
+            bson_iter_t it;
+            uint32_t num_errors = 0;
+            if (bson_iter_init_find(&it, &reply, "writeErrors") && bson_iter_type(&it) == BSON_TYPE_ARRAY) {
+                bson_iter_t errors;
+                bson_iter_recurse(&it, &errors);
+                while (bson_iter_next(&errors))
+                    num_errors++;
+            }
+            fprintf(stderr, "[E] update failed for %s on %s: (%d) %s (%u of %zu upserts failed)\n",
+                    db_name, collection_name, error.code, error.message, num_errors, zhash_size(updates));
+        }
+        bson_destroy(&reply);
+    }
+    if (cb.bulk)
+        mongoc_bulk_operation_destroy(cb.bulk);
+    if (collection)
+        mongoc_collection_destroy(collection);
+    dynamic_key_set_release(cb.dynamic_keys);
+    bson_destroy(&upsert_opts);
+}
+
+// jump consistent hashing (Lamping and Veach): when the pool grows from n to n+1 updaters,
+// only databases moving to the new updater change their queue, and shrinking reverses that.
+static
+size_t update_queue_index(const char *db_name, size_t n)
+{
+    uint32_t hash = 2166136261u;
+    while (*db_name)
+        hash = (hash ^ (uint8_t)*db_name++) * 16777619u;
+    uint64_t key = hash;
+    int64_t b = -1, j = 0;
+    while (j < (int64_t)n) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+    }
+    return b;
+}
+
+// caller must hold the queue mutex. returns the task already waiting for the same
+// database if the processor has been merged into it.
+static
+processor_state_t* update_queue_add(update_queue_t *queue, processor_state_t *processor)
+{
+    processor_state_t *pending = zhash_lookup(queue->pending, processor->db_name);
+    if (pending) {
+        merge_processor(pending, processor);
+    } else {
+        zlist_append(queue->tasks, processor);
+        zhash_insert(queue->pending, processor->db_name, processor);
+    }
+    return pending;
+}
+
+update_schedule_result_t stats_updater_schedule(processor_state_t *processor)
+{
+    size_t n = __atomic_load_n(&num_updaters, __ATOMIC_SEQ_CST);
+    size_t id = update_queue_index(processor->db_name, n);
+    update_queue_t *queue = &update_queues[id];
+    update_schedule_result_t result;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->tasks == NULL)
+        result = UPDATE_REJECTED;
+    else
+        result = update_queue_add(queue, processor) ? UPDATE_MERGED : UPDATE_QUEUED;
+    pthread_mutex_unlock(&queue->mutex);
+    if (result == UPDATE_REJECTED) {
+        fprintf(stderr, "[E] updater[%zu]: dropped updates for %s, as the updater has shut down\n", id, processor->db_name);
+        importer_prometheus_client_count_updates_rejected(1);
+    }
+    if (result != UPDATE_QUEUED)
+        processor_destroy(processor);
+    return result;
+}
+
+// called by the controller after adding updater id to the pool. moves the databases
+// now owned by the new updater out of the other queues, so that no database has tasks
+// waiting in two queues. returns the number of databases moved.
+size_t stats_updater_rehome(size_t id)
+{
+    zlist_t *moved = zlist_new();
+    for (size_t i = 0; i < id; i++) {
+        update_queue_t *queue = &update_queues[i];
+        pthread_mutex_lock(&queue->mutex);
+        if (queue->tasks == NULL) {
+            pthread_mutex_unlock(&queue->mutex);
+            continue;
+        }
+        zlist_t *kept = zlist_new();
+        processor_state_t *task;
+        while ( (task = zlist_pop(queue->tasks)) ) {
+            if (update_queue_index(task->db_name, id + 1) == id) {
+                zhash_delete(queue->pending, task->db_name);
+                zlist_append(moved, task);
+            } else
+                zlist_append(kept, task);
+        }
+        zlist_destroy(&queue->tasks);
+        queue->tasks = kept;
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    size_t n = zlist_size(moved);
+    update_queue_t *queue = &update_queues[id];
+    processor_state_t *task;
+    pthread_mutex_lock(&queue->mutex);
+    while ( (task = zlist_pop(moved)) ) {
+        // updates for the database may have been scheduled since the pool grew
+        if (update_queue_add(queue, task)) {
+            processor_destroy(task);
+            __atomic_sub_fetch(&queued_updates, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    zlist_destroy(&moved);
+    return n;
+}
+
+static
+size_t update_queue_backlog(update_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    size_t n = queue->tasks ? zlist_size(queue->tasks) : 0;
+    pthread_mutex_unlock(&queue->mutex);
+    return n;
+}
+
+// takes the next database from our own queue, or else steals the one its owner would reach last
+static
+processor_state_t* stats_updater_next_task(size_t id, bool *stolen)
+{
+    processor_state_t *task;
+    pthread_mutex_lock(&update_queues[id].mutex);
+    task = zlist_pop(update_queues[id].tasks);
+    if (task)
+        zhash_delete(update_queues[id].pending, task->db_name);
+    pthread_mutex_unlock(&update_queues[id].mutex);
+    *stolen = false;
+    if (task)
+        return task;
+
+    size_t victim = id, backlog = 0;
+    size_t n_updaters = __atomic_load_n(&num_updaters, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < n_updaters; i++) {
+        if (i == id)
+            continue;
+        size_t n = update_queue_backlog(&update_queues[i]);
+        if (n >= STEAL_MIN_BACKLOG && n > backlog) {
+            victim = i;
+            backlog = n;
+        }
+    }
+    if (victim == id)
+        return NULL;
+
+    update_queue_t *queue = &update_queues[victim];
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->tasks && zlist_size(queue->tasks) >= STEAL_MIN_BACKLOG) {
+        task = zlist_last(queue->tasks);
+        zlist_remove(queue->tasks, task);
+        zhash_delete(queue->pending, task->db_name);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    *stolen = task != NULL;
+    return task;
+}
+
+// writes all five collections of one database using a single pooled client, with one
+// unordered bulk upsert per collection
+static
+void stats_updater_update_database(processor_state_t *proc)
+{
+    mongo_lease_t lease;
+    mongoc_client_t *client = NULL;
+    if (!dryrun)
+        client = mongo_lease_acquire(&lease, proc->stream_info->db);
+
+    update_stats_collection(client, proc->stream_info, proc->db_name, "totals", proc->totals, totals_add_increments);
+    update_stats_collection(client, proc->stream_info, proc->db_name, "minutes", proc->minutes, minutes_add_increments);
+    update_stats_collection(client, proc->stream_info, proc->db_name, "quants", proc->quants, quants_add_quants);
+    update_stats_collection(client, proc->stream_info, proc->db_name, "heatmaps", proc->histograms, histograms_add_histograms);
+    update_stats_collection(client, proc->stream_info, proc->db_name, "agents", proc->agents, agents_add_agent);
+
+    if (!dryrun)
+        mongo_lease_release(&lease);
+
+    importer_prometheus_client_observe_latency(proc->stream_info, LATENCY_STAGE_UPDATER, proc->oldest_created_ms, zclock_time());
+}
+
+// returns false if there was nothing to do
+static
+bool stats_updater_process_task(stats_updater_state_t *state)
+{
+    bool stolen;
+    processor_state_t *task = stats_updater_next_task(state->id, &stolen);
+    if (task == NULL)
+        return false;
+
+    int64_t start_time_us = zclock_usecs();
+    if (stolen && debug)
+        printf("[D] updater[%zu]: stole %s\n", state->id, task->db_name);
+    state->tasks_stolen += stolen;
+    stats_updater_update_database(task);
+    processor_destroy(task);
+    __atomic_sub_fetch(&queued_updates, 1, __ATOMIC_SEQ_CST);
+
+    state->updates_count++;
+    state->update_time += zclock_usecs() - start_time_us;
+    return true;
+}
+
+
+// handles a single collection update sent over the PUSH socket (round robin scheduling)
+static
+void stats_updater_process_msg(stats_updater_state_t *state, zmsg_t *msg)
+{
+    state->updates_count++;
+    int64_t start_time_us = zclock_usecs();
+
+    zframe_t *task_frame = zmsg_first(msg);
+    zframe_t *db_frame = zmsg_next(msg);
+    zframe_t *stream_frame = zmsg_next(msg);
+    zframe_t *hash_frame = zmsg_next(msg);
+    zframe_t *created_frame = zmsg_next(msg);
+
+    assert(zframe_size(task_frame) == 1);
+    char task_type = *(char*)zframe_data(task_frame);
+
+    size_t n = zframe_size(db_frame);
+    char db_name[n+1];
+    memcpy(db_name, zframe_data(db_frame), n);
+    db_name[n] = '\0';
+
+    zhash_t *updates;
+    assert(zframe_size(hash_frame) == sizeof(updates));
+    memcpy(&updates, zframe_data(hash_frame), sizeof(updates));
+
+    stream_info_t *stream_info = zframe_getptr(stream_frame);
+
+    const char *collection_name = NULL;
+    updater_foreach_fn *fn = NULL;
+    switch (task_type) {
+    case 't':
+        collection_name = "totals";
+        fn = totals_add_increments;
+        break;
+    case 'm':
+        collection_name = "minutes";
+        fn = minutes_add_increments;
+        break;
+    case 'q':
+        collection_name = "quants";
+        fn = quants_add_quants;
+        break;
+    case 'h':
+        collection_name = "heatmaps";
+        fn = histograms_add_histograms;
+        break;
+    case 'a':
+        collection_name = "agents";
+        fn = agents_add_agent;
+        break;
+    default:
+        fprintf(stderr, "[E] updater[%zu]: unknown task type: %c\n", state->id, task_type);
+        assert(false);
+    }
+
+    // the pooled client is held only for the duration of this task
+    mongo_lease_t lease;
+    mongoc_client_t *client = NULL;
+    if (!dryrun)
+        client = mongo_lease_acquire(&lease, stream_info->db);
+    update_stats_collection(client, stream_info, db_name, collection_name, updates, fn);
+    if (!dryrun)
+        mongo_lease_release(&lease);
+    zhash_destroy(&updates);
+    __atomic_sub_fetch(&queued_updates, 1, __ATOMIC_SEQ_CST);
+
+    // totals are the first of the updates for a given db, so only record latency once
+    if (task_type == 't' && created_frame && zframe_size(created_frame) == sizeof(int64_t)) {
+        int64_t oldest_created_ms;
+        memcpy(&oldest_created_ms, zframe_data(created_frame), sizeof(int64_t));
+        importer_prometheus_client_observe_latency(stream_info, LATENCY_STAGE_UPDATER, oldest_created_ms, zclock_time());
+    }
+    release_stream_info(stream_info);
+
+    int64_t end_time_us = zclock_usecs();
+    int runtime = end_time_us - start_time_us;
+    state->update_time += runtime;
+    // printf("[D] updater[%zu]: task[%c]: (%3d ms) %s\n", state->id, task_type, runtime/1000, db_name);
+    zmsg_destroy(&msg);
+}
+
+// called when the controller shrinks the pool. it has already removed us, so nothing gets
+// scheduled for us anymore and it doesn't send updates while waiting for our answer. the
+// databases waiting in our queue are handed over to the updaters now owning them.
+static
+void stats_updater_drain(stats_updater_state_t *state)
+{
+    zmsg_t *msg;
+    while ((msg = zmsg_recv_nowait(state->pull_socket)))
+        stats_updater_process_msg(state, msg);
+    int rc = zsock_disconnect(state->pull_socket, "inproc://stats-updates");
+    log_zmq_error(rc, __FILE__, __LINE__);
+
+    zlist_t *tasks = zlist_new();
+    update_queue_t *queue = &update_queues[state->id];
+    pthread_mutex_lock(&queue->mutex);
+    processor_state_t *task;
+    while ( (task = zlist_pop(queue->tasks)) ) {
+        zhash_delete(queue->pending, task->db_name);
+        zlist_append(tasks, task);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    size_t handed_over = zlist_size(tasks);
+    while ( (task = zlist_pop(tasks)) ) {
+        if (stats_updater_schedule(task) != UPDATE_QUEUED)
+            __atomic_sub_fetch(&queued_updates, 1, __ATOMIC_SEQ_CST);
+    }
+    zlist_destroy(&tasks);
+
+    importer_prometheus_client_count_updates(state->updates_count);
+    importer_prometheus_client_time_updates(((double)state->update_time)/1000000);
+    if (!quiet)
+        printf("[I] updater[%zu]: drained (%zu databases handed over)\n", state->id, handed_over);
+    zsock_signal(state->pipe, 0);
+}
+
+// called on shutdown. later attempts to schedule updates for us get rejected, and the
+// databases still waiting in our queue are updated before we terminate.
+static
+void stats_updater_close_queue(stats_updater_state_t *state)
+{
+    update_queue_t *queue = &update_queues[state->id];
+    pthread_mutex_lock(&queue->mutex);
+    zlist_t *tasks = queue->tasks;
+    queue->tasks = NULL;
+    zhash_destroy(&queue->pending);
+    pthread_mutex_unlock(&queue->mutex);
+
+    size_t n = zlist_size(tasks);
+    processor_state_t *task;
+    while ( (task = zlist_pop(tasks)) ) {
+        stats_updater_update_database(task);
+        processor_destroy(task);
+        __atomic_sub_fetch(&queued_updates, 1, __ATOMIC_SEQ_CST);
+    }
+    zlist_destroy(&tasks);
+    if (n && !quiet)
+        printf("[I] updater[%zu]: updated %zu databases left in the queue\n", state->id, n);
+}
 
 static void stats_updater(zsock_t *pipe, void *args)
 {
@@ -507,7 +824,6 @@ static void stats_updater(zsock_t *pipe, void *args)
     if (!quiet)
         printf("[I] updater[%zu]: starting\n", id);
 
-    size_t ticks = 0;
     // signal readyiness after sockets have been created
     zsock_signal(pipe, 0);
 
@@ -516,8 +832,8 @@ static void stats_updater(zsock_t *pipe, void *args)
 
     while (!zsys_interrupted) {
         // printf("[D] updater[%zu]: polling\n", id);
-        // wait at most one second
-        void *socket = zpoller_wait(poller, 1000);
+        // wait at most one second, don't wait at all when there is queued work
+        void *socket = zpoller_wait(poller, state->has_work ? 0 : 1000);
         zmsg_t *msg = NULL;
         if (socket == state->pipe) {
             msg = zmsg_recv(state->pipe);
@@ -526,25 +842,23 @@ static void stats_updater(zsock_t *pipe, void *args)
             zmsg_destroy(&msg);
             if (streq(cmd, "tick")) {
                 if (verbose && (state->updates_count || state->update_time)) {
-                    printf("[I] updater[%zu]: tick (%d updates, %d ms)\n", id, state->updates_count, state->update_time/1000);
+                    printf("[I] updater[%zu]: tick (%d updates, %d ms, %d stolen)\n", id, state->updates_count, state->update_time/1000, state->tasks_stolen);
                 }
                 importer_prometheus_client_count_updates(state->updates_count);
                 importer_prometheus_client_time_updates(((double)state->update_time)/1000000);
                 importer_prometheus_client_record_rusage_updater(state->id);
-
-                // ping the server
-                if (ticks++ % PING_INTERVAL == 0) {
-                    for (int i=0; i<num_databases; i++) {
-                        mongo_client_ping(state->mongo_clients[i]);
-                    }
-                }
-                // refresh database information
-                if (ticks % COLLECTION_REFRESH_INTERVAL == COLLECTION_REFRESH_INTERVAL - id - 1) {
-                    zhash_destroy(&state->stats_collections);
-                    state->stats_collections = zhash_new();
-                }
                 state->updates_count = 0;
                 state->update_time = 0;
+                state->tasks_stolen = 0;
+                // look for backlogged queues at least once a second
+                state->has_work = updater_db_affinity;
+                free(cmd);
+            } else if (streq(cmd, "work")) {
+                state->has_work = true;
+                free(cmd);
+            } else if (streq(cmd, "drain")) {
+                stats_updater_drain(state);
+                state->has_work = false;
                 free(cmd);
             } else if (streq(cmd, "$TERM")) {
                 // printf("[D] updater[%zu]: received $TERM command\n", id);
@@ -556,67 +870,8 @@ static void stats_updater(zsock_t *pipe, void *args)
             }
         } else if (socket == state->pull_socket) {
             msg = zmsg_recv(state->pull_socket);
-            state->updates_count++;
-            int64_t start_time_us = zclock_usecs();
-
-            zframe_t *task_frame = zmsg_first(msg);
-            zframe_t *db_frame = zmsg_next(msg);
-            zframe_t *stream_frame = zmsg_next(msg);
-            zframe_t *hash_frame = zmsg_next(msg);
-
-            assert(zframe_size(task_frame) == 1);
-            char task_type = *(char*)zframe_data(task_frame);
-
-            size_t n = zframe_size(db_frame);
-            char db_name[n+1];
-            memcpy(db_name, zframe_data(db_frame), n);
-            db_name[n] = '\0';
-
-            zhash_t *updates;
-            assert(zframe_size(hash_frame) == sizeof(updates));
-            memcpy(&updates, zframe_data(hash_frame), sizeof(updates));
-
-            stream_info_t *stream_info = zframe_getptr(stream_frame);
-
-            stats_collections_t *collections = stats_updater_get_collections(state, db_name, stream_info);
-            release_stream_info(stream_info);
-
-            collection_update_callback_t cb;
-            cb.db_name = db_name;
-
-            switch (task_type) {
-            case 't':
-                cb.collection = collections->totals;
-                update_collection(updates, totals_add_increments, &cb);
-                break;
-            case 'm':
-                cb.collection = collections->minutes;
-                update_collection(updates, minutes_add_increments, &cb);
-                break;
-            case 'q':
-                cb.collection = collections->quants;
-                update_collection(updates, quants_add_quants, &cb);
-                break;
-            case 'h':
-                cb.collection = collections->histograms;
-                update_collection(updates, histograms_add_histograms, &cb);
-                break;
-            case 'a':
-                cb.collection = collections->agents;
-                update_collection(updates, agents_add_agent, &cb);
-                break;
-            default:
-                fprintf(stderr, "[E] updater[%zu]: unknown task type: %c\n", id, task_type);
-                assert(false);
-            }
-            zhash_destroy(&updates);
-            __atomic_sub_fetch(&queued_updates, 1, __ATOMIC_SEQ_CST);
-
-            int64_t end_time_us = zclock_usecs();
-            int runtime = end_time_us - start_time_us;
-            state->update_time += runtime;
-            // printf("[D] updater[%zu]: task[%c]: (%3d ms) %s\n", id, task_type, runtime/1000, db_name);
-            zmsg_destroy(&msg);
+            if (msg)
+                stats_updater_process_msg(state, msg);
         } else if (socket) {
             // if socket is not null, something is horribly broken
             printf("[E] updater[%zu]: broken poller. committing suicide.\n", id);
@@ -626,11 +881,15 @@ static void stats_updater(zsock_t *pipe, void *args)
             // probably interrupted by signal handler
             // if so, loop will terminate on condition !zsys_interrupted
         }
+        // one database per iteration, so that commands on the pipe don't starve
+        if (state->has_work && !zsys_interrupted)
+            state->has_work = stats_updater_process_task(state);
     }
 
     if (!quiet)
         printf("[I] updater[%zu]: shutting down\n", id);
 
+    stats_updater_close_queue(state);
     stats_updater_state_destroy(&state);
 
     if (!quiet)
@@ -2,12 +2,25 @@
 #define __LOGJAM_IMPORTER_STATS_UPDATER_H_INCLUDED__
 
 #include "importer-common.h"
+#include "importer-processor.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// when set, all updates of a database are sent to one updater as a single task
+extern bool updater_db_affinity;
+
+typedef enum {
+    UPDATE_QUEUED,      // appended to the queue of the owning updater
+    UPDATE_MERGED,      // merged into a task waiting for the same database
+    UPDATE_REJECTED,    // the owning updater has shut down
+} update_schedule_result_t;
+
 extern zactor_t* stats_updater_new(zconfig_t *config, size_t id);
+// takes ownership of the processor, which has been destroyed unless it got queued
+extern update_schedule_result_t stats_updater_schedule(processor_state_t *processor);
+extern size_t stats_updater_rehome(size_t id);
 
 #ifdef __cplusplus
 }
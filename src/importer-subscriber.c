@@ -3,6 +3,7 @@
 #include "logjam-util.h"
 #include "device-tracker.h"
 #include "importer-prometheus-client.h"
+#include "importer-admission.h"
 
 /*
  * connections: n_s = num_subscribers, n_w = num_writers, n_p = num_parsers, "[<>^v]" = connect, "o" = bind
@@ -40,6 +41,10 @@ typedef struct {
     size_t message_gap_size;                  // messages missed due to gaps in the stream (since last tick)
     size_t message_drops;                     // messages dropped because push_socket wasn't ready (since last tick)
     size_t message_blocks;                    // how often the subscriber blocked on the push_socket (since last tick)
+    size_t messages_shed;                     // messages rejected by admission control (since last tick)
+    size_t frontend_messages;                 // frontend messages seen while sampling frontend traffic
+    recv_batch_t batch;                       // adaptive batch size and batch counts (since last tick)
+    zhash_t *stream_info_cache;               // used for latencies and admission decisions per stream
     zlist_t *subscriptions;                   // current subscriptions, NULL if socket has not been subscribed before
 } subscriber_state_t;
 
@@ -167,6 +172,20 @@ zsock_t* subscriber_push_socket_new(zconfig_t* config, size_t id)
     return socket;
 }
 
+static
+void record_latency(subscriber_state_t *state, zframe_t *stream_frame, msg_meta_t *meta)
+{
+    size_t n = zframe_size(stream_frame);
+    char stream_name[n+1];
+    memcpy(stream_name, zframe_data(stream_frame), n);
+    stream_name[n] = '\0';
+    stream_info_t *stream_info = get_stream_info(stream_name, state->stream_info_cache);
+    if (stream_info) {
+        importer_prometheus_client_observe_latency(stream_info, LATENCY_STAGE_SUBSCRIBER, meta->created_ms, zclock_time());
+        release_stream_info(stream_info);
+    }
+}
+
 static
 int process_meta_information_and_handle_heartbeat(subscriber_state_t *state, zmsg_t* msg, int* valid_meta)
 {
@@ -196,40 +215,124 @@ int process_meta_information_and_handle_heartbeat(subscriber_state_t *state, zms
         pub_spec = zframe_strdup(spec_frame);
     }
     state->message_gap_size += device_tracker_calculate_gap(state->tracker, &meta, pub_spec);
+    if (!is_heartbeat && latency_sampled(&meta))
+        record_latency(state, first, &meta);
     return is_heartbeat;
 }
 
+// message rates are used to weigh streams when partitioning
 static
-int read_request_and_forward(zloop_t *loop, zsock_t *socket, void *callback_data)
+void count_message(subscriber_state_t *state, zframe_t *stream_frame)
 {
-    subscriber_state_t *state = callback_data;
-    zmsg_t *msg = zmsg_recv(socket);
-    if (msg) {
-        state->message_count++;
-        state->message_bytes += zmsg_content_size(msg);
-        // printf("[D] received messsage size: %zu\n", zmsg_content_size(msg));
-        int n = zmsg_size(msg);
-        if (n != 4) {
-            fprintf(stderr, "[E] subscriber[%zu]: (%s:%d): dropped invalid message of size %d\n", state->id, __FILE__, __LINE__, n);
-            my_zmsg_fprint(msg, "[E] MSG", stderr);
-            return 0;
-        }
+    size_t n = zframe_size(stream_frame);
+    char stream_name[n+1];
+    memcpy(stream_name, zframe_data(stream_frame), n);
+    stream_name[n] = '\0';
+    stream_info_t *stream_info = get_stream_info(stream_name, state->stream_info_cache);
+    if (stream_info) {
+        count_stream_message(stream_info);
+        release_stream_info(stream_info);
+    }
+}
 
-        int valid_meta;
-        int is_heartbeat = process_meta_information_and_handle_heartbeat(state, msg, &valid_meta);
-        if (is_heartbeat) {
-            zmsg_destroy(&msg);
-            return 0;
-        }
+static
+void record_admission_decision(subscriber_state_t *state, zframe_t *stream_frame, admission_decision_t decision)
+{
+    size_t n = zframe_size(stream_frame);
+    char stream_name[n+1];
+    memcpy(stream_name, zframe_data(stream_frame), n);
+    stream_name[n] = '\0';
+    stream_info_t *stream_info = get_stream_info(stream_name, state->stream_info_cache);
+    if (stream_info) {
+        importer_prometheus_client_count_admission_decision_for_stream(stream_info, decision);
+        release_stream_info(stream_info);
+    }
+}
 
-        if (!output_socket_ready(state->push_socket, 0) && !state->message_blocks++)
-            fprintf(stderr, "[W] subscriber[%zu]: push socket not ready. blocking!\n", state->id);
+// backend requests always get through. under load, frontend messages get sampled first,
+// and everything else is dropped only when the parsers can't keep up at all.
+static
+bool admit_message(subscriber_state_t *state, zmsg_t *msg)
+{
+    admission_level_t level = admission_current_level();
+    if (level < ADMISSION_SAMPLE_FRONTEND)
+        return true;
+
+    zframe_t *stream_frame = zmsg_first(msg);
+    zframe_t *topic_frame = zmsg_next(msg);
+    const char *topic = (const char*) zframe_data(topic_frame);
+    size_t n = zframe_size(topic_frame);
+    if (n >= 4 && !strncmp("logs", topic, 4))
+        return true;
+
+    admission_decision_t decision;
+    if (level >= ADMISSION_SHED)
+        decision = ADMISSION_DROPPED;
+    else if (n >= 13 && (!strncmp("frontend.page", topic, 13) || !strncmp("frontend.ajax", topic, 13))) {
+        if (state->frontend_messages++ % ADMISSION_FRONTEND_SAMPLING_RATE == 0)
+            return true;
+        decision = ADMISSION_FRONTEND_SAMPLED_OUT;
+    } else
+        return true;
+
+    state->messages_shed++;
+    record_admission_decision(state, stream_frame, decision);
+    return false;
+}
 
-        int rc = zmsg_send_and_destroy(&msg, state->push_socket);
-        if (rc) {
-            if (!state->message_drops++)
-                fprintf(stderr, "[E] subscriber[%zu]: dropped message on push socket (%d: %s)\n", state->id, errno, zmq_strerror(errno));
-        }
+static
+void forward_request(subscriber_state_t *state, zmsg_t *msg)
+{
+    // printf("[D] received messsage size: %zu\n", zmsg_content_size(msg));
+    int n = zmsg_size(msg);
+    if (n != 4) {
+        fprintf(stderr, "[E] subscriber[%zu]: (%s:%d): dropped invalid message of size %d\n", state->id, __FILE__, __LINE__, n);
+        my_zmsg_fprint(msg, "[E] MSG", stderr);
+        zmsg_destroy(&msg);
+        return;
+    }
+
+    int valid_meta;
+    int is_heartbeat = process_meta_information_and_handle_heartbeat(state, msg, &valid_meta);
+    if (!is_heartbeat && stream_partitioning_enabled())
+        count_message(state, zmsg_first(msg));
+
+    if (is_heartbeat || !admit_message(state, msg)) {
+        zmsg_destroy(&msg);
+        return;
+    }
+
+    if (!output_socket_ready(state->push_socket, 0) && !state->message_blocks++)
+        fprintf(stderr, "[W] subscriber[%zu]: push socket not ready. blocking!\n", state->id);
+
+    int rc = zmsg_send_and_destroy(&msg, state->push_socket);
+    if (rc) {
+        if (!state->message_drops++)
+            fprintf(stderr, "[E] subscriber[%zu]: dropped message on push socket (%d: %s)\n", state->id, errno, zmq_strerror(errno));
+    } else
+        __atomic_add_fetch(&queued_parses, 1, __ATOMIC_RELAXED);
+}
+
+// drains up to batch.size messages per poll wakeup. only the first read can block.
+static
+int read_request_and_forward(zloop_t *loop, zsock_t *socket, void *callback_data)
+{
+    subscriber_state_t *state = callback_data;
+    size_t bytes = 0;
+    int received = 0;
+    zmsg_t *msg = zmsg_recv(socket);
+    while (msg) {
+        received++;
+        bytes += zmsg_content_size(msg);
+        forward_request(state, msg);
+        if (received >= state->batch.size || zsys_interrupted)
+            break;
+        msg = zmsg_recv_nowait(socket);
+    }
+    if (received) {
+        state->message_count += received;
+        state->message_bytes += bytes;
+        recv_batch_update(&state->batch, received);
     }
     return 0;
 }
@@ -290,7 +393,7 @@ int read_router_request_forward(zloop_t *loop, zsock_t *socket, void *callback_d
         goto answer;
     }
     is_ping = zframe_streq(zmsg_first(msg), "ping");
-    if (is_ping)
+    if (is_ping || !admit_message(state, msg))
         goto answer;
 
     if (!output_socket_ready(state->push_socket, 0) && !state->message_blocks++)
@@ -300,7 +403,8 @@ int read_router_request_forward(zloop_t *loop, zsock_t *socket, void *callback_d
     if (rc) {
         if (!state->message_drops++)
             fprintf(stderr, "[E] subscriber[%zu]: dropped message on push socket (%d: %s)\n", state->id, errno, zmq_strerror(errno));
-    }
+    } else
+        __atomic_add_fetch(&queued_parses, 1, __ATOMIC_RELAXED);
  answer:
     zmsg_destroy(&msg);
     if (reply) {
@@ -335,11 +439,12 @@ int actor_command(zloop_t *loop, zsock_t *socket, void *callback_data)
         }
         else if (streq(cmd, "tick")) {
             printf("[I] subscriber[%zu]: %5zu messages"
-                   "(size: %.2fMB, gap_size: %zu, no_info: %zu, dev_zero: %zu, blocks: %zu, drops: %zu)\n",
+                   "(size: %.2fMB, gap_size: %zu, no_info: %zu, dev_zero: %zu, blocks: %zu, drops: %zu, shed: %zu, batches: %zu, avg_batch: %.1f)\n",
                    state->id,
                    state->message_count, (double)state->message_bytes / 1048576,
                    state->message_gap_size, state->meta_info_failures,
-                   state->messages_dev_zero, state->message_blocks, state->message_drops);
+                   state->messages_dev_zero, state->message_blocks, state->message_drops,
+                   state->messages_shed, state->batch.batches, recv_batch_avg_size(&state->batch));
             importer_prometheus_client_count_msgs_received(state->message_count);
             importer_prometheus_client_count_bytes_received(state->message_bytes);
             importer_prometheus_client_count_msgs_missed(state->message_gap_size);
@@ -356,10 +461,26 @@ int actor_command(zloop_t *loop, zsock_t *socket, void *callback_data)
             state->messages_dev_zero = 0;
             state->message_drops = 0;
             state->message_blocks = 0;
+            state->messages_shed = 0;
+            recv_batch_reset_counters(&state->batch);
             device_number_recorder_fn *f = (device_number_recorder_fn*)importer_prometheus_client_record_device_sequence_number;
             device_tracker_record_sequence_numbers(state->tracker, f);
             if (++ticks % HEART_BEAT_INTERVAL == 0)
                 device_tracker_reconnect_stale_devices(state->tracker);
+            if (ticks % 60 == 0) {
+                zhash_destroy(&state->stream_info_cache);
+                state->stream_info_cache = zhash_new();
+            }
+        } else if (streq(cmd, "hold")) {
+            // stop forwarding while the controller drains a parser. incoming messages queue
+            // up on the sub socket in the meantime.
+            zsock_signal(socket, 0);
+            char *next = zstr_recv(socket);
+            if (next && streq(next, "$TERM"))
+                rc = -1;
+            else if (next == NULL || !streq(next, "resume"))
+                fprintf(stderr, "[E] subscriber[%zu]: expected resume command, got: %s\n", state->id, next ? next : "(null)");
+            zstr_free(&next);
         } else {
             fprintf(stderr, "[E] subscriber[%zu]: received unknown actor command: %s\n", state->id, cmd);
         }
@@ -387,6 +508,8 @@ subscriber_state_t* subscriber_state_new(zconfig_t* config, size_t id, zlist_t *
     subscriber_state_t *state = zmalloc(sizeof(*state));
     state->id = id;
     snprintf(state->me, 16, "subscriber[%zu]", id);
+    state->batch = (recv_batch_t)RECV_BATCH_INITIALIZER;
+    state->stream_info_cache = zhash_new();
     state->devices = devices;
     state->sub_socket = subscriber_sub_socket_new(config, state->devices, state->id);
     state->tracker = device_tracker_new(devices, state->sub_socket);
@@ -413,15 +536,15 @@ void subscriber_state_destroy(subscriber_state_t **state_p)
     }
     zsock_destroy(&state->push_socket);
     device_tracker_destroy(&state->tracker);
+    zhash_destroy(&state->stream_info_cache);
     *state_p = NULL;
 }
 
 static
 void update_subscriptions(subscriber_state_t *state, zlist_t *subscriptions)
 {
-    const char* pattern = get_subscription_pattern();
-    if (streq(pattern, "")) {
-        // no pattern set, we only need to subscribe once at startup
+    if (!stream_subscriptions_enabled()) {
+        // no pattern or partition set, we only need to subscribe once at startup
         if (state->subscriptions == NULL) {
             printf("[I] subscriber[%zu]: subscribing to all streams\n", state->id);
             zsock_set_subscribe(state->sub_socket, "");
@@ -495,8 +618,8 @@ int timer_function(zloop_t *loop, int timer_id, void* arg)
     assert(loop);
     zloop_set_verbose(loop, 0);
 
-    // set up timer for adapting socket subscriptions, if we have a subscription pattern
-    if (!streq(get_subscription_pattern(), ""))
+    // set up timer for adapting socket subscriptions, if we have a subscription pattern or partition
+    if (stream_subscriptions_enabled())
         zloop_timer(loop, 60000, 0, timer_function, state);
 
     // setup handler for actor messages
@@ -0,0 +1,311 @@
+#include "importer-timingslog.h"
+#include <zlib.h>
+
+bool timings_log_enabled = false;
+size_t timings_log_max_file_size = 0;
+int64_t timings_log_max_file_age = 0;
+bool timings_log_compress = false;
+
+typedef struct timings_buffer {
+    pthread_mutex_t mutex;          // only contended while the writer swaps buffers
+    char *data;
+    size_t used;
+    size_t dropped;                 // lines which didn't fit into the buffer
+    bool orphaned;                  // owning thread has terminated
+    struct timings_buffer *next;
+} timings_buffer_t;
+
+// buffers of all threads which have logged timings
+static timings_buffer_t *buffers = NULL;
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buffer_key;
+
+// only used by the main thread before the actor starts, and by the actor afterwards
+static const char *base_file_name = NULL;
+static char file_name[1024];
+static FILE *file = NULL;
+static gzFile gz_file = NULL;
+static size_t file_size = 0;
+static int64_t file_opened_at = 0;
+static bool open_failed = false;     // reported once, retried on every drain
+
+typedef struct {
+    zsock_t *pipe;
+    char *spare;                    // swapped with the buffer being drained
+    size_t lines_dropped;
+    size_t bytes_discarded;         // drained while no file could be opened
+} timings_log_state_t;
+
+static
+void timings_buffer_orphan(void *arg)
+{
+    timings_buffer_t *buffer = arg;
+    pthread_mutex_lock(&buffer->mutex);
+    buffer->orphaned = true;
+    pthread_mutex_unlock(&buffer->mutex);
+}
+
+static
+timings_buffer_t* timings_buffer_new()
+{
+    timings_buffer_t *buffer = zmalloc(sizeof(*buffer));
+    pthread_mutex_init(&buffer->mutex, NULL);
+    buffer->data = zmalloc(TIMINGS_LOG_BUFFER_SIZE);
+    pthread_setspecific(buffer_key, buffer);
+
+    pthread_mutex_lock(&buffers_mutex);
+    buffer->next = buffers;
+    buffers = buffer;
+    pthread_mutex_unlock(&buffers_mutex);
+    return buffer;
+}
+
+static
+void timings_buffer_destroy(timings_buffer_t **buffer_p)
+{
+    timings_buffer_t *buffer = *buffer_p;
+    pthread_mutex_destroy(&buffer->mutex);
+    free(buffer->data);
+    free(buffer);
+    *buffer_p = NULL;
+}
+
+void timings_log_printf(const char *format, ...)
+{
+    timings_buffer_t *buffer = pthread_getspecific(buffer_key);
+    if (buffer == NULL)
+        buffer = timings_buffer_new();
+
+    pthread_mutex_lock(&buffer->mutex);
+    size_t available = TIMINGS_LOG_BUFFER_SIZE - buffer->used;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer->data + buffer->used, available, format, args);
+    va_end(args);
+    // a truncated line stays after the end of the used part and gets overwritten
+    if (n >= 0 && (size_t)n < available)
+        buffer->used += n;
+    else
+        buffer->dropped++;
+    pthread_mutex_unlock(&buffer->mutex);
+}
+
+static
+bool timings_log_open()
+{
+    file_opened_at = zclock_time() / 1000;
+    file_size = 0;
+
+    if (timings_log_max_file_size == 0 && timings_log_max_file_age == 0 && !timings_log_compress) {
+        snprintf(file_name, sizeof(file_name), "%s", base_file_name);
+    } else {
+        char timestamp[32];
+        time_t now = file_opened_at;
+        struct tm local;
+        strftime(timestamp, sizeof(timestamp), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+        const char *extension = timings_log_compress ? ".gz" : "";
+        snprintf(file_name, sizeof(file_name), "%s.%s%s", base_file_name, timestamp, extension);
+        // names have second resolution, but a file can fill up faster than that
+        for (int sequence = 1; access(file_name, F_OK) == 0; sequence++)
+            snprintf(file_name, sizeof(file_name), "%s.%s.%d%s", base_file_name, timestamp, sequence, extension);
+    }
+
+    // appending to a gzip file adds another gzip member, which zcat handles fine
+    if (timings_log_compress)
+        gz_file = gzopen(file_name, "ab");
+    else
+        file = fopen(file_name, "a");
+
+    return file || gz_file;
+}
+
+static
+void timings_log_close()
+{
+    if (gz_file) {
+        gzclose(gz_file);
+        gz_file = NULL;
+    }
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+bool timings_log_init(const char *name)
+{
+    base_file_name = name;
+    int rc = pthread_key_create(&buffer_key, timings_buffer_orphan);
+    assert(rc == 0);
+    timings_log_enabled = timings_log_open();
+    return timings_log_enabled;
+}
+
+static
+void timings_log_reopen()
+{
+    if (timings_log_open()) {
+        if (open_failed)
+            printf("[I] timings log: writing to %s\n", file_name);
+        open_failed = false;
+    } else if (!open_failed) {
+        fprintf(stderr, "[E] timings log: could not open %s: %s\n", file_name, strerror(errno));
+        open_failed = true;
+    }
+}
+
+static
+void timings_log_write(timings_log_state_t *state, const char *data, size_t len)
+{
+    if (len == 0)
+        return;
+    if (!file && !gz_file) {
+        state->bytes_discarded += len;
+        return;
+    }
+    if (gz_file) {
+        if (gzwrite(gz_file, data, len) != (int)len)
+            fprintf(stderr, "[E] timings log: could not write to %s\n", file_name);
+    } else if (file) {
+        if (fwrite(data, 1, len, file) != len)
+            fprintf(stderr, "[E] timings log: could not write to %s: %s\n", file_name, strerror(errno));
+    }
+    file_size += len;
+}
+
+static
+void timings_log_rotate_if_needed()
+{
+    if (!file && !gz_file)
+        return;
+    bool too_large = timings_log_max_file_size > 0 && file_size >= timings_log_max_file_size;
+    bool too_old = timings_log_max_file_age > 0 && zclock_time() / 1000 - file_opened_at >= timings_log_max_file_age;
+    if (!too_large && !too_old)
+        return;
+    if (verbose)
+        printf("[D] timings log: rotating %s (%zu bytes)\n", file_name, file_size);
+    timings_log_close();
+    timings_log_reopen();
+}
+
+static
+void timings_log_drain(timings_log_state_t *state)
+{
+    pthread_mutex_lock(&buffers_mutex);
+    timings_buffer_t **link = &buffers;
+    while (*link) {
+        timings_buffer_t *buffer = *link;
+
+        pthread_mutex_lock(&buffer->mutex);
+        char *data = buffer->data;
+        size_t used = buffer->used;
+        bool orphaned = buffer->orphaned;
+        state->lines_dropped += buffer->dropped;
+        buffer->data = state->spare;
+        buffer->used = 0;
+        buffer->dropped = 0;
+        pthread_mutex_unlock(&buffer->mutex);
+
+        state->spare = data;
+        timings_log_write(state, data, used);
+
+        if (orphaned) {
+            *link = buffer->next;
+            timings_buffer_destroy(&buffer);
+        } else
+            link = &buffer->next;
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+
+    if (file)
+        fflush(file);
+}
+
+static
+int drain_timer(zloop_t *loop, int timer_id, void *arg)
+{
+    if (!file && !gz_file)
+        timings_log_reopen();
+    timings_log_drain(arg);
+    timings_log_rotate_if_needed();
+    return 0;
+}
+
+static
+int report_timer(zloop_t *loop, int timer_id, void *arg)
+{
+    timings_log_state_t *state = arg;
+    if (state->lines_dropped) {
+        fprintf(stderr, "[W] timings log: dropped %zu lines, as parsers filled their buffers\n", state->lines_dropped);
+        state->lines_dropped = 0;
+    }
+    if (state->bytes_discarded) {
+        fprintf(stderr, "[E] timings log: discarded %zu bytes, as %s could not be opened\n", state->bytes_discarded, file_name);
+        state->bytes_discarded = 0;
+    }
+    return 0;
+}
+
+static
+int actor_command(zloop_t *loop, zsock_t *socket, void *callback_data)
+{
+    int rc = 0;
+    zmsg_t *msg = zmsg_recv(socket);
+    if (msg) {
+        char *cmd = zmsg_popstr(msg);
+        if (streq(cmd, "$TERM")) {
+            rc = -1;
+        } else {
+            fprintf(stderr, "[E] timings log: received unknown actor command: %s\n", cmd);
+        }
+        free(cmd);
+        zmsg_destroy(&msg);
+    }
+    return rc;
+}
+
+void timings_log_actor_fn(zsock_t *pipe, void *args)
+{
+    set_thread_name("timings_log[0]");
+
+    int rc;
+    timings_log_state_t state = { .pipe = pipe };
+    state.spare = zmalloc(TIMINGS_LOG_BUFFER_SIZE);
+
+    zsock_signal(pipe, 0);
+
+    zloop_t *loop = zloop_new();
+    assert(loop);
+    zloop_set_verbose(loop, 0);
+
+    rc = zloop_reader(loop, state.pipe, actor_command, &state);
+    assert(rc == 0);
+
+    rc = zloop_timer(loop, TIMINGS_LOG_DRAIN_INTERVAL, 0, drain_timer, &state);
+    assert(rc != -1);
+
+    rc = zloop_timer(loop, 60000, 0, report_timer, &state);
+    assert(rc != -1);
+
+    if (!quiet)
+        printf("[I] timings log: writing to %s\n", file_name);
+
+    bool should_continue_to_run = getenv("CPUPROFILE") != NULL;
+    do {
+        rc = zloop_start(loop);
+        should_continue_to_run &= errno == EINTR;
+        log_zmq_error(rc, __FILE__, __LINE__);
+    } while (should_continue_to_run);
+
+    // parsers have been shut down before us
+    timings_log_drain(&state);
+    report_timer(loop, 0, &state);
+    timings_log_close();
+
+    free(state.spare);
+    zloop_destroy(&loop);
+    assert(loop == NULL);
+
+    if (!quiet)
+        printf("[I] timings log: terminated\n");
+}
@@ -0,0 +1,32 @@
+#ifndef __LOGJAM_IMPORTER_TIMINGSLOG_H_INCLUDED__
+#define __LOGJAM_IMPORTER_TIMINGSLOG_H_INCLUDED__
+
+#include "importer-common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// frontend timings are appended to a buffer owned by the calling thread. the timings log
+// actor swaps out and writes all buffers every TIMINGS_LOG_DRAIN_INTERVAL ms, so parsers
+// never wait for file io. lines are dropped when a buffer is full.
+#define TIMINGS_LOG_BUFFER_SIZE (1024*1024)
+#define TIMINGS_LOG_DRAIN_INTERVAL 100
+
+extern bool timings_log_enabled;
+// rotation and compression are off by default, which appends to the given file forever
+extern size_t timings_log_max_file_size;     // uncompressed bytes, 0 means unlimited
+extern int64_t timings_log_max_file_age;     // seconds, 0 means unlimited
+extern bool timings_log_compress;            // write gzip files
+
+// opens the first log file, returns false if that fails
+extern bool timings_log_init(const char *file_name);
+extern void timings_log_printf(const char *format, ...) __attribute__ ((format (printf, 1, 2)));
+
+extern void timings_log_actor_fn(zsock_t *pipe, void *args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
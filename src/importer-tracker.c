@@ -89,15 +89,18 @@ int tracker_add_uuid(uuid_tracker_t *tracker, const char* uuid)
     return zstr_send(tracker->additions, uuid);
 }
 
-// client interface to send uuid deletion requests to server (synchronously)
-// returns whether request has been successfull
-int tracker_delete_uuid(uuid_tracker_t *tracker, const char* uuid, zmsg_t* original_msg, const char* request_type)
+// client interface to send a batch of uuid deletion requests to server (synchronously).
+// sets deleted[i] to whether the deletion of uuids[i] has been successful.
+int tracker_delete_uuids(uuid_tracker_t *tracker, size_t n, const char** uuids, zmsg_t** original_msgs, const char** request_types, int *deleted)
 {
+    memset(deleted, 0, n * sizeof(int));
     zmsg_t *msg = zmsg_new();
     if (!msg) return 0;
-    zmsg_addstr(msg, uuid);
-    zmsg_addptr(msg, original_msg);
-    zmsg_addstr(msg, request_type);
+    for (size_t i = 0; i < n; i++) {
+        zmsg_addstr(msg, uuids[i]);
+        zmsg_addptr(msg, original_msgs[i]);
+        zmsg_addstr(msg, request_types[i]);
+    }
 
     if (zmsg_send_with_retry(&msg, tracker->deletions)) {
         // we got interrupted
@@ -106,14 +109,22 @@ int tracker_delete_uuid(uuid_tracker_t *tracker, const char* uuid, zmsg_t* origi
 
     msg = zmsg_recv(tracker->deletions);
     assert(msg);
-    int deleted = 0;
     zframe_t *rcf = zmsg_first(msg);
     if (rcf) {
-        assert(zframe_size(rcf) == sizeof(int));
-        deleted = *((int*)zframe_data(rcf));
+        assert(zframe_size(rcf) == n * sizeof(int));
+        memcpy(deleted, zframe_data(rcf), n * sizeof(int));
     }
     zmsg_destroy(&msg);
 
+    return 1;
+}
+
+// client interface to send uuid deletion requests to server (synchronously)
+// returns whether request has been successfull
+int tracker_delete_uuid(uuid_tracker_t *tracker, const char* uuid, zmsg_t* original_msg, const char* request_type)
+{
+    int deleted = 0;
+    tracker_delete_uuids(tracker, 1, &uuid, &original_msg, &request_type, &deleted);
     return deleted;
 }
 
@@ -275,19 +286,9 @@ int server_add_uuid(zloop_t *loop, zsock_t *socket, void *args)
 
 // delete a uuid
 static
-int server_delete_uuid(zloop_t *loop, zsock_t *socket, void *arg)
+int server_delete_one_uuid(tracker_state_t *state, const char *uuid, zmsg_t *original_msg)
 {
     int rc = 0;
-    tracker_state_t *state = arg;
-    server_clean_expired_items(state);
-    zmsg_t *msg = zmsg_recv(socket);
-    assert(msg);
-    char *uuid = zmsg_popstr(msg);
-    assert(uuid);
-    zmsg_t *original_msg = zmsg_popptr(msg);
-    assert(original_msg);
-    char *request_type = zmsg_popstr(msg);
-    assert(request_type);
     uint64_t seen;
     if ( (seen = (uint64_t)zring_lookup(state->uuids, uuid)) ) {
         // printf("[D] tracker[%zu]: found uuid: %s\n", state->id, uuid);
@@ -296,7 +297,7 @@ int server_delete_uuid(zloop_t *loop, zsock_t *socket, void *arg)
         zring_insert(state->successes, uuid, (void*)seen);
         state->deleted++;
     } else if ( zring_lookup(state->successes, uuid) || zring_lookup(state->failures, uuid) ) {
-        // fprintf(stderr, "[W] tracker[%zu]: duplicate %s uuid: %s\n", state->id, request_type, uuid);
+        // fprintf(stderr, "[W] tracker[%zu]: duplicate uuid: %s\n", state->id, uuid);
         state->duplicates++;
     } else {
         // printf("[D] tracker[%zu]: missing uuid: %s\n", state->id, uuid);
@@ -306,9 +307,32 @@ int server_delete_uuid(zloop_t *loop, zsock_t *socket, void *arg)
         zmsg_clear_device_and_sequence_number(failure->msg);
         zring_insert(state->failures, uuid, failure);
     }
-    free(uuid);
-    free(request_type);
-    zmsg_addmem(msg, &rc, sizeof(rc));
+    return rc;
+}
+
+// delete a batch of uuids, sent as (uuid, original message, request type) triples
+static
+int server_delete_uuid(zloop_t *loop, zsock_t *socket, void *arg)
+{
+    tracker_state_t *state = arg;
+    server_clean_expired_items(state);
+    zmsg_t *msg = zmsg_recv(socket);
+    assert(msg);
+    size_t n = zmsg_size(msg) / 3;
+    assert(n > 0 && zmsg_size(msg) == 3 * n);
+    int rcs[n];
+    for (size_t i = 0; i < n; i++) {
+        char *uuid = zmsg_popstr(msg);
+        assert(uuid);
+        zmsg_t *original_msg = zmsg_popptr(msg);
+        assert(original_msg);
+        char *request_type = zmsg_popstr(msg);
+        assert(request_type);
+        rcs[i] = server_delete_one_uuid(state, uuid, original_msg);
+        free(uuid);
+        free(request_type);
+    }
+    zmsg_addmem(msg, rcs, sizeof(rcs));
     zmsg_send_with_retry(&msg, socket);
     return 0;
 }
@@ -13,6 +13,7 @@ extern uuid_tracker_t* tracker_new();
 extern void tracker_destroy(uuid_tracker_t **tracker);
 extern int tracker_add_uuid(uuid_tracker_t *tracker, const char* uuid);
 extern int tracker_delete_uuid(uuid_tracker_t *tracker, const char* uuid, zmsg_t* original_msg, const char* request_type);
+extern int tracker_delete_uuids(uuid_tracker_t *tracker, size_t n, const char** uuids, zmsg_t** original_msgs, const char** request_types, int *deleted);
 
 extern void tracker(zsock_t *pipe, void *args);
 
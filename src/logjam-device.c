@@ -46,6 +46,9 @@ static size_t compressed_messages_count = 0;
 static size_t compressed_messages_bytes = 0;
 static size_t compressed_messages_max_bytes = 0;
 
+static recv_batch_t receiver_batch = RECV_BATCH_INITIALIZER;
+static recv_batch_t compressor_batch = RECV_BATCH_INITIALIZER;
+
 static size_t io_threads = 1;
 static size_t num_compressors = 4;
 
@@ -65,6 +68,7 @@ static zactor_t *device_watchdog = NULL;
 int metrics_port = 8082;
 char metrics_address[256] = {0};
 const char *metrics_ip = "0.0.0.0";
+static const char *thread_placement_spec = NULL;
 
 typedef struct {
     char *app_env;
@@ -73,6 +77,25 @@ typedef struct {
 
 static zhashx_t *routing_id_to_app_env= NULL;
 
+// per stream ping and broken meta counts since the last tick
+static zhashx_t *pings_by_stream = NULL;
+static zhashx_t *broken_metas_by_stream = NULL;
+
+static void count_for_stream(zhashx_t *counts, const char *app_env)
+{
+    size_t n = (size_t)zhashx_lookup(counts, app_env);
+    zhashx_update(counts, app_env, (void*)(n+1));
+}
+
+typedef void (stream_count_fn)(const char* app_env, double value);
+
+static void flush_stream_counts(zhashx_t *counts, stream_count_fn *f)
+{
+    for (void *n = zhashx_first(counts); n; n = zhashx_next(counts))
+        f(zhashx_cursor(counts), (size_t)n);
+    zhashx_purge(counts);
+}
+
 static void free_app_env_record(void *self)
 {
     app_env_record_t *r = self;
@@ -138,6 +161,8 @@ static int timer_event(zloop_t *loop, int timer_id, void *arg)
     device_prometheus_client_count_pings(ping_count);
     device_prometheus_client_count_invalid_messages(invalid_count);
     device_prometheus_client_count_broken_metas(broken_meta_count);
+    flush_stream_counts(pings_by_stream, device_prometheus_client_count_ping);
+    flush_stream_counts(broken_metas_by_stream, device_prometheus_client_count_broken_meta);
     device_prometheus_client_record_rusage();
     device_prometheus_client_set_sequence_number(msg_meta.sequence_number);
     device_prometheus_client_set_msg_max_bytes(received_messages_max_bytes);
@@ -156,7 +181,13 @@ static int timer_event(zloop_t *loop, int timer_id, void *arg)
 
         printf("[I] pings: %zu, invalid msgs: %zu, broken metas: %zu\n",
                ping_count, invalid_count, broken_meta_count);
+
+        printf("[I] batches: %zu (avg: %.1f, limit: %d), compressor batches: %zu (avg: %.1f, limit: %d)\n",
+               receiver_batch.batches, recv_batch_avg_size(&receiver_batch), receiver_batch.size,
+               compressor_batch.batches, recv_batch_avg_size(&compressor_batch), compressor_batch.size);
     }
+    recv_batch_reset_counters(&receiver_batch);
+    recv_batch_reset_counters(&compressor_batch);
 
     last_received_count = received_messages_count;
     last_ping_count = ping_count_total;
@@ -217,7 +248,9 @@ static int timer_event(zloop_t *loop, int timer_id, void *arg)
     return 0;
 }
 
-static int read_multipart_msg(void* socket, zmq_msg_t *parts, int n, int* read)
+// flags apply to the first part only, the remaining parts of a multipart
+// message are always available once the first one has arrived
+static int read_multipart_msg(void* socket, zmq_msg_t *parts, int n, int* read, int flags)
 {
     int i = 0;
     int rc = 0;
@@ -226,7 +259,7 @@ static int read_multipart_msg(void* socket, zmq_msg_t *parts, int n, int* read)
         // printf("[D] receiving part %d\n", i+1);
         if (i<n) {
             zmq_msg_init(&parts[i]);
-            rc = zmq_recvmsg(socket, &parts[i], 0);
+            rc = zmq_recvmsg(socket, &parts[i], i == 0 ? flags : 0);
         } else {
             zmq_msg_t dummy_msg;
             zmq_msg_init(&dummy_msg);
@@ -236,6 +269,10 @@ static int read_multipart_msg(void* socket, zmq_msg_t *parts, int n, int* read)
         if (rc == -1) {
             if (i<n)
                 zmq_msg_close(&parts[i]);
+            if (i == 0 && errno == EAGAIN) {
+                *read = 0;
+                return -1;
+            }
             if (errno == EINTR) {
                 if (i == 0) {
                     *read = 0;
@@ -273,19 +310,34 @@ static bool warn_msg_size(zmq_msg_t *parts, int n, int min, int max)
     return false;
 }
 
-static void update_message_stats(void* socket, publisher_state_t *state, zmq_msg_t* body)
+// message stats of a drained batch, added to the global counters once per batch
+typedef struct {
+    size_t count;
+    size_t bytes;
+    size_t max_bytes;
+} message_stats_t;
+
+static void update_message_stats(message_stats_t *stats, zmq_msg_t* body)
 {
     size_t msg_bytes = zmq_msg_size(body);
+    stats->count++;
+    stats->bytes += msg_bytes;
+    if (msg_bytes > stats->max_bytes)
+        stats->max_bytes = msg_bytes;
+}
+
+static void add_message_stats(void* socket, publisher_state_t *state, message_stats_t *stats)
+{
     if (socket == state->compressor_output) {
-        compressed_messages_count++;
-        compressed_messages_bytes += msg_bytes;
-        if (msg_bytes > compressed_messages_max_bytes)
-            compressed_messages_max_bytes = msg_bytes;
+        compressed_messages_count += stats->count;
+        compressed_messages_bytes += stats->bytes;
+        if (stats->max_bytes > compressed_messages_max_bytes)
+            compressed_messages_max_bytes = stats->max_bytes;
     } else {
-        received_messages_count++;
-        received_messages_bytes += msg_bytes;
-        if (msg_bytes > received_messages_max_bytes)
-            received_messages_max_bytes = msg_bytes;
+        received_messages_count += stats->count;
+        received_messages_bytes += stats->bytes;
+        if (stats->max_bytes > received_messages_max_bytes)
+            received_messages_max_bytes = stats->max_bytes;
     }
 }
 
@@ -314,18 +366,19 @@ static void record_broken_meta(zmq_msg_t *stream_part)
     char app_env[n+1];
     memcpy(app_env, data, n);
     app_env[n] = '\0';
-    device_prometheus_client_count_broken_meta(app_env);
+    count_for_stream(broken_metas_by_stream, app_env);
 }
 
-static int read_zmq_message_and_forward(zloop_t *loop, zsock_t *sock, void *callback_data)
+// returns false if no message could be read
+static bool read_one_zmq_message_and_forward(void *socket, publisher_state_t *state, message_stats_t *stats, int flags)
 {
     zmq_msg_t message_parts[10];
-    publisher_state_t *state = (publisher_state_t*)callback_data;
-    void *socket = zsock_resolve(sock);
 
     int n;
-    int rc = read_multipart_msg(socket, message_parts, 10, &n);
+    int rc = read_multipart_msg(socket, message_parts, 10, &n, flags);
     if (rc) {
+        if (n == 0 && errno == EAGAIN)
+            return false;
         fprintf(stderr, "[E] unexpected error on recv: %d (%s)\n", errno, zmq_strerror(errno));
         goto cleanup;
     }
@@ -368,13 +421,37 @@ static int read_zmq_message_and_forward(zloop_t *loop, zsock_t *sock, void *call
         goto cleanup;
     }
 
-    update_message_stats(socket, state, &message_parts[2]);
+    update_message_stats(stats, &message_parts[2]);
     compress_or_forward(message_parts, &meta, state);
 
  cleanup:
     for (int i=n-1; i>=0; i--)
         zmq_msg_close(&message_parts[i]);
 
+    return n > 0;
+}
+
+// drains up to batch.size messages per poll wakeup. only the first read can block.
+static int read_zmq_message_and_forward(zloop_t *loop, zsock_t *sock, void *callback_data)
+{
+    publisher_state_t *state = (publisher_state_t*)callback_data;
+    void *socket = zsock_resolve(sock);
+    recv_batch_t *batch = socket == state->compressor_output ? &compressor_batch : &receiver_batch;
+
+    message_stats_t stats = {0};
+    int received = 0;
+    int flags = 0;
+    while (received < batch->size && !zsys_interrupted) {
+        if (!read_one_zmq_message_and_forward(socket, state, &stats, flags))
+            break;
+        received++;
+        flags = ZMQ_DONTWAIT;
+    }
+    if (received) {
+        add_message_stats(socket, state, &stats);
+        recv_batch_update(batch, received);
+    }
+
     return 0;
 }
 
@@ -409,7 +486,7 @@ static void record_ping(zmq_msg_t *sender_id, const char *routing_key, int routi
         char app_env[routing_key_len+1];
         memcpy(app_env, routing_key, routing_key_len);
         app_env[routing_key_len] = '\0';
-        device_prometheus_client_count_ping(app_env);
+        count_for_stream(pings_by_stream, app_env);
     } else {
         int sender_id_len = zmq_msg_size(sender_id);
         char routing_id[2*sender_id_len+1];
@@ -422,7 +499,7 @@ static void record_ping(zmq_msg_t *sender_id, const char *routing_key, int routi
             r->last_seen = zclock_time();
             app_env = r->app_env;
         }
-        device_prometheus_client_count_ping(app_env);
+        count_for_stream(pings_by_stream, app_env);
     }
 }
 
@@ -433,7 +510,7 @@ static int read_router_message_and_forward(zloop_t *loop, zsock_t *sock, void *c
     void *socket = zsock_resolve(sock);
 
     int n;
-    int rc = read_multipart_msg(socket, message_parts, 12, &n);
+    int rc = read_multipart_msg(socket, message_parts, 12, &n, 0);
     if (rc) {
         fprintf(stderr, "[E] unexpected error on recv: %d (%s)\n", errno, zmq_strerror(errno));
         goto cleanup;
@@ -540,8 +617,9 @@ static int read_router_message_and_forward(zloop_t *loop, zsock_t *sock, void *c
             goto cleanup;
         }
 
-        zmq_msg_t *body = &message_parts[app_env_index+2];
-        update_message_stats(socket, state, body);
+        message_stats_t stats = {0};
+        update_message_stats(&stats, &message_parts[app_env_index+2]);
+        add_message_stats(socket, state, &stats);
         compress_or_forward(message_parts+app_env_index, &meta, state);
     }
 
@@ -572,6 +650,7 @@ static void print_usage(char * const *argv)
             "  -M, --metrics-ip N         ip for binding metrics endpoint\n"
             "  -T, --trim-frequency N     malloc trim freqency in seconds, 0 means no trimming\n"
             "  -A, --allow-invalid-meta   allow invalid meta data\n"
+            "  -K, --placement P          pin threads to cpus, e.g. \"compressor=0-3 zmq_io=4\"\n"
             "      --help                 display this message\n"
             "\nEnvironment: (parameters take precedence)\n"
             "  LOGJAM_RCV_HWM             high watermark for input socket\n"
@@ -604,10 +683,11 @@ static void process_arguments(int argc, char * const *argv)
         { "metrics-ip",         required_argument, 0, 'M' },
         { "trim-frequency",     required_argument, 0, 'T' },
         { "allow-invalid-meta", no_argument,       0, 'A' },
+        { "placement",          required_argument, 0, 'K' },
         { 0,                    0,                 0,  0  }
     };
 
-    while ((c = getopt_long(argc, argv, "vqd:p:c:i:x:C:P:S:s:R:t:m:M:T:A", long_options, &longindex)) != -1) {
+    while ((c = getopt_long(argc, argv, "vqd:p:c:i:x:C:P:S:s:R:t:m:M:T:AK:", long_options, &longindex)) != -1) {
         switch (c) {
         case 'v':
             if (verbose)
@@ -668,6 +748,9 @@ static void process_arguments(int argc, char * const *argv)
         case 'A':
             allow_invalid_meta = true;
             break;
+        case 'K':
+            thread_placement_spec = optarg;
+            break;
         case 0:
             print_usage(argv);
             exit(0);
@@ -723,6 +806,9 @@ int main(int argc, char * const *argv)
                , argv[0], pull_port, pub_port, router_port, metrics_port, stats_port, io_threads, rcv_hwm, snd_hwm);
     }
 
+    if (thread_placement_spec && !thread_placement_init(thread_placement_spec, !quiet))
+        exit(1);
+
     // set global config
     zsys_init();
     zsys_set_rcvhwm(10000);
@@ -730,9 +816,12 @@ int main(int argc, char * const *argv)
     zsys_set_pipehwm(1000);
     zsys_set_linger(100);
     zsys_set_io_threads(io_threads);
+    thread_placement_pin_zmq_io_threads();
 
     compression_buffer = zchunk_new(NULL, INITIAL_COMPRESSION_BUFFER_SIZE);
     routing_id_to_app_env = zhashx_new();
+    pings_by_stream = zhashx_new();
+    broken_metas_by_stream = zhashx_new();
 
     // initalize prometheus client
     snprintf(metrics_address, sizeof(metrics_address), "%s:%d", metrics_ip, metrics_port);
@@ -10,6 +10,7 @@
 #include "graylog-forwarder-common.h"
 #include "graylog-forwarder-controller.h"
 #include "graylog-forwarder-prometheus-client.h"
+#include "logjam-streaminfo.h"
 
 // flags
 bool dryrun = false;
@@ -36,6 +37,7 @@ char *headers_file_name = NULL;
 int metrics_port = 8083;
 char metrics_address[256] = {0};
 const char *metrics_ip = "0.0.0.0";
+static const char *thread_placement_spec = NULL;
 
 static void print_usage(char * const *argv)
 {
@@ -58,6 +60,7 @@ static void print_usage(char * const *argv)
             "  -M, --metrics-ip N         ip for binding metrics endpoint\n"
             "  -T, --trim-frequency N     malloc trim freqency in seconds, 0 means no trimming\n"
             "  -H, --headers H            name of the whitelisted HTTP headers file\n"
+            "  -K, --placement P          pin threads to cpus, e.g. \"parser=0-3 writer=4 zmq_io=5\"\n"
             "      --help                 display this message\n"
             "\nEnvironment: (parameters take precedence)\n"
             "  LOGJAM_DEVICES             specs of devices to connect to\n"
@@ -96,10 +99,11 @@ static void process_arguments(int argc, char * const *argv)
         { "metrics-ip",     required_argument, 0, 'M' },
         { "trim-frequency", required_argument, 0, 'T' },
         { "headers",        required_argument, 0, 'H' },
+        { "placement",      required_argument, 0, 'K' },
         { 0,                0,                 0,  0  }
     };
 
-    while ((c = getopt_long(argc, argv, "vqc:np:zh:S:R:e:L:A:d:m:M:T:H:", long_options, &longindex)) != -1) {
+    while ((c = getopt_long(argc, argv, "vqc:np:zh:S:R:e:L:A:d:m:M:T:H:K:", long_options, &longindex)) != -1) {
         switch (c) {
         case 'v':
             if (verbose)
@@ -167,6 +171,9 @@ static void process_arguments(int argc, char * const *argv)
         case 'A':
             heartbeat_abort_after = atoi(optarg);
             break;
+        case 'K':
+            thread_placement_spec = optarg;
+            break;
         case 'H': {
             headers_file_name = optarg;
             break;
@@ -248,6 +255,15 @@ int main(int argc, char * const *argv)
         config = zconfig_load((char*)config_file_name);
     }
 
+    // pin threads before any of them gets started
+    if (thread_placement_spec == NULL)
+        thread_placement_spec = zconfig_resolve(config, "/graylog/threads/placement", NULL);
+    if (thread_placement_spec) {
+        if (!thread_placement_init(thread_placement_spec, !quiet))
+            exit(1);
+        thread_placement_pin_zmq_io_threads();
+    }
+
     // initalize prometheus client
     snprintf(metrics_address, sizeof(metrics_address), "%s:%d", metrics_ip, metrics_port);
     graylog_forwarder_prometheus_client_init(metrics_address, num_parsers);
@@ -282,6 +298,11 @@ int main(int argc, char * const *argv)
     if (snd_hwm == -1)
         snd_hwm = atoi(zconfig_resolve(config, "/graylog/high_water_mark", DEFAULT_SND_HWM_STR));
 
+    // start with the last known stream config, if we have one
+    const char *stream_config_snapshot = zconfig_resolve(config, "/logjam/stream_config_snapshot", NULL);
+    if (stream_config_snapshot)
+        set_stream_config_cache_file(stream_config_snapshot);
+
     if (!quiet)
         printf("[I] started %s\n"
                "[I] interface %s\n"
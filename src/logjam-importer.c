@@ -4,22 +4,19 @@
 #include "importer-mongoutils.h"
 #include "importer-processor.h"
 #include "importer-prometheus-client.h"
+#include "importer-admission.h"
+#include "importer-statsupdater.h"
+#include "importer-checkpoint.h"
+#include "importer-elastic.h"
+#include "importer-pageguard.h"
+#include "importer-jsedup.h"
+#include "importer-requestwriter.h"
+#include "importer-timingslog.h"
 #include <getopt.h>
 
-int snd_hwm = -1;
-int rcv_hwm = -1;
-int pull_port = -1;
-int router_port = -1;
-int sub_port = -1;
-int replay_port = -1;
 int metrics_port = -1;
 char metrics_address[256] = {0};
-char* live_stream_connection_spec = NULL;
-char* unknown_streams_collector_connection_spec = NULL;
 const char *metrics_ip = "0.0.0.0";
-zlist_t *hosts = NULL;
-
-int replay_router_msgs = -1;
 
 static uint64_t indexer_opts = 0;
 
@@ -29,9 +26,9 @@ static char *logjam_stream_url = "http://localhost:3000/admin/streams";
 static const char *subscription_pattern = NULL;
 static const char *config_file_name = "logjam.conf";
 
-FILE* frontend_timings = NULL;
 static char *frontend_timings_file_name = NULL;
 static char *frontend_timings_apdex_attr = NULL;
+static const char *thread_placement_spec = NULL;
 
 static char* num_subscribers_arg_value = NULL;
 static char* num_parsers_arg_value = NULL;
@@ -60,6 +57,159 @@ static void setup_thread_counts(zconfig_t* config)
         num_writers_arg_value = zconfig_resolve(config, "frontend/threads/writers", NULL);
     if (num_writers_arg_value)
         num_writers = strtoul(num_writers_arg_value, NULL, 0);
+
+    // parsers, writers and updaters can be added at runtime, up to the given maximum
+    unsigned long *max_values[] = {&max_parsers, &max_writers, &max_updaters};
+    const char *max_names[] = {"frontend/threads/max_parsers", "frontend/threads/max_writers", "frontend/threads/max_updaters"};
+    unsigned long limits[] = {MAX_PARSERS, MAX_WRITERS, MAX_UPDATERS};
+    for (int i = 0; i < 3; i++) {
+        const char *v = zconfig_resolve(config, max_names[i], NULL);
+        if (v == NULL)
+            continue;
+        *max_values[i] = strtoul(v, NULL, 0);
+        if (*max_values[i] > limits[i]) {
+            fprintf(stderr, "[W] %s cannot be larger than %lu\n", max_names[i], limits[i]);
+            *max_values[i] = limits[i];
+        }
+    }
+    elastic_pools_init();
+    max_parsers = elastic_pools[ELASTIC_PARSERS].max_size;
+    max_writers = elastic_pools[ELASTIC_WRITERS].max_size;
+    max_updaters = elastic_pools[ELASTIC_UPDATERS].max_size;
+
+    const char *num_indexers_value = zconfig_resolve(config, "frontend/threads/indexers", NULL);
+    if (num_indexers_value)
+        num_indexers = strtoul(num_indexers_value, NULL, 0);
+
+    // db affine scheduling coalesces the updates of databases waiting for an updater
+    const char *updater_scheduling = zconfig_resolve(config, "frontend/threads/updater_scheduling", "db_affine");
+    if (streq(updater_scheduling, "round_robin"))
+        updater_db_affinity = false;
+    else if (!streq(updater_scheduling, "db_affine"))
+        fprintf(stderr, "[W] unknown updater scheduling mode: %s\n", updater_scheduling);
+}
+
+static void setup_admission_limits(zconfig_t* config)
+{
+    const char *v;
+    if ((v = zconfig_resolve(config, "frontend/admission/max_queued_parses", NULL)))
+        admission_max_queued_parses = atoi(v);
+    if ((v = zconfig_resolve(config, "frontend/admission/max_queued_inserts", NULL)))
+        admission_max_queued_inserts = atoi(v);
+    if ((v = zconfig_resolve(config, "frontend/admission/max_queued_updates", NULL)))
+        admission_max_queued_updates = atoi(v);
+}
+
+// 0 means we aggregate every page we see
+static void setup_page_guard(zconfig_t* config)
+{
+    const char *v = zconfig_resolve(config, "frontend/cardinality/max_pages", NULL);
+    if (v)
+        max_pages_per_stream = atoi(v);
+}
+
+// number of raw exceptions we store per fingerprint and day
+static void setup_js_exception_dedup(zconfig_t* config)
+{
+    const char *v = zconfig_resolve(config, "frontend/js_exceptions/max_exemplars", NULL);
+    if (v == NULL)
+        return;
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(v, &end, 10);
+    if (errno || end == v || *end || strchr(v, '-')) {
+        fprintf(stderr, "[E] invalid number of javascript exception exemplars: %s\n", v);
+        exit(1);
+    }
+    max_js_exception_exemplars = n;
+}
+
+// e.g. "lines,request_info"
+static void setup_compressed_request_fields(zconfig_t* config)
+{
+    const char *v = zconfig_resolve(config, "frontend/storage/compressed_fields", NULL);
+    if (v == NULL)
+        return;
+    zlist_t *fields = split_delimited_string(v);
+    if (zlist_size(fields) > 0)
+        compressed_request_fields = zlist_to_hash(fields);
+    char *field;
+    while ((field = zlist_pop(fields)))
+        free(field);
+    zlist_destroy(&fields);
+}
+
+// roles are thread names without index: subscriber, parser, adder, writer, updater, zmq_io, ...
+// parsers and adders should share a numa node, as adders merge the processors of parsers.
+static void setup_thread_placement(zconfig_t* config)
+{
+    // argument takes precedence over config file
+    if (thread_placement_spec == NULL)
+        thread_placement_spec = zconfig_resolve(config, "frontend/threads/placement", NULL);
+    if (thread_placement_spec && !thread_placement_init(thread_placement_spec, !quiet))
+        exit(1);
+}
+
+// frontend debug logging, rotated files get a timestamp suffix
+static void setup_frontend_timings_log(zconfig_t* config)
+{
+    if (frontend_timings_file_name == NULL)
+        return;
+    const char *v;
+    if ((v = zconfig_resolve(config, "frontend/timings/max_file_size_mb", NULL)))
+        timings_log_max_file_size = strtoul(v, NULL, 0) * 1024 * 1024;
+    if ((v = zconfig_resolve(config, "frontend/timings/max_file_age", NULL)))
+        timings_log_max_file_age = atoi(v);
+    if ((v = zconfig_resolve(config, "frontend/timings/compress", NULL)))
+        timings_log_compress = streq(v, "true") || streq(v, "1");
+    if (!timings_log_init(frontend_timings_file_name)) {
+        fprintf(stderr, "[E] could not open frontend timings logfile: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static void setup_checkpointing(zconfig_t* config)
+{
+    const char *directory = zconfig_resolve(config, "frontend/checkpoint/directory", NULL);
+    if (directory == NULL)
+        return;
+    checkpoint_init(directory);
+
+    const char *interval = zconfig_resolve(config, "frontend/checkpoint/interval", NULL);
+    if (interval)
+        checkpoint_interval = atoi(interval);
+    if (checkpoint_interval <= 0)
+        checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+
+    static char stream_config_file[1024];
+    snprintf(stream_config_file, sizeof(stream_config_file), "%s/streams.snapshot", directory);
+    set_stream_config_cache_file(stream_config_file);
+
+    printf("[I] checkpoint directory: %s (every %d ticks)\n", directory, checkpoint_interval);
+}
+
+// the node index is usually different on each node, so it can be overridden from the environment
+static void setup_partitioning(zconfig_t* config)
+{
+    const char *node = getenv("LOGJAM_PARTITION_NODE");
+    if (node == NULL)
+        node = zconfig_resolve(config, "frontend/partition/node", NULL);
+    const char *nodes = getenv("LOGJAM_PARTITION_NODES");
+    if (nodes == NULL)
+        nodes = zconfig_resolve(config, "frontend/partition/nodes", NULL);
+    if (node == NULL && nodes == NULL)
+        return;
+
+    int n = node ? atoi(node) : -1;
+    int k = nodes ? atoi(nodes) : 0;
+    if (k <= 0 || n < 0 || n >= k) {
+        fprintf(stderr, "[E] invalid stream partition: node %s of %s nodes\n", node ? node : "?", nodes ? nodes : "?");
+        exit(1);
+    }
+    const char *rates_directory = zconfig_resolve(config, "frontend/partition/rates_directory", NULL);
+    set_stream_partitioning(n, k, rates_directory);
+
+    printf("[I] stream partition: node %d of %d, weights from %s\n", n, k, rates_directory ? rates_directory : "(none)");
 }
 
 void print_usage(char * const *argv)
@@ -94,6 +244,8 @@ void print_usage(char * const *argv)
             "  -O, --db-on-demand         create databases and indexes for streams on demand\n"
             "  -Y, --replay-port N        port number of zeromq router replay socket\n"
             "  -y, --replay               whether to duplicate msgs received on on the router port socket\n"
+            "  -E, --latency-sampling N   record processing latency for one in N messages (0 disables)\n"
+            "  -K, --placement P          pin threads to cpus, e.g. \"parser=0-7 adder=0-7 zmq_io=8\"\n"
             "      --help                 display this message\n"
             "\nEnvironment: (parameters take precedence)\n"
             "  LOGJAM_DEVICES             specs of devices to connect to\n"
@@ -101,6 +253,9 @@ void print_usage(char * const *argv)
             "  LOGJAM_RCV_HWM             high watermark for input socket\n"
             "  LOGJAM_SND_HWM             high watermark for output socket\n"
             "  LOGJAM_REPLAY              whether to duplicate msgs received on on the router port socket\n"
+            "  LOGJAM_LATENCY_SAMPLING    record processing latency for one in N messages\n"
+            "  LOGJAM_PARTITION_NODE      index of this node when partitioning streams across importers\n"
+            "  LOGJAM_PARTITION_NODES     number of importers to partition streams across\n"
             , argv[0]);
 }
 
@@ -139,6 +294,8 @@ void process_arguments(int argc, char * const *argv)
         { "initialize-dbs",   no_argument,       0, 'I' },
         { "db-fast-start",    no_argument,       0, 'F' },
         { "db-on-demand",     no_argument,       0, 'O' },
+        { "latency-sampling", required_argument, 0, 'E' },
+        { "placement",        required_argument, 0, 'K' },
         { 0,                  0,                 0,  0  }
     };
 
@@ -146,7 +303,7 @@ void process_arguments(int argc, char * const *argv)
         indexer_opts = atoi(v);
     }
 
-    while ((c = getopt_long(argc, argv, "a:b:c:f:nm:p:qs:u:vw:x:i:P:R:S:l:h:D:t:NM:L:T:IFOyY:", long_options, &longindex)) != -1) {
+    while ((c = getopt_long(argc, argv, "a:b:c:f:nm:p:qs:u:vw:x:i:P:R:S:l:h:D:t:NM:L:T:IFOyY:E:K:", long_options, &longindex)) != -1) {
         switch (c) {
         case 'n':
             dryrun = true;
@@ -175,6 +332,9 @@ void process_arguments(int argc, char * const *argv)
         case 'a':
             frontend_timings_apdex_attr = optarg;
             break;
+        case 'K':
+            thread_placement_spec = optarg;
+            break;
         case 'p': {
             unsigned long n = strtoul(optarg, NULL, 0);
             if (n <= MAX_PARSERS)
@@ -257,6 +417,9 @@ void process_arguments(int argc, char * const *argv)
         case 'Y':
             replay_port = atoi(optarg);
             break;
+        case 'E':
+            latency_sampling_rate = atoi(optarg);
+            break;
         case 'm':
             metrics_port = atoi(optarg);
             break;
@@ -277,7 +440,7 @@ void process_arguments(int argc, char * const *argv)
             exit(0);
             break;
         case '?':
-            if (strchr("acfpsuwiPRSlhD", optopt))
+            if (strchr("acfpsuwiPRSlhDE", optopt))
                 fprintf(stderr, "[E] option -%c requires an argument.\n", optopt);
             else if (isprint (optopt))
                 fprintf(stderr, "[E] unknown option `-%c'.\n", optopt);
@@ -334,6 +497,13 @@ void process_arguments(int argc, char * const *argv)
             snd_hwm = DEFAULT_SND_HWM;
     }
 
+    if (latency_sampling_rate < 0) {
+        if (( v = getenv("LOGJAM_LATENCY_SAMPLING") ))
+            latency_sampling_rate = atoi(v);
+        if (latency_sampling_rate < 0)
+            latency_sampling_rate = DEFAULT_LATENCY_SAMPLING_RATE;
+    }
+
     int l = strlen(logjam_url);
     int n = asprintf(&logjam_stream_url, "%s%s", logjam_url, (logjam_url[l-1] == '/') ? "admin/streams" : "/admin/streams");
     assert(n>0);
@@ -350,14 +520,6 @@ int main(int argc, char * const *argv)
 
     process_arguments(argc, argv);
 
-    // setup frontend debug logging if requested
-    if (frontend_timings_file_name) {
-        frontend_timings = fopen(frontend_timings_file_name, "a");
-        if (!frontend_timings) {
-            fprintf(stderr, "[E] could not open frontend timings logfile: %s\n", strerror(errno));
-            exit(1);
-        }
-    }
     if (frontend_timings_apdex_attr) {
         if (!processor_set_frontend_apdex_attribute(frontend_timings_apdex_attr)) {
             fprintf(stderr, "[E] invalid frontend apdex attribute name: %s\n", frontend_timings_apdex_attr);
@@ -384,6 +546,12 @@ int main(int argc, char * const *argv)
         unknown_streams_collector_connection_spec = zconfig_resolve(config, "frontend/endpoints/unknown_streams_collector/pub", DEFAULT_UNKNOWN_STREAMS_COLLECTOR_CONNECTION);
 
     setup_thread_counts(config);
+    setup_thread_placement(config);
+    setup_admission_limits(config);
+    setup_page_guard(config);
+    setup_js_exception_dedup(config);
+    setup_compressed_request_fields(config);
+    setup_frontend_timings_log(config);
 
     if (!quiet)
         printf("[I] started %s\n"
@@ -396,18 +564,22 @@ int main(int argc, char * const *argv)
                "[I] io-threads:      %zu\n"
                "[I] rcv-hwm:         %d\n"
                "[I] snd-hwm:         %d\n"
-               "[I] parsers:         %zu\n"
-               "[I] writers:         %zu\n"
-               "[I] updaters:        %zu\n"
+               "[I] parsers:         %zu (max %zu)\n"
+               "[I] writers:         %zu (max %zu)\n"
+               "[I] updaters:        %zu (max %zu, %s)\n"
                "[I] subscription:    %s\n"
+               "[I] max-pages:       %zu per stream\n"
                , argv[0], pull_port, sub_port, replay_port, replay_router_msgs, live_stream_connection_spec, unknown_streams_collector_connection_spec,
-               io_threads, rcv_hwm, snd_hwm, num_parsers, num_writers, num_updaters, subscription_pattern);
+               io_threads, rcv_hwm, snd_hwm, num_parsers, max_parsers, num_writers, max_writers, num_updaters, max_updaters,
+               updater_db_affinity ? "db affine" : "round robin", subscription_pattern, max_pages_per_stream);
 
     initialize_mongo_db_globals(config);
     snprintf(metrics_address, sizeof(metrics_address), "%s:%d", metrics_ip, metrics_port);
-    importer_prometheus_client_params_t prometheus_params = { .num_subscribers = num_subscribers, .num_parsers = num_parsers, .num_writers = num_writers, .num_updaters = num_updaters};
+    importer_prometheus_client_params_t prometheus_params = { .num_subscribers = num_subscribers, .num_parsers = max_parsers, .num_writers = max_writers, .num_updaters = max_updaters, .num_databases = num_databases};
     importer_prometheus_client_init(metrics_address, prometheus_params);
 
     setup_resource_maps(config);
+    setup_checkpointing(config);
+    setup_partitioning(config);
     return run_controller_loop(config, io_threads, logjam_stream_url, subscription_pattern, indexer_opts);
 }
@@ -13,14 +13,41 @@ typedef struct {
 } module_threshold_t;
 
 #define DEFAULT_MAX_INSERTS_PER_SECOND 100
+// keys per caller, sender and exception dimension stored for a page and minute
+#define DEFAULT_MAX_DYNAMIC_KEYS 100
 
 typedef struct {
     int64_t cap;                       // number of insertions allowed during one tick
-    int64_t current;                   // number of requests inserted since the last tick
+    uint64_t claimed;                  // insert window << 32 | inserts wanted during that window
 } requests_inserted_t;
 
 typedef void (stream_fn) (void *stream);
 
+// pipeline stages for which we record latencies relative to msg_meta_t.created_ms
+typedef enum {
+    LATENCY_STAGE_SUBSCRIBER = 0,
+    LATENCY_STAGE_PARSER     = 1,
+    LATENCY_STAGE_PROCESSOR  = 2,
+    LATENCY_STAGE_WRITER     = 3,
+    LATENCY_STAGE_UPDATER    = 4,
+} latency_stage_t;
+
+#define NUM_LATENCY_STAGES 5
+
+// what admission control did to messages of a stream while the importer was overloaded
+typedef enum {
+    ADMISSION_FRONTEND_SAMPLED_OUT = 0,  // frontend msg not selected by sampling
+    ADMISSION_INSERT_SKIPPED       = 1,  // request was processed, but not stored
+    ADMISSION_DROPPED              = 2,  // msg dropped before parsing
+} admission_decision_t;
+
+#define NUM_ADMISSION_DECISIONS 3
+
+typedef struct {
+    const char *module;                // module name as stored in known_modules
+    char *live_stream_key;             // app-env,module (lower case), used by the live stream
+} known_module_t;
+
 typedef struct {
     int32_t ref_count;
     char *key;      // [app,env].join('-')
@@ -46,12 +73,22 @@ typedef struct {
     char **api_requests;
     int api_requests_size;
     int all_requests_are_api_requests;
+    int max_dynamic_keys;                // 0 means unlimited
     zhash_t *known_modules;
+    known_module_t *known_modules_list;  // flat copy of known_modules, rebuilt when the module set changes
+    size_t known_modules_count;
+    uint64_t known_modules_expiry_check; // last time we looked for expired modules
+    uint64_t published_tick;             // last controller tick for which totals were published
     void *inserts_total;
     void *inserts_throttled_total;
+    void *latency_histograms[NUM_LATENCY_STAGES];
+    void *admission_decisions_total[NUM_ADMISSION_DECISIONS];
+    void *pages_folded_total;
     stream_fn *free_callback;
     requests_inserted_t *requests_inserted;
     bool free_requests_inserted;
+    uint64_t messages_received;          // messages seen by the subscribers since the last tick
+    double message_rate;                 // smoothed messages per second, used to weigh partitions
 } stream_info_t;
 
 
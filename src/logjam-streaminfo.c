@@ -1,10 +1,12 @@
 #include "logjam-streaminfo.h"
 #include "device-tracker.h"
 #include <pthread.h>
+#include <math.h>
 
 typedef struct {
     bool received_term_cmd;         // whether we have received a TERM command
     zsock_t *indexer_socket;        // send indexing requests to indexer
+    active_streams_t active_streams; // streams for which we reset request counters
 } stream_updater_state_t;
 
 // all configured streams
@@ -13,6 +15,11 @@ static zhash_t *configured_streams = NULL;
 static zlist_t *active_stream_names = NULL;
 // all streams we want to subscribe to
 static zlist_t *stream_subscriptions = NULL;
+// flat array of all active streams, rebuilt on each config update
+static stream_info_t **active_streams = NULL;
+static size_t num_active_streams = 0;
+// incremented whenever active_streams changes
+static uint64_t active_streams_version = 0;
 // lock around all stream access operations
 static pthread_mutex_t lock;
 // logjam url, to be used for retrieving stream information
@@ -21,9 +28,19 @@ static const char* streams_url = NULL;
 static bool have_subscription_pattern;
 // sbuscription pattern
 static const char *subscription_pattern = NULL;
+// partitioning of streams across importer nodes, disabled if partition_nodes is 0
+static int partition_node = 0;
+static int partition_nodes = 0;
+// directory shared by all nodes, to which each node publishes message rates of its streams
+static const char *partition_rates_directory = NULL;
 // httpp client
 static zhttp_client_t *client = NULL;
 
+// last stream config retrieved from logjam, NULL if disabled
+static const char *stream_config_cache_file = NULL;
+// whether the stream config has been loaded from the cache file at startup
+static bool stream_config_from_cache = false;
+
 // callback for creating streams
 static stream_fn *create_stream_callback = NULL;
 // callback for freeing streams
@@ -70,6 +87,24 @@ const char* get_subscription_pattern()
     return subscription_pattern;
 }
 
+bool stream_subscriptions_enabled()
+{
+    return have_subscription_pattern || partition_nodes > 0;
+}
+
+bool stream_partitioning_enabled()
+{
+    return partition_nodes > 0;
+}
+
+void set_stream_partitioning(int node, int nodes, const char *rates_directory)
+{
+    assert(nodes > 0 && node >= 0 && node < nodes);
+    partition_node = node;
+    partition_nodes = nodes;
+    partition_rates_directory = rates_directory;
+}
+
 zlist_t* get_stream_subscriptions()
 {
     pthread_mutex_lock(&lock);
@@ -86,6 +121,36 @@ zlist_t* get_active_stream_names()
     return names;
 }
 
+bool refresh_active_streams(active_streams_t *streams)
+{
+    uint64_t version = __atomic_load_n(&active_streams_version, __ATOMIC_SEQ_CST);
+    if (streams->version == version)
+        return false;
+
+    release_active_streams(streams);
+    pthread_mutex_lock(&lock);
+    size_t n = num_active_streams;
+    streams->version = active_streams_version;
+    streams->size = n;
+    streams->streams = n > 0 ? zmalloc(n * sizeof(stream_info_t*)) : NULL;
+    for (size_t i = 0; i < n; i++) {
+        stream_info_t *info = active_streams[i];
+        reference_stream_info(info);
+        streams->streams[i] = info;
+    }
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+void release_active_streams(active_streams_t *streams)
+{
+    for (size_t i = 0; i < streams->size; i++)
+        release_stream_info(streams->streams[i]);
+    free(streams->streams);
+    streams->streams = NULL;
+    streams->size = 0;
+}
+
 static
 void add_module_import_threshold_settings(stream_info_t* info, json_object *stream_obj)
 {
@@ -200,6 +265,11 @@ void add_stream_settings(stream_info_t *info, json_object *stream_obj)
     if (json_object_object_get_ex(stream_obj, "database_number", &obj)) {
         info->db = json_object_get_int(obj);
     }
+    if (json_object_object_get_ex(stream_obj, "max_dynamic_keys", &obj)) {
+        info->max_dynamic_keys = json_object_get_int(obj);
+    } else {
+        info->max_dynamic_keys = DEFAULT_MAX_DYNAMIC_KEYS;
+    }
     if (json_object_object_get_ex(stream_obj, "max_inserts_per_second", &obj)) {
         info->requests_inserted->cap = json_object_get_int(obj);
     } else {
@@ -251,6 +321,16 @@ stream_info_t* stream_info_new(const char* key, json_object *stream_obj)
     return info;
 }
 
+static
+void free_known_modules_list(stream_info_t *info)
+{
+    for (size_t i = 0; i < info->known_modules_count; i++)
+        free(info->known_modules_list[i].live_stream_key);
+    free(info->known_modules_list);
+    info->known_modules_list = NULL;
+    info->known_modules_count = 0;
+}
+
 void release_stream_info(stream_info_t *info)
 {
     int32_t ref_count = __atomic_fetch_add(&info->ref_count, -1, __ATOMIC_SEQ_CST);
@@ -283,6 +363,7 @@ void release_stream_info(stream_info_t *info)
         free(info->api_requests);
     }
     zhash_destroy(&info->known_modules);
+    free_known_modules_list(info);
 
     if (info->free_requests_inserted)
         free(info->requests_inserted);
@@ -305,6 +386,7 @@ void dump_stream_info(stream_info_t *stream)
     printf("[D] database_cleaning_threshold: %d\n", stream->database_cleaning_threshold);
     printf("[D] request_cleaning_threshold: %d\n", stream->request_cleaning_threshold);
     printf("[D] import_threshold: %d\n", stream->import_threshold);
+    printf("[D] max_dynamic_keys: %d\n", stream->max_dynamic_keys);
     for (int i = 0; i<stream->module_threshold_count; i++) {
         printf("[D] module_import_threshold: %s = %zu\n", stream->module_thresholds[i].name, stream->module_thresholds[i].value);
     }
@@ -329,10 +411,202 @@ void dump_stream_info(stream_info_t *stream)
     }
 }
 
+void set_stream_config_cache_file(const char *path)
+{
+    stream_config_cache_file = path;
+}
+
+static
+zhash_t* parse_streams(const char *body, size_t body_len)
+{
+    json_tokener* tokener = json_tokener_new();
+    json_object *streams_obj = parse_json_data(body, body_len, tokener);
+    json_tokener_free(tokener);
+    if (streams_obj == NULL)
+        return NULL;
+
+    zhash_t *streams = zhash_new();
+    json_object_object_foreach(streams_obj, key, val) {
+        stream_info_t *stream = stream_info_new(key, val);
+        if (stream) {
+            if (0) dump_stream_info(stream);
+            zhash_insert(streams, key, stream);
+            zhash_freefn(streams, key, (zhash_free_fn*)release_stream_info);
+        }
+    }
+    json_object_put(streams_obj);
+    return streams;
+}
+
+// Snapshot file layout: header, etag, last modified date, response body. The body is kept
+// as JSON, since stream_info_t holds derived state which must be rebuilt by stream_info_new.
+#define STREAM_CONFIG_SNAPSHOT_MAGIC 0x43534a4c    // "LJSC"
+#define STREAM_CONFIG_SNAPSHOT_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t body_hash;
+    uint64_t body_len;
+    uint32_t etag_len;
+    uint32_t last_modified_len;
+} stream_config_snapshot_header_t;
+
+// validators and body of the stream config currently in use, for conditional requests
+static char *config_etag = NULL;
+static char *config_last_modified = NULL;
+static uint64_t config_body_hash = 0;
+static char *config_body = NULL;
+static size_t config_body_len = 0;
+
+static
+uint64_t stream_config_hash(const char *body, size_t body_len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < body_len; i++)
+        hash = (hash ^ (uint8_t)body[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static
+bool same_validator(const char *a, const char *b)
+{
+    return a == NULL ? b == NULL : b != NULL && streq(a, b);
+}
+
+// returns true if the validators differ from the ones in use
+static
+bool set_config_validators(const char *etag, const char *last_modified, uint64_t body_hash)
+{
+    etag = etag && *etag ? etag : NULL;
+    last_modified = last_modified && *last_modified ? last_modified : NULL;
+    if (same_validator(etag, config_etag) && same_validator(last_modified, config_last_modified)
+        && body_hash == config_body_hash)
+        return false;
+    // the arguments can be the current validators
+    char *new_etag = etag ? strdup(etag) : NULL;
+    char *new_last_modified = last_modified ? strdup(last_modified) : NULL;
+    free(config_etag);
+    free(config_last_modified);
+    config_etag = new_etag;
+    config_last_modified = new_last_modified;
+    config_body_hash = body_hash;
+    return true;
+}
+
+// takes ownership of the body
+static
+void set_config_body(char *body, size_t body_len)
+{
+    free(config_body);
+    config_body = body;
+    config_body_len = body_len;
+}
+
+// header names are case insensitive
+static
+const char* response_header(zhttp_response_t *response, const char *name)
+{
+    zhash_t *headers = zhttp_response_headers(response);
+    for (const char *value = zhash_first(headers); value; value = zhash_next(headers)) {
+        if (strcasecmp(zhash_cursor(headers), name) == 0)
+            return value;
+    }
+    return NULL;
+}
+
+// saves the config body along with its current validators
+static
+void save_stream_config()
+{
+    if (stream_config_cache_file == NULL || config_body == NULL)
+        return;
+    const char *body = config_body;
+    size_t body_len = config_body_len;
+    stream_config_snapshot_header_t header = {
+        .magic = STREAM_CONFIG_SNAPSHOT_MAGIC,
+        .version = STREAM_CONFIG_SNAPSHOT_VERSION,
+        .body_hash = config_body_hash,
+        .body_len = body_len,
+        .etag_len = config_etag ? strlen(config_etag) : 0,
+        .last_modified_len = config_last_modified ? strlen(config_last_modified) : 0,
+    };
+    char tmp_file[1024];
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", stream_config_cache_file);
+    FILE *file = fopen(tmp_file, "w");
+    bool ok = file
+        && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(config_etag, 1, header.etag_len, file) == header.etag_len
+        && fwrite(config_last_modified, 1, header.last_modified_len, file) == header.last_modified_len
+        && fwrite(body, 1, body_len, file) == body_len;
+    if (file && fclose(file) != 0)
+        ok = false;
+    if (!ok || rename(tmp_file, stream_config_cache_file) != 0) {
+        fprintf(stderr, "[E] stream-updater: could not save stream config to %s: %s\n", stream_config_cache_file, strerror(errno));
+        unlink(tmp_file);
+    }
+}
+
+static
+char* read_snapshot_string(FILE *file, size_t len)
+{
+    char *s = malloc(len + 1);
+    if (len > 0 && fread(s, 1, len, file) != len) {
+        free(s);
+        return NULL;
+    }
+    s[len] = '\0';
+    return s;
+}
+
 static
-zhash_t* get_streams()
+zhash_t* load_saved_stream_config()
+{
+    if (stream_config_cache_file == NULL)
+        return NULL;
+    FILE *file = fopen(stream_config_cache_file, "r");
+    if (file == NULL)
+        return NULL;
+
+    zhash_t *streams = NULL;
+    char *etag = NULL, *last_modified = NULL, *body = NULL;
+    stream_config_snapshot_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != STREAM_CONFIG_SNAPSHOT_MAGIC
+        || header.version != STREAM_CONFIG_SNAPSHOT_VERSION
+        || header.etag_len > 1024 || header.last_modified_len > 1024)
+        goto cleanup;
+
+    etag = read_snapshot_string(file, header.etag_len);
+    last_modified = read_snapshot_string(file, header.last_modified_len);
+    body = read_snapshot_string(file, header.body_len);
+    if (etag == NULL || last_modified == NULL || body == NULL)
+        goto cleanup;
+    if (stream_config_hash(body, header.body_len) != header.body_hash)
+        goto cleanup;
+
+    streams = parse_streams(body, header.body_len);
+    if (streams) {
+        set_config_validators(etag, last_modified, header.body_hash);
+        set_config_body(body, header.body_len);
+        body = NULL;
+    }
+
+ cleanup:
+    free(etag);
+    free(last_modified);
+    free(body);
+    fclose(file);
+    if (streams == NULL)
+        fprintf(stderr, "[W] stream-updater: ignoring unreadable stream config %s\n", stream_config_cache_file);
+    return streams;
+}
+
+// returns NULL and sets *unchanged, if the config is the one we already have
+zhash_t* get_streams(bool *unchanged)
 {
     zhash_t *streams = NULL;
+    *unchanged = false;
 
     zhttp_request_t *request = zhttp_request_new();
     zhttp_response_t *response = NULL;
@@ -340,6 +614,10 @@ zhash_t* get_streams()
     zhttp_request_set_method(request, "GET");
     zhash_t *headers = zhttp_request_headers(request);
     zhash_insert (headers, "Accept", "application/json");
+    if (config_etag)
+        zhash_insert(headers, "If-None-Match", config_etag);
+    if (config_last_modified)
+        zhash_insert(headers, "If-Modified-Since", config_last_modified);
 
     int rc = zhttp_request_send(request, client, 10000, NULL, NULL);
     if (rc) goto cleanup;
@@ -349,24 +627,39 @@ zhash_t* get_streams()
     rc = zhttp_response_recv(response, client, &user_arg1, &user_arg2);
     if (rc) goto cleanup;
 
+    const char *etag = response_header(response, "ETag");
+    const char *last_modified = response_header(response, "Last-Modified");
+
+    // a 304 response can update validators, those it doesn't send stay valid
+    if (zhttp_response_status_code(response) == 304) {
+        if (set_config_validators(etag ? etag : config_etag,
+                                  last_modified ? last_modified : config_last_modified,
+                                  config_body_hash))
+            save_stream_config();
+        *unchanged = true;
+        goto cleanup;
+    }
+
     const char* body = zhttp_response_content(response);
     const int body_len = zhttp_response_content_length(response);
 
-    json_tokener* tokener = json_tokener_new();
-    json_object *streams_obj = parse_json_data(body, body_len, tokener);
-    json_tokener_free(tokener);
-    if (streams_obj == NULL) goto cleanup;
+    // servers without validators still send identical bodies
+    uint64_t body_hash = stream_config_hash(body, body_len);
+    if (configured_streams && body_hash == config_body_hash) {
+        if (set_config_validators(etag, last_modified, body_hash))
+            save_stream_config();
+        *unchanged = true;
+        goto cleanup;
+    }
 
-    streams = zhash_new();
-    json_object_object_foreach(streams_obj, key, val) {
-        stream_info_t *stream = stream_info_new(key, val);
-        if (stream) {
-            if (0) dump_stream_info(stream);
-            zhash_insert(streams, key, stream);
-            zhash_freefn(streams, key, (zhash_free_fn*)release_stream_info);
-        }
+    streams = parse_streams(body, body_len);
+    if (streams) {
+        set_config_validators(etag, last_modified, body_hash);
+        char *copy = malloc(body_len);
+        memcpy(copy, body, body_len);
+        set_config_body(copy, body_len);
+        save_stream_config();
     }
-    json_object_put(streams_obj);
 
  cleanup:
     zhttp_request_destroy(&request);
@@ -375,38 +668,169 @@ zhash_t* get_streams()
 }
 
 static
-bool update_stream_config()
+void rates_file_name(char *buffer, size_t size, int node)
 {
-    printf("[I] stream-updater: updating stream config\n");
+    snprintf(buffer, size, "%s/rates.%d", partition_rates_directory, node);
+}
 
-    zhash_t *new_streams = get_streams();
-    if (new_streams == NULL) {
-        fprintf(stderr, "[E] stream-updater: could not retrieve streams from logjam instance\n");
-        return false;
+static
+void save_message_rates(active_streams_t *streams)
+{
+    if (partition_rates_directory == NULL)
+        return;
+    char file_name[1024], tmp_file[1024];
+    rates_file_name(file_name, sizeof(file_name), partition_node);
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", file_name);
+    FILE *file = fopen(tmp_file, "w");
+    bool ok = file != NULL;
+    for (size_t i = 0; ok && i < streams->size; i++) {
+        stream_info_t *info = streams->streams[i];
+        ok = fprintf(file, "%s %.3f\n", info->key, info->message_rate) > 0;
     }
+    if (file && fclose(file) != 0)
+        ok = false;
+    if (!ok || rename(tmp_file, file_name) != 0) {
+        fprintf(stderr, "[E] stream-updater: could not save message rates to %s: %s\n", file_name, strerror(errno));
+        unlink(tmp_file);
+    }
+}
 
-    zlist_t *new_subscriptions = zlist_new();
-    zlist_autofree(new_subscriptions);
-    zlist_comparefn(new_subscriptions, (zlist_compare_fn *) strcmp);
-    zlist_t *new_active_streams = zlist_new();
-    zlist_autofree(new_active_streams);
-    zlist_comparefn(new_active_streams, (zlist_compare_fn *) strcmp);
-
-    stream_info_t *info = zhash_first(new_streams);
-    while (info) {
-        const char *key = zhash_cursor(new_streams);
-        if (!have_subscription_pattern) {
-            zlist_append(new_active_streams, (void*)key);
-        } else
-            if (strstr(key, subscription_pattern) != NULL) {
-                zlist_append(new_subscriptions, (void*)key);
-                zlist_append(new_active_streams, (void*)key);
+// stream name -> messages per second, as published by all nodes (including ourselves). every
+// node must compute the same assignment, so we don't use our own in memory rates here.
+static
+zhash_t* load_message_rates()
+{
+    zhash_t *rates = zhash_new();
+    if (partition_rates_directory == NULL)
+        return rates;
+    for (int node = 0; node < partition_nodes; node++) {
+        char file_name[1024];
+        rates_file_name(file_name, sizeof(file_name), node);
+        FILE *file = fopen(file_name, "r");
+        if (file == NULL)
+            continue;
+        char name[256];
+        double rate;
+        while (fscanf(file, "%255s %lf", name, &rate) == 2) {
+            double *current = zhash_lookup(rates, name);
+            if (current == NULL) {
+                current = zmalloc(sizeof(double));
+                zhash_insert(rates, name, current);
+                zhash_freefn(rates, name, free);
             }
-        info = zhash_next(new_streams);
+            // a stream which just moved can show up in two files
+            if (rate > *current)
+                *current = rate;
+        }
+        fclose(file);
+    }
+    return rates;
+}
+
+// rates are rounded to powers of two, so that nodes reading the rates files at slightly
+// different times still agree on the assignment
+static inline
+double partition_weight(double rate)
+{
+    return exp2(round(log2(1 + rate)));
+}
+
+// selects the streams matching the subscription pattern, which are assigned to our node
+static
+void select_streams(zhash_t *streams, zlist_t *subscriptions, zlist_t *active)
+{
+    zlist_t *keys = zhash_keys(streams);
+    zlist_sort(keys, (zlist_compare_fn *) strcmp);
+    size_t n = zlist_size(keys);
+    partition_item_t *items = n > 0 ? zmalloc(n * sizeof(partition_item_t)) : NULL;
+    size_t num_items = 0;
+    const char *key = zlist_first(keys);
+    while (key) {
+        if (!have_subscription_pattern || strstr(key, subscription_pattern) != NULL)
+            items[num_items++] = (partition_item_t){key, 1, partition_node};
+        key = zlist_next(keys);
     }
 
+    if (partition_nodes > 0 && num_items > 0) {
+        zhash_t *rates = load_message_rates();
+        for (size_t i = 0; i < num_items; i++) {
+            double *rate = zhash_lookup(rates, items[i].name);
+            items[i].weight = partition_weight(rate ? *rate : 0);
+        }
+        zhash_destroy(&rates);
+        partition_assign(items, num_items, partition_nodes);
+    }
+
+    double total_weight = 0, our_weight = 0;
+    for (size_t i = 0; i < num_items; i++) {
+        total_weight += items[i].weight;
+        if (items[i].node != partition_node)
+            continue;
+        our_weight += items[i].weight;
+        zlist_append(active, (void*)items[i].name);
+        if (stream_subscriptions_enabled())
+            zlist_append(subscriptions, (void*)items[i].name);
+    }
+    if (partition_nodes > 0)
+        printf("[I] stream-updater: partition %d/%d: %zu of %zu streams, weight %.0f of %.0f\n",
+               partition_node, partition_nodes, zlist_size(active), num_items, our_weight, total_weight);
+
+    free(items);
+    zlist_destroy(&keys);
+}
+
+// replaces the active streams and subscriptions. takes ownership of both lists.
+static
+void activate_streams(zhash_t *streams, zlist_t *subscriptions, zlist_t *active)
+{
+    size_t new_num_active_streams = zlist_size(active);
+    stream_info_t **new_active_streams_array = NULL;
+    if (new_num_active_streams > 0)
+        new_active_streams_array = zmalloc(new_num_active_streams * sizeof(stream_info_t*));
+    size_t i = 0;
+    const char *name = zlist_first(active);
+    while (name) {
+        stream_info_t *info = zhash_lookup(streams, name);
+        reference_stream_info(info);
+        new_active_streams_array[i++] = info;
+        name = zlist_next(active);
+    }
+
+    pthread_mutex_lock(&lock);
+    zlist_destroy(&stream_subscriptions);
+    zlist_destroy(&active_stream_names);
+    stream_info_t **old_active_streams_array = active_streams;
+    size_t old_num_active_streams = num_active_streams;
+    stream_subscriptions = subscriptions;
+    active_stream_names = active;
+    active_streams = new_active_streams_array;
+    num_active_streams = new_num_active_streams;
+    __atomic_add_fetch(&active_streams_version, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < old_num_active_streams; i++)
+        release_stream_info(old_active_streams_array[i]);
+    free(old_active_streams_array);
+}
+
+static
+zlist_t* new_stream_name_list()
+{
+    zlist_t *list = zlist_new();
+    zlist_autofree(list);
+    zlist_comparefn(list, (zlist_compare_fn *) strcmp);
+    return list;
+}
+
+static
+void install_stream_config(zhash_t *new_streams)
+{
+    zlist_t *new_subscriptions = new_stream_name_list();
+    zlist_t *new_active_streams = new_stream_name_list();
+    select_streams(new_streams, new_subscriptions, new_active_streams);
+
     pthread_mutex_lock(&lock);
-    info = zhash_first(new_streams);
+    stream_info_t *info = zhash_first(new_streams);
     while (info) {
         info->free_callback = free_stream_callback;
         stream_info_t *old_info = configured_streams ? zhash_lookup(configured_streams, info->key) : NULL;
@@ -414,12 +838,16 @@ bool update_stream_config()
             // stream already existed
             info->inserts_total = old_info->inserts_total;
             info->inserts_throttled_total = old_info->inserts_throttled_total;
+            memcpy(info->latency_histograms, old_info->latency_histograms, sizeof(info->latency_histograms));
+            memcpy(info->admission_decisions_total, old_info->admission_decisions_total, sizeof(info->admission_decisions_total));
+            info->pages_folded_total = old_info->pages_folded_total;
             int64_t new_cap = info->requests_inserted->cap;
             __atomic_store_n(&old_info->requests_inserted->cap, new_cap, __ATOMIC_SEQ_CST);
             free(info->requests_inserted);
             old_info->free_requests_inserted = false;
             info->requests_inserted = old_info->requests_inserted;
             old_info->free_callback = NULL;
+            info->message_rate = old_info->message_rate;
         } else if (create_stream_callback) {
             // create inserts_total counter for new stream
             create_stream_callback(info);
@@ -427,13 +855,53 @@ bool update_stream_config()
         info = zhash_next(new_streams);
     }
     zhash_destroy(&configured_streams);
-    zlist_destroy(&stream_subscriptions);
-    zlist_destroy(&active_stream_names);
     configured_streams = new_streams;
-    stream_subscriptions = new_subscriptions;
-    active_stream_names = new_active_streams;
     pthread_mutex_unlock(&lock);
 
+    activate_streams(new_streams, new_subscriptions, new_active_streams);
+}
+
+// recomputes our share of the current stream config, after message rates have changed.
+// configured_streams is only replaced by the stream updater, so we can read it without locking.
+static
+void repartition_streams()
+{
+    zlist_t *new_subscriptions = new_stream_name_list();
+    zlist_t *new_active_streams = new_stream_name_list();
+    select_streams(configured_streams, new_subscriptions, new_active_streams);
+
+    zlist_t *added = zlist_added(active_stream_names, new_active_streams);
+    zlist_t *deleted = zlist_deleted(active_stream_names, new_active_streams);
+    size_t num_added = zlist_size(added), num_deleted = zlist_size(deleted);
+    zlist_destroy(&added);
+    zlist_destroy(&deleted);
+
+    if (num_added == 0 && num_deleted == 0) {
+        zlist_destroy(&new_subscriptions);
+        zlist_destroy(&new_active_streams);
+        return;
+    }
+    printf("[I] stream-updater: rebalanced partition: %zu streams added, %zu removed\n", num_added, num_deleted);
+    activate_streams(configured_streams, new_subscriptions, new_active_streams);
+}
+
+static
+bool update_stream_config()
+{
+    printf("[I] stream-updater: updating stream config\n");
+
+    bool unchanged;
+    zhash_t *new_streams = get_streams(&unchanged);
+    if (unchanged) {
+        printf("[I] stream-updater: stream config unchanged\n");
+        return true;
+    }
+    if (new_streams == NULL) {
+        fprintf(stderr, "[E] stream-updater: could not retrieve streams from logjam instance\n");
+        return false;
+    }
+    install_stream_config(new_streams);
+
     printf("[I] stream-updater: updated stream config\n");
 
     return true;
@@ -444,7 +912,7 @@ bool setup_stream_config(const char* logjam_url, const char *pattern)
     streams_url = logjam_url;
     subscription_pattern = pattern;
     have_subscription_pattern = strcmp("", pattern);
-    if (have_subscription_pattern)
+    if (stream_subscriptions_enabled())
         log_gaps = false;
 
     int rc = pthread_mutex_init(&lock, NULL);
@@ -452,6 +920,16 @@ bool setup_stream_config(const char* logjam_url, const char *pattern)
 
     client = zhttp_client_new(debug);
     assert(client);
+
+    // start with the last known config, the stream updater retrieves the current one right away
+    zhash_t *saved_streams = load_saved_stream_config();
+    if (saved_streams) {
+        printf("[I] stream-updater: using saved stream config %s\n", stream_config_cache_file);
+        install_stream_config(saved_streams);
+        stream_config_from_cache = true;
+        return true;
+    }
+
     if (update_stream_config()) {
         return true;
     }
@@ -460,37 +938,86 @@ bool setup_stream_config(const char* logjam_url, const char *pattern)
 }
 
 #define ONE_DAY_MS (1000 * 60 * 60 * 24)
+#define KNOWN_MODULES_EXPIRY_CHECK_INTERVAL_MS (1000 * 60 * 60)
 
+static
+void rebuild_known_modules_list(stream_info_t *stream_info)
+{
+    free_known_modules_list(stream_info);
+    zhash_t *known_modules = stream_info->known_modules;
+    size_t n = zhash_size(known_modules);
+    if (n == 0)
+        return;
+
+    stream_info->known_modules_list = zmalloc(n * sizeof(known_module_t));
+    size_t prefix_len = stream_info->app_len + 1 + stream_info->env_len;
+    size_t i = 0;
+    void *value = zhash_first(known_modules);
+    while (value) {
+        const char *namespace = zhash_cursor(known_modules);
+        const char *module = namespace;
+        // skip :: at the beginning of module
+        while (*module == ':') module++;
+        size_t key_len = prefix_len + 1 + strlen(module);
+        char *key = malloc(key_len + 1);
+        sprintf(key, "%s-%s,%s", stream_info->app, stream_info->env, module);
+        // TODO: change this crap in the live stream publisher
+        // tolower is unsafe and not really necessary
+        for (char *p = key; *p; ++p) *p = tolower(*p);
+        stream_info->known_modules_list[i].module = namespace;
+        stream_info->known_modules_list[i].live_stream_key = key;
+        i++;
+        value = zhash_next(known_modules);
+    }
+    stream_info->known_modules_count = i;
+}
+
+// only called from the controller thread
 void update_known_modules(stream_info_t *stream_info, zhash_t* module_hash)
 {
     uint64_t now = zclock_time();
-    uint64_t age_threshold = now - ONE_DAY_MS;
     zhash_t *known_modules = stream_info->known_modules;
+    bool changed = false;
 
     // update timestamps for modules just seen
     void *elem = zhash_first(module_hash);
     while (elem) {
         const char *module = zhash_cursor(module_hash);
-        zhash_update(known_modules, module, (void*)now);
+        if (zhash_insert(known_modules, module, (void*)now) == 0)
+            changed = true;
+        else
+            zhash_update(known_modules, module, (void*)now);
         elem = zhash_next(module_hash);
     }
 
-    // delete modules we haven't heard from for over a day
-    zlist_t* modules = zhash_keys(known_modules);
-    const char* module = zlist_first(modules);
-    while (module) {
-        uint64_t last_seen = (uint64_t)zhash_lookup(known_modules, module);
-        if (last_seen < age_threshold) {
-            zhash_delete(known_modules, module);
+    // delete modules we haven't heard from for over a day. one day of retention
+    // doesn't need second precision, so we only check once an hour.
+    if (now - stream_info->known_modules_expiry_check >= KNOWN_MODULES_EXPIRY_CHECK_INTERVAL_MS) {
+        stream_info->known_modules_expiry_check = now;
+        uint64_t age_threshold = now - ONE_DAY_MS;
+        zlist_t* modules = zhash_keys(known_modules);
+        const char* module = zlist_first(modules);
+        while (module) {
+            uint64_t last_seen = (uint64_t)zhash_lookup(known_modules, module);
+            if (last_seen < age_threshold) {
+                zhash_delete(known_modules, module);
+                changed = true;
+            }
+            module = zlist_next(modules);
         }
-        module = zlist_next(modules);
+        zlist_destroy(&modules);
     }
 
     // update all_pages, unless no module is left
-    if (zhash_size(known_modules) > 0)
-        zhash_update(known_modules, "all_pages", (void*)now);
+    if (zhash_size(known_modules) > 0) {
+        if (zhash_insert(known_modules, "all_pages", (void*)now) == 0)
+            changed = true;
+        else
+            zhash_update(known_modules, "all_pages", (void*)now);
+    }
 
-    zlist_destroy(&modules);
+    if (changed)
+        rebuild_known_modules_list(stream_info);
 }
 
 const char* throttling_reason_str(throttling_reason_t reason)
@@ -498,8 +1025,6 @@ const char* throttling_reason_str(throttling_reason_t reason)
     switch (reason) {
     case NOT_THROTTLED:
         return "not throttled";
-    case THROTTLE_MAX_INSERTS_PER_SECOND:
-        return "max inserts reached";
     case THROTTLE_SOFT_LIMIT_STORAGE_SIZE:
         return "disk soft limit reached";
     case THROTTLE_HARD_LIMIT_STORAGE_SIZE:
@@ -509,37 +1034,82 @@ const char* throttling_reason_str(throttling_reason_t reason)
     }
 }
 
-bool throttle_request_for_stream(stream_info_t *stream_info)
+static uint32_t insert_window = 0;
+
+void advance_insert_window()
+{
+    __atomic_add_fetch(&insert_window, 1, __ATOMIC_SEQ_CST);
+}
+
+// returns how many of the wanted inserts fit into the remaining capacity of the stream.
+// the counter is reset by the first claim of a new window, in the same atomic operation,
+// so a claim can't be charged to a window it doesn't belong to.
+size_t claim_request_inserts(stream_info_t *stream_info, size_t wanted)
 {
-    int64_t current = __atomic_add_fetch(&stream_info->requests_inserted->current, 1, __ATOMIC_SEQ_CST);
+    uint64_t window = __atomic_load_n(&insert_window, __ATOMIC_SEQ_CST);
     int64_t cap = __atomic_load_n(&stream_info->requests_inserted->cap, __ATOMIC_SEQ_CST);
-    // printf("[D] throttle_request_for_stream %s(%p): cap: %" PRIi64 ", inserted: %" PRIi64 "\n", stream_info->key, stream_info, cap, current);
-    return current > cap;
-}
-
-static void reset_request_counters()
-{
-    zlist_t* stream_names = get_active_stream_names();
-    const char* stream_name = zlist_first(stream_names);
-    while (stream_name) {
-        stream_info_t* stream_info = get_stream_info(stream_name, NULL);
-        int64_t current = __atomic_exchange_n(&stream_info->requests_inserted->current, 0, __ATOMIC_SEQ_CST);
-        if (verbose) {
-            int64_t cap = __atomic_load_n(&stream_info->requests_inserted->cap, __ATOMIC_SEQ_CST);
-            if (current > cap)
-                printf("[I] stream-updater: %s(%p): inserted %" PRIi64 ", throttled: %" PRIi64 "\n", stream_name, stream_info, cap, current - cap);
-            else
-                printf("[D] stream-updater: %s(%p): inserted %" PRIi64 ", capacity: %" PRIi64 "\n", stream_name, stream_info, current, cap);
-        }
-        release_stream_info(stream_info);
-        stream_name = zlist_next(stream_names);
+    uint64_t claimed = __atomic_load_n(&stream_info->requests_inserted->claimed, __ATOMIC_SEQ_CST);
+    int64_t before;
+    uint64_t desired;
+    do {
+        before = (claimed >> 32) == window ? (int64_t)(claimed & UINT32_MAX) : 0;
+        int64_t after = before + wanted;
+        if (after > UINT32_MAX)
+            after = UINT32_MAX;
+        desired = window << 32 | (uint64_t)after;
+    } while (!__atomic_compare_exchange_n(&stream_info->requests_inserted->claimed, &claimed, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+    // printf("[D] claim_request_inserts %s(%p): cap: %" PRIi64 ", inserted: %" PRIi64 ", wanted: %zu\n", stream_info->key, stream_info, cap, before, wanted);
+    if (before >= cap)
+        return 0;
+    if (cap - before < (int64_t)wanted)
+        return cap - before;
+    return wanted;
+}
+
+// parsers may still be claiming inserts for the current window, so we report the last one
+static void report_request_counters(active_streams_t *streams)
+{
+    refresh_active_streams(streams);
+    if (!verbose)
+        return;
+    uint32_t last_window = __atomic_load_n(&insert_window, __ATOMIC_SEQ_CST) - 1;
+    for (size_t i = 0; i < streams->size; i++) {
+        stream_info_t* stream_info = streams->streams[i];
+        const char* stream_name = stream_info->key;
+        uint64_t claimed = __atomic_load_n(&stream_info->requests_inserted->claimed, __ATOMIC_SEQ_CST);
+        if ((claimed >> 32) != last_window)
+            continue;
+        int64_t wanted = claimed & UINT32_MAX;
+        int64_t cap = __atomic_load_n(&stream_info->requests_inserted->cap, __ATOMIC_SEQ_CST);
+        if (wanted > cap)
+            printf("[I] stream-updater: %s(%p): inserted %" PRIi64 ", throttled: %" PRIi64 "\n", stream_name, stream_info, cap, wanted - cap);
+        else
+            printf("[D] stream-updater: %s(%p): inserted %" PRIi64 ", capacity: %" PRIi64 "\n", stream_name, stream_info, wanted, cap);
+    }
+}
+
+// messages per tick are averaged over roughly the last minute
+#define MESSAGE_RATE_SMOOTHING 0.05
+
+static void update_message_rates(active_streams_t *streams)
+{
+    for (size_t i = 0; i < streams->size; i++) {
+        stream_info_t* stream_info = streams->streams[i];
+        uint64_t received = __atomic_exchange_n(&stream_info->messages_received, 0, __ATOMIC_RELAXED);
+        stream_info->message_rate += MESSAGE_RATE_SMOOTHING * (received - stream_info->message_rate);
     }
-    zlist_destroy(&stream_names);
 }
 
 static int timer_event(zloop_t *loop, int timer_id, void *arg)
 {
+    stream_updater_state_t *state = arg;
+    if (partition_nodes > 0)
+        save_message_rates(&state->active_streams);
+    uint64_t version = __atomic_load_n(&active_streams_version, __ATOMIC_SEQ_CST);
     update_stream_config();
+    // the config didn't change, but weights might have
+    if (partition_nodes > 0 && version == __atomic_load_n(&active_streams_version, __ATOMIC_SEQ_CST))
+        repartition_streams();
     return 0;
 }
 
@@ -560,8 +1130,9 @@ int actor_command(zloop_t *loop, zsock_t *socket, void *arg)
             if (verbose)
                 printf("[I] stream-updater: tick\n");
             ticks++;
-            // printf("[D] stream-updater: resetting request counters\n");
-            reset_request_counters();
+            report_request_counters(&state->active_streams);
+            if (partition_nodes > 0)
+                update_message_rates(&state->active_streams);
         } else {
             fprintf(stderr, "[E] stream-updater: received unknown actor command: %s\n", cmd);
         }
@@ -588,7 +1159,7 @@ static void stream_config_updater(zsock_t *pipe, void *args)
     set_thread_name("stream-updater");
 
     int rc;
-    stream_updater_state_t state = {.received_term_cmd = false, .indexer_socket = NULL};
+    stream_updater_state_t state = {.received_term_cmd = false, .indexer_socket = NULL, .active_streams = {0}};
     if (args)
         state.indexer_socket = indexer_socket_new();
 
@@ -610,6 +1181,12 @@ static void stream_config_updater(zsock_t *pipe, void *args)
     rc = zloop_timer(loop, 60000, 0, timer_event, &state);
     assert(rc != -1);
 
+    // replace a saved stream config as soon as possible
+    if (stream_config_from_cache) {
+        rc = zloop_timer(loop, 1, 1, timer_event, &state);
+        assert(rc != -1);
+    }
+
     // run the loop
     bool should_continue_to_run = getenv("CPUPROFILE") != NULL;
     do {
@@ -627,6 +1204,7 @@ static void stream_config_updater(zsock_t *pipe, void *args)
     assert(loop == NULL);
     zhttp_client_destroy(&client);
     zsock_destroy(&state.indexer_socket);
+    release_active_streams(&state.active_streams);
 
     if (!quiet)
         printf("[I] stream-updater: terminated\n");
@@ -16,23 +16,50 @@ static inline void reference_stream_info(stream_info_t *stream_info) {
 }
 extern void release_stream_info(stream_info_t *stream_info);
 extern const char* get_subscription_pattern();
+// whether we subscribe to a subset of streams, selected by pattern or partition
+extern bool stream_subscriptions_enabled();
 extern zlist_t* get_stream_subscriptions();
 extern zlist_t* get_active_stream_names();
 
+// flat array of referenced active streams, tagged with the version of the stream config it was
+// built from. refresh_active_streams only takes the lock when the config has changed since the
+// last call and returns whether the array was replaced.
+typedef struct {
+    uint64_t version;
+    size_t size;
+    stream_info_t **streams;
+} active_streams_t;
+
+extern bool refresh_active_streams(active_streams_t *active_streams);
+extern void release_active_streams(active_streams_t *active_streams);
+
 extern zactor_t* stream_config_updater_new(void *importer);
 extern void stream_config_updater_destroy(zactor_t **updater);
 
 #define MAX_RANDOM_VALUE ((1L<<31) - 1)
 #define TEN_PERCENT_OF_MAX_RANDOM 214748364
 
-// request storage size soft limit is 15 GB, hard limit 30 GB, per app
-#define SOFT_LIMIT_STORAGE_SIZE 16106127360
-#define HARD_LIMIT_STORAGE_SIZE 32212254720
+// database size soft limit is 20 GB, hard limit 40 GB, per app. sizes include indexes, as
+// reported by listDatabases (sizeOnDisk), so the limits are higher than the former storage
+// size limits of 15 GB and 30 GB.
+#define SOFT_LIMIT_STORAGE_SIZE 21474836480
+#define HARD_LIMIT_STORAGE_SIZE 42949672960
 
+extern void set_stream_config_cache_file(const char *path);
+// process only streams assigned to node (0 <= node < nodes). weights are taken from message
+// rates published by all nodes in rates_directory (optional, must be shared between nodes).
+extern void set_stream_partitioning(int node, int nodes, const char *rates_directory);
+extern bool stream_partitioning_enabled();
+static inline void count_stream_message(stream_info_t *stream_info) {
+    __atomic_fetch_add(&stream_info->messages_received, 1, __ATOMIC_RELAXED);
+}
 extern bool setup_stream_config(const char* logjam_url, const char* pattern);
 extern void update_known_modules(stream_info_t *stream_info, zhash_t* module_hash);
 extern void adjust_caller_info(const char* path, const char* module, json_object *request, stream_info_t *stream_info);
-extern bool throttle_request_for_stream(stream_info_t *stream_info);
+// the controller starts a new insert window every tick, before parsers claim inserts for
+// the requests collected during the previous one
+extern void advance_insert_window();
+extern size_t claim_request_inserts(stream_info_t *stream_info, size_t wanted);
 extern void indexer_ensure_indexes(stream_info_t *stream_info, const char* db_name, zsock_t* indexer_socket);
 
 typedef int sampling_reason_t;
@@ -49,7 +76,6 @@ typedef int throttling_reason_t;
 #define NOT_THROTTLED 0
 #define THROTTLE_SOFT_LIMIT_STORAGE_SIZE    1
 #define THROTTLE_HARD_LIMIT_STORAGE_SIZE 1<<1
-#define THROTTLE_MAX_INSERTS_PER_SECOND  1<<2
 
 extern const char* throttling_reason_str(throttling_reason_t reason);
 
@@ -4,8 +4,13 @@
 #include <zlib.h>
 #include <snappy-c.h>
 #include <lz4.h>
+#include <math.h>
 #include "logjam-util.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 int malloc_trim_frequency = 0;
 
 time_t get_iso_date_info(char today[ISO_DATE_STR_LEN], char tomorrow[ISO_DATE_STR_LEN])
@@ -117,8 +122,202 @@ uint64_t ntohll(uint64_t native_number)
 }
 #endif
 
+// cpu sets by thread role, which is the thread name without its "[index]" suffix
+#define MAX_THREAD_PLACEMENTS 16
+#define MAX_NUMA_NODES 64
+
+#if defined(__linux__)
+typedef struct {
+    char role[32];
+    cpu_set_t cpus;
+} thread_placement_t;
+
+static thread_placement_t thread_placements[MAX_THREAD_PLACEMENTS];
+static size_t num_thread_placements = 0;
+// not all programs linking this file define the quiet global
+static bool report_thread_placement = true;
+
+// "0-3,8,10-11"
+static
+bool parse_cpu_list(const char *list, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return false;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                return false;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+        if (*p == ',')
+            p++;
+        else if (*p && !isspace(*p))
+            return false;
+        else
+            break;
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+static
+void format_cpu_list(cpu_set_t *cpus, char *buffer, size_t size)
+{
+    size_t n = 0;
+    buffer[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < size; cpu++) {
+        if (!CPU_ISSET(cpu, cpus))
+            continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus))
+            last++;
+        if (last == cpu)
+            n += snprintf(buffer + n, size - n, "%s%d", n ? "," : "", cpu);
+        else
+            n += snprintf(buffer + n, size - n, "%s%d-%d", n ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+// numa nodes as "0,1", empty if the kernel doesn't expose them
+static
+void format_numa_nodes(cpu_set_t *cpus, char *buffer, size_t size)
+{
+    cpu_set_t node_cpus;
+    size_t n = 0;
+    buffer[0] = '\0';
+    for (int node = 0; node < MAX_NUMA_NODES && n < size; node++) {
+        char path[128], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (!file)
+            continue;
+        bool read = fgets(list, sizeof(list), file) != NULL;
+        fclose(file);
+        if (!read || !parse_cpu_list(list, &node_cpus))
+            continue;
+        CPU_AND(&node_cpus, &node_cpus, cpus);
+        if (CPU_COUNT(&node_cpus) > 0)
+            n += snprintf(buffer + n, size - n, "%s%d", n ? "," : "", node);
+    }
+}
+
+static
+thread_placement_t* find_thread_placement(const char *name)
+{
+    size_t len = strcspn(name, "[");
+    for (size_t i = 0; i < num_thread_placements; i++) {
+        thread_placement_t *placement = &thread_placements[i];
+        if (strlen(placement->role) == len && !strncmp(placement->role, name, len))
+            return placement;
+    }
+    return NULL;
+}
+
+// memory allocated by a thread after it has been pinned ends up on its numa node, as
+// linux places pages on first touch. this keeps processors of parsers node local.
+static
+void apply_thread_placement(const char *name)
+{
+    thread_placement_t *placement = find_thread_placement(name);
+    if (placement == NULL)
+        return;
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &placement->cpus);
+    if (rc) {
+        fprintf(stderr, "[W] %s: could not set cpu affinity: %s\n", name, strerror(rc));
+        return;
+    }
+    if (report_thread_placement) {
+        cpu_set_t effective;
+        char cpus[256], nodes[256];
+        pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &effective);
+        format_cpu_list(&effective, cpus, sizeof(cpus));
+        format_numa_nodes(&effective, nodes, sizeof(nodes));
+        printf("[I] %s: running on cpus %s (numa nodes %s)\n", name, cpus, *nodes ? nodes : "unknown");
+    }
+}
+
+bool thread_placement_init(const char *spec, bool report)
+{
+    report_thread_placement = report;
+    const char *p = spec;
+    while (*p) {
+        while (isspace(*p))
+            p++;
+        if (!*p)
+            break;
+        size_t len = strcspn(p, " \t\n");
+        const char *equals = memchr(p, '=', len);
+        if (equals == NULL || equals == p || (size_t)(equals - p) >= sizeof(thread_placements[0].role)
+            || num_thread_placements == MAX_THREAD_PLACEMENTS) {
+            fprintf(stderr, "[E] invalid thread placement: %.*s\n", (int)len, p);
+            return false;
+        }
+        thread_placement_t *placement = &thread_placements[num_thread_placements];
+        memset(placement->role, 0, sizeof(placement->role));
+        memcpy(placement->role, p, equals - p);
+        char list[256];
+        snprintf(list, sizeof(list), "%.*s", (int)(p + len - equals - 1), equals + 1);
+        if (!parse_cpu_list(list, &placement->cpus)) {
+            fprintf(stderr, "[E] invalid cpu list for %s: %s\n", placement->role, list);
+            return false;
+        }
+        num_thread_placements++;
+        p += len;
+    }
+
+    if (report) {
+        for (size_t i = 0; i < num_thread_placements; i++) {
+            char cpus[256], nodes[256];
+            format_cpu_list(&thread_placements[i].cpus, cpus, sizeof(cpus));
+            format_numa_nodes(&thread_placements[i].cpus, nodes, sizeof(nodes));
+            printf("[I] placement: %-12s cpus %s (numa nodes %s)\n", thread_placements[i].role, cpus, *nodes ? nodes : "unknown");
+        }
+    }
+    return true;
+}
+
+// zeromq creates its io threads along with the first socket, so this must be called
+// after the number of io threads has been set and before any sockets get created
+void thread_placement_pin_zmq_io_threads()
+{
+    thread_placement_t *io = find_thread_placement(ZMQ_IO_THREAD_ROLE);
+    if (io == NULL)
+        return;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &io->cpus))
+            zsys_thread_affinity_cpu_add(cpu);
+}
+#else
+static
+void apply_thread_placement(const char *name)
+{
+}
+
+void thread_placement_pin_zmq_io_threads()
+{
+}
+
+bool thread_placement_init(const char *spec, bool report)
+{
+    fprintf(stderr, "[W] thread placement is only supported on linux, ignoring: %s\n", spec);
+    return true;
+}
+#endif
+
 int set_thread_name(const char* name)
 {
+    // threads name themselves when they start, which is a good time to pin them
+    apply_thread_placement(name);
 #if defined(HAVE_PTHREAD_SETNAME_NP) && defined(__linux__)
     pthread_t self = pthread_self();
     return pthread_setname_np(self, name);
@@ -849,6 +1048,327 @@ zlist_t* zlist_deleted(zlist_t *old, zlist_t *new)
     return deleted;
 }
 
+static inline uint64_t partition_mix(uint64_t h)
+{
+    // splitmix64 finalizer, spreads FNV hashes of similar names over the ring
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static uint64_t partition_hash(const char *s)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 1099511628211ULL;
+    }
+    return partition_mix(h);
+}
+
+typedef struct {
+    uint64_t hash;
+    int node;
+} partition_point_t;
+
+static int partition_point_cmp(const void *a, const void *b)
+{
+    const partition_point_t *x = a, *y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->node - y->node;
+}
+
+static int partition_item_cmp(const void *a, const void *b)
+{
+    const partition_item_t *x = *(partition_item_t**)a, *y = *(partition_item_t**)b;
+    if (x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+void partition_assign(partition_item_t *items, size_t n, int num_nodes)
+{
+    assert(num_nodes > 0);
+    if (n == 0)
+        return;
+
+    size_t num_points = num_nodes * PARTITION_VIRTUAL_NODES;
+    partition_point_t *ring = zmalloc(num_points * sizeof(partition_point_t));
+    for (int node = 0; node < num_nodes; node++)
+        for (int v = 0; v < PARTITION_VIRTUAL_NODES; v++)
+            ring[node * PARTITION_VIRTUAL_NODES + v] = (partition_point_t){partition_mix(((uint64_t)node << 32) | v), node};
+    qsort(ring, num_points, sizeof(partition_point_t), partition_point_cmp);
+
+    // place heavy items first, so that light ones fill up the remaining capacity
+    partition_item_t **order = zmalloc(n * sizeof(partition_item_t*));
+    double total = 0;
+    for (size_t i = 0; i < n; i++) {
+        order[i] = &items[i];
+        total += items[i].weight;
+    }
+    qsort(order, n, sizeof(partition_item_t*), partition_item_cmp);
+
+    double capacity = (1 + PARTITION_LOAD_SLACK) * total / num_nodes;
+    double *load = zmalloc(num_nodes * sizeof(double));
+
+    for (size_t i = 0; i < n; i++) {
+        partition_item_t *item = order[i];
+        uint64_t h = partition_hash(item->name);
+        // first point on the ring at or after the item hash
+        size_t lo = 0, hi = num_points;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (ring[mid].hash < h)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        // walk clockwise until we find a node with spare capacity. items heavier than the
+        // capacity go to the least loaded node on the walk.
+        int chosen = -1;
+        for (size_t k = 0; k < num_points; k++) {
+            int node = ring[(lo + k) % num_points].node;
+            if (load[node] + item->weight <= capacity) {
+                chosen = node;
+                break;
+            }
+            if (chosen == -1 || load[node] < load[chosen])
+                chosen = node;
+        }
+        item->node = chosen;
+        load[chosen] += item->weight;
+    }
+
+    free(load);
+    free(order);
+    free(ring);
+}
+
+space_saving_t* space_saving_new(size_t capacity)
+{
+    assert(capacity > 0);
+    space_saving_t *self = zmalloc(sizeof(*self));
+    self->capacity = capacity;
+    self->heap = zmalloc(capacity * sizeof(space_saving_entry_t));
+    self->index = zhash_new();
+    return self;
+}
+
+void space_saving_destroy(space_saving_t **self_p)
+{
+    space_saving_t *self = *self_p;
+    if (self == NULL)
+        return;
+    for (size_t i = 0; i < self->size; i++)
+        free(self->heap[i].key);
+    free(self->heap);
+    zhash_destroy(&self->index);
+    free(self);
+    *self_p = NULL;
+}
+
+static void space_saving_swap(space_saving_t *self, size_t i, size_t j)
+{
+    space_saving_entry_t tmp = self->heap[i];
+    self->heap[i] = self->heap[j];
+    self->heap[j] = tmp;
+    zhash_update(self->index, self->heap[i].key, (void*)(i + 1));
+    zhash_update(self->index, self->heap[j].key, (void*)(j + 1));
+}
+
+static void space_saving_sift_up(space_saving_t *self, size_t i)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (self->heap[parent].count <= self->heap[i].count)
+            break;
+        space_saving_swap(self, i, parent);
+        i = parent;
+    }
+}
+
+static void space_saving_sift_down(space_saving_t *self, size_t i)
+{
+    for (;;) {
+        size_t left = 2 * i + 1, right = left + 1, min = i;
+        if (left < self->size && self->heap[left].count < self->heap[min].count)
+            min = left;
+        if (right < self->size && self->heap[right].count < self->heap[min].count)
+            min = right;
+        if (min == i)
+            return;
+        space_saving_swap(self, i, min);
+        i = min;
+    }
+}
+
+// returns the estimated count of key
+uint64_t space_saving_add(space_saving_t *self, const char *key, uint64_t count)
+{
+    size_t pos = (size_t) zhash_lookup(self->index, key);
+    if (pos) {
+        uint64_t estimate = self->heap[pos - 1].count += count;
+        space_saving_sift_down(self, pos - 1);
+        return estimate;
+    }
+    if (self->size < self->capacity) {
+        size_t i = self->size++;
+        self->heap[i] = (space_saving_entry_t){strdup(key), count, 0};
+        zhash_insert(self->index, key, (void*)(i + 1));
+        space_saving_sift_up(self, i);
+        return count;
+    }
+    // evict the key with the smallest count
+    space_saving_entry_t *min = &self->heap[0];
+    zhash_delete(self->index, min->key);
+    free(min->key);
+    min->key = strdup(key);
+    min->error = min->count;
+    uint64_t estimate = min->count += count;
+    zhash_insert(self->index, key, (void*)1);
+    space_saving_sift_down(self, 0);
+    return estimate;
+}
+
+bool space_saving_remove(space_saving_t *self, const char *key)
+{
+    size_t pos = (size_t) zhash_lookup(self->index, key);
+    if (pos == 0)
+        return false;
+    size_t i = pos - 1;
+    zhash_delete(self->index, key);
+    free(self->heap[i].key);
+    size_t last = --self->size;
+    if (i != last) {
+        self->heap[i] = self->heap[last];
+        zhash_update(self->index, self->heap[i].key, (void*)(i + 1));
+        space_saving_sift_up(self, i);
+        space_saving_sift_down(self, i);
+    }
+    return true;
+}
+
+// halves all counts, so that old traffic gradually loses weight. keeps the heap order.
+void space_saving_decay(space_saving_t *self)
+{
+    for (size_t i = 0; i < self->size; i++) {
+        self->heap[i].count /= 2;
+        self->heap[i].error /= 2;
+    }
+}
+
+#define DDSKETCH_GAMMA ((1 + DDSKETCH_RELATIVE_ACCURACY) / (1 - DDSKETCH_RELATIVE_ACCURACY))
+#define DDSKETCH_INITIAL_BUCKETS 16
+
+void ddsketch_init(ddsketch_t *self)
+{
+    memset(self, 0, sizeof(*self));
+}
+
+void ddsketch_reset(ddsketch_t *self)
+{
+    free(self->counts);
+    ddsketch_init(self);
+}
+
+int32_t ddsketch_index(double value)
+{
+    if (value < DDSKETCH_MIN_VALUE)
+        value = DDSKETCH_MIN_VALUE;
+    return (int32_t) ceil(log(value) / log(DDSKETCH_GAMMA));
+}
+
+// bucket index covers (gamma^(index-1), gamma^index]. this value has the same relative
+// distance to both bounds.
+double ddsketch_bucket_value(int32_t index)
+{
+    return 2 * pow(DDSKETCH_GAMMA, index) / (DDSKETCH_GAMMA + 1);
+}
+
+// returns the position of bucket index in counts, growing the array if necessary.
+// indexes below the range we can keep map to the lowest bucket.
+static uint32_t ddsketch_slot(ddsketch_t *self, int32_t index)
+{
+    if (self->counts == NULL) {
+        self->num_buckets = DDSKETCH_INITIAL_BUCKETS;
+        self->counts = zmalloc(DDSKETCH_INITIAL_BUCKETS * sizeof(uint32_t));
+        self->offset = index - DDSKETCH_INITIAL_BUCKETS / 2;
+        return index - self->offset;
+    }
+    int64_t lo = self->offset, hi = lo + self->num_buckets;
+    if (index >= lo && index < hi)
+        return index - lo;
+    if (index < lo && self->num_buckets == DDSKETCH_MAX_BUCKETS) {
+        // collapse into the lowest bucket
+        return 0;
+    }
+
+    int64_t needed = index < lo ? hi - index : index + 1 - lo;
+    int64_t size = 2 * (int64_t)self->num_buckets;
+    if (size < needed)
+        size = needed;
+    if (size > DDSKETCH_MAX_BUCKETS)
+        size = DDSKETCH_MAX_BUCKETS;
+    int64_t new_lo;
+    if (index < lo)
+        new_lo = hi - size;
+    else if (index < lo + size)
+        new_lo = lo;
+    else
+        new_lo = index + 1 - size;
+
+    uint32_t *counts = zmalloc(size * sizeof(uint32_t));
+    for (uint32_t j = 0; j < self->num_buckets; j++) {
+        int64_t i = lo + j;
+        counts[(i < new_lo ? new_lo : i) - new_lo] += self->counts[j];
+    }
+    free(self->counts);
+    self->counts = counts;
+    self->offset = new_lo;
+    self->num_buckets = size;
+    return (index < new_lo ? new_lo : index) - new_lo;
+}
+
+void ddsketch_add_bucket(ddsketch_t *self, int32_t index, uint64_t count)
+{
+    uint32_t slot = ddsketch_slot(self, index);
+    self->counts[slot] += count;
+    self->count += count;
+}
+
+void ddsketch_add(ddsketch_t *self, double value)
+{
+    ddsketch_add_bucket(self, ddsketch_index(value), 1);
+}
+
+void ddsketch_merge(ddsketch_t *self, const ddsketch_t *other)
+{
+    // start at the top, so that a collapse happens at most once
+    for (int64_t j = (int64_t)other->num_buckets - 1; j >= 0; j--) {
+        if (other->counts[j])
+            ddsketch_add_bucket(self, other->offset + j, other->counts[j]);
+    }
+}
+
+double ddsketch_quantile(const ddsketch_t *self, double q)
+{
+    if (self->count == 0)
+        return 0;
+    double rank = q * (self->count - 1);
+    uint64_t seen = 0;
+    for (uint32_t j = 0; j < self->num_buckets; j++) {
+        seen += self->counts[j];
+        if (seen > rank)
+            return ddsketch_bucket_value(self->offset + j);
+    }
+    return ddsketch_bucket_value(self->offset + self->num_buckets - 1);
+}
+
 // unlike zsys_hostname() this supports IPV6
 const char* my_fqdn()
 {
@@ -1007,6 +1527,19 @@ void append_line(zchunk_t* buffer, const char* format, ...)
     zchunk_append(buffer, line, n);
 }
 
+void recv_batch_update(recv_batch_t *batch, int received)
+{
+    batch->batches++;
+    batch->messages += received;
+    if (received >= batch->size) {
+        if (batch->size < RECV_BATCH_MAX_SIZE)
+            batch->size *= 2;
+    } else if (received < batch->size / 4) {
+        if (batch->size > RECV_BATCH_MIN_SIZE)
+            batch->size /= 2;
+    }
+}
+
 void append_null_byte(zchunk_t* buffer)
 {
     ensure_chunk_can_take(buffer, 1);
@@ -1014,6 +1547,205 @@ void append_null_byte(zchunk_t* buffer)
     zchunk_append(buffer, "", 1);
 }
 
+#define ONES_64       0x0101010101010101ULL
+#define HIGH_BITS_64  0x8080808080808080ULL
+
+size_t ascii_prefix_length(const char *str, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(str + i));
+        int mask = _mm_movemask_epi8(chunk) | _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, str + i, 8);
+        // high bits set or (possibly) zero bytes present: find the exact position below
+        if ((w | ((w - ONES_64) & ~w)) & HIGH_BITS_64)
+            break;
+    }
+    for (; i < n; i++) {
+        uint8_t c = str[i];
+        if (c == 0 || (c & 0x80))
+            break;
+    }
+    return i;
+}
+
+// see table 3-7 of the unicode standard for well formed byte sequences
+bool utf8_validate(const char *str, size_t n)
+{
+    const uint8_t *s = (const uint8_t*)str;
+    size_t i = 0;
+    for (;;) {
+        i += ascii_prefix_length(str + i, n - i);
+        if (i == n)
+            return true;
+        uint8_t c = s[i];
+        if (c >= 0xC2 && c <= 0xDF) {
+            if (n - i < 2 || (s[i+1] & 0xC0) != 0x80)
+                return false;
+            i += 2;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            uint8_t lo = c == 0xE0 ? 0xA0 : 0x80;
+            uint8_t hi = c == 0xED ? 0x9F : 0xBF;
+            if (n - i < 3 || s[i+1] < lo || s[i+1] > hi || (s[i+2] & 0xC0) != 0x80)
+                return false;
+            i += 3;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            uint8_t lo = c == 0xF0 ? 0x90 : 0x80;
+            uint8_t hi = c == 0xF4 ? 0x8F : 0xBF;
+            if (n - i < 4 || s[i+1] < lo || s[i+1] > hi || (s[i+2] & 0xC0) != 0x80 || (s[i+3] & 0xC0) != 0x80)
+                return false;
+            i += 4;
+        } else {
+            // null byte, stray continuation byte or illegal lead byte
+            return false;
+        }
+    }
+}
+
+static inline
+const char* json_skip_whitespace(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+    return p;
+}
+
+// p points to the opening quote. returns the position of the closing quote.
+static
+const char* json_string_end(const char *p, const char *end)
+{
+    for (p++; p < end; p++) {
+        if (*p == '\\')
+            p++;
+        else if (*p == '"')
+            return p;
+    }
+    return NULL;
+}
+
+static
+bool json_unescape_string(const char *p, const char *end, char *out, size_t size)
+{
+    size_t j = 0;
+    while (p < end) {
+        char c = *p++;
+        if (c == '\\') {
+            switch (*p++) {
+            case '"':  c = '"'; break;
+            case '\\': c = '\\'; break;
+            case '/':  c = '/'; break;
+            case 'b':  c = '\b'; break;
+            case 'f':  c = '\f'; break;
+            case 'n':  c = '\n'; break;
+            case 'r':  c = '\r'; break;
+            case 't':  c = '\t'; break;
+            default:   return false;
+            }
+        }
+        if (j + 1 >= size)
+            return false;
+        out[j++] = c;
+    }
+    out[j] = '\0';
+    return true;
+}
+
+static
+const char* json_skip_value(const char *p, const char *end)
+{
+    if (p >= end)
+        return NULL;
+    if (*p == '"') {
+        p = json_string_end(p, end);
+        return p ? p + 1 : NULL;
+    }
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            if (*p == '"') {
+                if (!(p = json_string_end(p, end)))
+                    return NULL;
+            } else if (*p == '{' || *p == '[') {
+                depth++;
+            } else if (*p == '}' || *p == ']') {
+                if (--depth == 0)
+                    return p + 1;
+            }
+            p++;
+        }
+        return NULL;
+    }
+    const char *start = p;
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+        p++;
+    return p > start ? p : NULL;
+}
+
+bool json_scan_string_fields(const char *json, size_t n, json_string_field_t *fields, size_t num_fields)
+{
+    const char *end = json + n;
+    for (size_t i = 0; i < num_fields; i++)
+        fields[i].found = false;
+
+    const char *p = json_skip_whitespace(json, end);
+    if (p == end || *p++ != '{')
+        return false;
+    p = json_skip_whitespace(p, end);
+    if (p < end && *p == '}')
+        return true;
+
+    while (p < end) {
+        if (*p != '"')
+            return false;
+        const char *key = p + 1;
+        const char *key_end = json_string_end(p, end);
+        if (!key_end)
+            return false;
+        p = json_skip_whitespace(key_end + 1, end);
+        if (p == end || *p++ != ':')
+            return false;
+        p = json_skip_whitespace(p, end);
+
+        json_string_field_t *field = NULL;
+        size_t key_len = key_end - key;
+        for (size_t i = 0; i < num_fields; i++) {
+            if (strlen(fields[i].name) == key_len && !memcmp(fields[i].name, key, key_len)) {
+                field = &fields[i];
+                break;
+            }
+        }
+        if (field) {
+            if (p == end || *p != '"')
+                return false;
+            const char *value_end = json_string_end(p, end);
+            if (!value_end || !json_unescape_string(p + 1, value_end, field->value, field->size))
+                return false;
+            field->found = true;
+            p = value_end + 1;
+        } else if (!(p = json_skip_value(p, end))) {
+            return false;
+        }
+
+        p = json_skip_whitespace(p, end);
+        if (p == end)
+            return false;
+        if (*p == '}')
+            return true;
+        if (*p++ != ',')
+            return false;
+        p = json_skip_whitespace(p, end);
+    }
+    return false;
+}
+
 static void test_uint64wrap (int verbose)
 {
     uint64_t i = 0xffffffffffffffff;
@@ -1172,6 +1904,213 @@ static void test_compression_decompression (int verbose)
     }
 }
 
+static void test_recv_batch_update (int verbose)
+{
+    recv_batch_t batch = RECV_BATCH_INITIALIZER;
+    size_t total = 0;
+    recv_batch_update(&batch, RECV_BATCH_MIN_SIZE);
+    total += RECV_BATCH_MIN_SIZE;
+    assert(batch.size == 2 * RECV_BATCH_MIN_SIZE);
+    for (int i = 0; i < 20; i++) {
+        total += batch.size;
+        recv_batch_update(&batch, batch.size);
+    }
+    assert(batch.size == RECV_BATCH_MAX_SIZE);
+    recv_batch_update(&batch, RECV_BATCH_MAX_SIZE / 2);
+    total += RECV_BATCH_MAX_SIZE / 2;
+    assert(batch.size == RECV_BATCH_MAX_SIZE);
+    for (int i = 0; i < 20; i++) {
+        recv_batch_update(&batch, 1);
+        total += 1;
+    }
+    assert(batch.size == RECV_BATCH_MIN_SIZE);
+    assert(batch.batches == 42);
+    assert(batch.messages == total);
+    recv_batch_reset_counters(&batch);
+    assert(recv_batch_avg_size(&batch) == 0);
+}
+
+static void test_utf8_validate (int verbose)
+{
+    const char *ascii = "GET /users/123/profile?format=json HTTP/1.1 completed in 12ms";
+    size_t n = strlen(ascii);
+    assert(ascii_prefix_length(ascii, n) == n);
+    assert(utf8_validate(ascii, n));
+    assert(utf8_validate("", 0));
+
+    // non ascii characters at every position relative to the chunk boundaries
+    char buf[64];
+    for (int i = 0; i < 40; i++) {
+        memset(buf, 'a', sizeof(buf));
+        memcpy(buf + i, "\xC3\xA4", 2);
+        assert(ascii_prefix_length(buf, 48) == i);
+        assert(utf8_validate(buf, 48));
+        buf[i] = '\0';
+        assert(ascii_prefix_length(buf, 48) == i);
+        assert(!utf8_validate(buf, 48));
+        buf[i] = '\xE4'; // win1252 encoded umlaut
+        buf[i+1] = 'a';
+        assert(!utf8_validate(buf, 48));
+    }
+
+    assert(utf8_validate("\xE2\x80\xA4", 3));          // one dot leader
+    assert(utf8_validate("\xF0\x9F\x98\x80", 4));      // emoji
+    assert(!utf8_validate("\xE2\x80", 2));              // truncated sequence
+    assert(!utf8_validate("\xC0\xAE", 2));              // overlong encoding
+    assert(!utf8_validate("\xE0\x80\xAE", 3));          // overlong encoding
+    assert(!utf8_validate("\xED\xA0\x80", 3));          // surrogate
+    assert(!utf8_validate("\xF4\x90\x80\x80", 4));      // beyond U+10FFFF
+    assert(!utf8_validate("\x80", 1));                  // stray continuation byte
+}
+
+static void test_partition_assign (int verbose)
+{
+    const size_t n = 200;
+    const int num_nodes = 4;
+    partition_item_t items[n], again[n];
+    char names[n][32];
+    for (size_t i = 0; i < n; i++) {
+        snprintf(names[i], sizeof(names[i]), "app%zu-production", i);
+        // one dominating stream, the rest roughly equal
+        double weight = i == 7 ? 100 : 1 + i % 3;
+        items[i] = (partition_item_t){names[i], weight, -1};
+        again[i] = items[i];
+    }
+    partition_assign(items, n, num_nodes);
+    partition_assign(again, n, num_nodes);
+
+    double total = 0, load[num_nodes];
+    memset(load, 0, sizeof(load));
+    for (size_t i = 0; i < n; i++) {
+        assert(items[i].node >= 0 && items[i].node < num_nodes);
+        assert(items[i].node == again[i].node);
+        load[items[i].node] += items[i].weight;
+        total += items[i].weight;
+    }
+    for (int k = 0; k < num_nodes; k++)
+        assert(load[k] <= (1 + PARTITION_LOAD_SLACK) * total / num_nodes);
+
+    // a single node gets everything
+    partition_assign(items, n, 1);
+    for (size_t i = 0; i < n; i++)
+        assert(items[i].node == 0);
+}
+
+static void test_space_saving (int verbose)
+{
+    space_saving_t *sketch = space_saving_new(16);
+    char key[32];
+    // ten heavy keys among a long tail of keys seen only once
+    for (int round = 0; round < 100; round++) {
+        for (int i = 0; i < 10; i++) {
+            snprintf(key, sizeof(key), "heavy-%d", i);
+            space_saving_add(sketch, key, 1);
+        }
+        for (int i = 0; i < 5; i++) {
+            snprintf(key, sizeof(key), "tail-%d-%d", round, i);
+            space_saving_add(sketch, key, 1);
+        }
+    }
+    assert(sketch->size == 16);
+    assert(zhash_size(sketch->index) == 16);
+    for (int i = 0; i < 10; i++) {
+        snprintf(key, sizeof(key), "heavy-%d", i);
+        size_t pos = (size_t) zhash_lookup(sketch->index, key);
+        assert(pos);
+        space_saving_entry_t *e = &sketch->heap[pos - 1];
+        assert(e->count >= 100);
+        assert(e->count - e->error <= 100);
+    }
+    for (size_t i = 1; i < sketch->size; i++)
+        assert(sketch->heap[(i - 1) / 2].count <= sketch->heap[i].count);
+
+    assert(space_saving_remove(sketch, "heavy-3"));
+    assert(!space_saving_remove(sketch, "heavy-3"));
+    assert(sketch->size == 15);
+    for (size_t i = 0; i < sketch->size; i++)
+        assert((size_t) zhash_lookup(sketch->index, sketch->heap[i].key) == i + 1);
+
+    space_saving_decay(sketch);
+    for (size_t i = 1; i < sketch->size; i++)
+        assert(sketch->heap[(i - 1) / 2].count <= sketch->heap[i].count);
+
+    space_saving_destroy(&sketch);
+    assert(sketch == NULL);
+}
+
+static void test_ddsketch (int verbose)
+{
+    ddsketch_t all, low, high;
+    ddsketch_init(&all);
+    ddsketch_init(&low);
+    ddsketch_init(&high);
+    for (int v = 1; v <= 10000; v++) {
+        ddsketch_add(&all, v);
+        ddsketch_add(v <= 5000 ? &low : &high, v);
+    }
+    assert(all.count == 10000);
+    double qs[] = {0.5, 0.95, 0.99};
+    for (int i = 0; i < 3; i++) {
+        double expected = qs[i] * 9999 + 1;
+        assert(fabs(ddsketch_quantile(&all, qs[i]) - expected) <= DDSKETCH_RELATIVE_ACCURACY * expected);
+    }
+
+    // merging gives the same buckets as adding everything to one sketch
+    ddsketch_merge(&low, &high);
+    assert(low.count == all.count);
+    for (double q = 0; q <= 1; q += 0.125)
+        assert(ddsketch_quantile(&low, q) == ddsketch_quantile(&all, q));
+
+    // values spanning more buckets than we keep collapse at the low end
+    ddsketch_reset(&high);
+    for (double v = DDSKETCH_MIN_VALUE / 10; v < 1e12; v *= 1.01)
+        ddsketch_add(&high, v);
+    ddsketch_add(&high, 0);
+    assert(high.num_buckets == DDSKETCH_MAX_BUCKETS);
+    uint64_t total = 0;
+    for (uint32_t j = 0; j < high.num_buckets; j++)
+        total += high.counts[j];
+    assert(total == high.count);
+    assert(fabs(ddsketch_quantile(&high, 1) - 1e12) <= DDSKETCH_RELATIVE_ACCURACY * 1e12);
+
+    ddsketch_reset(&all);
+    ddsketch_reset(&low);
+    ddsketch_reset(&high);
+    assert(high.counts == NULL && high.count == 0);
+}
+
+static void test_json_scan_string_fields (int verbose)
+{
+    char rts[32], rid[33], agent[64];
+    json_string_field_t fields[] = {
+        {"rts", rts, sizeof(rts)},
+        {"request_id", rid, sizeof(rid)},
+        {"user_agent", agent, sizeof(agent)},
+    };
+    const char *msg = "{\"viewport\": {\"w\": 10, \"h\": [1, \"}\"]}, \"rts\":\"1,2,3\", \"n\": -1.5e3, \"ok\": true,"
+        " \"title\": \"\\u00e4\", \"user_agent\": \"Mozilla\\/5.0 \\\"x\\\"\"}";
+    assert(json_scan_string_fields(msg, strlen(msg), fields, 3));
+    assert(fields[0].found && streq(rts, "1,2,3"));
+    assert(!fields[1].found);
+    assert(fields[2].found && streq(agent, "Mozilla/5.0 \"x\""));
+
+    const char *empty = " {} ";
+    assert(json_scan_string_fields(empty, strlen(empty), fields, 3));
+    assert(!fields[0].found);
+
+    // callers fall back to a full parse for these
+    const char *not_string = "{\"rts\": 17}";
+    assert(!json_scan_string_fields(not_string, strlen(not_string), fields, 3));
+    const char *unicode = "{\"rts\": \"\\u0031\"}";
+    assert(!json_scan_string_fields(unicode, strlen(unicode), fields, 3));
+    const char *too_long = "{\"rts\": \"0123456789012345678901234567890123456789\"}";
+    assert(!json_scan_string_fields(too_long, strlen(too_long), fields, 3));
+    const char *truncated = "{\"rts\": \"1,2\", \"x\": {";
+    assert(!json_scan_string_fields(truncated, strlen(truncated), fields, 3));
+    const char *array = "[\"rts\"]";
+    assert(!json_scan_string_fields(array, strlen(array), fields, 3));
+}
+
 void logjam_util_test (int verbose)
 {
     printf (" * logjam-utils: ");
@@ -1188,6 +2127,12 @@ void logjam_util_test (int verbose)
     test_extract_app_env (verbose);
     test_extract_app_env_rid (verbose);
     test_compression_decompression (verbose);
+    test_recv_batch_update (verbose);
+    test_utf8_validate (verbose);
+    test_partition_assign (verbose);
+    test_space_saving (verbose);
+    test_ddsketch (verbose);
+    test_json_scan_string_fields (verbose);
 
     printf ("OK\n");
 }
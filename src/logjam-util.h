@@ -77,6 +77,11 @@ extern uint64_t htonll(uint64_t net_number);
 extern uint64_t ntohll(uint64_t native_number);
 #endif
 
+// pins threads to cpus by role (the thread name without index) when they call set_thread_name.
+// spec is a space separated list like "parser=0-7 adder=0-7 writer=8,9 zmq_io=10".
+#define ZMQ_IO_THREAD_ROLE "zmq_io"
+extern bool thread_placement_init(const char *spec, bool report);
+extern void thread_placement_pin_zmq_io_threads();
 extern int set_thread_name(const char* name);
 
 extern void dump_meta_info(const char* prefix, msg_meta_t *meta);
@@ -226,6 +231,41 @@ static inline zmsg_t* zmsg_recv_with_retry(zsock_t *socket)
     return msg;
 }
 
+// returns NULL if no message can be read without blocking
+static inline zmsg_t* zmsg_recv_nowait(zsock_t *socket)
+{
+    if (!(zsock_events(socket) & ZMQ_POLLIN))
+        return NULL;
+    return zmsg_recv(socket);
+}
+
+// Adaptive upper bound for the number of messages drained from a socket per poll
+// wakeup. It doubles when a wakeup drained a full batch and halves when it read less
+// than a quarter of it, so only busy sockets pay for the extra non blocking reads.
+#define RECV_BATCH_MIN_SIZE 8
+#define RECV_BATCH_MAX_SIZE 1024
+
+typedef struct {
+    int size;                   // current batch size limit
+    size_t batches;             // number of batches read (since last reset)
+    size_t messages;            // number of messages read (since last reset)
+} recv_batch_t;
+
+#define RECV_BATCH_INITIALIZER {RECV_BATCH_MIN_SIZE, 0, 0}
+
+extern void recv_batch_update(recv_batch_t *batch, int received);
+
+static inline double recv_batch_avg_size(recv_batch_t *batch)
+{
+    return batch->batches ? (double)batch->messages / batch->batches : 0;
+}
+
+static inline void recv_batch_reset_counters(recv_batch_t *batch)
+{
+    batch->batches = 0;
+    batch->messages = 0;
+}
+
 extern int zmsg_savex (zmsg_t *self, FILE *file);
 extern int dump_message_payload(zmsg_t *self, FILE *file, zchunk_t *buffer);
 extern int dump_message_as_json(zmsg_t *self, FILE *file, zchunk_t *buffer);
@@ -236,6 +276,66 @@ extern zlist_t* zlist_added(zlist_t *older, zlist_t *newer);
 extern zlist_t* zlist_deleted(zlist_t *older, zlist_t *newer);
 extern size_t zchunk_ensure_size(zchunk_t *buffer, size_t desired_size);
 
+// consistent hashing with bounded loads: each item is placed on the first node clockwise from
+// its hash on a ring of virtual nodes, which doesn't exceed (1 + slack) * average load. the
+// result only depends on names, weights and the number of nodes.
+#define PARTITION_VIRTUAL_NODES 64
+#define PARTITION_LOAD_SLACK 0.25
+
+typedef struct {
+    const char *name;
+    double weight;
+    int node;                  // assigned node, set by partition_assign
+} partition_item_t;
+
+extern void partition_assign(partition_item_t *items, size_t n, int num_nodes);
+
+// space-saving heavy hitter sketch: monitors at most capacity keys. an unmonitored key
+// replaces the one with the smallest count and inherits that count as its error, so
+// counts never underestimate and overestimate by at most error.
+typedef struct {
+    char *key;
+    uint64_t count;
+    uint64_t error;
+} space_saving_entry_t;
+
+typedef struct {
+    size_t capacity;
+    size_t size;
+    space_saving_entry_t *heap;  // min-heap on count
+    zhash_t *index;              // key -> heap position + 1
+} space_saving_t;
+
+extern space_saving_t* space_saving_new(size_t capacity);
+extern void space_saving_destroy(space_saving_t **self_p);
+extern uint64_t space_saving_add(space_saving_t *self, const char *key, uint64_t count);
+extern bool space_saving_remove(space_saving_t *self, const char *key);
+extern void space_saving_decay(space_saving_t *self);
+
+// DDSketch quantile sketch: a value v goes into bucket ceil(log_gamma(v)), with
+// gamma = (1 + a) / (1 - a), so every quantile is accurate within relative error a.
+// sketches merge by adding bucket counts. when the buckets would span more than
+// DDSKETCH_MAX_BUCKETS, the lowest ones get collapsed, which only affects low quantiles.
+#define DDSKETCH_RELATIVE_ACCURACY 0.02
+#define DDSKETCH_MIN_VALUE 0.001
+#define DDSKETCH_MAX_BUCKETS 256
+
+typedef struct {
+    int32_t offset;            // bucket index of counts[0]
+    uint32_t num_buckets;      // allocated buckets
+    uint32_t *counts;
+    uint64_t count;            // number of values added
+} ddsketch_t;
+
+extern void ddsketch_init(ddsketch_t *self);
+extern void ddsketch_reset(ddsketch_t *self);
+extern int32_t ddsketch_index(double value);
+extern double ddsketch_bucket_value(int32_t index);
+extern void ddsketch_add_bucket(ddsketch_t *self, int32_t index, uint64_t count);
+extern void ddsketch_add(ddsketch_t *self, double value);
+extern void ddsketch_merge(ddsketch_t *self, const ddsketch_t *other);
+extern double ddsketch_quantile(const ddsketch_t *self, double q);
+
 extern void logjam_util_test (int verbose);
 extern const char* my_fqdn();
 extern void send_heartbeat(zsock_t *socket, msg_meta_t* meta, int pub_port);
@@ -249,6 +349,24 @@ extern void ensure_chunk_can_take(zchunk_t* buffer, size_t data_size);
 extern void append_line(zchunk_t* buffer, const char* format, ...);
 extern void append_null_byte(zchunk_t* buffer);
 
+// length of the longest prefix consisting of non null ASCII characters
+extern size_t ascii_prefix_length(const char *str, size_t n);
+// strict UTF-8 validation, rejecting null characters (like bson_utf8_validate(str, n, false))
+extern bool utf8_validate(const char *str, size_t n);
+
+// top level string field of a JSON object, copied into value (size bytes, including the null byte)
+typedef struct {
+    const char *name;
+    char *value;
+    size_t size;
+    bool found;
+} json_string_field_t;
+
+// extracts top level string fields without building json-c objects. returns false for malformed
+// input, non string values and values we can't copy verbatim (unicode escapes or values which
+// don't fit into the buffer), so that callers can fall back to a full parse.
+extern bool json_scan_string_fields(const char *json, size_t n, json_string_field_t *fields, size_t num_fields);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,157 @@
+#include <czmq.h>
+#include <new>
+#include "prometheus-sharded-counter.h"
+
+namespace logjam {
+
+// threads get assigned slots round robin on their first increment
+static std::atomic<unsigned int> next_shard(0);
+static thread_local unsigned int shard = next_shard++ % COUNTER_SHARDS;
+
+ShardedCounter::ShardedCounter(prometheus::Family<prometheus::Counter>* family, const std::map<std::string, std::string>& labels)
+    : family(family), labels(labels), counter(nullptr), idle(false), last_active(zclock_time()), next(nullptr), retired(false)
+{
+    for (int i=0; i<COUNTER_SHARDS; i++)
+        shards[i].value.store(0, std::memory_order_relaxed);
+}
+
+void* ShardedCounter::operator new(std::size_t size)
+{
+    void* p = nullptr;
+    if (posix_memalign(&p, alignof(ShardedCounter), size))
+        throw std::bad_alloc();
+    return p;
+}
+
+void ShardedCounter::operator delete(void* p)
+{
+    free(p);
+}
+
+void ShardedCounter::Increment(double value)
+{
+    std::atomic<double>& slot = shards[shard].value;
+    double current = slot.load(std::memory_order_relaxed);
+    while (!slot.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+        ;
+}
+
+double ShardedCounter::Drain()
+{
+    double sum = 0;
+    for (int i=0; i<COUNTER_SHARDS; i++)
+        sum += shards[i].value.exchange(0, std::memory_order_relaxed);
+    return sum;
+}
+
+ShardedCounterRegistry::ShardedCounterRegistry(std::shared_ptr<prometheus::Registry> registry)
+    : registry(registry), head(nullptr)
+{
+}
+
+ShardedCounter& ShardedCounterRegistry::Add(prometheus::Family<prometheus::Counter>& family, const std::map<std::string, std::string>& labels)
+{
+    ShardedCounter* counter = new ShardedCounter(&family, labels);
+    counter->next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(counter->next, counter, std::memory_order_release, std::memory_order_relaxed))
+        ;
+    return *counter;
+}
+
+void ShardedCounterRegistry::Remove(ShardedCounter& counter)
+{
+    counter.retired.store(true, std::memory_order_release);
+}
+
+// caller must hold flush_mutex
+void ShardedCounterRegistry::Unlink(ShardedCounter* prev, ShardedCounter* counter) const
+{
+    if (prev == nullptr) {
+        ShardedCounter* expected = counter;
+        if (head.compare_exchange_strong(expected, counter->next, std::memory_order_acq_rel))
+            return;
+        // new counters have been pushed in front of it
+        prev = expected;
+        while (prev->next != counter)
+            prev = prev->next;
+    }
+    prev->next = counter->next;
+}
+
+// caller must hold flush_mutex. streams get recreated on config changes, so a new
+// sharded counter can have the same labels as one which hasn't been removed yet.
+void ShardedCounterRegistry::Acquire(ShardedCounter* counter) const
+{
+    ChildKey key(counter->family, counter->labels);
+    std::map<ChildKey, Child>::iterator it = children.find(key);
+    if (it == children.end()) {
+        Child child = { &counter->family->Add(counter->labels), 0 };
+        it = children.insert(std::make_pair(key, child)).first;
+    }
+    it->second.owners++;
+    counter->counter = it->second.counter;
+}
+
+// caller must hold flush_mutex
+void ShardedCounterRegistry::Release(ShardedCounter* counter) const
+{
+    std::map<ChildKey, Child>::iterator it = children.find(ChildKey(counter->family, counter->labels));
+    if (it != children.end() && --it->second.owners == 0) {
+        counter->family->Remove(it->second.counter);
+        children.erase(it);
+    }
+    counter->counter = nullptr;
+}
+
+// caller must hold flush_mutex
+void ShardedCounterRegistry::Flush() const
+{
+    int64_t now = zclock_time();
+    ShardedCounter* prev = nullptr;
+    ShardedCounter* counter = head.load(std::memory_order_acquire);
+    while (counter) {
+        ShardedCounter* next = counter->next;
+        bool retired = counter->retired.load(std::memory_order_acquire);
+        double value = counter->Drain();
+        if (value > 0) {
+            counter->last_active = now;
+            counter->idle = false;
+        }
+        if (counter->counter == nullptr && (value > 0 || !(counter->idle || retired)))
+            Acquire(counter);
+        if (value > 0)
+            counter->counter->Increment(value);
+        if (retired) {
+            if (counter->counter)
+                Release(counter);
+            Unlink(prev, counter);
+            delete counter;
+        } else
+            prev = counter;
+        counter = next;
+    }
+}
+
+void ShardedCounterRegistry::RemoveIdle(int64_t max_age)
+{
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    Flush();
+    int64_t threshold = zclock_time() - max_age;
+    for (ShardedCounter* counter = head.load(std::memory_order_acquire); counter; counter = counter->next) {
+        if (counter->counter && counter->last_active < threshold) {
+            Release(counter);
+            counter->idle = true;
+        }
+    }
+}
+
+std::vector<prometheus::MetricFamily> ShardedCounterRegistry::Collect() const
+{
+    {
+        std::lock_guard<std::mutex> lock(flush_mutex);
+        Flush();
+    }
+    return registry->Collect();
+}
+
+}
@@ -0,0 +1,95 @@
+#ifndef __LOGJAM_PROMETHEUS_SHARDED_COUNTER_H_INCLUDED__
+#define __LOGJAM_PROMETHEUS_SHARDED_COUNTER_H_INCLUDED__
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <prometheus/collectable.h>
+#include <prometheus/counter.h>
+#include <prometheus/family.h>
+#include <prometheus/registry.h>
+
+// Counters for hot paths incremented from many threads. Each thread adds to its own
+// cache line sized slot, slots are only summed into the prometheus counter when the exposer collects.
+
+namespace logjam {
+
+const int COUNTER_SHARDS = 16;
+const int CACHE_LINE_SIZE = 64;
+
+class ShardedCounter {
+public:
+    void Increment(double value = 1.0);
+
+private:
+    friend class ShardedCounterRegistry;
+    ShardedCounter(prometheus::Family<prometheus::Counter>* family, const std::map<std::string, std::string>& labels);
+    double Drain();
+
+    // counters are created with new, which only honors extended alignment since C++17
+    static void* operator new(std::size_t size);
+    static void operator delete(void* p);
+
+    struct alignas(CACHE_LINE_SIZE) Shard {
+        std::atomic<double> value;
+    };
+    static_assert(sizeof(Shard) == CACHE_LINE_SIZE, "shards must not share cache lines");
+    Shard shards[COUNTER_SHARDS];
+
+    // all fields below are only accessed by the collector
+    prometheus::Family<prometheus::Counter>* family;
+    std::map<std::string, std::string> labels;
+    prometheus::Counter* counter;
+    bool idle;
+    int64_t last_active;
+    ShardedCounter* next;
+    std::atomic<bool> retired;
+};
+
+// Wraps a registry, flushing all sharded counters before the registry gets collected.
+// Counters are kept in a list which only the collector removes elements from. Sharded
+// counters with identical family and labels share the labelled counter, which gets
+// removed from its family when the last of them is removed.
+class ShardedCounterRegistry : public prometheus::Collectable {
+public:
+    explicit ShardedCounterRegistry(std::shared_ptr<prometheus::Registry> registry);
+
+    // lock free, the labelled counter gets added to the family on the next collect
+    ShardedCounter& Add(prometheus::Family<prometheus::Counter>& family, const std::map<std::string, std::string>& labels);
+
+    // the counter must not be incremented afterwards. pending increments are flushed
+    // and the counter is freed on the next collect.
+    void Remove(ShardedCounter& counter);
+
+    // remove counters not incremented for max_age milliseconds from their families,
+    // they reappear from zero when incremented again
+    void RemoveIdle(int64_t max_age);
+
+    std::vector<prometheus::MetricFamily> Collect() const override;
+
+private:
+    void Flush() const;
+    void Unlink(ShardedCounter* prev, ShardedCounter* counter) const;
+    void Acquire(ShardedCounter* counter) const;
+    void Release(ShardedCounter* counter) const;
+
+    typedef std::pair<prometheus::Family<prometheus::Counter>*, std::map<std::string, std::string>> ChildKey;
+    struct Child {
+        prometheus::Counter* counter;
+        int owners;
+    };
+
+    std::shared_ptr<prometheus::Registry> registry;
+    // labelled counters in use, only accessed by the collector
+    mutable std::map<ChildKey, Child> children;
+    mutable std::atomic<ShardedCounter*> head;
+    mutable std::mutex flush_mutex;
+};
+
+}
+
+#endif
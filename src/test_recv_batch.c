@@ -0,0 +1,129 @@
+#include <zmq.h>
+#include <czmq.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include "logjam-util.h"
+
+// Measures poll wakeups and receive calls per message for a PULL socket driven by a zloop
+// reader, comparing one message per wakeup with draining the socket in (adaptive) batches.
+//
+// usage: test_recv_batch [messages] [body size] [batch size]
+//        batch size 1 reads one message per wakeup, 0 uses the adaptive batch size.
+//
+// Run it under `strace -c -f` to get exact syscall counts.
+
+bool verbose = false;
+
+typedef struct {
+  size_t messages;
+  size_t body_size;
+} sender_args_t;
+
+typedef struct {
+  size_t expected;
+  size_t received;
+  size_t wakeups;
+  size_t recv_calls;
+  int fixed_batch_size;
+  recv_batch_t batch;
+} receiver_state_t;
+
+static void *sender(void *arg)
+{
+  sender_args_t *args = arg;
+  zsock_t *socket = zsock_new(ZMQ_PUSH);
+  assert(socket);
+  zsock_set_sndhwm(socket, 100000);
+  int rc = zsock_connect(socket, "inproc://recv-batch");
+  assert(rc == 0);
+
+  char *body = zmalloc(args->body_size);
+  memset(body, 'a', args->body_size);
+  for (size_t i = 0; i < args->messages && !zsys_interrupted; i++) {
+    zmsg_t *msg = zmsg_new();
+    zmsg_addstr(msg, "app-env");
+    zmsg_addstr(msg, "logs.app.env");
+    zmsg_addmem(msg, body, args->body_size);
+    zmsg_addmem(msg, &i, sizeof(i));
+    rc = zmsg_send(&msg, socket);
+    assert(rc == 0);
+  }
+  free(body);
+  zsock_destroy(&socket);
+  return NULL;
+}
+
+static int read_messages(zloop_t *loop, zsock_t *socket, void *arg)
+{
+  receiver_state_t *state = arg;
+  int limit = state->fixed_batch_size ? state->fixed_batch_size : state->batch.size;
+  int received = 0;
+  state->wakeups++;
+  state->recv_calls++;
+  zmsg_t *msg = zmsg_recv(socket);
+  while (msg) {
+    received++;
+    zmsg_destroy(&msg);
+    if (received >= limit)
+      break;
+    state->recv_calls++;
+    msg = zmsg_recv_nowait(socket);
+  }
+  recv_batch_update(&state->batch, received);
+  state->received += received;
+  return state->received >= state->expected ? -1 : 0;
+}
+
+int main(int argc, char const * const *argv)
+{
+  size_t message_count = argc>1 ? atol(argv[1]) : 1000000;
+  size_t body_size = argc>2 ? atol(argv[2]) : 1024;
+  int batch_size = argc>3 ? atoi(argv[3]) : 0;
+
+  zsys_init();
+  zsock_t *socket = zsock_new(ZMQ_PULL);
+  assert(socket);
+  zsock_set_rcvhwm(socket, 100000);
+  int rc = zsock_bind(socket, "inproc://recv-batch");
+  assert(rc == 0);
+
+  receiver_state_t state = {.expected = message_count, .fixed_batch_size = batch_size, .batch = RECV_BATCH_INITIALIZER};
+  zloop_t *loop = zloop_new();
+  assert(loop);
+  rc = zloop_reader(loop, socket, read_messages, &state);
+  assert(rc == 0);
+
+  struct rusage usage_before, usage_after;
+  getrusage(RUSAGE_THREAD, &usage_before);
+  int64_t start_time = zclock_usecs();
+
+  pthread_t thread;
+  sender_args_t args = {.messages = message_count, .body_size = body_size};
+  rc = pthread_create(&thread, NULL, sender, &args);
+  assert(rc == 0);
+
+  zloop_start(loop);
+
+  int64_t end_time = zclock_usecs();
+  getrusage(RUSAGE_THREAD, &usage_after);
+  pthread_join(thread, NULL);
+
+  double seconds = (end_time - start_time) / 1000000.0;
+  double n = state.received ? state.received : 1;
+  printf("batch size:      %s\n", batch_size ? argv[3] : "adaptive");
+  printf("messages:        %zu\n", state.received);
+  printf("elapsed:         %.3f s (%.0f msgs/s)\n", seconds, state.received / seconds);
+  printf("wakeups/msg:     %.4f\n", state.wakeups / n);
+  printf("recv calls/msg:  %.4f\n", state.recv_calls / n);
+  printf("avg batch:       %.1f\n", recv_batch_avg_size(&state.batch));
+  printf("ctx switches:    %ld voluntary, %ld involuntary\n",
+         usage_after.ru_nvcsw - usage_before.ru_nvcsw, usage_after.ru_nivcsw - usage_before.ru_nivcsw);
+
+  zloop_destroy(&loop);
+  zsock_destroy(&socket);
+  return 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <bson.h>
+#include "importer-common.h"
+
+// Compares bson_utf8_validate with utf8_validate on the keys and string values of logjam
+// request payloads, and measures win1252 conversion speed for the strings which need it.
+//
+// usage: test_utf8 [file with one JSON request per line] [iterations]
+//        without a file, a synthetic request with typical log lines is used.
+
+static const char *sample_request =
+    "{\"action\":\"Users::SessionsController#create\",\"started_at\":\"2024-01-01T12:00:00+01:00\","
+    "\"request_id\":\"d2a5e3b0e1a611ea8b0f0242ac120002\",\"total_time\":123.4,\"code\":200,\"severity\":1,"
+    "\"lines\":[[1,\"2024-01-01T12:00:00.123456\",\"Started POST \\\"/sessions\\\" for 10.0.0.1 at 2024-01-01 12:00:00 +0100\"],"
+    "[1,\"2024-01-01T12:00:00.123789\",\"Processing by Users::SessionsController#create as HTML\"],"
+    "[1,\"2024-01-01T12:00:00.124001\",\"  Parameters: {\\\"utf8\\\"=>\\\"\\u2713\\\", \\\"user\\\"=>{\\\"login\\\"=>\\\"m\\u00fcller\\\"}}\"],"
+    "[0,\"2024-01-01T12:00:00.125000\",\"  User Load (0.4ms)  SELECT `users`.* FROM `users` WHERE `users`.`login` = 'mueller' LIMIT 1\"],"
+    "[1,\"2024-01-01T12:00:00.130000\",\"Redirected to https://www.example.com/dashboard\"],"
+    "[1,\"2024-01-01T12:00:00.130500\",\"Completed 302 Found in 7ms (ActiveRecord: 0.4ms)\"]],"
+    "\"request_info\":{\"method\":\"POST\",\"url\":\"/sessions\",\"headers\":{\"User-Agent\":\"Mozilla/5.0 (X11; Linux x86_64)\"}}}";
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    const char **strings;
+    size_t *lengths;
+    size_t bytes;
+} string_list_t;
+
+static void add_string(string_list_t *list, const char *s, size_t n)
+{
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 1024;
+        list->strings = realloc(list->strings, list->capacity * sizeof(char*));
+        list->lengths = realloc(list->lengths, list->capacity * sizeof(size_t));
+    }
+    list->strings[list->count] = s;
+    list->lengths[list->count] = n;
+    list->count++;
+    list->bytes += n;
+}
+
+static void collect_strings(string_list_t *list, json_object *obj)
+{
+    switch (json_object_get_type(obj)) {
+    case json_type_object: {
+        json_object_object_foreach(obj, key, val) {
+            add_string(list, key, strlen(key));
+            collect_strings(list, val);
+        }
+        break;
+    }
+    case json_type_array: {
+        int n = json_object_array_length(obj);
+        for (int i = 0; i < n; i++)
+            collect_strings(list, json_object_array_get_idx(obj, i));
+        break;
+    }
+    case json_type_string:
+        add_string(list, json_object_get_string(obj), json_object_get_string_len(obj));
+        break;
+    default:
+        break;
+    }
+}
+
+int main(int argc, char const * const *argv)
+{
+    const char *file_name = argc > 1 ? argv[1] : NULL;
+    int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+
+    string_list_t strings = {0};
+    zlist_t *requests = zlist_new();
+    if (file_name) {
+        FILE *file = fopen(file_name, "r");
+        if (!file) {
+            fprintf(stderr, "[E] could not open %s\n", file_name);
+            exit(1);
+        }
+        char *line = NULL;
+        size_t line_size = 0;
+        ssize_t n;
+        while ((n = getline(&line, &line_size, file)) > 0) {
+            json_object *request = json_tokener_parse(line);
+            if (request)
+                zlist_append(requests, request);
+        }
+        free(line);
+        fclose(file);
+    } else {
+        zlist_append(requests, json_tokener_parse(sample_request));
+    }
+    for (json_object *request = zlist_first(requests); request; request = zlist_next(requests))
+        collect_strings(&strings, request);
+
+    printf("requests:        %zu\n", zlist_size(requests));
+    printf("strings:         %zu (%zu bytes)\n", strings.count, strings.bytes);
+
+    size_t valid_bson = 0, valid_fast = 0;
+    int64_t start = zclock_usecs();
+    for (int k = 0; k < iterations; k++)
+        for (size_t i = 0; i < strings.count; i++)
+            valid_bson += bson_utf8_validate(strings.strings[i], strings.lengths[i], false);
+    int64_t bson_time = zclock_usecs() - start;
+
+    start = zclock_usecs();
+    for (int k = 0; k < iterations; k++)
+        for (size_t i = 0; i < strings.count; i++)
+            valid_fast += utf8_validate(strings.strings[i], strings.lengths[i]);
+    int64_t fast_time = zclock_usecs() - start;
+
+    if (valid_bson != valid_fast)
+        printf("[W] validators disagree: bson: %zu, utf8_validate: %zu\n", valid_bson, valid_fast);
+
+    double mb = (double) strings.bytes * iterations / 1048576;
+    printf("bson_utf8_validate: %8.1f MB/s\n", mb / (bson_time ? bson_time : 1) * 1000000);
+    printf("utf8_validate:      %8.1f MB/s\n", mb / (fast_time ? fast_time : 1) * 1000000);
+
+    size_t max_len = 0;
+    for (size_t i = 0; i < strings.count; i++)
+        if (strings.lengths[i] > max_len)
+            max_len = strings.lengths[i];
+    char *buffer = malloc(6 * max_len + 1);
+    start = zclock_usecs();
+    for (int k = 0; k < iterations; k++)
+        for (size_t i = 0; i < strings.count; i++)
+            convert_to_win1252(strings.strings[i], strings.lengths[i], buffer);
+    int64_t convert_time = zclock_usecs() - start;
+    printf("convert_to_win1252: %8.1f MB/s\n", mb / (convert_time ? convert_time : 1) * 1000000);
+
+    free(buffer);
+    for (json_object *request = zlist_first(requests); request; request = zlist_next(requests))
+        json_object_put(request);
+    zlist_destroy(&requests);
+    free(strings.strings);
+    free(strings.lengths);
+    return 0;
+}